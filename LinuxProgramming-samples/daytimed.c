@@ -8,53 +8,225 @@
     with or without modification, are permitted.
 */
 
-#if defined(__digital__) && defined(__unix__)
-# ifdef _XOPEN_SOURCE
-#  undef _XOPEN_SOURCE
-# endif
-# define _XOPEN_SOURCE 500
-# define _OSF_SOURCE
-#endif
+/*
+    Usage: daytimed [-o <port offset>] [<service>...]
+
+    Serves the small inetd services over both TCP and UDP from one
+    thread driven by epoll(7):
+
+        echo     7  (RFC 862)       chargen 19  (RFC 864)
+        discard  9  (RFC 863)       time    37  (RFC 868)
+        daytime 13  (RFC 867)
+
+    All of them by default, or the ones named.  Each listens on its
+    well-known port plus the offset, so "-o 10000" serves daytime on
+    10013 without privileges.  The daytime and time replies are
+    formatted once a second and copied out as they are, and UDP
+    requests are read and answered in batches with recvmmsg(2) and
+    sendmmsg(2), so the server is cheap enough to probe at a high rate.
+    A datagram from a privileged port or from the port of any of these
+    services (with or without the offset) gets no reply: a forged one
+    could otherwise set two servers answering each other forever.
+*/
+
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <signal.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <netinet/in.h>
 #include <netdb.h>
 
-#define DEFAULT_PORT 13
+#define MAX_EVENTS 256
+#define ACCEPT_BATCH 256        /* connections accepted per wakeup */
+#define UDP_BATCH 64            /* datagrams per recvmmsg(2) */
+#define UDP_BUF_SIZE 2048       /* longer echo requests are dropped */
+#define ECHO_BUF_SIZE 4096
+#define CHARGEN_LINE 72
+#define CHARGEN_CHARS 95        /* printable ASCII, ' ' to '~' */
+#define CHARGEN_PATTERN (CHARGEN_CHARS * (CHARGEN_LINE + 2))
+#define CHARGEN_BURST (256 * 1024)  /* bytes written per wakeup */
+#define RFC868_EPOCH 2208988800UL   /* 1900-01-01 in Unix time */
+
+enum service_id {
+    SVC_ECHO,
+    SVC_DISCARD,
+    SVC_DAYTIME,
+    SVC_CHARGEN,
+    SVC_TIME,
+    N_SERVICES
+};
+
+struct service {
+    const char *name;
+    int port;
+    int enabled;
+};
 
-static int listen_socket(int port);
+enum kind {
+    TCP_LISTENER,
+    UDP_SOCKET,
+    TCP_CONN
+};
+
+/* Everything registered with epoll starts with this. */
+struct endpoint {
+    enum kind kind;
+    int fd;
+    enum service_id svc;
+};
+
+struct conn {
+    struct endpoint ep;
+    size_t chargen_pos;         /* offset into the pattern */
+    size_t out_off;             /* echo: unsent part of buf */
+    size_t out_len;
+    char buf[ECHO_BUF_SIZE];
+};
+
+static void open_service(enum service_id svc, int port);
+static int listen_socket(int port, int type);
+static void add_endpoint(struct endpoint *ep, unsigned int events);
+static void update_clock(void);
+static void init_chargen(void);
+static void accept_clients(struct endpoint *ep);
+static int accept_one(int server);
+static void open_conn(int sock, enum service_id svc);
+static void conn_event(struct conn *c, unsigned int events);
+static int echo_input(struct conn *c);
+static int echo_output(struct conn *c);
+static int chargen_output(struct conn *c);
+static void watch(struct conn *c, unsigned int events);
+static void close_conn(struct conn *c);
+static void udp_event(struct endpoint *ep);
+static size_t udp_reply(enum service_id svc, char *req, size_t len, char **out);
+static int udp_peer_ok(struct sockaddr_storage *addr);
+
+static struct service services[N_SERVICES] = {
+    { "echo",     7, 0 },
+    { "discard",  9, 0 },
+    { "daytime", 13, 0 },
+    { "chargen", 19, 0 },
+    { "time",    37, 0 },
+};
+
+static int epfd;
+static int spare_fd;            /* given up when out of descriptors */
+static time_t clock_sec = -1;
+static char daytime_str[64];    /* asctime() output */
+static size_t daytime_len;
+static unsigned char time_bin[4];   /* RFC 868, big endian */
+static char chargen_pattern[CHARGEN_PATTERN * 2];
+static size_t udp_chargen_pos = 0;
+static int port_offset = 0;
 
 int
 main(int argc, char *argv[])
 {
-    struct sockaddr_storage addr;
-    socklen_t addrlen = sizeof addr;
-    int sock, server;
-    time_t t;
-    struct tm *tm;
-    char *timestr;
-    
-    server = listen_socket(argc > 1 ? atoi(argv[1]) : DEFAULT_PORT);
-    sock = accept(server, (struct sockaddr*)&addr, &addrlen);
-    if (sock < 0) {
-        perror("accept(2)");
+    struct epoll_event events[MAX_EVENTS];
+    struct rlimit rl;
+    int opt, i, n, any = 0;
+
+    while ((opt = getopt(argc, argv, "o:")) != -1) {
+        switch (opt) {
+        case 'o':
+            port_offset = atoi(optarg);
+            break;
+        default:
+            fprintf(stderr, "Usage: %s [-o <port offset>] [<service>...]\n", argv[0]);
+            exit(1);
+        }
+    }
+    for (i = optind; i < argc; i++) {
+        int s;
+
+        for (s = 0; s < N_SERVICES; s++) {
+            if (strcmp(argv[i], services[s].name) == 0) break;
+        }
+        if (s == N_SERVICES) {
+            fprintf(stderr, "unknown service: %s\n", argv[i]);
+            exit(1);
+        }
+        services[s].enabled = 1;
+        any = 1;
+    }
+
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0) {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+    signal(SIGPIPE, SIG_IGN);
+    spare_fd = open("/dev/null", O_RDONLY|O_CLOEXEC);
+    epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (epfd < 0) {
+        perror("epoll_create1(2)");
         exit(1);
     }
-    time(&t);
-    tm = localtime(&t);
-    timestr = asctime(tm);
-    write(sock, timestr, strlen(timestr));
-    close(sock);
-    close(server);
-    exit(0);
+    update_clock();
+    init_chargen();
+    for (i = 0; i < N_SERVICES; i++) {
+        if (!any || services[i].enabled)
+            open_service(i, services[i].port + port_offset);
+    }
+
+    for (;;) {
+        n = epoll_wait(epfd, events, MAX_EVENTS, -1);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            perror("epoll_wait(2)");
+            exit(1);
+        }
+        update_clock();
+        for (i = 0; i < n; i++) {
+            struct endpoint *ep = events[i].data.ptr;
+
+            switch (ep->kind) {
+            case TCP_LISTENER:
+                accept_clients(ep);
+                break;
+            case UDP_SOCKET:
+                udp_event(ep);
+                break;
+            case TCP_CONN:
+                conn_event((struct conn*)ep, events[i].events);
+                break;
+            }
+        }
+    }
 }
 
+static void
+open_service(enum service_id svc, int port)
+{
+    struct endpoint *ep;
+
+    ep = malloc(sizeof(struct endpoint) * 2);
+    if (!ep) {
+        perror("malloc(3)");
+        exit(1);
+    }
+    ep[0].kind = TCP_LISTENER;
+    ep[0].fd = listen_socket(port, SOCK_STREAM);
+    ep[0].svc = svc;
+    add_endpoint(&ep[0], EPOLLIN);
+    ep[1].kind = UDP_SOCKET;
+    ep[1].fd = listen_socket(port, SOCK_DGRAM);
+    ep[1].svc = svc;
+    add_endpoint(&ep[1], EPOLLIN);
+    fprintf(stderr, "%s on port %d/tcp and %d/udp\n", services[svc].name, port, port);
+}
+
+/* IPv4 only, for the same reason as in the book. */
 static int
-listen_socket(int port)
+listen_socket(int port, int type)
 {
     struct addrinfo hints, *res, *ai;
     int err;
@@ -63,7 +235,7 @@ listen_socket(int port)
     memset(&hints, 0, sizeof(struct addrinfo));
     /* hints.ai_family = AF_UNSPEC; */
     hints.ai_family = AF_INET;
-    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_socktype = type;
     hints.ai_flags = AI_PASSIVE;
     snprintf(service, sizeof service, "%d", port);
     if ((err = getaddrinfo(NULL, service, &hints, &res)) != 0) {
@@ -71,22 +243,325 @@ listen_socket(int port)
         exit(1);
     }
     for (ai = res; ai; ai = ai->ai_next) {
-        int sock;
+        int sock, on = 1;
 
-        sock = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+        sock = socket(ai->ai_family, ai->ai_socktype|SOCK_NONBLOCK|SOCK_CLOEXEC,
+                      ai->ai_protocol);
         if (sock < 0) continue;
+        setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &on, sizeof on);
         if (bind(sock, ai->ai_addr, ai->ai_addrlen) < 0) {
             close(sock);
             continue;
         }
-        if (listen(sock, 5) < 0) {
+        if (type == SOCK_STREAM && listen(sock, SOMAXCONN) < 0) {
             close(sock);
             continue;
         }
         freeaddrinfo(res);
-        fprintf(stderr, "listening on port %d...\n", port);
         return sock;
     }
-    fprintf(stderr, "cannot listen socket\n");
+    fprintf(stderr, "cannot listen on port %d/%s\n", port, type == SOCK_STREAM ? "tcp" : "udp");
     exit(1);
 }
+
+static void
+add_endpoint(struct endpoint *ep, unsigned int events)
+{
+    struct epoll_event ev;
+
+    ev.events = events;
+    ev.data.ptr = ep;
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, ep->fd, &ev) < 0) {
+        perror("epoll_ctl(2)");
+        exit(1);
+    }
+}
+
+/* Formats the replies of daytime and time when the second changes. */
+static void
+update_clock(void)
+{
+    time_t t = time(NULL);
+    unsigned long v;
+
+    if (t == clock_sec) return;
+    clock_sec = t;
+    strncpy(daytime_str, asctime(localtime(&t)), sizeof daytime_str - 1);
+    daytime_len = strlen(daytime_str);
+    v = (unsigned long)t + RFC868_EPOCH;
+    time_bin[0] = v >> 24;
+    time_bin[1] = v >> 16;
+    time_bin[2] = v >> 8;
+    time_bin[3] = v;
+}
+
+/* Lays out the 95 lines of the usual rotating pattern twice, so that
+   any CHARGEN_PATTERN bytes from any offset are contiguous. */
+static void
+init_chargen(void)
+{
+    char *p = chargen_pattern;
+    int line, i;
+
+    for (line = 0; line < CHARGEN_CHARS * 2; line++) {
+        for (i = 0; i < CHARGEN_LINE; i++)
+            *p++ = ' ' + (line + i) % CHARGEN_CHARS;
+        *p++ = '\r';
+        *p++ = '\n';
+    }
+}
+
+/* daytime and time are answered right after accept(2): the reply fits
+   in any socket buffer, so the connection is never registered. */
+static void
+accept_clients(struct endpoint *ep)
+{
+    int i;
+
+    for (i = 0; i < ACCEPT_BATCH; i++) {
+        int sock = accept_one(ep->fd);
+
+        if (sock < 0) return;
+        switch (ep->svc) {
+        case SVC_DAYTIME:
+            send(sock, daytime_str, daytime_len, MSG_NOSIGNAL|MSG_DONTWAIT);
+            close(sock);
+            break;
+        case SVC_TIME:
+            send(sock, time_bin, sizeof time_bin, MSG_NOSIGNAL|MSG_DONTWAIT);
+            close(sock);
+            break;
+        default:
+            open_conn(sock, ep->svc);
+            break;
+        }
+    }
+}
+
+/* When out of descriptors, the spare one is used to accept and drop
+   a client; otherwise the pending connection would wake us up again
+   and again. */
+static int
+accept_one(int server)
+{
+    int sock;
+
+    sock = accept4(server, NULL, NULL, SOCK_NONBLOCK|SOCK_CLOEXEC);
+    if (sock >= 0) return sock;
+    if ((errno == EMFILE || errno == ENFILE) && spare_fd >= 0) {
+        close(spare_fd);
+        sock = accept(server, NULL, NULL);
+        if (sock >= 0) close(sock);
+        spare_fd = open("/dev/null", O_RDONLY|O_CLOEXEC);
+    }
+    else if (errno != EAGAIN && errno != EINTR && errno != ECONNABORTED) {
+        perror("accept(2)");
+    }
+    return -1;
+}
+
+static void
+open_conn(int sock, enum service_id svc)
+{
+    struct conn *c;
+
+    c = malloc(sizeof(struct conn));
+    if (!c) {
+        close(sock);
+        return;
+    }
+    c->ep.kind = TCP_CONN;
+    c->ep.fd = sock;
+    c->ep.svc = svc;
+    c->chargen_pos = 0;
+    c->out_off = c->out_len = 0;
+    add_endpoint(&c->ep, svc == SVC_CHARGEN ? EPOLLIN|EPOLLOUT : EPOLLIN);
+}
+
+static void
+conn_event(struct conn *c, unsigned int events)
+{
+    int ok = 1;
+
+    if (events & EPOLLERR) ok = 0;
+    switch (c->ep.svc) {
+    case SVC_ECHO:
+        if (ok && (events & EPOLLOUT)) ok = echo_output(c);
+        if (ok && (events & (EPOLLIN|EPOLLHUP))) ok = echo_input(c);
+        break;
+    case SVC_CHARGEN:
+        if (ok && (events & EPOLLOUT)) ok = chargen_output(c);
+        /* fall through: whatever the client sends is ignored */
+    case SVC_DISCARD:
+    default:
+        if (ok && (events & (EPOLLIN|EPOLLHUP))) {
+            ssize_t n;
+
+            while ((n = read(c->ep.fd, c->buf, sizeof c->buf)) > 0)
+                ;
+            if (n == 0 || errno != EAGAIN) ok = 0;
+        }
+        break;
+    }
+    if (!ok) close_conn(c);
+}
+
+/* Returns 0 when the connection is finished. */
+static int
+echo_input(struct conn *c)
+{
+    ssize_t n;
+
+    if (c->out_len > 0) return 1;   /* still sending the last read */
+    n = read(c->ep.fd, c->buf, sizeof c->buf);
+    if (n == 0) return 0;
+    if (n < 0) return errno == EAGAIN;
+    c->out_off = 0;
+    c->out_len = n;
+    return echo_output(c);
+}
+
+static int
+echo_output(struct conn *c)
+{
+    ssize_t n;
+
+    if (c->out_len == 0) return 1;
+    n = send(c->ep.fd, c->buf + c->out_off, c->out_len, MSG_NOSIGNAL);
+    if (n < 0) {
+        if (errno != EAGAIN) return 0;
+        n = 0;
+    }
+    c->out_off += n;
+    c->out_len -= n;
+    /* stop reading until the client takes what it sent */
+    watch(c, c->out_len > 0 ? EPOLLOUT : EPOLLIN);
+    return 1;
+}
+
+static int
+chargen_output(struct conn *c)
+{
+    size_t done = 0;
+    ssize_t n;
+
+    while (done < CHARGEN_BURST) {
+        n = send(c->ep.fd, chargen_pattern + c->chargen_pos, CHARGEN_PATTERN, MSG_NOSIGNAL);
+        if (n < 0) return errno == EAGAIN;
+        c->chargen_pos = (c->chargen_pos + n) % CHARGEN_PATTERN;
+        done += n;
+    }
+    return 1;
+}
+
+static void
+watch(struct conn *c, unsigned int events)
+{
+    struct epoll_event ev;
+
+    ev.events = events;
+    ev.data.ptr = c;
+    if (epoll_ctl(epfd, EPOLL_CTL_MOD, c->ep.fd, &ev) < 0) {
+        perror("epoll_ctl(2)");
+        exit(1);
+    }
+}
+
+static void
+close_conn(struct conn *c)
+{
+    close(c->ep.fd);    /* also removes it from the epoll set */
+    free(c);
+}
+
+/* Reads up to UDP_BATCH datagrams with one system call and sends all
+   the replies with another, until the socket is drained.  A reply the
+   socket buffer cannot take is dropped, as UDP allows. */
+static void
+udp_event(struct endpoint *ep)
+{
+    static char in[UDP_BATCH][UDP_BUF_SIZE];
+    static struct sockaddr_storage addrs[UDP_BATCH];
+    struct mmsghdr msgs[UDP_BATCH], replies[UDP_BATCH];
+    struct iovec iov[UDP_BATCH], riov[UDP_BATCH];
+    int i, n, n_replies;
+
+    do {
+        for (i = 0; i < UDP_BATCH; i++) {
+            iov[i].iov_base = in[i];
+            iov[i].iov_len = UDP_BUF_SIZE;
+            memset(&msgs[i], 0, sizeof(struct mmsghdr));
+            msgs[i].msg_hdr.msg_iov = &iov[i];
+            msgs[i].msg_hdr.msg_iovlen = 1;
+            msgs[i].msg_hdr.msg_name = &addrs[i];
+            msgs[i].msg_hdr.msg_namelen = sizeof addrs[i];
+        }
+        n = recvmmsg(ep->fd, msgs, UDP_BATCH, MSG_DONTWAIT, NULL);
+        if (n <= 0) return;
+        if (ep->svc == SVC_DISCARD) continue;
+        n_replies = 0;
+        for (i = 0; i < n; i++) {
+            struct mmsghdr *r = &replies[n_replies];
+            char *data;
+            size_t len;
+
+            if (msgs[i].msg_hdr.msg_flags & MSG_TRUNC) continue;
+            if (!udp_peer_ok(&addrs[i])) continue;
+            len = udp_reply(ep->svc, in[i], msgs[i].msg_len, &data);
+            memset(r, 0, sizeof(struct mmsghdr));
+            riov[n_replies].iov_base = data;
+            riov[n_replies].iov_len = len;
+            r->msg_hdr.msg_iov = &riov[n_replies];
+            r->msg_hdr.msg_iovlen = 1;
+            r->msg_hdr.msg_name = &addrs[i];
+            r->msg_hdr.msg_namelen = msgs[i].msg_hdr.msg_namelen;
+            n_replies++;
+        }
+        if (n_replies > 0)
+            sendmmsg(ep->fd, replies, n_replies, MSG_DONTWAIT);
+    } while (n == UDP_BATCH);
+}
+
+/* Whether a datagram from addr may be answered.  Replies to another
+   small service would be answered again, so those are refused, as are
+   privileged ports, where such services live. */
+static int
+udp_peer_ok(struct sockaddr_storage *addr)
+{
+    int port, i;
+
+    if (addr->ss_family == AF_INET6)
+        port = ntohs(((struct sockaddr_in6*)addr)->sin6_port);
+    else
+        port = ntohs(((struct sockaddr_in*)addr)->sin_port);
+    if (port < 1024) return 0;
+    for (i = 0; i < N_SERVICES; i++) {
+        if (port == services[i].port + port_offset) return 0;
+    }
+    return 1;
+}
+
+/* Points out at the reply to a datagram; nothing is copied. */
+static size_t
+udp_reply(enum service_id svc, char *req, size_t len, char **out)
+{
+    switch (svc) {
+    case SVC_ECHO:
+        *out = req;
+        return len;
+    case SVC_DAYTIME:
+        *out = daytime_str;
+        return daytime_len;
+    case SVC_TIME:
+        *out = (char*)time_bin;
+        return sizeof time_bin;
+    case SVC_CHARGEN:
+        /* one line of the pattern per datagram */
+        *out = chargen_pattern + udp_chargen_pos;
+        udp_chargen_pos = (udp_chargen_pos + CHARGEN_LINE + 2) % CHARGEN_PATTERN;
+        return CHARGEN_LINE + 2;
+    default:
+        *out = NULL;
+        return 0;
+    }
+}
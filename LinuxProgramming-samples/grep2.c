@@ -14,148 +14,3212 @@
     ɤǤȤǤ
 */
 
+#define _GNU_SOURCE     /* memrchr() */
 #include <stdio.h>
 #include <stdlib.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <string.h>
+#include <ctype.h>
+#include <errno.h>
 #include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <pthread.h>
 #include <regex.h>
 #include <unistd.h>
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__)) && defined(__SSE2__)
+#include <immintrin.h>
+#define HAVE_SIMD
+#endif
 
-static void grep_file(regex_t *re, char *path);
-static void grep_stream(regex_t *re, FILE *f);
+/* What every match of a subexpression is known to contain.  When exact
+   is set the subexpression matches nothing but that one string, and
+   left, right and in are all equal to it. */
+struct must {
+    int exact;
+    char *left;     /* every match begins with this */
+    char *right;    /* every match ends with this */
+    char *in;       /* the longest string inside every match */
+};
+
+#define MUST_DEPTH_MAX 64
+#define READ_BLOCK_SIZE (256 * 1024)
+#define MMAP_MIN_SIZE (64 * 1024)     /* smaller files are read() */
+#define CHUNK_SIZE (4 * 1024 * 1024)  /* larger files are split at about this */
+#define CHUNK_AHEAD 4                 /* chunks per thread done ahead of output */
+#define IDX_MAGIC "GREPIDX2"
+#define IDX_TAIL_SIZE 4096
+#define IDX_TRIGRAMS_MAX 64           /* of the literal, looked up in the index */
+#define OUTPUT_BUFFER_SIZE (256 * 1024)
+#define DIRENT_BUF_SIZE (32 * 1024)
+
+#define NFA_MAX_NODES 20000
+#define DFA_CACHE_SIZE (4 * 1024 * 1024)
+#define DFA_HASH_SIZE 4096
+#define DFA_THRASH_BYTES 8      /* fewer bytes per cached state than this... */
+#define DFA_THRASH_LIMIT 3      /* ...at this many flushes in a row */
+#define BYTE_SET_SIZE 32
+#define BYTE_SET_INDEX(c) ((c) >> 3)
+#define BYTE_SET_BIT(c) (1 << ((c) & 7))
+
+enum nfa_op { NFA_SET, NFA_EMPTY, NFA_SPLIT, NFA_BOL, NFA_EOL, NFA_MATCH };
+
+struct nfa_node {
+    int op;
+    int out;
+    int out1;       /* NFA_SPLIT */
+    int set;        /* NFA_SET: index into dfa.sets */
+};
+
+/* a piece of NFA under construction; node[end].out is still loose */
+struct frag {
+    int start;
+    int end;
+};
+
+/* A DFA state is the set of NFA_SET nodes alive at some point of a
+   line.  States are built the first time a transition is needed. */
+struct dstate {
+    struct dstate *hash_next;
+    unsigned int hash;
+    int match;          /* the line has matched */
+    int eol_match;      /* the line matches if it ends here */
+    int n;
+    int *nodes;         /* sorted */
+    struct dstate *next[1];     /* one per byte class; NULL until needed */
+};
+
+struct dfa {
+    struct nfa_node *node;
+    int n_nodes;
+    int capa_nodes;
+    unsigned char (*sets)[BYTE_SET_SIZE];
+    int n_sets;
+    int capa_sets;
+    int start_node;
+    int match_node;
+    int icase;
+    int too_big;
+    int has_eol;                /* the pattern has "$" */
+    unsigned char cls[256];     /* byte -> class */
+    int n_classes;
+
+    /* the node set being computed, as a sparse set */
+    int *dense;
+    int *sparse;
+    int set_n;
+    int *stack;
+    int *key;
+    int key_n;
+
+    /* the state cache */
+    size_t state_size;
+    struct dstate **hash;
+    int n_states;
+    size_t cache_used;
+    struct dstate *start;
+    struct dstate matched;
+    struct dstate *scratch[2];  /* states when not caching any more */
+    int nfa_mode;
+    int thrash;
+    unsigned long flushes;
+    size_t scanned;
+    size_t flushed_at;
+};
+
+#define AC_FILTER_MAX 32        /* bytes that may start a string */
+
+/* the trie while the -f strings are added */
+struct ac_build_edge {
+    int to;
+    int next;
+    unsigned char c;
+};
+
+struct ac_build {
+    int root[256];
+    int *first_edge;
+    int *fail;
+    unsigned char *match;
+    int n_nodes;
+    int capa_nodes;
+    struct ac_build_edge *edge;
+    int n_edges;
+    int capa_edges;
+    int n_patterns;
+};
+
+/* the finished automaton; nodes are numbered breadth first */
+struct ac_node {
+    int fail;
+    int edges;                  /* the first in ac.label and ac.target */
+    unsigned short n_edges;
+    unsigned char match;        /* some string ends here */
+};
+
+struct ac {
+    int root[256];
+    struct ac_node *node;
+    int n_nodes;
+    unsigned char *label;
+    int *target;
+    int n_edges;
+    int n_patterns;
+    int filter;
+    unsigned char first[256];   /* bytes that start some string */
+    unsigned char fold[256];    /* -i: to lower case, otherwise as is */
+    unsigned char lo_mask[16];
+    unsigned char hi_mask[16];
+};
+
+/* what one thread searches with */
+struct matcher {
+    regex_t re;
+    struct dfa *dfa;            /* NULL when the pattern needs regexec() */
+};
+
+enum sink_kind {
+    SINK_STDOUT,
+    SINK_MEMORY,                /* text collected in buf */
+    SINK_RANGES                 /* ranges of the input, in ranges */
+};
+
+/* lines of the input, and the line number of the first one
+   counted from where the search began */
+struct range {
+    const char *p;
+    size_t len;
+    unsigned long line;
+};
+
+/* where the matching lines go */
+struct sink {
+    enum sink_kind kind;
+    const char *name;           /* put in front of every line, or NULL */
+    const char *start;          /* the range not written yet */
+    size_t len;
+    const char *counted;        /* -n: newlines before here are counted... */
+    unsigned long lineno;       /* ...and there are this many */
+    char *buf;
+    size_t buf_len;
+    size_t buf_capa;
+    struct range *ranges;
+    size_t n_ranges;
+    size_t capa_ranges;
+};
+
+/* a line-aligned part of a large file */
+struct chunk {
+    const char *start;
+    const char *end;
+    int done;
+    struct sink out;
+};
+
+/* the chunks of one file and the threads searching them */
+struct chunk_job {
+    struct chunk *chunk;
+    int n_chunks;
+    int next;                   /* the chunk to be searched next */
+    int written;                /* chunks before this are written out */
+    int ahead;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+};
+
+/* The index written by grepidx.  These must match grepidx.c. */
+struct IdxHeader {
+    char magic[8];
+    unsigned int block_size;
+    unsigned int n_files;
+    unsigned int n_blocks;
+    unsigned int n_trigrams;
+    unsigned long long files_offset;
+    unsigned long long order_offset;
+    unsigned long long lines_offset;
+    unsigned long long trigrams_offset;
+    unsigned long long postings_offset;
+    unsigned long long names_offset;
+    unsigned long long names_size;
+};
+
+struct IdxFile {
+    unsigned long long size;        /* bytes indexed */
+    unsigned long long dev;
+    unsigned long long ino;
+    unsigned long long tail_hash;   /* of the last IDX_TAIL_SIZE bytes */
+    unsigned long long mtime_ns;    /* st_mtim when indexed */
+    unsigned int first_block;
+    unsigned int n_blocks;
+    unsigned int name;              /* offset into the names */
+    unsigned int pad;
+};
+
+struct IdxTrigram {
+    unsigned int trigram;
+    unsigned int n_blocks;
+    unsigned long long offset;      /* into the posting lists */
+};
+
+/* -X: an index mapped at startup */
+struct index {
+    char *map;
+    size_t size;
+    struct IdxHeader *header;
+    struct IdxFile *files;
+    unsigned int *order;            /* file numbers sorted by name */
+    unsigned int *lines;            /* newlines in each block */
+    struct IdxTrigram *trigrams;
+    const unsigned char *postings;
+    const unsigned char *postings_end;
+    char *names;
+    unsigned char *cand;            /* blocks that may match, or NULL */
+    unsigned int n_cand;
+};
+
+/* -r: a file or a directory, in a tree that is in output order */
+struct walk_node {
+    char *path;
+    int is_dir;
+    int ready;                  /* listed, or searched */
+    char *out;                  /* what a file printed */
+    size_t out_len;
+    struct walk_node **child;   /* the entries of a directory, by name */
+    int n_child;
+};
+
+struct worker {
+    int id;
+    pthread_t thread;
+    struct matcher m;
+    pthread_mutex_t lock;       /* for the deque below */
+    struct walk_node **task;
+    size_t head;
+    size_t tail;
+    size_t capa;
+};
+
+/* a directory being written out and its entry to write next */
+struct cursor {
+    struct walk_node *dir;
+    int next;
+};
+
+#ifdef SYS_getdents64
+/* not in any header of glibc before 2.30 */
+struct linux_dirent64 {
+    uint64_t d_ino;
+    int64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+};
+#endif
+
+static void matcher_init(struct matcher *m);
+static void matcher_free(struct matcher *m);
+static int grep_file(struct matcher *m, const char *path, struct sink *out);
+static void grep_fd(struct matcher *m, int fd, const char *name, size_t block,
+                    struct sink *out);
+static void grep_buffer(struct matcher *m, const char *buf, size_t len,
+                        struct sink *out);
+static int next_match(struct matcher *m, const char *p, const char *end,
+                      const char **line, const char **next);
+static int line_matches(struct matcher *m, const char *s, const char *e);
+static void grep_chunks(const char *map, size_t size, struct sink *out);
+static struct index *index_open(const char *path);
+static void index_prepare(struct index *x);
+static struct IdxFile *index_lookup(struct index *x, const char *path,
+                                    struct stat *st, const char *map);
+static void grep_indexed(struct matcher *m, const char *map, size_t size,
+                         struct IdxFile *f, struct sink *out);
+static unsigned int index_varint(const unsigned char **pp, const unsigned char *end);
+static int cmp_trigram(const void *a, const void *b);
+static unsigned long long tail_hash(const char *p, size_t len);
+static void *chunk_worker(void *arg);
+static void sink_init(struct sink *out, const char *name, enum sink_kind kind);
+static void emit(struct sink *out, const char *p, size_t len);
+static void flush_output(struct sink *out);
+static void sink_write(struct sink *out, const char *p, size_t len);
+static void sink_range(struct sink *out);
+static unsigned long count_lines(const char *p, const char *end);
+static void grep_tree(char **paths, int n);
+static void *worker_main(void *arg);
+static void walk_dir(struct worker *w, struct walk_node *dir);
+static void walk_add(struct walk_node *dir, int *capa, int dirfd,
+                     const char *name, int type);
+static void search_file(struct worker *w, struct walk_node *file);
+static void write_ready(void);
+static void cursor_push(struct walk_node *dir);
+static struct walk_node *walk_node_new(char *path, int is_dir);
+static void walk_node_free(struct walk_node *t);
+static int cmp_walk_node(const void *a, const void *b);
+static void task_push(struct worker *w, struct walk_node *t);
+static struct walk_node *task_pop(struct worker *w);
+static struct walk_node *task_steal(struct worker *thief);
+static char *necessary_literal(const char *pattern);
+static int must_alternation(const char **pp, struct must *m, int depth);
+static int must_sequence(const char **pp, struct must *m, int depth);
+static int must_repeat(const char **pp, struct must *m, int depth);
+static int must_atom(const char **pp, struct must *m, int depth);
+static int parse_interval(const char **pp, int *min, int *max);
+static int skip_bracket(const char **pp);
+static void must_init(struct must *m, const char *s, size_t len, int exact);
+static void must_cat(struct must *a, struct must *b);
+static void must_alt(struct must *a, struct must *b);
+static void must_free(struct must *m);
+static char *str_ndup(const char *s, size_t len);
+static char *str_cat(const char *a, const char *b);
+static char *longer(char *a, char *b);
+static void select_find_literal(void);
+static const char *find_literal_generic(const char *hay, size_t len,
+                                        const char *needle, size_t n);
+static const char *find_literal_icase(const char *hay, size_t len,
+                                      const char *needle, size_t n);
+static int fold_equal(const char *a, const char *b, size_t n);
+static int ascii_only(const char *s);
+#ifdef HAVE_SIMD
+static const char *find_literal_sse2(const char *hay, size_t len,
+                                     const char *needle, size_t n);
+static const char *find_literal_avx2(const char *hay, size_t len,
+                                     const char *needle, size_t n);
+static const char *find_literal_icase_sse2(const char *hay, size_t len,
+                                           const char *needle, size_t n);
+static const char *find_literal_icase_avx2(const char *hay, size_t len,
+                                           const char *needle, size_t n);
+#endif
+static struct dfa *dfa_compile(const char *pattern, int icase);
+static void dfa_free(struct dfa *d);
+static const char *dfa_search(struct dfa *d, const char *p, const char *end);
+static struct dstate *dfa_next(struct dfa *d, struct dstate *s, int c, size_t pos);
+static void dfa_start(struct dfa *d);
+static struct dstate *dfa_lookup(struct dfa *d, int match, int eol_match);
+static struct dstate *dfa_insert(struct dfa *d, int match, int eol_match);
+static void dfa_fill(struct dfa *d, struct dstate *t, int match, int eol_match);
+static void dfa_flush(struct dfa *d);
+static unsigned int key_hash(struct dfa *d, int match, int eol_match);
+static void nfa_step(struct dfa *d, const int *nodes, int n, int c,
+                     int *match, int *eol_match);
+static void closure(struct dfa *d, int n, int bol, int eol);
+static int set_contains(struct dfa *d, int n);
+static int cmp_int(const void *a, const void *b);
+static void compute_classes(struct dfa *d);
+static int nfa_alternation(struct dfa *d, const char **pp, struct frag *f, int depth);
+static int nfa_sequence(struct dfa *d, const char **pp, struct frag *f, int depth);
+static int nfa_repeat(struct dfa *d, const char **pp, struct frag *f, int depth);
+static int nfa_interval(struct dfa *d, const char *text, struct frag *f,
+                        int min, int max, int depth);
+static int nfa_atom(struct dfa *d, const char **pp, struct frag *f, int depth);
+static int parse_bracket(struct dfa *d, const char **pp, unsigned char *set);
+static struct frag frag_node(struct dfa *d, int op);
+static struct frag frag_set(struct dfa *d, unsigned char *set);
+static struct frag frag_cat(struct dfa *d, struct frag a, struct frag b);
+static struct frag frag_alt(struct dfa *d, struct frag a, struct frag b);
+static struct frag frag_repeat(struct dfa *d, struct frag a, int min);
+static struct frag frag_quest(struct dfa *d, struct frag a);
+static int nfa_add(struct dfa *d, int op, int out, int out1, int set);
+static int set_has(const unsigned char *set, int c);
+static void set_add(unsigned char *set, int c);
+static void set_invert(unsigned char *set);
+static void set_fold(unsigned char *set);
+static struct ac *ac_compile(const char *buf, int icase);
+static struct ac *ac_finish(struct ac_build *b);
+static void ac_setup_filter(struct ac *a);
+static const char *ac_search(struct ac *a, const char *p, const char *end);
+static int ac_goto(struct ac *a, int s, int c);
+static size_t ac_memory(struct ac *a);
+static void ac_free(struct ac *a);
+static const char *skip_first_bytes_generic(struct ac *a, const char *p,
+                                            const char *end);
+#ifdef HAVE_SIMD
+static const char *skip_first_bytes_ssse3(struct ac *a, const char *p,
+                                          const char *end);
+#endif
+static void ac_build_node(struct ac_build *b);
+static int ac_build_child(struct ac_build *b, int s, int c, int create);
+static void ac_build_free(struct ac_build *b);
+static void print_stats(struct matcher *m);
 static char *read_file(char *path);
+static int lines_to_alternation(char *buf);
 static void die(const char *s);
 
 static int opt_invert = 0;
 static int opt_ignorecase = 0;
+static int opt_stats = 0;
+static int opt_number = 0;
+static int no_patterns = 0;     /* -f with an empty file: nothing matches */
+
+/* Lines not containing literal cannot match, so regexec() is skipped
+   for them.  NULL when the pattern has no such literal. */
+static char *literal = NULL;
+static size_t literal_len;
+static const char *(*find_literal)(const char *hay, size_t len,
+                                   const char *needle, size_t n);
+
+static char *pattern = NULL;
+static char *pattern_file = NULL;
+static char *index_path = NULL;
+static struct index *idx = NULL;
+
+/* -f with fixed strings only; neither regexec() nor dfa is used then */
+static struct ac *ac = NULL;
+static const char *(*skip_first_bytes)(struct ac *a, const char *p,
+                                       const char *end);
+
+/* -r */
+static int opt_recursive = 0;
+static int opt_unordered = 0;   /* -u: files in the order they are done */
+static int opt_threads = 0;     /* -j: one per CPU by default */
+static struct worker *workers;
+static unsigned long pending = 0;       /* tasks queued or running */
+static unsigned long work_seq = 0;      /* bumped by every task_push() */
+static int n_idle = 0;
+static pthread_mutex_t idle_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t idle_cond = PTHREAD_COND_INITIALIZER;
+static pthread_mutex_t output_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct cursor *cursor;   /* the directories being written out */
+static int n_cursor = 0;
+static int capa_cursor = 0;
 
 int
 main(int argc, char *argv[])
 {
-    char *pattern = NULL;
-    regex_t re;
-    int re_mode;
-    int err;
+    struct matcher m;
+    struct sink out;
+    char *p;
     int i;
     int opt;
 
-    while ((opt = getopt(argc, argv, "if:v")) != -1) {
+    while ((opt = getopt(argc, argv, "if:j:nrSuvX:")) != -1) {
         switch (opt) {
         case 'i':
             opt_ignorecase = 1;
             break;
         case 'f':
-            pattern = read_file(optarg);
+            pattern_file = optarg;
+            break;
+        case 'j':
+            opt_threads = atoi(optarg);
+            break;
+        case 'n':
+            opt_number = 1;
+            break;
+        case 'r':
+            opt_recursive = 1;
+            break;
+        case 'S':
+            opt_stats = 1;
+            break;
+        case 'u':
+            opt_unordered = 1;
             break;
         case 'v':
             opt_invert = 1;
             break;
+        case 'X':
+            index_path = optarg;
+            break;
         case '?':
-            fprintf(stderr, "Usage: %s [-iv] [-f PATTERN] [<file>...]\n", argv[0]);
+            fprintf(stderr, "Usage: %s [-inrSuv] [-j THREADS] [-X INDEX] [-f PATTERN] [<file>...]\n", argv[0]);
             exit(1);
         }
     }
     argc -= optind;
     argv += optind;
-    if (!pattern) {
+    if (opt_threads <= 0) opt_threads = sysconf(_SC_NPROCESSORS_ONLN);
+    if (opt_threads <= 0) opt_threads = 1;
+    select_find_literal();
+    if (pattern_file) {
+        pattern = read_file(pattern_file);
+        /* grep2 runs in the C locale, where only ASCII letters
+           have a case; others are left to REG_ICASE */
+        if (!opt_ignorecase || ascii_only(pattern))
+            ac = ac_compile(pattern, opt_ignorecase);
+        if (!ac && lines_to_alternation(pattern) == 0) no_patterns = 1;
+    }
+    else {
         if (argc < 1) {
             fputs("no pattern\n", stderr);
             exit(1);
         }
         pattern = argv[0];
+        lines_to_alternation(pattern);
         argc--;
         argv++;
     }
+    if (!ac) {
+        literal = necessary_literal(pattern);
+        if (literal && opt_ignorecase) {
+            /* find_literal_icase() wants it in lower case */
+            if (!ascii_only(literal)) {
+                free(literal);
+                literal = NULL;
+            }
+            else {
+                for (p = literal; *p; p++)
+                    *p = tolower((unsigned char)*p);
+            }
+        }
+        if (literal) literal_len = strlen(literal);
+    }
+    if (index_path) {
+        idx = index_open(index_path);
+        index_prepare(idx);
+    }
+    matcher_init(&m);
+    if (opt_stats) print_stats(&m);
+    setvbuf(stdout, NULL, _IOFBF, OUTPUT_BUFFER_SIZE);
+    if (opt_recursive) {
+        grep_tree(argv, argc);
+    }
+    else if (argc == 0) {
+        sink_init(&out, NULL, SINK_STDOUT);
+        grep_fd(&m, STDIN_FILENO, "stdin", READ_BLOCK_SIZE, &out);
+    }
+    else {
+        for (i = 0; i < argc; i++) {
+            sink_init(&out, NULL, SINK_STDOUT);
+            if (grep_file(&m, argv[i], &out) < 0) exit(1);
+        }
+    }
+    matcher_free(&m);
+    if (ac) ac_free(ac);
+    exit(0);
+}
+
+/* Sets up what one thread searches with.  The regex_t and the DFA are
+   per thread: regexec() takes a lock inside glibc and the DFA fills
+   its cache as it goes.  The literal and the automaton are shared. */
+static void
+matcher_init(struct matcher *m)
+{
+    int re_mode;
+    int err;
 
+    m->dfa = NULL;
+    if (ac) return;
     /* re ϡɽ (Regular Expression)פά졣
        regexpסregexפʤɤ褯Ȥޤ */
-    re_mode = REG_EXTENDED | REG_NOSUB | REG_NEWLINE;
+    re_mode = REG_EXTENDED | REG_NEWLINE;
     if (opt_ignorecase) re_mode |= REG_ICASE;
-    err = regcomp(&re, argv[0], re_mode);
+    err = regcomp(&m->re, pattern, re_mode);
     if (err != 0) {
         char buf[1024];
 
-        regerror(err, &re, buf, sizeof buf);
+        regerror(err, &m->re, buf, sizeof buf);
         puts(buf);
         exit(1);
     }
-    if (argc == 0) {
-        grep_stream(&re, stdin);
+    m->dfa = dfa_compile(pattern, opt_ignorecase);
+}
+
+static void
+matcher_free(struct matcher *m)
+{
+    if (ac) return;
+    if (m->dfa) dfa_free(m->dfa);
+    regfree(&m->re);
+}
+
+/* path Ǽե grep 
+   ʤ -1 ֤ */
+static int
+grep_file(struct matcher *m, const char *path, struct sink *out)
+{
+    struct stat st;
+    struct IdxFile *f;
+    char *map;
+    int fd;
+
+    fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        perror(path);
+        return -1;
+    }
+    if (fstat(fd, &st) < 0) die(path);
+    if (S_ISREG(st.st_mode) && st.st_size < MMAP_MIN_SIZE) {
+        /* one read() is cheaper than mapping and unmapping */
+        grep_fd(m, fd, path, st.st_size + 1, out);
+        close(fd);
+        return 0;
     }
-    else {
-        for (i = 0; i < argc; i++) {
-            grep_file(&re, argv[i]);
+    if (S_ISREG(st.st_mode) && (unsigned long long)st.st_size <= SIZE_MAX) {
+        map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (map != MAP_FAILED) {
+            f = idx && idx->cand ? index_lookup(idx, path, &st, map) : NULL;
+#ifdef MADV_SEQUENTIAL
+            if (!f) madvise(map, st.st_size, MADV_SEQUENTIAL);
+#endif
+            /* -r already keeps every thread busy */
+            if (f)
+                grep_indexed(m, map, st.st_size, f, out);
+            else if (st.st_size >= 2 * CHUNK_SIZE && opt_threads > 1 && !opt_recursive)
+                grep_chunks(map, st.st_size, out);
+            else
+                grep_buffer(m, map, st.st_size, out);
+            munmap(map, st.st_size);
+            close(fd);
+            return 0;
         }
     }
-    regfree(&re);
-    exit(0);
+    grep_fd(m, fd, path, READ_BLOCK_SIZE, out);
+    close(fd);
+    return 0;
 }
 
-/* path Ǽե grep  */
+/* For pipes, small files and anything else that is not mapped.  Reads
+   blocks of the given size and greps the complete lines in them; an
+   unfinished line is moved to the front and the buffer grows until it
+   fits. */
 static void
-grep_file(regex_t *re, char *path)
+grep_fd(struct matcher *m, int fd, const char *name, size_t block,
+        struct sink *out)
 {
-    FILE *f;
-    
-    f = fopen(path, "r");
-    if (!f) {
-        perror(path);
+    char *buf, *nl;
+    size_t capa = block;
+    size_t len = 0;
+    size_t done;
+    ssize_t n;
+
+    buf = malloc(capa);
+    if (!buf) die("malloc");
+    for (;;) {
+        if (len == capa) {
+            capa *= 2;
+            buf = realloc(buf, capa);
+            if (!buf) die("realloc");
+        }
+        n = read(fd, buf + len, capa - len);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            die(name);
+        }
+        if (n == 0) break;
+        /* the part kept from last time has no newline */
+        nl = memrchr(buf + len, '\n', n);
+        len += n;
+        if (!nl) continue;
+        done = nl + 1 - buf;
+        grep_buffer(m, buf, done, out);
+        memmove(buf, buf + done, len - done);
+        len -= done;
+    }
+    if (len > 0) grep_buffer(m, buf, len, out);
+    free(buf);
+}
+
+/* Splits a large file into chunks of whole lines and searches them on
+   opt_threads threads.  The chunks are written out in file order: the
+   output of a chunk is kept as ranges of the file until all chunks
+   before it are written.  Its line numbers are counted from its own
+   start, and each chunk counts the lines in it, so the numbers are
+   fixed up as the chunks are written. */
+static void
+grep_chunks(const char *map, size_t size, struct sink *out)
+{
+    const char *end = map + size;
+    const char *p, *q;
+    struct chunk_job job;
+    struct chunk *c;
+    struct range *r;
+    pthread_t *threads;
+    unsigned long base = 0;
+    int i;
+
+    job.n_chunks = 0;
+    job.chunk = calloc(size / CHUNK_SIZE + 1, sizeof(struct chunk));
+    if (!job.chunk) die("calloc");
+    for (p = map; p < end; p = q) {
+        q = p + CHUNK_SIZE - 1;
+        if (q >= end - 1) {
+            q = end;
+        }
+        else {
+            q = memchr(q, '\n', end - q);
+            q = q ? q + 1 : end;
+        }
+        job.chunk[job.n_chunks].start = p;
+        job.chunk[job.n_chunks].end = q;
+        job.n_chunks++;
+    }
+    job.next = 0;
+    job.written = 0;
+    job.ahead = opt_threads * CHUNK_AHEAD;
+    pthread_mutex_init(&job.lock, NULL);
+    pthread_cond_init(&job.cond, NULL);
+    threads = malloc(opt_threads * sizeof(pthread_t));
+    if (!threads) die("malloc");
+    for (i = 0; i < opt_threads; i++) {
+        if (pthread_create(&threads[i], NULL, chunk_worker, &job) != 0)
+            die("pthread_create");
+    }
+
+    for (i = 0; i < job.n_chunks; i++) {
+        c = &job.chunk[i];
+        pthread_mutex_lock(&job.lock);
+        while (!c->done)
+            pthread_cond_wait(&job.cond, &job.lock);
+        pthread_mutex_unlock(&job.lock);
+        for (r = c->out.ranges; r < c->out.ranges + c->out.n_ranges; r++) {
+            out->counted = r->p;
+            out->lineno = base + r->line;
+            emit(out, r->p, r->len);
+            flush_output(out);
+        }
+        base += c->out.lineno;
+        free(c->out.ranges);
+        pthread_mutex_lock(&job.lock);
+        job.written++;
+        pthread_cond_broadcast(&job.cond);
+        pthread_mutex_unlock(&job.lock);
+    }
+
+    for (i = 0; i < opt_threads; i++)
+        pthread_join(threads[i], NULL);
+    free(threads);
+    free(job.chunk);
+    pthread_mutex_destroy(&job.lock);
+    pthread_cond_destroy(&job.cond);
+}
+
+/* Takes chunks in order, but no more than job->ahead past the last one
+   written, so that a file with many matches does not pile up output. */
+static void *
+chunk_worker(void *arg)
+{
+    struct chunk_job *job = arg;
+    struct matcher m;
+    struct chunk *c;
+
+    matcher_init(&m);
+    for (;;) {
+        pthread_mutex_lock(&job->lock);
+        while (job->next < job->n_chunks && job->next >= job->written + job->ahead)
+            pthread_cond_wait(&job->cond, &job->lock);
+        if (job->next == job->n_chunks) {
+            pthread_mutex_unlock(&job->lock);
+            break;
+        }
+        c = &job->chunk[job->next++];
+        pthread_mutex_unlock(&job->lock);
+
+        sink_init(&c->out, NULL, SINK_RANGES);
+        grep_buffer(&m, c->start, c->end - c->start, &c->out);
+
+        pthread_mutex_lock(&job->lock);
+        c->done = 1;
+        pthread_cond_broadcast(&job->cond);
+        pthread_mutex_unlock(&job->lock);
+    }
+    matcher_free(&m);
+    return NULL;
+}
+
+/* Maps an index written by grepidx. */
+static struct index *
+index_open(const char *path)
+{
+    struct index *x;
+    struct IdxHeader *h;
+    struct IdxFile *f;
+    struct stat st;
+    unsigned int i;
+    int fd;
+
+    x = calloc(1, sizeof *x);
+    if (!x) die("calloc");
+    fd = open(path, O_RDONLY);
+    if (fd < 0 || fstat(fd, &st) < 0) die(path);
+    x->size = st.st_size;
+    if (x->size < sizeof(struct IdxHeader)) {
+        fprintf(stderr, "%s: not an index\n", path);
         exit(1);
     }
-    grep_stream(re, f);
-    fclose(f);
+    x->map = mmap(NULL, x->size, PROT_READ, MAP_SHARED, fd, 0);
+    if (x->map == MAP_FAILED) die("mmap");
+    close(fd);
+    h = x->header = (struct IdxHeader *)x->map;
+    if (memcmp(h->magic, IDX_MAGIC, sizeof h->magic) != 0
+            || h->files_offset > x->size
+            || h->n_files > (x->size - h->files_offset) / sizeof(struct IdxFile)
+            || h->order_offset > x->size
+            || h->n_files > (x->size - h->order_offset) / sizeof(unsigned int)
+            || h->lines_offset > x->size
+            || h->n_blocks > (x->size - h->lines_offset) / sizeof(unsigned int)
+            || h->trigrams_offset > x->size
+            || h->n_trigrams > (x->size - h->trigrams_offset) / sizeof(struct IdxTrigram)
+            || h->postings_offset > h->names_offset
+            || h->names_offset > x->size
+            || h->names_size == 0
+            || h->names_size > x->size - h->names_offset) {
+        fprintf(stderr, "%s: broken index\n", path);
+        exit(1);
+    }
+    x->files = (struct IdxFile *)(x->map + h->files_offset);
+    x->order = (unsigned int *)(x->map + h->order_offset);
+    x->lines = (unsigned int *)(x->map + h->lines_offset);
+    x->trigrams = (struct IdxTrigram *)(x->map + h->trigrams_offset);
+    x->postings = (const unsigned char *)x->map + h->postings_offset;
+    x->postings_end = (const unsigned char *)x->map + h->names_offset;
+    x->names = x->map + h->names_offset;
+    /* checked once, so that lookups need not */
+    for (i = 0; i < h->n_files; i++) {
+        f = &x->files[i];
+        if (x->order[i] >= h->n_files
+                || f->name >= h->names_size
+                || f->first_block > h->n_blocks
+                || f->n_blocks > h->n_blocks - f->first_block
+                || x->names[h->names_size - 1] != '\0') {
+            fprintf(stderr, "%s: broken index\n", path);
+            exit(1);
+        }
+    }
+    return x;
 }
 
-/* f Ǽ륹ȥ꡼ grep 롣
-   ҤǤϡFILE* ϥȥ꡼ʤפȻäˡ
-   ѿ̾ f (file Ƭʸ) ˤ뤢꤬夤 */
+/* Marks the blocks that may have a match in x->cand.  A string starting
+   in a block has its trigrams in that block or the next one (of the
+   same file), so a block is kept when every trigram of the literal is
+   in it or in the next.  Leaves x->cand NULL when the index cannot
+   help: no literal of three bytes or more, -v or -i. */
 static void
-grep_stream(regex_t *re, FILE *f)
+index_prepare(struct index *x)
 {
-    char buf[4096];
-    int matched;
+    unsigned int tri[IDX_TRIGRAMS_MAX];
+    unsigned int n_blocks = x->header->n_blocks;
+    struct IdxTrigram key, *t;
+    const unsigned char *p, *s;
+    unsigned char *has;
+    unsigned int b, i, j, k, n = 0, id;
+    struct IdxFile *f;
 
-    while (fgets(buf, sizeof buf, f)) {
-        matched = (regexec(re, buf, 0, NULL, 0) == 0);
-        if (opt_invert) {
-            matched = !matched;
+    /* the trigrams are of the bytes as they are */
+    if (!literal || literal_len < 3 || opt_invert || opt_ignorecase) return;
+    s = (const unsigned char *)literal;
+    for (i = 0; i + 3 <= literal_len && i < x->header->block_size
+                && n < IDX_TRIGRAMS_MAX; i++) {
+        key.trigram = (s[i] << 16) | (s[i + 1] << 8) | s[i + 2];
+        for (j = 0; j < n && tri[j] != key.trigram; j++)
+            ;
+        if (j == n) tri[n++] = key.trigram;
+    }
+    x->cand = malloc(n_blocks + 1);
+    has = malloc(n_blocks + 1);
+    if (!x->cand || !has) die("malloc");
+    memset(x->cand, 1, n_blocks);
+    for (i = 0; i < n; i++) {
+        key.trigram = tri[i];
+        t = bsearch(&key, x->trigrams, x->header->n_trigrams,
+                    sizeof(struct IdxTrigram), cmp_trigram);
+        if (!t) {
+            memset(x->cand, 0, n_blocks);
+            break;
         }
-        if (matched) {
-            fputs(buf, stdout);
+        memset(has, 0, n_blocks);
+        p = x->postings + (t->offset < (unsigned long long)(x->postings_end - x->postings)
+                           ? t->offset : 0);
+        for (id = 0, k = 0; k < t->n_blocks && p < x->postings_end; k++) {
+            id += index_varint(&p, x->postings_end);
+            if (id < n_blocks) has[id] = 1;
+        }
+        for (j = 0; j < x->header->n_files; j++) {
+            f = &x->files[j];
+            for (b = f->first_block; b < f->first_block + f->n_blocks; b++) {
+                if (!has[b] && !(b + 1 < f->first_block + f->n_blocks && has[b + 1]))
+                    x->cand[b] = 0;
+            }
         }
     }
+    free(has);
+    for (b = 0; b < n_blocks; b++)
+        x->n_cand += x->cand[b];
 }
 
-/* path ǼեΤɤߡ֤ */
-static char *
-read_file(char *path)
+/* Returns the entry for path when the file is still what was indexed,
+   possibly with more appended to it.  A file of the indexed size must
+   also have the indexed mtime, or it was edited in place. */
+static struct IdxFile *
+index_lookup(struct index *x, const char *path, struct stat *st, const char *map)
 {
-    FILE *f;
-    char *buf;
-    size_t capa = 1024;   /* Хåե */
-    size_t idx;           /* ߤΥХåե񤭹߰ */
+    struct IdxFile *f;
+    unsigned int lo = 0, hi = x->header->n_files, mid;
+    size_t start;
     int c;
-    
-    f = fopen(path, "r");
-    if (!f) {
-        perror(path);
-        exit(1);
+
+    while (lo < hi) {
+        mid = (lo + hi) / 2;
+        f = &x->files[x->order[mid]];
+        c = strcmp(x->names + f->name, path);
+        if (c == 0) {
+            start = f->size > IDX_TAIL_SIZE ? f->size - IDX_TAIL_SIZE : 0;
+            if (f->dev != (unsigned long long)st->st_dev
+                    || f->ino != (unsigned long long)st->st_ino
+                    || f->size > (unsigned long long)st->st_size
+                    || (f->size == (unsigned long long)st->st_size
+                        && f->mtime_ns != (unsigned long long)st->st_mtim.tv_sec * 1000000000
+                                          + st->st_mtim.tv_nsec)
+                    || f->size > (unsigned long long)f->n_blocks * x->header->block_size
+                    || f->tail_hash != tail_hash(map + start, f->size - start))
+                return NULL;
+            return f;
+        }
+        if (c < 0)
+            lo = mid + 1;
+        else
+            hi = mid;
     }
-    buf = malloc(capa);
-    if (!buf) die("malloc");
-    while ((c = getc(f)) != EOF) {
-        /* ХåեĹå ('\0' 뤳Ȥͤ +1 ) */
-        if (idx + 1 >= capa) {
-            capa *= 2;
-            buf = realloc(buf, capa);
-            if (!buf) die("realloc");
+    return NULL;
+}
+
+/* Searches only the blocks that may have a match, each widened to whole
+   lines, and what was appended to the file after it was indexed.  For
+   -n, the lines before a block are added up from the index. */
+static void
+grep_indexed(struct matcher *m, const char *map, size_t size,
+             struct IdxFile *f, struct sink *out)
+{
+    size_t bs = idx->header->block_size;
+    const char *end = map + size;
+    const char *s = NULL, *e = NULL;
+    const char *rs = NULL, *re = NULL;  /* the region to search next */
+    unsigned long lines = 0;            /* newlines before block lb */
+    unsigned int b, lb = 0, tb;
+    int more;
+
+    for (b = 0; ; b++) {
+        more = 0;
+        if (b < f->n_blocks) {
+            if (!idx->cand[f->first_block + b]) continue;
+            s = map + (size_t)b * bs;
+            e = (b + 1 < f->n_blocks) ? s + bs : map + f->size;
+            more = 1;
         }
-        buf[idx++] = c;
+        else if (b == f->n_blocks && f->size < size) {
+            s = map + f->size;
+            e = end;
+            more = 1;
+        }
+        if (more) {
+            if (s > map && s[-1] != '\n') {
+                s = memrchr(map, '\n', s - map);
+                s = s ? s + 1 : map;
+            }
+            if (e > s && e < end && e[-1] != '\n') {
+                e = memchr(e, '\n', end - e);
+                e = e ? e + 1 : end;
+            }
+            if (rs && s <= re) {
+                if (e > re) re = e;
+                continue;
+            }
+        }
+        if (rs) {
+            if (opt_number) {
+                tb = (rs - map) / bs;
+                if (tb > f->n_blocks) tb = f->n_blocks;
+                for (; lb < tb; lb++)
+                    lines += idx->lines[f->first_block + lb];
+                out->lineno = lines + count_lines(map + (size_t)lb * bs, rs);
+            }
+            grep_buffer(m, rs, re - rs, out);
+        }
+        if (!more) break;
+        rs = s;
+        re = e;
     }
-    buf[idx++] = '\0';
-    fclose(f);
+}
 
-    return buf;
+static unsigned int
+index_varint(const unsigned char **pp, const unsigned char *end)
+{
+    const unsigned char *p = *pp;
+    unsigned int v = 0;
+    int shift = 0;
+
+    while (p < end && (*p & 0x80) && shift < 28) {
+        v |= (*p++ & 0x7f) << shift;
+        shift += 7;
+    }
+    if (p < end) v |= *p++ << shift;
+    *pp = p;
+    return v;
+}
+
+static int
+cmp_trigram(const void *a, const void *b)
+{
+    unsigned int x = ((const struct IdxTrigram *)a)->trigram;
+    unsigned int y = ((const struct IdxTrigram *)b)->trigram;
+
+    return x < y ? -1 : x > y;
+}
+
+/* FNV-1a; must match grepidx.c */
+static unsigned long long
+tail_hash(const char *p, size_t len)
+{
+    unsigned long long h = 14695981039346656037ULL;
+
+    while (len-- > 0) {
+        h ^= (unsigned char)*p++;
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+/* Greps the lines in [buf, buf + len).  Only the last line may lack its
+   newline.  Lines are never split apart: the buffer is searched as a
+   whole and line boundaries are looked up around each match. */
+static void
+grep_buffer(struct matcher *m, const char *buf, size_t len, struct sink *out)
+{
+    const char *p = buf;
+    const char *end = buf + len;
+    const char *line, *next;
+
+    out->counted = buf;
+    while (p < end && next_match(m, p, end, &line, &next)) {
+        if (opt_invert)
+            emit(out, p, line - p);
+        else
+            emit(out, line, next - line);
+        p = next;
+    }
+    if (opt_invert)
+        emit(out, p, end - p);
+    flush_output(out);
+    if (opt_number) {
+        out->lineno += count_lines(out->counted, end);
+        out->counted = end;
+    }
+}
+
+/* Finds the first matching line in [p, end).  *line is set to its
+   beginning and *next to the beginning of the line after it. */
+static int
+next_match(struct matcher *m, const char *p, const char *end,
+           const char **line, const char **next)
+{
+    regmatch_t rm;
+    const char *hit, *s, *e;
+    int verify;
+
+    if (no_patterns) return 0;
+    while (p < end) {
+        verify = (literal != NULL);
+        if (literal) {
+            hit = find_literal(p, end - p, literal, literal_len);
+            if (!hit) return 0;
+        }
+        else if (ac) {
+            hit = ac_search(ac, p, end);
+            if (!hit) return 0;
+        }
+        else if (m->dfa) {
+            hit = dfa_search(m->dfa, p, end);
+            if (!hit) return 0;
+        }
+        else {
+            rm.rm_so = 0;
+            rm.rm_eo = end - p;
+            if (regexec(&m->re, p, 1, &rm, REG_STARTEND) != 0) return 0;
+            hit = p + rm.rm_so;
+            /* [[:space:]] or \s may match '\n' even with REG_NEWLINE */
+            verify = (memchr(hit, '\n', rm.rm_eo - rm.rm_so) != NULL);
+        }
+        /* "$" or "" matching after the final newline */
+        if (hit == end && end[-1] == '\n') return 0;
+        s = memrchr(p, '\n', hit - p);
+        s = s ? s + 1 : p;
+        e = memchr(hit, '\n', end - hit);
+        e = e ? e + 1 : end;
+        if (!verify || line_matches(m, s, e)) {
+            *line = s;
+            *next = e;
+            return 1;
+        }
+        p = e;
+    }
+    return 0;
+}
+
+/* the DFA or regexec() on the single line [s, e) */
+static int
+line_matches(struct matcher *m, const char *s, const char *e)
+{
+    regmatch_t rm;
+
+    if (e > s && e[-1] == '\n') e--;
+    if (m->dfa) return dfa_search(m->dfa, s, e) != NULL;
+    rm.rm_so = 0;
+    rm.rm_eo = e - s;
+    return regexec(&m->re, s, 0, &rm, REG_STARTEND) == 0;
+}
+
+/* name, when not NULL, is put in front of every line */
+static void
+sink_init(struct sink *out, const char *name, enum sink_kind kind)
+{
+    out->kind = kind;
+    out->name = name;
+    out->start = NULL;
+    out->len = 0;
+    out->counted = NULL;
+    out->lineno = 0;
+    out->buf = NULL;
+    out->buf_len = 0;
+    out->buf_capa = 0;
+    out->ranges = NULL;
+    out->n_ranges = 0;
+    out->capa_ranges = 0;
+}
+
+/* Output is kept as one range of the input and written out at once
+   when the next range does not continue it. */
+static void
+emit(struct sink *out, const char *p, size_t len)
+{
+    if (len == 0) return;
+    if (out->len > 0 && out->start + out->len == p) {
+        out->len += len;
+        return;
+    }
+    flush_output(out);
+    out->start = p;
+    out->len = len;
+}
+
+static void
+flush_output(struct sink *out)
+{
+    const char *p = out->start;
+    const char *end = out->start + out->len;
+    const char *e;
+    char num[32];
+
+    if (out->len == 0) return;
+    if (out->kind == SINK_RANGES) {
+        sink_range(out);
+        out->len = 0;
+        return;
+    }
+    if (!out->name && !opt_number) {
+        sink_write(out, p, end - p);
+    }
+    else {
+        for (; p < end; p = e) {
+            e = memchr(p, '\n', end - p);
+            e = e ? e + 1 : end;
+            if (out->name) {
+                sink_write(out, out->name, strlen(out->name));
+                sink_write(out, ":", 1);
+            }
+            if (opt_number) {
+                /* only as far as the line being written */
+                out->lineno += count_lines(out->counted, p);
+                out->counted = p;
+                sprintf(num, "%lu:", out->lineno + 1);
+                sink_write(out, num, strlen(num));
+            }
+            sink_write(out, p, e - p);
+        }
+    }
+    /* the last line of a file without a newline */
+    if (end[-1] != '\n') sink_write(out, "\n", 1);
+    out->len = 0;
+}
+
+static void
+sink_write(struct sink *out, const char *p, size_t len)
+{
+    if (out->kind == SINK_STDOUT) {
+        if (fwrite(p, 1, len, stdout) != len) die("fwrite");
+        return;
+    }
+    if (out->buf_len + len > out->buf_capa) {
+        while (out->buf_len + len > out->buf_capa)
+            out->buf_capa = out->buf_capa ? out->buf_capa * 2 : 4096;
+        out->buf = realloc(out->buf, out->buf_capa);
+        if (!out->buf) die("realloc");
+    }
+    memcpy(out->buf + out->buf_len, p, len);
+    out->buf_len += len;
+}
+
+static void
+sink_range(struct sink *out)
+{
+    struct range *r;
+
+    if (out->n_ranges == out->capa_ranges) {
+        out->capa_ranges = out->capa_ranges ? out->capa_ranges * 2 : 64;
+        out->ranges = realloc(out->ranges, out->capa_ranges * sizeof(struct range));
+        if (!out->ranges) die("realloc");
+    }
+    if (opt_number) {
+        out->lineno += count_lines(out->counted, out->start);
+        out->counted = out->start;
+    }
+    r = &out->ranges[out->n_ranges++];
+    r->p = out->start;
+    r->len = out->len;
+    r->line = out->lineno;
+}
+
+/* the number of newlines in [p, end) */
+static unsigned long
+count_lines(const char *p, const char *end)
+{
+    unsigned long n = 0;
+
+    while ((p = memchr(p, '\n', end - p)) != NULL) {
+        n++;
+        p++;
+    }
+    return n;
+}
+
+/* -r: the paths, and everything under the directories among them, are
+   searched by opt_threads workers.  Each worker keeps its own deque of
+   tasks (a directory to list or a file to search); it takes the newest
+   task from its own and, when that is empty, steals the oldest one from
+   another worker.  Listing a directory adds its entries as new tasks.
+
+   The tasks form a tree in which the entries of a directory are sorted
+   by name.  A file's output is kept until everything before it in that
+   tree has been written, so the output does not depend on the timing,
+   unless -u asks for each file to be written as soon as it is done. */
+static void
+grep_tree(char **paths, int n)
+{
+    static char *dot[] = { "" };
+    struct walk_node *root;
+    struct stat st;
+    int i;
+
+    if (n == 0) {
+        paths = dot;
+        n = 1;
+    }
+    workers = calloc(opt_threads, sizeof(struct worker));
+    if (!workers) die("calloc");
+    for (i = 0; i < opt_threads; i++) {
+        workers[i].id = i;
+        pthread_mutex_init(&workers[i].lock, NULL);
+    }
+
+    /* the command line is the root directory */
+    root = walk_node_new(strdup(""), 1);
+    root->ready = 1;
+    root->child = malloc(n * sizeof(struct walk_node *));
+    if (!root->child) die("malloc");
+    for (i = 0; i < n; i++) {
+        /* symbolic links are followed on the command line only */
+        int is_dir = (stat(paths[i][0] ? paths[i] : ".", &st) == 0
+                      && S_ISDIR(st.st_mode));
+        root->child[i] = walk_node_new(strdup(paths[i]), is_dir);
+        if (!root->child[i]->path) die("strdup");
+    }
+    root->n_child = n;
+    if (!opt_unordered) cursor_push(root);
+    for (i = n - 1; i >= 0; i--)
+        task_push(&workers[0], root->child[i]);
+    if (opt_unordered) {
+        free(root->child);
+        walk_node_free(root);
+    }
+
+    for (i = 0; i < opt_threads; i++) {
+        if (pthread_create(&workers[i].thread, NULL, worker_main, &workers[i]) != 0)
+            die("pthread_create");
+    }
+    for (i = 0; i < opt_threads; i++)
+        pthread_join(workers[i].thread, NULL);
+    fflush(stdout);
+}
+
+static void *
+worker_main(void *arg)
+{
+    struct worker *w = arg;
+    struct walk_node *t;
+    unsigned long seq;
+
+    matcher_init(&w->m);
+    for (;;) {
+        seq = __atomic_load_n(&work_seq, __ATOMIC_SEQ_CST);
+        t = task_pop(w);
+        if (!t) t = task_steal(w);
+        if (t) {
+            if (t->is_dir)
+                walk_dir(w, t);
+            else
+                search_file(w, t);
+            if (__atomic_sub_fetch(&pending, 1, __ATOMIC_SEQ_CST) == 0) {
+                pthread_mutex_lock(&idle_lock);
+                pthread_cond_broadcast(&idle_cond);
+                pthread_mutex_unlock(&idle_lock);
+            }
+            continue;
+        }
+        /* Nothing to do.  task_push() bumps work_seq before it looks at
+           n_idle, and we look at work_seq after bumping n_idle, so one
+           of the two sees the other. */
+        pthread_mutex_lock(&idle_lock);
+        __atomic_add_fetch(&n_idle, 1, __ATOMIC_SEQ_CST);
+        while (__atomic_load_n(&pending, __ATOMIC_SEQ_CST) > 0
+                && __atomic_load_n(&work_seq, __ATOMIC_SEQ_CST) == seq)
+            pthread_cond_wait(&idle_cond, &idle_lock);
+        __atomic_sub_fetch(&n_idle, 1, __ATOMIC_SEQ_CST);
+        pthread_mutex_unlock(&idle_lock);
+        if (__atomic_load_n(&pending, __ATOMIC_SEQ_CST) == 0) break;
+    }
+    matcher_free(&w->m);
+    return NULL;
+}
+
+/* Lists a directory into dir->child, sorted by name, and queues the
+   entries.  Only directories and regular files are kept; symbolic
+   links are not followed. */
+static void
+walk_dir(struct worker *w, struct walk_node *dir)
+{
+    const char *path = dir->path[0] ? dir->path : ".";
+    int capa = 0;
+    int fd, i;
+
+    dir->n_child = 0;
+    dir->child = NULL;
+    fd = open(path, O_RDONLY | O_DIRECTORY);
+    if (fd < 0) {
+        perror(path);
+    }
+    else {
+#ifdef SYS_getdents64
+        char buf[DIRENT_BUF_SIZE];
+        struct linux_dirent64 *ent;
+        long n, off;
+
+        while ((n = syscall(SYS_getdents64, fd, buf, sizeof buf)) > 0) {
+            for (off = 0; off < n; off += ent->d_reclen) {
+                ent = (struct linux_dirent64 *)(buf + off);
+                walk_add(dir, &capa, fd, ent->d_name, ent->d_type);
+            }
+        }
+        if (n < 0) perror(path);
+        close(fd);
+#else
+        DIR *d;
+        struct dirent *ent;
+
+        d = fdopendir(fd);
+        if (!d) die(path);
+        while ((ent = readdir(d)) != NULL)
+            walk_add(dir, &capa, fd, ent->d_name, DT_UNKNOWN);
+        closedir(d);
+#endif
+    }
+    qsort(dir->child, dir->n_child, sizeof(struct walk_node *), cmp_walk_node);
+    for (i = dir->n_child - 1; i >= 0; i--)
+        task_push(w, dir->child[i]);
+    if (opt_unordered) {
+        free(dir->child);
+        walk_node_free(dir);
+        return;
+    }
+    pthread_mutex_lock(&output_lock);
+    dir->ready = 1;
+    write_ready();
+    pthread_mutex_unlock(&output_lock);
+}
+
+static void
+walk_add(struct walk_node *dir, int *capa, int dirfd,
+         const char *name, int type)
+{
+    struct stat st;
+    size_t len;
+    char *path;
+
+    if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0) return;
+    if (type == DT_UNKNOWN) {
+        if (fstatat(dirfd, name, &st, AT_SYMLINK_NOFOLLOW) < 0) return;
+        if (S_ISDIR(st.st_mode)) type = DT_DIR;
+        if (S_ISREG(st.st_mode)) type = DT_REG;
+    }
+    if (type != DT_DIR && type != DT_REG) return;
+
+    len = strlen(dir->path);
+    path = malloc(len + 1 + strlen(name) + 1);
+    if (!path) die("malloc");
+    if (len == 0)
+        strcpy(path, name);
+    else if (dir->path[len - 1] == '/')
+        sprintf(path, "%s%s", dir->path, name);
+    else
+        sprintf(path, "%s/%s", dir->path, name);
+    if (dir->n_child == *capa) {
+        *capa = *capa ? *capa * 2 : 16;
+        dir->child = realloc(dir->child, *capa * sizeof(struct walk_node *));
+        if (!dir->child) die("realloc");
+    }
+    dir->child[dir->n_child++] = walk_node_new(path, type == DT_DIR);
+}
+
+static void
+search_file(struct worker *w, struct walk_node *file)
+{
+    struct sink out;
+
+    sink_init(&out, file->path, SINK_MEMORY);
+    grep_file(&w->m, file->path, &out);
+    pthread_mutex_lock(&output_lock);
+    if (opt_unordered) {
+        if (out.buf_len > 0 && fwrite(out.buf, 1, out.buf_len, stdout) != out.buf_len)
+            die("fwrite");
+        free(out.buf);
+        walk_node_free(file);
+    }
+    else {
+        file->out = out.buf;
+        file->out_len = out.buf_len;
+        file->ready = 1;
+        write_ready();
+    }
+    pthread_mutex_unlock(&output_lock);
+}
+
+/* Writes out, in tree order, whatever is ready, and frees it.  Called
+   with output_lock held. */
+static void
+write_ready(void)
+{
+    struct cursor *top;
+    struct walk_node *t;
+
+    while (n_cursor > 0) {
+        top = &cursor[n_cursor - 1];
+        if (!top->dir->ready) return;
+        if (top->next == top->dir->n_child) {
+            free(top->dir->child);
+            walk_node_free(top->dir);
+            n_cursor--;
+            continue;
+        }
+        t = top->dir->child[top->next];
+        if (t->is_dir) {
+            top->next++;
+            cursor_push(t);
+            continue;
+        }
+        if (!t->ready) return;
+        if (t->out_len > 0 && fwrite(t->out, 1, t->out_len, stdout) != t->out_len)
+            die("fwrite");
+        free(t->out);
+        walk_node_free(t);
+        top->next++;
+    }
+}
+
+static void
+cursor_push(struct walk_node *dir)
+{
+    if (n_cursor == capa_cursor) {
+        capa_cursor = capa_cursor ? capa_cursor * 2 : 64;
+        cursor = realloc(cursor, capa_cursor * sizeof(struct cursor));
+        if (!cursor) die("realloc");
+    }
+    cursor[n_cursor].dir = dir;
+    cursor[n_cursor].next = 0;
+    n_cursor++;
+}
+
+static struct walk_node *
+walk_node_new(char *path, int is_dir)
+{
+    struct walk_node *t;
+
+    t = calloc(1, sizeof *t);
+    if (!t) die("calloc");
+    t->path = path;
+    t->is_dir = is_dir;
+    return t;
+}
+
+static void
+walk_node_free(struct walk_node *t)
+{
+    free(t->path);
+    free(t);
+}
+
+static int
+cmp_walk_node(const void *a, const void *b)
+{
+    return strcmp((*(struct walk_node * const *)a)->path,
+                  (*(struct walk_node * const *)b)->path);
+}
+
+/* The owner pushes and pops at the tail; thieves take from the head. */
+static void
+task_push(struct worker *w, struct walk_node *t)
+{
+    __atomic_add_fetch(&pending, 1, __ATOMIC_SEQ_CST);
+    pthread_mutex_lock(&w->lock);
+    if (w->tail == w->capa) {
+        if (w->head > 0) {
+            memmove(w->task, w->task + w->head,
+                    (w->tail - w->head) * sizeof(struct walk_node *));
+            w->tail -= w->head;
+            w->head = 0;
+        }
+        else {
+            w->capa = w->capa ? w->capa * 2 : 256;
+            w->task = realloc(w->task, w->capa * sizeof(struct walk_node *));
+            if (!w->task) die("realloc");
+        }
+    }
+    w->task[w->tail++] = t;
+    pthread_mutex_unlock(&w->lock);
+    __atomic_add_fetch(&work_seq, 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&n_idle, __ATOMIC_SEQ_CST) > 0) {
+        pthread_mutex_lock(&idle_lock);
+        pthread_cond_signal(&idle_cond);
+        pthread_mutex_unlock(&idle_lock);
+    }
+}
+
+static struct walk_node *
+task_pop(struct worker *w)
+{
+    struct walk_node *t = NULL;
+
+    pthread_mutex_lock(&w->lock);
+    if (w->tail > w->head) t = w->task[--w->tail];
+    pthread_mutex_unlock(&w->lock);
+    return t;
+}
+
+static struct walk_node *
+task_steal(struct worker *thief)
+{
+    struct worker *w;
+    struct walk_node *t = NULL;
+    int i;
+
+    for (i = 1; i < opt_threads && !t; i++) {
+        w = &workers[(thief->id + i) % opt_threads];
+        pthread_mutex_lock(&w->lock);
+        if (w->tail > w->head) t = w->task[w->head++];
+        pthread_mutex_unlock(&w->lock);
+    }
+    return t;
+}
+
+/* Returns the longest string that every match of the ERE pattern must
+   contain, or NULL when nothing useful is known.  Constructs glibc might
+   treat specially are taken as "anything", so the answer errs on the
+   short side. */
+static char *
+necessary_literal(const char *pattern)
+{
+    struct must m;
+    const char *p = pattern;
+
+    if (strchr(pattern, '\n')) return NULL;
+    if (must_alternation(&p, &m, 0) < 0) return NULL;
+    free(m.left);
+    free(m.right);
+    if (*p != '\0' || m.in[0] == '\0') {
+        free(m.in);
+        return NULL;
+    }
+    return m.in;
+}
+
+/* branch|branch... */
+static int
+must_alternation(const char **pp, struct must *m, int depth)
+{
+    struct must branch;
+
+    if (must_sequence(pp, m, depth) < 0) return -1;
+    while (**pp == '|') {
+        (*pp)++;
+        if (must_sequence(pp, &branch, depth) < 0) {
+            must_free(m);
+            return -1;
+        }
+        must_alt(m, &branch);
+    }
+    return 0;
+}
+
+/* a concatenation of pieces, ending at '|', ')' or the end */
+static int
+must_sequence(const char **pp, struct must *m, int depth)
+{
+    struct must piece;
+
+    must_init(m, "", 0, 1);
+    while (**pp && **pp != '|' && **pp != ')') {
+        if (must_repeat(pp, &piece, depth) < 0) {
+            must_free(m);
+            return -1;
+        }
+        must_cat(m, &piece);
+    }
+    return 0;
+}
+
+/* an atom followed by any number of *, +, ? and {n,m} */
+static int
+must_repeat(const char **pp, struct must *m, int depth)
+{
+    int min, max;
+
+    if (must_atom(pp, m, depth) < 0) return -1;
+    for (;;) {
+        switch (**pp) {
+        case '*':
+        case '?':
+            min = 0;
+            max = -1;
+            (*pp)++;
+            break;
+        case '+':
+            min = 1;
+            max = -1;
+            (*pp)++;
+            break;
+        case '{':
+            if (parse_interval(pp, &min, &max) < 0) {
+                must_free(m);
+                return -1;
+            }
+            break;
+        default:
+            return 0;
+        }
+        if (min == 0) {
+            must_free(m);
+            must_init(m, "", 0, 0);
+        }
+        else if (min != 1 || max != 1) {
+            m->exact = 0;
+        }
+    }
+}
+
+static int
+must_atom(const char **pp, struct must *m, int depth)
+{
+    const char *p = *pp;
+
+    switch (*p) {
+    case '(':
+        if (depth >= MUST_DEPTH_MAX) return -1;
+        p++;
+        if (must_alternation(&p, m, depth + 1) < 0) return -1;
+        if (*p != ')') {
+            must_free(m);
+            return -1;
+        }
+        p++;
+        break;
+    case '[':
+        if (skip_bracket(&p) < 0) return -1;
+        must_init(m, "", 0, 0);
+        break;
+    case '.':
+        p++;
+        must_init(m, "", 0, 0);
+        break;
+    case '^':
+    case '$':
+        /* zero width */
+        p++;
+        must_init(m, "", 0, 1);
+        break;
+    case '\\':
+        p++;
+        if (*p == '\0') return -1;
+        if (strchr("bB<>`'", *p))
+            must_init(m, "", 0, 1);         /* word and buffer anchors */
+        else if (isalnum((unsigned char)*p))
+            must_init(m, "", 0, 0);         /* \w, \s, back references... */
+        else
+            must_init(m, p, 1, 1);
+        p++;
+        break;
+    case '*':
+    case '+':
+    case '?':
+    case '{':
+    case '|':
+    case ')':
+    case '\0':
+        return -1;
+    default:
+        must_init(m, p, 1, 1);
+        p++;
+        break;
+    }
+    *pp = p;
+    return 0;
+}
+
+/* {n}, {n,} or {n,m}; max is -1 when unbounded */
+static int
+parse_interval(const char **pp, int *min, int *max)
+{
+    const char *p = *pp + 1;
+    char *end;
+
+    if (!isdigit((unsigned char)*p)) return -1;
+    *min = *max = strtol(p, &end, 10);
+    p = end;
+    if (*p == ',') {
+        p++;
+        if (isdigit((unsigned char)*p)) {
+            *max = strtol(p, &end, 10);
+            p = end;
+        }
+        else {
+            *max = -1;
+        }
+    }
+    if (*p != '}') return -1;
+    *pp = p + 1;
+    return 0;
+}
+
+/* skips [...], including []...], [^]...] and [:class:] inside */
+static int
+skip_bracket(const char **pp)
+{
+    const char *p = *pp + 1;
+    char close;
+
+    if (*p == '^') p++;
+    if (*p == ']') p++;
+    while (*p != ']') {
+        if (*p == '\0') return -1;
+        if (*p == '[' && (p[1] == ':' || p[1] == '.' || p[1] == '=')) {
+            close = p[1];
+            p += 2;
+            while (*p && !(p[0] == close && p[1] == ']'))
+                p++;
+            if (*p == '\0') return -1;
+            p += 2;
+        }
+        else {
+            p++;
+        }
+    }
+    *pp = p + 1;
+    return 0;
+}
+
+static void
+must_init(struct must *m, const char *s, size_t len, int exact)
+{
+    m->exact = exact;
+    m->left = str_ndup(s, len);
+    m->right = str_ndup(s, len);
+    m->in = str_ndup(s, len);
+}
+
+/* a = a followed by b.  b is consumed. */
+static void
+must_cat(struct must *a, struct must *b)
+{
+    char *s;
+
+    a->in = longer(a->in, b->in);
+    a->in = longer(a->in, str_cat(a->right, b->left));
+    if (a->exact) {
+        s = str_cat(a->left, b->left);
+        free(a->left);
+        a->left = s;
+    }
+    if (b->exact) {
+        s = str_cat(a->right, b->right);
+        free(b->right);
+    }
+    else {
+        s = b->right;
+    }
+    free(a->right);
+    a->right = s;
+    a->exact = a->exact && b->exact;
+    free(b->left);
+}
+
+/* a = a|b.  b is consumed. */
+static void
+must_alt(struct must *a, struct must *b)
+{
+    size_t i, la, lb;
+
+    if (a->exact && b->exact && strcmp(a->left, b->left) == 0) {
+        must_free(b);
+        return;
+    }
+    a->exact = 0;
+    for (i = 0; a->left[i] && a->left[i] == b->left[i]; i++)
+        ;
+    a->left[i] = '\0';
+    la = strlen(a->right);
+    lb = strlen(b->right);
+    for (i = 0; i < la && i < lb && a->right[la-i-1] == b->right[lb-i-1]; i++)
+        ;
+    memmove(a->right, a->right + la - i, i + 1);
+    free(a->in);
+    a->in = strdup(strlen(a->left) >= strlen(a->right) ? a->left : a->right);
+    if (!a->in) die("strdup");
+    must_free(b);
+}
+
+static void
+must_free(struct must *m)
+{
+    free(m->left);
+    free(m->right);
+    free(m->in);
+}
+
+static char *
+str_ndup(const char *s, size_t len)
+{
+    char *p;
+
+    p = malloc(len + 1);
+    if (!p) die("malloc");
+    memcpy(p, s, len);
+    p[len] = '\0';
+    return p;
+}
+
+static char *
+str_cat(const char *a, const char *b)
+{
+    size_t la = strlen(a);
+    size_t lb = strlen(b);
+    char *p;
+
+    p = malloc(la + lb + 1);
+    if (!p) die("malloc");
+    memcpy(p, a, la);
+    memcpy(p + la, b, lb + 1);
+    return p;
+}
+
+/* returns the longer of a and b and frees the other */
+static char *
+longer(char *a, char *b)
+{
+    if (strlen(b) > strlen(a)) {
+        free(a);
+        return b;
+    }
+    free(b);
+    return a;
+}
+
+static void
+select_find_literal(void)
+{
+    find_literal = opt_ignorecase ? find_literal_icase : find_literal_generic;
+    skip_first_bytes = skip_first_bytes_generic;
+#ifdef HAVE_SIMD
+    find_literal = find_literal_sse2;
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+        find_literal = find_literal_avx2;
+    if (opt_ignorecase) {
+        find_literal = find_literal_icase_sse2;
+        if (__builtin_cpu_supports("avx2"))
+            find_literal = find_literal_icase_avx2;
+    }
+    if (__builtin_cpu_supports("ssse3"))
+        skip_first_bytes = skip_first_bytes_ssse3;
+#endif
+}
+
+/* The same as memmem(), with memchr() looking for the first byte. */
+static const char *
+find_literal_generic(const char *hay, size_t len, const char *needle, size_t n)
+{
+    const char *p, *end;
+
+    if (n > len) return NULL;
+    end = hay + len - n + 1;
+    for (p = hay; p < end; p++) {
+        p = memchr(p, needle[0], end - p);
+        if (!p) return NULL;
+        if (memcmp(p + 1, needle + 1, n - 1) == 0) return p;
+    }
+    return NULL;
+}
+
+/* find_literal_generic() ignoring the case of ASCII letters.  needle
+   must be in lower case. */
+static const char *
+find_literal_icase(const char *hay, size_t len, const char *needle, size_t n)
+{
+    const char *p, *end;
+
+    if (n > len) return NULL;
+    end = hay + len - n + 1;
+    for (p = hay; p < end; p++) {
+        if (tolower((unsigned char)*p) == (unsigned char)needle[0]
+                && fold_equal(p + 1, needle + 1, n - 1))
+            return p;
+    }
+    return NULL;
+}
+
+/* a, in any case, equals b in lower case */
+static int
+fold_equal(const char *a, const char *b, size_t n)
+{
+    size_t i;
+
+    for (i = 0; i < n; i++) {
+        if (tolower((unsigned char)a[i]) != (unsigned char)b[i]) return 0;
+    }
+    return 1;
+}
+
+static int
+ascii_only(const char *s)
+{
+    for (; *s; s++) {
+        if ((unsigned char)*s >= 0x80) return 0;
+    }
+    return 1;
+}
+
+#ifdef HAVE_SIMD
+/* Compares 16 candidate positions at once against the first and the
+   last byte of needle; memcmp() is called only where both agree.
+   The tail shorter than a block goes to find_literal_generic(). */
+static const char *
+find_literal_sse2(const char *hay, size_t len, const char *needle, size_t n)
+{
+    const __m128i first = _mm_set1_epi8(needle[0]);
+    const __m128i last = _mm_set1_epi8(needle[n - 1]);
+    __m128i a, b;
+    unsigned int mask;
+    size_t i;
+
+    if (n == 1) return memchr(hay, needle[0], len);
+    for (i = 0; i + n - 1 + 16 <= len; i += 16) {
+        a = _mm_loadu_si128((const __m128i *)(hay + i));
+        b = _mm_loadu_si128((const __m128i *)(hay + i + n - 1));
+        mask = _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(a, first),
+                                               _mm_cmpeq_epi8(b, last)));
+        while (mask) {
+            size_t pos = i + __builtin_ctz(mask);
+            if (memcmp(hay + pos + 1, needle + 1, n - 2) == 0)
+                return hay + pos;
+            mask &= mask - 1;
+        }
+    }
+    return find_literal_generic(hay + i, len - i, needle, n);
+}
+
+/* find_literal_sse2() with 32 byte blocks */
+__attribute__((target("avx2")))
+static const char *
+find_literal_avx2(const char *hay, size_t len, const char *needle, size_t n)
+{
+    const __m256i first = _mm256_set1_epi8(needle[0]);
+    const __m256i last = _mm256_set1_epi8(needle[n - 1]);
+    __m256i a, b;
+    unsigned int mask;
+    size_t i;
+
+    if (n == 1) return memchr(hay, needle[0], len);
+    for (i = 0; i + n - 1 + 32 <= len; i += 32) {
+        a = _mm256_loadu_si256((const __m256i *)(hay + i));
+        b = _mm256_loadu_si256((const __m256i *)(hay + i + n - 1));
+        mask = _mm256_movemask_epi8(_mm256_and_si256(_mm256_cmpeq_epi8(a, first),
+                                                     _mm256_cmpeq_epi8(b, last)));
+        while (mask) {
+            size_t pos = i + __builtin_ctz(mask);
+            if (memcmp(hay + pos + 1, needle + 1, n - 2) == 0)
+                return hay + pos;
+            mask &= mask - 1;
+        }
+    }
+    return find_literal_sse2(hay + i, len - i, needle, n);
+}
+
+/* find_literal_sse2() ignoring case.  A letter of needle (in lower
+   case) is compared with the haystack byte ORed with 0x20, which turns
+   'A'-'Z' into 'a'-'z' and nothing else into a letter; other bytes are
+   compared as they are. */
+static const char *
+find_literal_icase_sse2(const char *hay, size_t len, const char *needle, size_t n)
+{
+    const __m128i first = _mm_set1_epi8(needle[0]);
+    const __m128i last = _mm_set1_epi8(needle[n - 1]);
+    const __m128i first_case = _mm_set1_epi8(islower((unsigned char)needle[0]) ? 0x20 : 0);
+    const __m128i last_case = _mm_set1_epi8(islower((unsigned char)needle[n - 1]) ? 0x20 : 0);
+    __m128i a, b;
+    unsigned int mask;
+    size_t i;
+
+    if (n == 1) return find_literal_icase(hay, len, needle, n);
+    for (i = 0; i + n - 1 + 16 <= len; i += 16) {
+        a = _mm_or_si128(_mm_loadu_si128((const __m128i *)(hay + i)), first_case);
+        b = _mm_or_si128(_mm_loadu_si128((const __m128i *)(hay + i + n - 1)), last_case);
+        mask = _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(a, first),
+                                               _mm_cmpeq_epi8(b, last)));
+        while (mask) {
+            size_t pos = i + __builtin_ctz(mask);
+            if (fold_equal(hay + pos + 1, needle + 1, n - 2))
+                return hay + pos;
+            mask &= mask - 1;
+        }
+    }
+    return find_literal_icase(hay + i, len - i, needle, n);
+}
+
+/* find_literal_icase_sse2() with 32 byte blocks */
+__attribute__((target("avx2")))
+static const char *
+find_literal_icase_avx2(const char *hay, size_t len, const char *needle, size_t n)
+{
+    const __m256i first = _mm256_set1_epi8(needle[0]);
+    const __m256i last = _mm256_set1_epi8(needle[n - 1]);
+    const __m256i first_case = _mm256_set1_epi8(islower((unsigned char)needle[0]) ? 0x20 : 0);
+    const __m256i last_case = _mm256_set1_epi8(islower((unsigned char)needle[n - 1]) ? 0x20 : 0);
+    __m256i a, b;
+    unsigned int mask;
+    size_t i;
+
+    if (n == 1) return find_literal_icase(hay, len, needle, n);
+    for (i = 0; i + n - 1 + 32 <= len; i += 32) {
+        a = _mm256_or_si256(_mm256_loadu_si256((const __m256i *)(hay + i)), first_case);
+        b = _mm256_or_si256(_mm256_loadu_si256((const __m256i *)(hay + i + n - 1)), last_case);
+        mask = _mm256_movemask_epi8(_mm256_and_si256(_mm256_cmpeq_epi8(a, first),
+                                                     _mm256_cmpeq_epi8(b, last)));
+        while (mask) {
+            size_t pos = i + __builtin_ctz(mask);
+            if (fold_equal(hay + pos + 1, needle + 1, n - 2))
+                return hay + pos;
+            mask &= mask - 1;
+        }
+    }
+    return find_literal_icase_sse2(hay + i, len - i, needle, n);
+}
+#endif
+
+/* Compiles the ERE pattern into an NFA for dfa_search().  Returns NULL
+   for anything the engine does not do (back references, word anchors,
+   collating elements...) or for an NFA that is too large; regexec() is
+   used then. */
+static struct dfa *
+dfa_compile(const char *pattern, int icase)
+{
+    struct dfa *d;
+    struct frag f;
+    const char *p = pattern;
+    int n;
+
+    d = calloc(1, sizeof *d);
+    if (!d) die("calloc");
+    d->icase = icase;
+    d->match_node = nfa_add(d, NFA_MATCH, -1, -1, -1);
+    if (nfa_alternation(d, &p, &f, 0) < 0 || *p != '\0' || d->too_big) {
+        dfa_free(d);
+        return NULL;
+    }
+    d->node[f.end].out = d->match_node;
+    d->start_node = f.start;
+    compute_classes(d);
+
+    n = d->n_nodes;
+    d->dense = malloc(n * sizeof(int));
+    d->sparse = calloc(n, sizeof(int));
+    d->stack = malloc((2 * n + 1) * sizeof(int));
+    d->key = malloc(n * sizeof(int));
+    d->state_size = offsetof(struct dstate, next)
+                    + d->n_classes * sizeof(struct dstate *);
+    d->scratch[0] = malloc(d->state_size + n * sizeof(int));
+    d->scratch[1] = malloc(d->state_size + n * sizeof(int));
+    d->hash = calloc(DFA_HASH_SIZE, sizeof(struct dstate *));
+    if (!d->dense || !d->sparse || !d->stack || !d->key
+            || !d->scratch[0] || !d->scratch[1] || !d->hash)
+        die("malloc");
+    d->matched.match = 1;
+    dfa_start(d);
+    return d;
+}
+
+static void
+dfa_free(struct dfa *d)
+{
+    if (d->hash) dfa_flush(d);
+    free(d->node);
+    free(d->sets);
+    free(d->dense);
+    free(d->sparse);
+    free(d->stack);
+    free(d->key);
+    free(d->scratch[0]);
+    free(d->scratch[1]);
+    free(d->hash);
+    free(d);
+}
+
+/* Returns a position inside the first line in [p, end) that matches,
+   or NULL.  p must be at the beginning of a line.  On '\n' every state
+   goes back to the start state, or to d->matched when "$" completes a
+   match there, so the whole buffer is scanned in one loop. */
+static const char *
+dfa_search(struct dfa *d, const char *p, const char *end)
+{
+    const char *begin = p;
+    const unsigned char *cls = d->cls;
+    struct dstate *s = d->start;
+    struct dstate *t;
+
+    if (s->match) return p;
+    while (p < end) {
+        t = s->next[cls[(unsigned char)*p]];
+        if (!t) {
+            t = dfa_next(d, s, (unsigned char)*p, d->scanned + (p - begin));
+        }
+        if (t->match) {
+            d->scanned += p - begin;
+            return p;
+        }
+        s = t;
+        p++;
+    }
+    d->scanned += p - begin;
+    return s->eol_match ? end : NULL;
+}
+
+/* Makes the state that follows s on byte c.  pos counts the bytes
+   scanned so far.  States are cached until they take DFA_CACHE_SIZE
+   bytes, and then the whole cache is thrown away.  If that keeps
+   happening every few bytes, caching is given up and the NFA sets are
+   stepped directly from then on, in two scratch states. */
+static struct dstate *
+dfa_next(struct dfa *d, struct dstate *s, int c, size_t pos)
+{
+    struct dstate *t;
+    int match, eol_match;
+
+    if (c == '\n') {
+        t = s->eol_match ? &d->matched : d->start;
+        s->next[d->cls[c]] = t;
+        return t;
+    }
+    nfa_step(d, s->nodes, s->n, c, &match, &eol_match);
+    if (d->nfa_mode) {
+        t = (s == d->scratch[0]) ? d->scratch[1] : d->scratch[0];
+        dfa_fill(d, t, match, eol_match);
+        return t;
+    }
+    t = dfa_lookup(d, match, eol_match);
+    if (!t && d->cache_used < DFA_CACHE_SIZE)
+        t = dfa_insert(d, match, eol_match);
+    if (t) {
+        s->next[d->cls[c]] = t;
+        return t;
+    }
+
+    /* the cache is full; s goes away with it */
+    if (pos - d->flushed_at < d->n_states * DFA_THRASH_BYTES)
+        d->thrash++;
+    else
+        d->thrash = 0;
+    d->flushed_at = pos;
+    d->flushes++;
+    dfa_flush(d);
+    if (d->thrash >= DFA_THRASH_LIMIT) {
+        d->nfa_mode = 1;
+        t = d->scratch[0];
+        dfa_fill(d, t, match, eol_match);
+    }
+    else {
+        t = dfa_insert(d, match, eol_match);
+    }
+    dfa_start(d);
+    return t;
+}
+
+/* (re)creates the start state; this overwrites d->key */
+static void
+dfa_start(struct dfa *d)
+{
+    int match, eol_match;
+
+    nfa_step(d, NULL, 0, -1, &match, &eol_match);
+    d->start = dfa_lookup(d, match, eol_match);
+    if (!d->start) d->start = dfa_insert(d, match, eol_match);
+}
+
+static struct dstate *
+dfa_lookup(struct dfa *d, int match, int eol_match)
+{
+    struct dstate *t;
+    unsigned int h = key_hash(d, match, eol_match);
+
+    for (t = d->hash[h & (DFA_HASH_SIZE - 1)]; t; t = t->hash_next) {
+        if (t->hash == h && t->match == match && t->eol_match == eol_match
+                && t->n == d->key_n
+                && memcmp(t->nodes, d->key, d->key_n * sizeof(int)) == 0)
+            return t;
+    }
+    return NULL;
+}
+
+static struct dstate *
+dfa_insert(struct dfa *d, int match, int eol_match)
+{
+    struct dstate *t;
+    struct dstate **bucket;
+
+    t = malloc(d->state_size + d->key_n * sizeof(int));
+    if (!t) die("malloc");
+    dfa_fill(d, t, match, eol_match);
+    t->hash = key_hash(d, match, eol_match);
+    bucket = &d->hash[t->hash & (DFA_HASH_SIZE - 1)];
+    t->hash_next = *bucket;
+    *bucket = t;
+    d->n_states++;
+    d->cache_used += d->state_size + d->key_n * sizeof(int);
+    return t;
+}
+
+/* makes t the state for d->key, with no transitions yet */
+static void
+dfa_fill(struct dfa *d, struct dstate *t, int match, int eol_match)
+{
+    t->match = match;
+    t->eol_match = eol_match;
+    t->n = d->key_n;
+    t->nodes = (int *)((char *)t + d->state_size);
+    memcpy(t->nodes, d->key, d->key_n * sizeof(int));
+    memset(t->next, 0, d->n_classes * sizeof(struct dstate *));
+}
+
+static void
+dfa_flush(struct dfa *d)
+{
+    struct dstate *t, *next;
+    int i;
+
+    for (i = 0; i < DFA_HASH_SIZE; i++) {
+        for (t = d->hash[i]; t; t = next) {
+            next = t->hash_next;
+            free(t);
+        }
+        d->hash[i] = NULL;
+    }
+    d->n_states = 0;
+    d->cache_used = 0;
+    d->start = NULL;
+}
+
+static unsigned int
+key_hash(struct dfa *d, int match, int eol_match)
+{
+    unsigned int h = 2166136261u ^ (match << 1 | eol_match);
+    int i;
+
+    for (i = 0; i < d->key_n; i++)
+        h = (h ^ d->key[i]) * 16777619u;
+    return h;
+}
+
+/* Puts into d->key the NFA_SET nodes that are active after the ones in
+   nodes have consumed c (c < 0: at the beginning of a line).  The start
+   node is always added, since a match may begin anywhere.  Once a match
+   is seen the rest of the line does not matter and the key is empty. */
+static void
+nfa_step(struct dfa *d, const int *nodes, int n, int c,
+         int *match, int *eol_match)
+{
+    struct nfa_node *nd;
+    int bol = (c < 0);
+    int i;
+
+    d->set_n = 0;
+    for (i = 0; i < n; i++) {
+        nd = &d->node[nodes[i]];
+        if (set_has(d->sets[nd->set], c))
+            closure(d, nd->out, 0, 0);
+    }
+    closure(d, d->start_node, bol, 0);
+    d->key_n = 0;
+    *match = set_contains(d, d->match_node);
+    *eol_match = 0;
+    if (*match) return;
+    for (i = 0; i < d->set_n; i++) {
+        if (d->node[d->dense[i]].op == NFA_SET)
+            d->key[d->key_n++] = d->dense[i];
+    }
+    if (!d->nfa_mode)
+        qsort(d->key, d->key_n, sizeof(int), cmp_int);
+
+    /* what "$" would complete here */
+    if (!d->has_eol) return;
+    n = d->set_n;
+    for (i = 0; i < n; i++) {
+        nd = &d->node[d->dense[i]];
+        if (nd->op == NFA_EOL)
+            closure(d, nd->out, bol, 1);
+    }
+    *eol_match = set_contains(d, d->match_node);
+}
+
+/* adds to the set every node reachable from n without consuming a byte */
+static void
+closure(struct dfa *d, int n, int bol, int eol)
+{
+    struct nfa_node *nd;
+    int sp = 0;
+
+    d->stack[sp++] = n;
+    while (sp > 0) {
+        n = d->stack[--sp];
+        if (set_contains(d, n)) continue;
+        d->sparse[n] = d->set_n;
+        d->dense[d->set_n++] = n;
+        nd = &d->node[n];
+        switch (nd->op) {
+        case NFA_EMPTY:
+            d->stack[sp++] = nd->out;
+            break;
+        case NFA_SPLIT:
+            d->stack[sp++] = nd->out1;
+            d->stack[sp++] = nd->out;
+            break;
+        case NFA_BOL:
+            if (bol) d->stack[sp++] = nd->out;
+            break;
+        case NFA_EOL:
+            if (eol) d->stack[sp++] = nd->out;
+            break;
+        }
+    }
+}
+
+static int
+set_contains(struct dfa *d, int n)
+{
+    int i = d->sparse[n];
+
+    return i < d->set_n && d->dense[i] == n;
+}
+
+static int
+cmp_int(const void *a, const void *b)
+{
+    int x = *(const int *)a;
+    int y = *(const int *)b;
+
+    return (x > y) - (x < y);
+}
+
+/* Splits the 256 byte values into classes that no set in the NFA tells
+   apart, so that a DFA state needs one transition per class only.
+   '\n' gets a class of its own. */
+static void
+compute_classes(struct dfa *d)
+{
+    unsigned char cls[256];
+    int map[256][2];
+    int i, b, k;
+
+    memset(d->cls, 0, sizeof d->cls);
+    d->cls['\n'] = 1;
+    d->n_classes = 2;
+    for (i = 0; i < d->n_sets; i++) {
+        if (i > 0 && memcmp(d->sets[i], d->sets[i - 1], BYTE_SET_SIZE) == 0)
+            continue;
+        memset(map, -1, sizeof map);
+        k = 0;
+        for (b = 0; b < 256; b++) {
+            int *m = &map[d->cls[b]][set_has(d->sets[i], b)];
+            if (*m < 0) *m = k++;
+            cls[b] = *m;
+        }
+        memcpy(d->cls, cls, sizeof cls);
+        d->n_classes = k;
+    }
+}
+
+/* Thompson's construction.  Every fragment has a single loose end,
+   node[end].out, which is patched to whatever follows it. */
+static int
+nfa_alternation(struct dfa *d, const char **pp, struct frag *f, int depth)
+{
+    struct frag g;
+
+    if (nfa_sequence(d, pp, f, depth) < 0) return -1;
+    while (**pp == '|') {
+        (*pp)++;
+        if (nfa_sequence(d, pp, &g, depth) < 0) return -1;
+        *f = frag_alt(d, *f, g);
+    }
+    return 0;
+}
+
+static int
+nfa_sequence(struct dfa *d, const char **pp, struct frag *f, int depth)
+{
+    struct frag g;
+
+    *f = frag_node(d, NFA_EMPTY);
+    while (**pp && **pp != '|' && **pp != ')') {
+        if (nfa_repeat(d, pp, &g, depth) < 0) return -1;
+        *f = frag_cat(d, *f, g);
+    }
+    return 0;
+}
+
+static int
+nfa_repeat(struct dfa *d, const char **pp, struct frag *f, int depth)
+{
+    const char *atom = *pp;
+    int anchor = (**pp == '^' || **pp == '$');
+    int repeated = 0;
+    int min, max;
+
+    if (nfa_atom(d, pp, f, depth) < 0) return -1;
+    for (;;) {
+        switch (**pp) {
+        case '*':
+            *f = frag_repeat(d, *f, 0);
+            break;
+        case '+':
+            *f = frag_repeat(d, *f, 1);
+            break;
+        case '?':
+            *f = frag_quest(d, *f);
+            break;
+        case '{':
+            /* the atom is parsed again for every copy */
+            if (anchor || repeated) return -1;
+            if (parse_interval(pp, &min, &max) < 0) return -1;
+            if (max >= 0 && max < min) return -1;
+            if (nfa_interval(d, atom, f, min, max, depth) < 0) return -1;
+            repeated = 1;
+            continue;
+        default:
+            return 0;
+        }
+        if (anchor) return -1;
+        (*pp)++;
+        repeated = 1;
+    }
+}
+
+/* f is the first copy of the atom at text; x{2,4} becomes xxx?x? */
+static int
+nfa_interval(struct dfa *d, const char *text, struct frag *f,
+             int min, int max, int depth)
+{
+    struct frag r, g;
+    const char *p;
+    int i;
+
+    r = frag_node(d, NFA_EMPTY);
+    for (i = 0; max < 0 ? i <= min : i < max; i++) {
+        g = *f;
+        if (i > 0) {
+            p = text;
+            if (nfa_atom(d, &p, &g, depth) < 0) return -1;
+        }
+        if (d->too_big) return -1;
+        if (i >= min)
+            g = (max < 0) ? frag_repeat(d, g, 0) : frag_quest(d, g);
+        r = frag_cat(d, r, g);
+    }
+    *f = r;
+    return 0;
+}
+
+static int
+nfa_atom(struct dfa *d, const char **pp, struct frag *f, int depth)
+{
+    unsigned char set[BYTE_SET_SIZE];
+    const char *p = *pp;
+    int c;
+
+    memset(set, 0, sizeof set);
+    switch (*p) {
+    case '(':
+        if (depth >= MUST_DEPTH_MAX) return -1;
+        p++;
+        if (nfa_alternation(d, &p, f, depth + 1) < 0) return -1;
+        if (*p != ')') return -1;
+        *pp = p + 1;
+        return 0;
+    case '^':
+        *f = frag_node(d, NFA_BOL);
+        *pp = p + 1;
+        return 0;
+    case '$':
+        d->has_eol = 1;
+        *f = frag_node(d, NFA_EOL);
+        *pp = p + 1;
+        return 0;
+    case '[':
+        if (parse_bracket(d, &p, set) < 0) return -1;
+        *f = frag_set(d, set);
+        *pp = p;
+        return 0;
+    case '.':
+        memset(set, 0xff, sizeof set);
+        break;
+    case '\\':
+        p++;
+        switch (*p) {
+        case 'w':
+        case 'W':
+            for (c = 0; c < 256; c++)
+                if (isalnum(c) || c == '_') set_add(set, c);
+            if (*p == 'W') set_invert(set);
+            break;
+        case 's':
+        case 'S':
+            for (c = 0; c < 256; c++)
+                if (isspace(c)) set_add(set, c);
+            if (*p == 'S') set_invert(set);
+            break;
+        default:
+            /* \b, \<, \1 and the like are left to regexec() */
+            if (*p == '\0' || isalnum((unsigned char)*p) || strchr("<>`'", *p))
+                return -1;
+            set_add(set, (unsigned char)*p);
+            break;
+        }
+        break;
+    case '*':
+    case '+':
+    case '?':
+    case '{':
+    case '|':
+    case ')':
+    case '\0':
+        return -1;
+    default:
+        set_add(set, (unsigned char)*p);
+        break;
+    }
+    *f = frag_set(d, set);
+    *pp = p + 1;
+    return 0;
+}
+
+/* [...] in the C locale.  Collating elements and equivalence classes
+   are not supported. */
+static int
+parse_bracket(struct dfa *d, const char **pp, unsigned char *set)
+{
+    static const struct {
+        const char *name;
+        int (*test)(int);
+    } classes[] = {
+        {"alpha", isalpha}, {"digit", isdigit}, {"alnum", isalnum},
+        {"upper", isupper}, {"lower", islower}, {"space", isspace},
+        {"blank", isblank}, {"punct", ispunct}, {"print", isprint},
+        {"graph", isgraph}, {"cntrl", iscntrl}, {"xdigit", isxdigit},
+        {NULL, NULL}
+    };
+    const char *p = *pp + 1;
+    int negate = 0;
+    int first = 1;
+    int lo, hi, c, i;
+    size_t len;
+
+    if (*p == '^') {
+        negate = 1;
+        p++;
+    }
+    while (first || *p != ']') {
+        first = 0;
+        if (*p == '\0') return -1;
+        if (*p == '[' && (p[1] == '.' || p[1] == '=')) return -1;
+        if (*p == '[' && p[1] == ':') {
+            p += 2;
+            for (i = 0; classes[i].name; i++) {
+                len = strlen(classes[i].name);
+                if (strncmp(p, classes[i].name, len) == 0
+                        && p[len] == ':' && p[len + 1] == ']')
+                    break;
+            }
+            if (!classes[i].name) return -1;
+            for (c = 0; c < 256; c++)
+                if (classes[i].test(c)) set_add(set, c);
+            p += len + 2;
+            continue;
+        }
+        lo = (unsigned char)*p++;
+        if (*p == '-' && p[1] != ']' && p[1] != '\0') {
+            hi = (unsigned char)p[1];
+            if (hi == '[' || hi < lo) return -1;
+            p += 2;
+        }
+        else {
+            hi = lo;
+        }
+        for (c = lo; c <= hi; c++)
+            set_add(set, c);
+    }
+    /* [^a] with -i excludes "A" as well */
+    if (d->icase) set_fold(set);
+    if (negate) set_invert(set);
+    *pp = p + 1;
+    return 0;
+}
+
+static struct frag
+frag_node(struct dfa *d, int op)
+{
+    struct frag f;
+
+    f.start = f.end = nfa_add(d, op, -1, -1, -1);
+    return f;
+}
+
+/* A set never contains '\n' (REG_NEWLINE), and with -i it holds both
+   cases of every letter. */
+static struct frag
+frag_set(struct dfa *d, unsigned char *set)
+{
+    struct frag f;
+
+    set[BYTE_SET_INDEX('\n')] &= ~BYTE_SET_BIT('\n');
+    if (d->icase) set_fold(set);
+    if (d->n_sets == d->capa_sets) {
+        d->capa_sets = d->capa_sets ? d->capa_sets * 2 : 64;
+        d->sets = realloc(d->sets, d->capa_sets * BYTE_SET_SIZE);
+        if (!d->sets) die("realloc");
+    }
+    memcpy(d->sets[d->n_sets], set, BYTE_SET_SIZE);
+    f.start = f.end = nfa_add(d, NFA_SET, -1, -1, d->n_sets++);
+    return f;
+}
+
+static struct frag
+frag_cat(struct dfa *d, struct frag a, struct frag b)
+{
+    d->node[a.end].out = b.start;
+    a.end = b.end;
+    return a;
+}
+
+static struct frag
+frag_alt(struct dfa *d, struct frag a, struct frag b)
+{
+    struct frag f;
+
+    f.start = nfa_add(d, NFA_SPLIT, a.start, b.start, -1);
+    f.end = nfa_add(d, NFA_EMPTY, -1, -1, -1);
+    d->node[a.end].out = f.end;
+    d->node[b.end].out = f.end;
+    return f;
+}
+
+/* a* (min == 0) or a+ (min == 1) */
+static struct frag
+frag_repeat(struct dfa *d, struct frag a, int min)
+{
+    struct frag f;
+    int split;
+
+    f.end = nfa_add(d, NFA_EMPTY, -1, -1, -1);
+    split = nfa_add(d, NFA_SPLIT, a.start, f.end, -1);
+    d->node[a.end].out = split;
+    f.start = min ? a.start : split;
+    return f;
+}
+
+static struct frag
+frag_quest(struct dfa *d, struct frag a)
+{
+    struct frag f;
+
+    f.end = nfa_add(d, NFA_EMPTY, -1, -1, -1);
+    f.start = nfa_add(d, NFA_SPLIT, a.start, f.end, -1);
+    d->node[a.end].out = f.end;
+    return f;
+}
+
+/* Past NFA_MAX_NODES only too_big is set, and node 0 is handed out so
+   that the construction can run to its end harmlessly. */
+static int
+nfa_add(struct dfa *d, int op, int out, int out1, int set)
+{
+    struct nfa_node *nd;
+
+    if (d->n_nodes >= NFA_MAX_NODES) {
+        d->too_big = 1;
+        return 0;
+    }
+    if (d->n_nodes == d->capa_nodes) {
+        d->capa_nodes = d->capa_nodes ? d->capa_nodes * 2 : 256;
+        d->node = realloc(d->node, d->capa_nodes * sizeof(struct nfa_node));
+        if (!d->node) die("realloc");
+    }
+    nd = &d->node[d->n_nodes];
+    nd->op = op;
+    nd->out = out;
+    nd->out1 = out1;
+    nd->set = set;
+    return d->n_nodes++;
+}
+
+static int
+set_has(const unsigned char *set, int c)
+{
+    return c >= 0 && (set[BYTE_SET_INDEX(c)] & BYTE_SET_BIT(c)) != 0;
+}
+
+static void
+set_add(unsigned char *set, int c)
+{
+    set[BYTE_SET_INDEX(c)] |= BYTE_SET_BIT(c);
+}
+
+static void
+set_invert(unsigned char *set)
+{
+    int i;
+
+    for (i = 0; i < BYTE_SET_SIZE; i++)
+        set[i] = ~set[i];
+}
+
+/* adds the other case of every letter in set */
+static void
+set_fold(unsigned char *set)
+{
+    int c;
+
+    for (c = 'a'; c <= 'z'; c++) {
+        if (set_has(set, c) || set_has(set, toupper(c))) {
+            set_add(set, c);
+            set_add(set, toupper(c));
+        }
+    }
+}
+
+/* Builds an Aho-Corasick automaton when every line of the -f file is a
+   fixed string (backslash-escaped punctuation included).  Returns NULL
+   otherwise, or when there are no lines or an empty one.  With icase
+   the strings are stored in lower case and the input is folded as it
+   is read. */
+static struct ac *
+ac_compile(const char *buf, int icase)
+{
+    struct ac_build b;
+    struct ac *a;
+    const char *p = buf;
+    const char *eol;
+    int s, c;
+
+    memset(&b, 0, sizeof b);
+    ac_build_node(&b);
+    while (*p) {
+        eol = strchr(p, '\n');
+        if (!eol) eol = p + strlen(p);
+        if (eol == p) goto fail;
+        s = 0;
+        for (; p < eol; p++) {
+            c = (unsigned char)*p;
+            if (c == '\\') {
+                p++;
+                c = (unsigned char)*p;
+                if (p == eol || isalnum(c)) goto fail;
+            }
+            else if (strchr(".[]()*+?{}|^$", c)) {
+                goto fail;
+            }
+            if (icase) c = tolower(c);
+            s = ac_build_child(&b, s, c, 1);
+        }
+        b.match[s] = 1;
+        b.n_patterns++;
+        if (*p == '\n') p++;
+    }
+    if (b.n_patterns == 0) goto fail;
+    a = ac_finish(&b);
+    ac_build_free(&b);
+    for (c = 0; c < 256; c++)
+        a->fold[c] = icase ? tolower(c) : c;
+    if (icase) {
+        /* the root table takes either case without folding */
+        for (c = 'a'; c <= 'z'; c++) {
+            a->root[toupper(c)] = a->root[c];
+            a->first[toupper(c)] = a->first[c];
+        }
+        ac_setup_filter(a);
+    }
+    return a;
+
+  fail:
+    ac_build_free(&b);
+    return NULL;
+}
+
+/* Computes the failure links in breadth-first order and lays the trie
+   out again in that order: each node's edges sorted by byte and stored
+   side by side, and a full 256 entry table for the root, where the
+   search spends most of its time. */
+static struct ac *
+ac_finish(struct ac_build *b)
+{
+    struct ac *a;
+    int *queue, *new_id;
+    int head, tail, u, v, f, e, n, i, j;
+    int c;
+
+    queue = malloc(b->n_nodes * sizeof(int));
+    new_id = malloc(b->n_nodes * sizeof(int));
+    if (!queue || !new_id) die("malloc");
+    head = tail = 0;
+    queue[tail++] = 0;
+    b->fail[0] = 0;
+    while (head < tail) {
+        u = queue[head++];
+        for (e = b->first_edge[u]; e >= 0; e = b->edge[e].next) {
+            v = b->edge[e].to;
+            c = b->edge[e].c;
+            if (u == 0) {
+                b->fail[v] = 0;
+            }
+            else {
+                f = b->fail[u];
+                while (f != 0 && ac_build_child(b, f, c, 0) < 0)
+                    f = b->fail[f];
+                n = ac_build_child(b, f, c, 0);
+                b->fail[v] = (n > 0) ? n : 0;
+            }
+            b->match[v] |= b->match[b->fail[v]];
+            queue[tail++] = v;
+        }
+    }
+    for (i = 0; i < tail; i++)
+        new_id[queue[i]] = i;
+
+    a = calloc(1, sizeof *a);
+    if (!a) die("calloc");
+    a->n_nodes = b->n_nodes;
+    a->n_edges = b->n_edges;
+    a->n_patterns = b->n_patterns;
+    a->node = malloc(a->n_nodes * sizeof(struct ac_node));
+    a->label = malloc(a->n_edges ? a->n_edges : 1);
+    a->target = malloc((a->n_edges ? a->n_edges : 1) * sizeof(int));
+    if (!a->node || !a->label || !a->target) die("malloc");
+    n = 0;
+    for (i = 0; i < tail; i++) {
+        u = queue[i];
+        a->node[i].fail = new_id[b->fail[u]];
+        a->node[i].match = b->match[u];
+        a->node[i].edges = n;
+        for (e = b->first_edge[u]; e >= 0; e = b->edge[e].next) {
+            /* insertion sort by byte */
+            for (j = n; j > a->node[i].edges && a->label[j - 1] > b->edge[e].c; j--) {
+                a->label[j] = a->label[j - 1];
+                a->target[j] = a->target[j - 1];
+            }
+            a->label[j] = b->edge[e].c;
+            a->target[j] = new_id[b->edge[e].to];
+            n++;
+        }
+        a->node[i].n_edges = n - a->node[i].edges;
+    }
+    for (e = a->node[0].edges; e < a->node[0].edges + a->node[0].n_edges; e++) {
+        a->root[a->label[e]] = a->target[e];
+        a->first[a->label[e]] = 1;
+    }
+    ac_setup_filter(a);
+    free(queue);
+    free(new_id);
+    return a;
+}
+
+/* The first byte filter pays off only while few bytes can start a
+   pattern.  lo_mask and hi_mask are the tables for the SSSE3 version:
+   byte b may start a pattern if lo_mask[b & 15] & hi_mask[b >> 4] is
+   not zero.  High nibbles 8 apart share a bit, so there can be false
+   hits, which the root table then rejects. */
+static void
+ac_setup_filter(struct ac *a)
+{
+    int c, n = 0;
+
+    for (c = 0; c < 256; c++) {
+        if (!a->first[c]) continue;
+        n++;
+        a->lo_mask[c & 15] |= 1 << ((c >> 4) & 7);
+        a->hi_mask[c >> 4] = 1 << ((c >> 4) & 7);
+    }
+    a->filter = (n <= AC_FILTER_MAX);
+}
+
+/* Returns a position inside the first line in [p, end) that contains
+   one of the strings, or NULL.  p must be at the beginning of a line. */
+static const char *
+ac_search(struct ac *a, const char *p, const char *end)
+{
+    const struct ac_node *node = a->node;
+    int s = 0;
+    int c;
+
+    while (p < end) {
+        c = (unsigned char)*p;
+        if (s == 0) {
+            if (a->filter && !a->first[c]) {
+                p = skip_first_bytes(a, p, end);
+                if (p == end) break;
+                c = (unsigned char)*p;
+            }
+            s = a->root[c];
+        }
+        else if (c == '\n') {
+            s = 0;
+        }
+        else {
+            s = ac_goto(a, s, a->fold[c]);
+        }
+        if (node[s].match) return p;
+        p++;
+    }
+    return NULL;
+}
+
+/* the transition from s (not the root) on c, following failure links */
+static int
+ac_goto(struct ac *a, int s, int c)
+{
+    const struct ac_node *nd;
+    int lo, hi, mid;
+
+    while (s != 0) {
+        nd = &a->node[s];
+        lo = nd->edges;
+        hi = nd->edges + nd->n_edges;
+        if (nd->n_edges <= 8) {
+            for (; lo < hi; lo++)
+                if (a->label[lo] == c) return a->target[lo];
+        }
+        else {
+            while (lo < hi) {
+                mid = (lo + hi) / 2;
+                if (a->label[mid] < c)
+                    lo = mid + 1;
+                else
+                    hi = mid;
+            }
+            if (lo < nd->edges + nd->n_edges && a->label[lo] == c)
+                return a->target[lo];
+        }
+        s = nd->fail;
+    }
+    return a->root[c];
+}
+
+static size_t
+ac_memory(struct ac *a)
+{
+    return sizeof *a + a->n_nodes * sizeof(struct ac_node)
+           + a->n_edges * (1 + sizeof(int));
+}
+
+static void
+ac_free(struct ac *a)
+{
+    free(a->node);
+    free(a->label);
+    free(a->target);
+    free(a);
+}
+
+static const char *
+skip_first_bytes_generic(struct ac *a, const char *p, const char *end)
+{
+    while (p < end && !a->first[(unsigned char)*p])
+        p++;
+    return p;
+}
+
+#ifdef HAVE_SIMD
+/* 16 bytes at a time, looked up in ac_setup_filter()'s nibble tables */
+__attribute__((target("ssse3")))
+static const char *
+skip_first_bytes_ssse3(struct ac *a, const char *p, const char *end)
+{
+    const __m128i lo = _mm_loadu_si128((const __m128i *)a->lo_mask);
+    const __m128i hi = _mm_loadu_si128((const __m128i *)a->hi_mask);
+    const __m128i nibble = _mm_set1_epi8(0x0f);
+    const __m128i zero = _mm_setzero_si128();
+    __m128i v, l, h;
+    unsigned int mask;
+
+    while (end - p >= 16) {
+        v = _mm_loadu_si128((const __m128i *)p);
+        l = _mm_shuffle_epi8(lo, _mm_and_si128(v, nibble));
+        h = _mm_shuffle_epi8(hi, _mm_and_si128(_mm_srli_epi16(v, 4), nibble));
+        mask = ~_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_and_si128(l, h), zero));
+        mask &= 0xffff;
+        if (mask) return p + __builtin_ctz(mask);
+        p += 16;
+    }
+    return skip_first_bytes_generic(a, p, end);
+}
+#endif
+
+static void
+ac_build_node(struct ac_build *b)
+{
+    if (b->n_nodes == b->capa_nodes) {
+        b->capa_nodes = b->capa_nodes ? b->capa_nodes * 2 : 1024;
+        b->first_edge = realloc(b->first_edge, b->capa_nodes * sizeof(int));
+        b->fail = realloc(b->fail, b->capa_nodes * sizeof(int));
+        b->match = realloc(b->match, b->capa_nodes);
+        if (!b->first_edge || !b->fail || !b->match) die("realloc");
+    }
+    b->first_edge[b->n_nodes] = -1;
+    b->match[b->n_nodes] = 0;
+    b->n_nodes++;
+}
+
+/* the child of s on c; with create, it is made when missing.
+   Returns -1 when it is missing otherwise. */
+static int
+ac_build_child(struct ac_build *b, int s, int c, int create)
+{
+    int e;
+
+    if (s == 0 && b->root[c] > 0) return b->root[c];
+    if (s != 0) {
+        for (e = b->first_edge[s]; e >= 0; e = b->edge[e].next)
+            if (b->edge[e].c == c) return b->edge[e].to;
+    }
+    if (!create) return -1;
+    if (b->n_edges == b->capa_edges) {
+        b->capa_edges = b->capa_edges ? b->capa_edges * 2 : 1024;
+        b->edge = realloc(b->edge, b->capa_edges * sizeof(struct ac_build_edge));
+        if (!b->edge) die("realloc");
+    }
+    ac_build_node(b);
+    e = b->n_edges++;
+    b->edge[e].c = c;
+    b->edge[e].to = b->n_nodes - 1;
+    b->edge[e].next = b->first_edge[s];
+    b->first_edge[s] = e;
+    if (s == 0) b->root[c] = b->n_nodes - 1;
+    return b->n_nodes - 1;
+}
+
+static void
+ac_build_free(struct ac_build *b)
+{
+    free(b->first_edge);
+    free(b->fail);
+    free(b->match);
+    free(b->edge);
+}
+
+/* -S: what the pattern was turned into, on stderr */
+static void
+print_stats(struct matcher *m)
+{
+    if (ac) {
+        fprintf(stderr, "aho-corasick: %d strings, %d states, %d edges, %lu bytes%s%s\n",
+                ac->n_patterns, ac->n_nodes, ac->n_edges,
+                (unsigned long)ac_memory(ac),
+                ac->filter ? ", first byte filter" : "",
+                opt_ignorecase ? ", ignoring case" : "");
+        return;
+    }
+    if (literal)
+        fprintf(stderr, "literal: %s%s\n", literal, opt_ignorecase ? " (ignoring case)" : "");
+    if (m->dfa)
+        fprintf(stderr, "dfa: %d NFA nodes, %d byte classes, %lu bytes of NFA, %d bytes of cache\n",
+                m->dfa->n_nodes, m->dfa->n_classes,
+                (unsigned long)(m->dfa->n_nodes * sizeof(struct nfa_node)
+                                + m->dfa->n_sets * BYTE_SET_SIZE),
+                DFA_CACHE_SIZE);
+    else
+        fputs("regexec\n", stderr);
+    if (idx) {
+        fprintf(stderr, "index: %u files, %u blocks, %u trigrams", idx->header->n_files,
+                idx->header->n_blocks, idx->header->n_trigrams);
+        if (idx->cand)
+            fprintf(stderr, ", %u blocks to search\n", idx->n_cand);
+        else
+            fputs(", not used\n", stderr);
+    }
+}
+
+/* path ǼեΤɤߡ֤ */
+static char *
+read_file(char *path)
+{
+    FILE *f;
+    char *buf;
+    size_t capa = 1024;   /* Хåե */
+    size_t idx = 0;           /* ߤΥХåե񤭹߰ */
+    int c;
+    
+    f = fopen(path, "r");
+    if (!f) {
+        perror(path);
+        exit(1);
+    }
+    buf = malloc(capa);
+    if (!buf) die("malloc");
+    while ((c = getc(f)) != EOF) {
+        /* ХåեĹå ('\0' 뤳Ȥͤ +1 ) */
+        if (idx + 1 >= capa) {
+            capa *= 2;
+            buf = realloc(buf, capa);
+            if (!buf) die("realloc");
+        }
+        buf[idx++] = c;
+    }
+    buf[idx++] = '\0';
+    fclose(f);
+
+    return buf;
+}
+
+/* Each line of the -f file is a pattern of its own; joins them with '|'
+   and returns the number of patterns. */
+static int
+lines_to_alternation(char *buf)
+{
+    size_t len = strlen(buf);
+    int n = 0;
+    size_t i;
+
+    if (len == 0) return 0;
+    if (buf[len - 1] == '\n') buf[--len] = '\0';
+    for (i = 0; i < len; i++) {
+        if (buf[i] == '\n') {
+            buf[i] = '|';
+            n++;
+        }
+    }
+    return n + 1;
 }
 
 static void
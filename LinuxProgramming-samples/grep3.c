@@ -10,14 +10,20 @@
     with or without modification, are permitted.
 */
 
+#define _GNU_SOURCE     /* memrchr() */
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <errno.h>
 #include <sys/types.h>
+#include <fcntl.h>
 #include <regex.h>
+#include <unistd.h>
 
-static void do_grep(regex_t *pat, FILE *f);
-static char* getline(FILE *f);
+#define BLOCK_SIZE (64 * 1024)
+
+static void do_grep(regex_t *pat, int fd, const char *name);
+static void grep_lines(regex_t *pat, const char *buf, size_t len);
 static void die(const char *s);
 
 int
@@ -31,7 +37,7 @@ main(int argc, char *argv[])
         fputs("no pattern\n", stderr);
         exit(1);
     }
-    err = regcomp(&pat, argv[1], REG_EXTENDED | REG_NOSUB | REG_NEWLINE);
+    err = regcomp(&pat, argv[1], REG_EXTENDED | REG_NEWLINE);
     if (err != 0) {
         char buf[1024];
 
@@ -40,60 +46,94 @@ main(int argc, char *argv[])
         exit(1);
     }
     if (argc == 2) {
-        do_grep(&pat, stdin);
+        do_grep(&pat, STDIN_FILENO, "stdin");
     }
     else {
         for (i = 2; i < argc; i++) {
-            FILE *f = fopen(argv[i], "r");
-            if (!f) die(argv[i]);
-            do_grep(&pat, f);
-            fclose(f);
+            int fd = open(argv[i], O_RDONLY);
+            if (fd < 0) die(argv[i]);
+            do_grep(&pat, fd, argv[i]);
+            close(fd);
         }
     }
     regfree(&pat);
     exit(0);
 }
 
+/* Reads fd in blocks.  Complete lines are grepped right away; the
+   unfinished line at the end is moved to the front of the buffer,
+   which doubles whenever a single line fills it. */
 static void
-do_grep(regex_t *pat, FILE *src)
+do_grep(regex_t *pat, int fd, const char *name)
 {
-    char *line;
+    char *buf, *nl;
+    size_t capa = BLOCK_SIZE;
+    size_t len = 0;
+    size_t done;
+    ssize_t n;
 
-    while (line = getline(src)) {
-        if (regexec(pat, line, 0, NULL, 0) == 0) {
-            puts(line);
+    buf = malloc(capa);
+    if (!buf) die("malloc");
+    for (;;) {
+        if (len == capa) {
+            capa *= 2;
+            buf = realloc(buf, capa);
+            if (!buf) die("realloc");
         }
-        free(line);
+        n = read(fd, buf + len, capa - len);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            die(name);
+        }
+        if (n == 0) break;
+        nl = memrchr(buf + len, '\n', n);
+        len += n;
+        if (!nl) continue;
+        done = nl + 1 - buf;
+        grep_lines(pat, buf, done);
+        memmove(buf, buf + done, len - done);
+        len -= done;
     }
+    if (len > 0) grep_lines(pat, buf, len);
+    free(buf);
 }
 
-static char*
-getline(FILE *src)
+/* regexec() runs over all the lines at once; the line around each
+   match is found with memrchr() and memchr().  REG_NEWLINE does not
+   keep [[:space:]] from matching a newline, so a match running into
+   the next line is tried again on its first line alone. */
+static void
+grep_lines(regex_t *pat, const char *buf, size_t len)
 {
-    unsigned char *line;   /* Хåե */
-    size_t capa = 160;     /* Хåե */
-    size_t idx = 0;        /* ߤΥХåե񤭹߰ */
-    int c;
+    const char *p = buf;
+    const char *end = buf + len;
+    const char *hit, *s, *e;
+    regmatch_t m;
 
-    line = malloc(capa);
-    if (!line) die("malloc");
-    while ((c = getc(src)) != EOF) {
-        if (c == '\n')
+    while (p < end) {
+        m.rm_so = 0;
+        m.rm_eo = end - p;
+        if (regexec(pat, p, 1, &m, REG_STARTEND) != 0)
             break;
-        if (idx == capa - 1) {   /* ХåեĹå */
-            capa *= 2;
-            line = realloc(line, capa);
-            if (!line) die("realloc");
+        hit = p + m.rm_so;
+        if (hit == end && end[-1] == '\n')
+            break;
+        s = memrchr(p, '\n', hit - p);
+        s = s ? s + 1 : p;
+        e = memchr(hit, '\n', end - hit);
+        e = e ? e : end;
+        if (p + m.rm_eo > e) {
+            m.rm_so = 0;
+            m.rm_eo = e - s;
+            if (regexec(pat, s, 1, &m, REG_STARTEND) != 0) {
+                p = e + 1;
+                continue;
+            }
         }
-        line[idx++] = (unsigned char)c;
+        fwrite(s, 1, e - s, stdout);
+        putchar('\n');
+        p = e + 1;
     }
-    if ((idx == 0) && (c == EOF)) {
-        free(line);
-        return NULL;
-    }
-    line[idx++] = '\0';
-
-    return (char*)line;
 }
 
 static void
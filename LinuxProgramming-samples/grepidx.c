@@ -0,0 +1,682 @@
+/*
+    grepidx.c -- builds the trigram index that grep2 -X reads.
+
+    Usage: grepidx [-b <block size>] <index> <file>...
+
+    Each file is cut into blocks of <block size> bytes (4KB by
+    default).  For every trigram, that is three bytes in a row without
+    a newline, the index has the list of blocks it starts in.  grep2
+    looks up the trigrams of the literal every match must contain, and
+    searches only the blocks (and the lines around them) that have all
+    of them.
+
+    When <index> already exists, it is updated: a file that has only
+    grown since is indexed again from its last indexed block onward,
+    everything before that is taken over from the old index.  Files
+    not given this time are dropped.  A file counts as "only grown"
+    when it is the same inode, is not shorter, its last indexed bytes
+    are unchanged and, if it has the same size, the same mtime.  grep2
+    uses an entry by the same rule, so an edit in place is noticed
+    unless it comes with an append and leaves the last IDX_TAIL_SIZE
+    indexed bytes alone; index such files again from scratch (remove
+    <index> first).
+
+    The layout (in host byte order) is an IdxHeader, the IdxFile
+    array, the file numbers sorted by name, the newline count of every
+    block, the IdxTrigram array sorted by trigram, the posting lists
+    and the names.  A posting list is the block numbers in increasing
+    order, each stored as the difference from the previous one in
+    7-bit groups (LEB128).  Blocks are numbered through all the files.
+
+    This program is free software.
+    Redistribution and use in source and binary forms,
+    with or without modification, are permitted.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#define IDX_MAGIC "GREPIDX2"
+#define IDX_ALIGN 8
+#define IDX_TAIL_SIZE 4096      /* bytes checked to tell an append */
+#define DEFAULT_BLOCK_SIZE (4 * 1024)
+#define N_TRIGRAMS (1 << 24)
+
+/* These must match grep2.c. */
+struct IdxHeader {
+    char magic[8];
+    unsigned int block_size;
+    unsigned int n_files;
+    unsigned int n_blocks;
+    unsigned int n_trigrams;
+    unsigned long long files_offset;
+    unsigned long long order_offset;
+    unsigned long long lines_offset;
+    unsigned long long trigrams_offset;
+    unsigned long long postings_offset;
+    unsigned long long names_offset;
+    unsigned long long names_size;
+};
+
+struct IdxFile {
+    unsigned long long size;        /* bytes indexed */
+    unsigned long long dev;
+    unsigned long long ino;
+    unsigned long long tail_hash;   /* of the last IDX_TAIL_SIZE bytes */
+    unsigned long long mtime_ns;    /* st_mtim when indexed */
+    unsigned int first_block;
+    unsigned int n_blocks;
+    unsigned int name;              /* offset into the names */
+    unsigned int pad;
+};
+
+struct IdxTrigram {
+    unsigned int trigram;
+    unsigned int n_blocks;
+    unsigned long long offset;      /* into the posting lists */
+};
+
+/* an index mapped read-only */
+struct index {
+    char *map;
+    size_t size;
+    struct IdxHeader *header;
+    struct IdxFile *files;
+    unsigned int *lines;
+    struct IdxTrigram *trigrams;
+    unsigned char *postings;
+    unsigned long long postings_size;
+    char *names;
+};
+
+struct buffer {
+    unsigned char *ptr;
+    size_t len;
+    size_t capa;
+};
+
+/* the blocks of one trigram indexed this time */
+struct posting {
+    unsigned int trigram;
+    unsigned int n;             /* 0 while the slot is free */
+    unsigned int last;
+    struct buffer list;
+};
+
+static struct index *open_index(const char *path);
+static void index_file(int i);
+static void index_block(const char *p, const char *block_end,
+                        const char *end, unsigned int block);
+static struct posting *find_posting(unsigned int trigram, int create);
+static void grow_postings(void);
+static unsigned int write_index(const char *path);
+static void add_old_postings(struct IdxTrigram *t, unsigned int **ids,
+                             size_t *n, size_t *capa);
+static void put_varint(struct buffer *b, unsigned int v);
+static unsigned int get_varint(const unsigned char **pp);
+static void buffer_add(struct buffer *b, const void *p, size_t len);
+static unsigned long long tail_hash(const char *p, size_t len);
+static int cmp_uint(const void *a, const void *b);
+static int cmp_order(const void *a, const void *b);
+static int cmp_trigram(const void *a, const void *b);
+static void write_all(int fd, const void *buf, size_t len);
+static void pad(int fd, unsigned long long *offset);
+static void* xmalloc(size_t size);
+static void* xrealloc(void *ptr, size_t size);
+static void die(const char *s);
+
+static unsigned int block_size = DEFAULT_BLOCK_SIZE;
+static struct index *old;
+static char **paths;
+static struct IdxFile *files;
+static int n_files;
+static unsigned int *old_file;  /* old file number of each file, or -1 */
+static unsigned int *remap;     /* old block number -> new one, or -1 */
+static unsigned int *lines;     /* newlines in each block */
+static unsigned int n_blocks;
+static unsigned int n_new_blocks;
+static unsigned long long new_bytes;
+
+/* open addressing, keyed by trigram */
+static struct posting *postings;
+static size_t postings_capa = 0;
+static size_t n_postings = 0;
+
+/* the trigrams seen in the current block */
+static unsigned char seen[N_TRIGRAMS / 8];
+static unsigned int *seen_list;
+
+int
+main(int argc, char *argv[])
+{
+    unsigned int i, j, b, n_trigrams;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "b:")) != -1) {
+        switch (opt) {
+        case 'b':
+            block_size = atoi(optarg);
+            break;
+        case '?':
+            fprintf(stderr, "Usage: %s [-b <block size>] <index> <file>...\n", argv[0]);
+            exit(1);
+        }
+    }
+    if (argc - optind < 2 || block_size < 1024) {
+        fprintf(stderr, "Usage: %s [-b <block size>] <index> <file>...\n", argv[0]);
+        exit(1);
+    }
+    old = open_index(argv[optind]);
+    if (old && old->header->block_size != block_size) old = NULL;
+    paths = argv + optind + 1;
+    n_files = argc - optind - 1;
+    files = xmalloc(n_files * sizeof(struct IdxFile));
+    old_file = xmalloc(n_files * sizeof(unsigned int));
+    if (old) {
+        remap = xmalloc((old->header->n_blocks + 1) * sizeof(unsigned int));
+        memset(remap, 0xff, (old->header->n_blocks + 1) * sizeof(unsigned int));
+    }
+    seen_list = xmalloc(block_size * sizeof(unsigned int));
+    postings_capa = 1024;
+    postings = xrealloc(NULL, postings_capa * sizeof(struct posting));
+    memset(postings, 0, postings_capa * sizeof(struct posting));
+
+    for (i = 0; i < (unsigned int)n_files; i++)
+        index_file(i);
+
+    /* the blocks kept get their new numbers */
+    if (old) {
+        for (i = 0; i < (unsigned int)n_files; i++) {
+            struct IdxFile *of;
+
+            if (old_file[i] == (unsigned int)-1) continue;
+            of = &old->files[old_file[i]];
+            for (j = 0; j + 1 < of->n_blocks; j++) {
+                b = of->first_block + j;
+                remap[b] = files[i].first_block + j;
+                lines[files[i].first_block + j] = old->lines[b];
+            }
+        }
+    }
+    n_trigrams = write_index(argv[optind]);
+    printf("%d files, %u blocks (%u indexed, %llu bytes read), %u trigrams\n",
+           n_files, n_blocks, n_new_blocks, new_bytes, n_trigrams);
+    exit(0);
+}
+
+/* Maps an existing index.  Returns NULL when there is none, or when it
+   is not one this program can take over. */
+static struct index *
+open_index(const char *path)
+{
+    struct index *idx;
+    struct IdxHeader *h;
+    struct stat st;
+    int fd;
+
+    fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        if (errno == ENOENT) return NULL;
+        die(path);
+    }
+    if (fstat(fd, &st) < 0) die(path);
+    if ((size_t)st.st_size < sizeof(struct IdxHeader)) {
+        close(fd);
+        return NULL;
+    }
+    idx = xmalloc(sizeof(struct index));
+    idx->size = st.st_size;
+    idx->map = mmap(NULL, idx->size, PROT_READ, MAP_SHARED, fd, 0);
+    if (idx->map == MAP_FAILED) die("mmap(2)");
+    close(fd);
+    h = idx->header = (struct IdxHeader *)idx->map;
+    if (memcmp(h->magic, IDX_MAGIC, sizeof h->magic) != 0
+            || h->files_offset > idx->size
+            || h->n_files > (idx->size - h->files_offset) / sizeof(struct IdxFile)
+            || h->lines_offset > idx->size
+            || h->n_blocks > (idx->size - h->lines_offset) / sizeof(unsigned int)
+            || h->trigrams_offset > idx->size
+            || h->n_trigrams > (idx->size - h->trigrams_offset) / sizeof(struct IdxTrigram)
+            || h->postings_offset > idx->size
+            || h->names_offset > idx->size
+            || h->names_size > idx->size - h->names_offset) {
+        fprintf(stderr, "%s: broken index, building it again\n", path);
+        munmap(idx->map, idx->size);
+        free(idx);
+        return NULL;
+    }
+    idx->files = (struct IdxFile *)(idx->map + h->files_offset);
+    idx->lines = (unsigned int *)(idx->map + h->lines_offset);
+    idx->trigrams = (struct IdxTrigram *)(idx->map + h->trigrams_offset);
+    idx->postings = (unsigned char *)(idx->map + h->postings_offset);
+    idx->postings_size = h->names_offset - h->postings_offset;
+    idx->names = idx->map + h->names_offset;
+    return idx;
+}
+
+/* Indexes the part of paths[i] the old index does not have. */
+static void
+index_file(int i)
+{
+    struct IdxFile *f = &files[i];
+    struct IdxFile *of;
+    struct stat st;
+    char *map = NULL;
+    unsigned int j, k, keep = 0;
+    size_t start, end;
+    int fd;
+
+    fd = open(paths[i], O_RDONLY);
+    if (fd < 0 || fstat(fd, &st) < 0) die(paths[i]);
+    if (!S_ISREG(st.st_mode)) {
+        fprintf(stderr, "%s: not a regular file\n", paths[i]);
+        exit(1);
+    }
+    if (st.st_size > 0) {
+        map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (map == MAP_FAILED) die(paths[i]);
+    }
+    close(fd);
+
+    memset(f, 0, sizeof *f);
+    f->size = st.st_size;
+    f->dev = st.st_dev;
+    f->ino = st.st_ino;
+    f->mtime_ns = (unsigned long long)st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec;
+    f->first_block = n_blocks;
+    f->n_blocks = (st.st_size + block_size - 1) / block_size;
+    old_file[i] = (unsigned int)-1;
+    if (old) {
+        for (j = 0; j < old->header->n_files; j++) {
+            of = &old->files[j];
+            if (of->name >= old->header->names_size
+                    || strcmp(old->names + of->name, paths[i]) != 0)
+                continue;
+            start = of->size > IDX_TAIL_SIZE ? of->size - IDX_TAIL_SIZE : 0;
+            if (of->dev == f->dev && of->ino == f->ino && of->size <= f->size
+                    && (of->size < f->size || of->mtime_ns == f->mtime_ns)
+                    && of->n_blocks <= old->header->n_blocks - of->first_block
+                    && of->first_block <= old->header->n_blocks
+                    && of->tail_hash == tail_hash(map + start, of->size - start)) {
+                old_file[i] = j;
+                /* the last block may have lost trigrams at its end */
+                keep = of->n_blocks > 0 ? of->n_blocks - 1 : 0;
+            }
+            break;
+        }
+    }
+    if (n_blocks + f->n_blocks < n_blocks) {
+        fputs("too many blocks\n", stderr);
+        exit(1);
+    }
+    n_blocks += f->n_blocks;
+    lines = xrealloc(lines, (n_blocks + 1) * sizeof(unsigned int));
+
+    for (k = keep; k < f->n_blocks; k++) {
+        const char *p, *q;
+        unsigned int n = 0;
+
+        start = (size_t)k * block_size;
+        end = start + block_size < f->size ? start + block_size : f->size;
+        index_block(map + start, map + end, map + f->size, f->first_block + k);
+        for (p = map + start; (q = memchr(p, '\n', map + end - p)) != NULL; p = q + 1)
+            n++;
+        lines[f->first_block + k] = n;
+        n_new_blocks++;
+        new_bytes += end - start;
+    }
+    start = f->size > IDX_TAIL_SIZE ? f->size - IDX_TAIL_SIZE : 0;
+    f->tail_hash = tail_hash(map + start, f->size - start);
+    if (map) munmap(map, st.st_size);
+}
+
+/* Adds the block to the list of every trigram starting in it.  The
+   last two may reach into the next block. */
+static void
+index_block(const char *p, const char *block_end, const char *end,
+            unsigned int block)
+{
+    const unsigned char *s = (const unsigned char *)p;
+    const unsigned char *e = (const unsigned char *)block_end;
+    unsigned int n = 0, i, t;
+    struct posting *post;
+
+    if (end - block_end < 2) e -= 2 - (end - block_end);
+    for (; s < e; s++) {
+        if (s[0] == '\n' || s[1] == '\n' || s[2] == '\n') continue;
+        t = (s[0] << 16) | (s[1] << 8) | s[2];
+        if (seen[t >> 3] & (1 << (t & 7))) continue;
+        seen[t >> 3] |= 1 << (t & 7);
+        seen_list[n++] = t;
+    }
+    for (i = 0; i < n; i++) {
+        t = seen_list[i];
+        seen[t >> 3] &= ~(1 << (t & 7));
+        post = find_posting(t, 1);
+        /* the first is stored as is, as if the previous were 0 */
+        put_varint(&post->list, block - post->last);
+        post->last = block;
+        post->n++;
+    }
+}
+
+static struct posting *
+find_posting(unsigned int trigram, int create)
+{
+    size_t i;
+
+    if (create && n_postings * 2 >= postings_capa) grow_postings();
+    i = (trigram * 2654435761u) & (postings_capa - 1);
+    while (postings[i].n > 0) {
+        if (postings[i].trigram == trigram) return &postings[i];
+        i = (i + 1) & (postings_capa - 1);
+    }
+    if (!create) return NULL;
+    /* the caller adds the first block at once */
+    postings[i].trigram = trigram;
+    n_postings++;
+    return &postings[i];
+}
+
+static void
+grow_postings(void)
+{
+    struct posting *old_postings = postings;
+    size_t old_capa = postings_capa;
+    size_t i, j;
+
+    postings_capa *= 2;
+    postings = xmalloc(postings_capa * sizeof(struct posting));
+    memset(postings, 0, postings_capa * sizeof(struct posting));
+    for (i = 0; i < old_capa; i++) {
+        if (old_postings[i].n == 0) continue;
+        j = (old_postings[i].trigram * 2654435761u) & (postings_capa - 1);
+        while (postings[j].n > 0)
+            j = (j + 1) & (postings_capa - 1);
+        postings[j] = old_postings[i];
+    }
+    free(old_postings);
+}
+
+/* Merges the old and the new posting lists and writes the whole index
+   to path.tmp, then renames it over path.  Returns the number of
+   trigrams. */
+static unsigned int
+write_index(const char *path)
+{
+    struct IdxHeader header;
+    struct IdxTrigram *trigrams;
+    struct buffer out = { NULL, 0, 0 };
+    struct buffer names = { NULL, 0, 0 };
+    unsigned int *order, *ids = NULL;
+    size_t n_ids, capa_ids = 0;
+    unsigned int n_trigrams = 0, i, j, t, prev;
+    unsigned long long offset;
+    struct IdxTrigram *ot;
+    struct posting *post;
+    const unsigned char *p;
+    char *tmppath;
+    int fd;
+
+    /* every trigram in either index, sorted */
+    trigrams = xmalloc((n_postings + (old ? old->header->n_trigrams : 0) + 1)
+                       * sizeof(struct IdxTrigram));
+    for (i = 0; i < postings_capa; i++) {
+        if (postings[i].n == 0) continue;
+        trigrams[n_trigrams].trigram = postings[i].trigram;
+        n_trigrams++;
+    }
+    if (old) {
+        for (i = 0; i < old->header->n_trigrams; i++) {
+            t = old->trigrams[i].trigram;
+            if (find_posting(t, 0)) continue;
+            trigrams[n_trigrams].trigram = t;
+            n_trigrams++;
+        }
+    }
+    qsort(trigrams, n_trigrams, sizeof(struct IdxTrigram), cmp_trigram);
+
+    ot = old ? old->trigrams : NULL;
+    for (i = 0; i < n_trigrams; i++) {
+        t = trigrams[i].trigram;
+        n_ids = 0;
+        /* both are sorted by trigram */
+        while (old && ot < old->trigrams + old->header->n_trigrams && ot->trigram < t)
+            ot++;
+        if (old && ot < old->trigrams + old->header->n_trigrams && ot->trigram == t)
+            add_old_postings(ot, &ids, &n_ids, &capa_ids);
+        post = find_posting(t, 0);
+        if (post) {
+            p = post->list.ptr;
+            prev = 0;
+            for (j = 0; j < post->n; j++) {
+                if (n_ids == capa_ids) {
+                    capa_ids = capa_ids ? capa_ids * 2 : 1024;
+                    ids = xrealloc(ids, capa_ids * sizeof(unsigned int));
+                }
+                prev += get_varint(&p);
+                ids[n_ids++] = prev;
+            }
+        }
+        /* files may come in another order than last time */
+        for (j = 1; j < n_ids; j++) {
+            if (ids[j - 1] > ids[j]) {
+                qsort(ids, n_ids, sizeof(unsigned int), cmp_uint);
+                break;
+            }
+        }
+        trigrams[i].offset = out.len;
+        trigrams[i].n_blocks = n_ids;
+        prev = 0;
+        for (j = 0; j < n_ids; j++) {
+            put_varint(&out, ids[j] - prev);
+            prev = ids[j];
+        }
+    }
+    for (i = 0; i < (unsigned int)n_files; i++) {
+        files[i].name = names.len;
+        buffer_add(&names, paths[i], strlen(paths[i]) + 1);
+    }
+    order = xmalloc((n_files + 1) * sizeof(unsigned int));
+    for (i = 0; i < (unsigned int)n_files; i++)
+        order[i] = i;
+    qsort(order, n_files, sizeof(unsigned int), cmp_order);
+
+    tmppath = xmalloc(strlen(path) + 5);
+    strcpy(tmppath, path);
+    strcat(tmppath, ".tmp");
+    fd = open(tmppath, O_WRONLY|O_CREAT|O_TRUNC, 0644);
+    if (fd < 0) die(tmppath);
+    memset(&header, 0, sizeof header);
+    write_all(fd, &header, sizeof header);
+    offset = sizeof header;
+    header.files_offset = offset;
+    write_all(fd, files, n_files * sizeof(struct IdxFile));
+    offset += n_files * sizeof(struct IdxFile);
+    header.order_offset = offset;
+    write_all(fd, order, n_files * sizeof(unsigned int));
+    offset += n_files * sizeof(unsigned int);
+    pad(fd, &offset);
+    header.lines_offset = offset;
+    write_all(fd, lines, n_blocks * sizeof(unsigned int));
+    offset += n_blocks * sizeof(unsigned int);
+    pad(fd, &offset);
+    header.trigrams_offset = offset;
+    write_all(fd, trigrams, n_trigrams * sizeof(struct IdxTrigram));
+    offset += n_trigrams * sizeof(struct IdxTrigram);
+    header.postings_offset = offset;
+    write_all(fd, out.ptr, out.len);
+    offset += out.len;
+    header.names_offset = offset;
+    header.names_size = names.len;
+    write_all(fd, names.ptr, names.len);
+
+    memcpy(header.magic, IDX_MAGIC, sizeof header.magic);
+    header.block_size = block_size;
+    header.n_files = n_files;
+    header.n_blocks = n_blocks;
+    header.n_trigrams = n_trigrams;
+    if (lseek(fd, 0, SEEK_SET) < 0) die("lseek(2)");
+    write_all(fd, &header, sizeof header);
+    if (close(fd) < 0) die(tmppath);
+    if (rename(tmppath, path) < 0) die(path);
+    return n_trigrams;
+}
+
+/* Appends the blocks of an old posting list that are kept, by their
+   new numbers. */
+static void
+add_old_postings(struct IdxTrigram *t, unsigned int **ids,
+                 size_t *n, size_t *capa)
+{
+    const unsigned char *p;
+    unsigned int b = 0, i;
+
+    if (t->offset >= old->postings_size) return;
+    p = old->postings + t->offset;
+    for (i = 0; i < t->n_blocks; i++) {
+        b += get_varint(&p);
+        if (b >= old->header->n_blocks || remap[b] == (unsigned int)-1) continue;
+        if (*n == *capa) {
+            *capa = *capa ? *capa * 2 : 1024;
+            *ids = xrealloc(*ids, *capa * sizeof(unsigned int));
+        }
+        (*ids)[(*n)++] = remap[b];
+    }
+}
+
+static void
+put_varint(struct buffer *b, unsigned int v)
+{
+    unsigned char c[5];
+    int n = 0;
+
+    while (v >= 0x80) {
+        c[n++] = (v & 0x7f) | 0x80;
+        v >>= 7;
+    }
+    c[n++] = v;
+    buffer_add(b, c, n);
+}
+
+static unsigned int
+get_varint(const unsigned char **pp)
+{
+    const unsigned char *p = *pp;
+    unsigned int v = 0;
+    int shift = 0;
+
+    while (*p & 0x80) {
+        v |= (*p++ & 0x7f) << shift;
+        shift += 7;
+    }
+    v |= *p++ << shift;
+    *pp = p;
+    return v;
+}
+
+static void
+buffer_add(struct buffer *b, const void *p, size_t len)
+{
+    if (b->len + len > b->capa) {
+        while (b->len + len > b->capa)
+            b->capa = b->capa ? b->capa * 2 : 64;
+        b->ptr = xrealloc(b->ptr, b->capa);
+    }
+    memcpy(b->ptr + b->len, p, len);
+    b->len += len;
+}
+
+/* FNV-1a; must match grep2.c */
+static unsigned long long
+tail_hash(const char *p, size_t len)
+{
+    unsigned long long h = 14695981039346656037ULL;
+
+    while (len-- > 0) {
+        h ^= (unsigned char)*p++;
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+static int
+cmp_uint(const void *a, const void *b)
+{
+    unsigned int x = *(const unsigned int *)a;
+    unsigned int y = *(const unsigned int *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+static int
+cmp_order(const void *a, const void *b)
+{
+    return strcmp(paths[*(const unsigned int *)a], paths[*(const unsigned int *)b]);
+}
+
+static int
+cmp_trigram(const void *a, const void *b)
+{
+    return cmp_uint(&((const struct IdxTrigram *)a)->trigram,
+                    &((const struct IdxTrigram *)b)->trigram);
+}
+
+static void
+write_all(int fd, const void *buf, size_t len)
+{
+    const char *p = buf;
+
+    while (len > 0) {
+        ssize_t n = write(fd, p, len);
+
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            die("write(2)");
+        }
+        p += n;
+        len -= n;
+    }
+}
+
+static void
+pad(int fd, unsigned long long *offset)
+{
+    static const char zero[IDX_ALIGN];
+    size_t n = (IDX_ALIGN - *offset % IDX_ALIGN) % IDX_ALIGN;
+
+    write_all(fd, zero, n);
+    *offset += n;
+}
+
+static void*
+xmalloc(size_t size)
+{
+    void *p = malloc(size ? size : 1);
+
+    if (!p) die("malloc(3)");
+    return p;
+}
+
+static void*
+xrealloc(void *ptr, size_t size)
+{
+    void *p = realloc(ptr, size ? size : 1);
+
+    if (!p) die("realloc(3)");
+    return p;
+}
+
+static void
+die(const char *s)
+{
+    perror(s);
+    exit(1);
+}
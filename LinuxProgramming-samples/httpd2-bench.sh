@@ -0,0 +1,85 @@
+#!/bin/sh
+#
+# httpd2-bench.sh -- latency of httpd2 under each listen option
+#
+# Usage: httpd2-bench.sh <docroot> <path> [<requests> [<clients>]]
+#
+# Starts ./httpd2 once per option set listed below and fetches <path>
+# <requests> times in all with <clients> concurrent curl processes,
+# each making its share of the requests on new connections, printing
+# the median and the 99th percentile of the time to first byte and of
+# the total time (msec).  The clients ask for TCP Fast Open, which the
+# fastopen run then grants, provided the net.ipv4.tcp_fastopen sysctl
+# has both bit 1 (client, the default) and bit 2 (server) set.
+
+docroot=$1
+path=$2
+n=${3:-200}
+clients=${4:-16}
+port=18080
+
+if [ -z "$docroot" -o -z "$path" ]
+then
+    echo "Usage: $0 <docroot> <path> [<requests>]" >&2
+    exit 1
+fi
+
+conf=/tmp/httpd2-bench.$$
+trap 'rm -f $conf $conf.urls $conf.out $conf.out.*' 0
+
+# nearest rank, as probe and httpd2-replay count it
+percentile() {
+    sort -n | awk -v p=$1 '{ v[NR] = $1 } END { r = NR * p / 100; i = int(r); if (i < r) i++; if (i < 1) i = 1; printf "%.3f", v[i] * 1000 }'
+}
+
+# one client's share of the requests, as a curl config file
+i=0
+while [ $i -lt `expr $n / $clients` ]
+do
+    echo "url = \"http://127.0.0.1:$port$path\""
+    echo 'output = "/dev/null"'
+    i=`expr $i + 1`
+done > $conf.urls
+
+run() {
+    echo "listen $port $*" > $conf
+    ./httpd2 --debug --config=$conf $docroot 2>/dev/null &
+    pid=$!
+    sleep 1
+    curls=
+    i=0
+    while [ $i -lt $clients ]
+    do
+        curl -s --tcp-fastopen -K $conf.urls \
+            -w '%{time_starttransfer} %{time_total}\n' > $conf.out.$i &
+        curls="$curls $!"
+        i=`expr $i + 1`
+    done
+    wait $curls
+    cat $conf.out.* > $conf.out
+    kill $pid
+    wait $pid 2>/dev/null
+    printf '%-28s ttfb p50 %8s p99 %8s   total p50 %8s p99 %8s\n' \
+        "${*:-(defaults)}" \
+        `cut -d' ' -f1 $conf.out | percentile 50` \
+        `cut -d' ' -f1 $conf.out | percentile 99` \
+        `cut -d' ' -f2 $conf.out | percentile 50` \
+        `cut -d' ' -f2 $conf.out | percentile 99`
+}
+
+tfo=`cat /proc/sys/net/ipv4/tcp_fastopen 2>/dev/null`
+if [ $(( ${tfo:-0} & 3 )) -ne 3 ]
+then
+    echo "note: net.ipv4.tcp_fastopen is ${tfo:-unknown}; without bits 1" \
+         "and 2 set the fastopen run will not use Fast Open" >&2
+fi
+
+run
+run defer=5
+run fastopen=64
+run nodelay
+run cork
+run sndbuf=16384
+run sndbuf=1048576
+run rcvbuf=1048576
+run backlog=1024
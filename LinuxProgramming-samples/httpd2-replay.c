@@ -0,0 +1,539 @@
+/*
+    httpd2-replay.c -- replays a request trace captured by httpd2.
+
+    Usage: httpd2-replay [-s <speed>] [-t <timeout msec>] <host> <port> <trace>
+
+    httpd2 writes the trace when started with --capture=<trace> (or
+    with a "capture" line in its config).  Each request is sent on a
+    connection of its own at its original offset from the first one,
+    divided by speed, so the trace's inter-arrival times, and with them
+    its concurrency, are reproduced.  Request bodies are not captured;
+    a body of the recorded length is sent instead.
+
+    Latencies are measured from the time a request was due, not from
+    when it could be sent, so a server that falls behind shows its
+    queueing delay instead of slowing the replay down.
+
+    This program is free software.
+    Redistribution and use in source and binary forms,
+    with or without modification, are permitted.
+*/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <netdb.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <sys/resource.h>
+#include <netinet/in.h>
+
+#define CAPTURE_MAGIC 0x31435448    /* "HTC1" */
+#define DEFAULT_TIMEOUT_MSEC 30000
+#define MAX_EVENTS 256
+#define READ_BUF_SIZE (64 * 1024)
+
+/* as written by httpd2 */
+struct CaptureRecord {
+    unsigned int magic;
+    unsigned int head_len;
+    unsigned long long start_usec;  /* wall clock, when reading began */
+    unsigned int duration_usec;
+    unsigned int body_len;          /* the body itself is not kept */
+    unsigned long long bytes_sent;
+    unsigned int pid;
+    unsigned int status;
+};
+
+struct request {
+    struct CaptureRecord *rec;
+    char *head;
+    unsigned long long due;         /* usec, CLOCK_MONOTONIC */
+    unsigned long long started;
+    unsigned long long first_byte;
+    unsigned long long done;
+    int fd;
+    int connected;
+    char *out;                      /* head, blank line and body */
+    size_t out_len;
+    size_t out_pos;
+    char status_line[16];
+    size_t status_len;
+    int status;
+    unsigned long long received;
+    int failed;
+};
+
+static void load_trace(char *path);
+static int cmp_request(const void *a, const void *b);
+static void resolve(char *host, char *port);
+static void start_request(struct request *r);
+static void handle_event(struct request *r, unsigned int events);
+static void send_request(struct request *r);
+static void receive_response(struct request *r);
+static void finish_request(struct request *r, int failed);
+static void expire_requests(unsigned long long now);
+static void set_timer(unsigned long long when);
+static void report(void);
+static void print_percentiles(const char *label, unsigned long long *v, size_t n);
+static int cmp_ull(const void *a, const void *b);
+static unsigned long long now_usec(void);
+static void* xmalloc(size_t size);
+static void die(const char *s);
+
+static struct request *requests;
+static size_t n_requests;
+static struct request **active;     /* indexed by fd */
+static int n_active = 0, peak_active = 0;
+static int max_fd;
+static int epfd, timerfd;
+static struct sockaddr_storage server_addr;
+static socklen_t server_addrlen;
+static double speed = 1.0;
+static unsigned long long timeout_usec = DEFAULT_TIMEOUT_MSEC * 1000ULL;
+static unsigned long long replay_start, replay_end;
+static unsigned long n_failed = 0, n_timeout = 0, n_status_differs = 0;
+
+int
+main(int argc, char *argv[])
+{
+    struct epoll_event ev, events[MAX_EVENTS];
+    struct rlimit rl;
+    size_t next = 0;
+    int opt, i, n;
+
+    while ((opt = getopt(argc, argv, "s:t:")) != -1) {
+        switch (opt) {
+        case 's':
+            speed = atof(optarg);
+            break;
+        case 't':
+            timeout_usec = strtoull(optarg, NULL, 10) * 1000;
+            break;
+        default:
+            goto usage;
+        }
+    }
+    if (argc - optind != 3 || speed <= 0) {
+  usage:
+        fprintf(stderr, "Usage: %s [-s <speed>] [-t <timeout msec>] <host> <port> <trace>\n",
+                argv[0]);
+        exit(1);
+    }
+    resolve(argv[optind], argv[optind + 1]);
+    load_trace(argv[optind + 2]);
+    if (n_requests == 0) {
+        fprintf(stderr, "%s: no requests\n", argv[optind + 2]);
+        exit(1);
+    }
+
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0) {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+        getrlimit(RLIMIT_NOFILE, &rl);
+    }
+    max_fd = rl.rlim_cur > 1048576 ? 1048576 : rl.rlim_cur;
+    active = xmalloc(sizeof(struct request*) * max_fd);
+    memset(active, 0, sizeof(struct request*) * max_fd);
+
+    epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (epfd < 0) die("epoll_create1(2)");
+    timerfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK|TFD_CLOEXEC);
+    if (timerfd < 0) die("timerfd_create(2)");
+    ev.events = EPOLLIN;
+    ev.data.ptr = NULL;
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, timerfd, &ev) < 0) die("epoll_ctl(2)");
+
+    replay_start = now_usec() + 1000;
+    for (i = 0; (size_t)i < n_requests; i++) {
+        requests[i].due = replay_start
+            + (unsigned long long)((requests[i].rec->start_usec - requests[0].rec->start_usec) / speed);
+    }
+    set_timer(requests[0].due);
+    while (next < n_requests || n_active > 0) {
+        unsigned long long now;
+
+        n = epoll_wait(epfd, events, MAX_EVENTS, 1000);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            die("epoll_wait(2)");
+        }
+        for (i = 0; i < n; i++) {
+            if (events[i].data.ptr)
+                handle_event(events[i].data.ptr, events[i].events);
+        }
+        now = now_usec();
+        if (next < n_requests && requests[next].due <= now) {
+            unsigned long long expirations;
+
+            if (read(timerfd, &expirations, sizeof expirations) < 0 && errno != EAGAIN)
+                die("read(2)");
+            while (next < n_requests && requests[next].due <= now)
+                start_request(&requests[next++]);
+            if (next < n_requests) set_timer(requests[next].due);
+        }
+        expire_requests(now);
+    }
+    replay_end = now_usec();
+    report();
+    exit(0);
+}
+
+/* Reads the whole trace and orders it by start time.  httpd2 writes
+   the records as requests finish. */
+static void
+load_trace(char *path)
+{
+    struct stat st;
+    char *map, *p, *end;
+    size_t capa = 1024;
+    int fd;
+
+    fd = open(path, O_RDONLY);
+    if (fd < 0) die(path);
+    if (fstat(fd, &st) < 0) die(path);
+    requests = xmalloc(sizeof(struct request) * capa);
+    n_requests = 0;
+    if (st.st_size == 0) return;
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (map == MAP_FAILED) die("mmap(2)");
+    close(fd);
+    p = map;
+    end = map + st.st_size;
+    while (p < end) {
+        struct CaptureRecord *rec;
+
+        if ((size_t)(end - p) < sizeof(struct CaptureRecord)) break;
+        rec = xmalloc(sizeof(struct CaptureRecord));
+        memcpy(rec, p, sizeof(struct CaptureRecord));
+        if (rec->magic != CAPTURE_MAGIC
+            || (size_t)(end - p) < sizeof(struct CaptureRecord) + rec->head_len) {
+            fprintf(stderr, "%s: broken record at offset %ld\n", path, (long)(p - map));
+            exit(1);
+        }
+        if (n_requests == capa) {
+            capa *= 2;
+            requests = realloc(requests, sizeof(struct request) * capa);
+            if (!requests) die("realloc(3)");
+        }
+        memset(&requests[n_requests], 0, sizeof(struct request));
+        requests[n_requests].rec = rec;
+        requests[n_requests].head = p + sizeof(struct CaptureRecord);
+        requests[n_requests].fd = -1;
+        n_requests++;
+        p += sizeof(struct CaptureRecord) + rec->head_len;
+    }
+    qsort(requests, n_requests, sizeof(struct request), cmp_request);
+}
+
+/* By start time; records of the same microsecond keep file order,
+   so a replay of one trace always issues requests in the same order. */
+static int
+cmp_request(const void *a, const void *b)
+{
+    const struct request *x = a, *y = b;
+
+    if (x->rec->start_usec != y->rec->start_usec)
+        return x->rec->start_usec < y->rec->start_usec ? -1 : 1;
+    return x->head < y->head ? -1 : x->head > y->head;
+}
+
+static void
+resolve(char *host, char *port)
+{
+    struct addrinfo hints, *res;
+    int err;
+
+    memset(&hints, 0, sizeof hints);
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    if ((err = getaddrinfo(host, port, &hints, &res)) != 0) {
+        fprintf(stderr, "%s:%s: %s\n", host, port, gai_strerror(err));
+        exit(1);
+    }
+    memcpy(&server_addr, res->ai_addr, res->ai_addrlen);
+    server_addrlen = res->ai_addrlen;
+    freeaddrinfo(res);
+}
+
+static void
+start_request(struct request *r)
+{
+    struct epoll_event ev;
+    int fd;
+
+    r->started = now_usec();
+    fd = socket(server_addr.ss_family, SOCK_STREAM|SOCK_NONBLOCK|SOCK_CLOEXEC, 0);
+    if (fd < 0 || fd >= max_fd) {
+        if (fd >= 0) close(fd);
+        r->fd = -1;
+        finish_request(r, 1);
+        return;
+    }
+    r->fd = fd;
+    r->out_len = r->rec->head_len + 2 + r->rec->body_len;
+    r->out = xmalloc(r->out_len);
+    memcpy(r->out, r->head, r->rec->head_len);
+    memcpy(r->out + r->rec->head_len, "\r\n", 2);
+    memset(r->out + r->rec->head_len + 2, 0, r->rec->body_len);
+    active[fd] = r;
+    n_active++;
+    if (n_active > peak_active) peak_active = n_active;
+    if (connect(fd, (struct sockaddr*)&server_addr, server_addrlen) < 0
+        && errno != EINPROGRESS) {
+        finish_request(r, 1);
+        return;
+    }
+    ev.events = EPOLLOUT;
+    ev.data.ptr = r;
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) < 0) die("epoll_ctl(2)");
+}
+
+static void
+handle_event(struct request *r, unsigned int events)
+{
+    if (!r->connected) {
+        int err = 0;
+        socklen_t len = sizeof err;
+
+        if (getsockopt(r->fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0 || err != 0) {
+            finish_request(r, 1);
+            return;
+        }
+        r->connected = 1;
+    }
+    if (r->out_pos < r->out_len) {
+        send_request(r);
+        return;
+    }
+    if (events & (EPOLLIN|EPOLLHUP|EPOLLERR))
+        receive_response(r);
+}
+
+static void
+send_request(struct request *r)
+{
+    struct epoll_event ev;
+    ssize_t n;
+
+    n = send(r->fd, r->out + r->out_pos, r->out_len - r->out_pos, MSG_NOSIGNAL);
+    if (n < 0) {
+        if (errno != EAGAIN) finish_request(r, 1);
+        return;
+    }
+    r->out_pos += n;
+    if (r->out_pos < r->out_len) return;
+    free(r->out);
+    r->out = NULL;
+    ev.events = EPOLLIN;
+    ev.data.ptr = r;
+    if (epoll_ctl(epfd, EPOLL_CTL_MOD, r->fd, &ev) < 0) die("epoll_ctl(2)");
+}
+
+/* Reads until the server closes the connection, as httpd2 does after
+   each HTTP/1 response. */
+static void
+receive_response(struct request *r)
+{
+    static char buf[READ_BUF_SIZE];
+    ssize_t n;
+
+    for (;;) {
+        n = read(r->fd, buf, sizeof buf);
+        if (n < 0) {
+            if (errno == EAGAIN) return;
+            finish_request(r, 1);
+            return;
+        }
+        if (n == 0) break;
+        if (!r->first_byte) r->first_byte = now_usec();
+        if (r->status_len < sizeof r->status_line - 1) {
+            size_t len = sizeof r->status_line - 1 - r->status_len;
+
+            if ((size_t)n < len) len = n;
+            memcpy(r->status_line + r->status_len, buf, len);
+            r->status_len += len;
+            r->status_line[r->status_len] = '\0';
+        }
+        r->received += n;
+    }
+    if (strncmp(r->status_line, "HTTP/1.", 7) == 0 && r->status_len >= 12)
+        r->status = atoi(r->status_line + 9);
+    finish_request(r, r->status == 0);
+}
+
+static void
+finish_request(struct request *r, int failed)
+{
+    r->done = now_usec();
+    r->failed = failed;
+    if (failed) n_failed++;
+    else if ((unsigned int)r->status != r->rec->status) n_status_differs++;
+    if (r->fd >= 0) {
+        active[r->fd] = NULL;
+        n_active--;
+        close(r->fd);
+        r->fd = -1;
+    }
+    free(r->out);
+    r->out = NULL;
+}
+
+/* Gives up on requests older than the timeout.  Called about once a
+   second at most, so the linear scan is cheap enough. */
+static void
+expire_requests(unsigned long long now)
+{
+    static unsigned long long last = 0;
+    int fd;
+
+    if (now - last < 1000000) return;
+    last = now;
+    for (fd = 0; fd < max_fd && n_active > 0; fd++) {
+        struct request *r = active[fd];
+
+        if (r && now - r->due > timeout_usec) {
+            n_timeout++;
+            finish_request(r, 1);
+        }
+    }
+}
+
+static void
+set_timer(unsigned long long when)
+{
+    struct itimerspec its;
+
+    memset(&its, 0, sizeof its);
+    its.it_value.tv_sec = when / 1000000;
+    its.it_value.tv_nsec = (when % 1000000) * 1000;
+    if (timerfd_settime(timerfd, TFD_TIMER_ABSTIME, &its, NULL) < 0)
+        die("timerfd_settime(2)");
+}
+
+static void
+report(void)
+{
+    unsigned long long *total, *ttfb, *traced, *lag;
+    unsigned long long *starts, *ends;
+    unsigned long long trace_span, trace_end = 0;
+    size_t i, a, b, n = 0;
+    int peak = 0, cur = 0;
+
+    total = xmalloc(sizeof(unsigned long long) * n_requests);
+    ttfb = xmalloc(sizeof(unsigned long long) * n_requests);
+    traced = xmalloc(sizeof(unsigned long long) * n_requests);
+    lag = xmalloc(sizeof(unsigned long long) * n_requests);
+    starts = xmalloc(sizeof(unsigned long long) * n_requests);
+    ends = xmalloc(sizeof(unsigned long long) * n_requests);
+    for (i = 0; i < n_requests; i++) {
+        struct request *r = &requests[i];
+
+        traced[i] = r->rec->duration_usec;
+        starts[i] = r->rec->start_usec;
+        ends[i] = r->rec->start_usec + r->rec->duration_usec;
+        if (ends[i] > trace_end) trace_end = ends[i];
+        if (r->failed) continue;
+        total[n] = r->done - r->due;
+        ttfb[n] = r->first_byte - r->due;
+        n++;
+    }
+    /* the trace's own peak concurrency */
+    qsort(starts, n_requests, sizeof(unsigned long long), cmp_ull);
+    qsort(ends, n_requests, sizeof(unsigned long long), cmp_ull);
+    for (a = b = 0; a < n_requests; ) {
+        if (starts[a] < ends[b]) {
+            if (++cur > peak) peak = cur;
+            a++;
+        }
+        else {
+            cur--;
+            b++;
+        }
+    }
+    trace_span = trace_end - requests[0].rec->start_usec;
+
+    printf("requests: %lu replayed, %lu failed (%lu timed out), %lu with another status than traced\n",
+           (unsigned long)n_requests, n_failed, n_timeout, n_status_differs);
+    printf("duration: trace %.3fs, replay %.3fs at speed %g\n",
+           trace_span / 1e6, (replay_end - replay_start) / 1e6, speed);
+    printf("concurrency: trace peak %d, replay peak %d\n", peak, peak_active);
+    print_percentiles("latency", total, n);
+    print_percentiles("first byte", ttfb, n);
+    print_percentiles("traced", traced, n_requests);
+    for (i = 0; i < n_requests; i++)
+        lag[i] = requests[i].started - requests[i].due;
+    print_percentiles("send lag", lag, n_requests);
+    free(total);
+    free(ttfb);
+    free(traced);
+    free(lag);
+    free(starts);
+    free(ends);
+}
+
+static void
+print_percentiles(const char *label, unsigned long long *v, size_t n)
+{
+    static const double pcts[] = { 50, 90, 99, 99.9 };
+    size_t i;
+
+    printf("%-11s usec:", label);
+    if (n == 0) {
+        printf(" -\n");
+        return;
+    }
+    qsort(v, n, sizeof(unsigned long long), cmp_ull);
+    for (i = 0; i < sizeof pcts / sizeof pcts[0]; i++) {
+        /* nearest rank: the smallest value with p% of all at or below it */
+        double rank = n * pcts[i] / 100;
+        size_t k = (size_t)rank;
+
+        if (k < rank) k++;
+        k = k > 0 ? k - 1 : 0;
+        printf(" p%g=%llu", pcts[i], v[k]);
+    }
+    printf(" max=%llu\n", v[n - 1]);
+}
+
+static int
+cmp_ull(const void *a, const void *b)
+{
+    unsigned long long x = *(const unsigned long long*)a, y = *(const unsigned long long*)b;
+
+    return x < y ? -1 : x > y;
+}
+
+static unsigned long long
+now_usec(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void*
+xmalloc(size_t size)
+{
+    void *p = malloc(size ? size : 1);
+
+    if (!p) die("malloc(3)");
+    return p;
+}
+
+static void
+die(const char *s)
+{
+    perror(s);
+    exit(1);
+}
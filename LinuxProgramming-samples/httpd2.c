@@ -8,27 +8,42 @@
     with or without modification, are permitted.
 */
 
+#define _GNU_SOURCE     /* accept4(2) */
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/time.h>
+#include <sys/mman.h>
 #include <sys/socket.h>
+#include <sys/sendfile.h>
 #include <sys/wait.h>
+#include <sys/prctl.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <netdb.h>
+#include <poll.h>
 #include <fcntl.h>
 #include <errno.h>
 #include <string.h>
+#include <limits.h>
 #include <time.h>
 #include <stdarg.h>
 #include <ctype.h>
 #include <signal.h>
+#include <setjmp.h>
 #include <pwd.h>
 #include <grp.h>
+#include <dirent.h>
 #include <syslog.h>
-#define _GNU_SOURCE
 #include <getopt.h>
+#ifdef SYS_openat2
+# include <linux/openat2.h>
+#endif
+#include <linux/futex.h>
 
 /****** Constants ********************************************************/
 
@@ -37,31 +52,478 @@
 #define HTTP_MINOR_VERSION 0
 #define BLOCK_BUF_SIZE 1024
 #define LINE_BUF_SIZE 4096
+#define IOBUF_SIZE (16 * 1024)
+#define IOBUF_SLAB_COUNT 16     /* buffers allocated at once */
+#define INLINE_BUF_SIZE 256
+#define HIST_BUCKETS 976        /* 16 sub-buckets for each power of 2 */
 #define MAX_REQUEST_BODY_LENGTH (1024 * 1024)
-#define MAX_BACKLOG 5
+#define DEFAULT_BACKLOG 128
+#define ACCEPT_BATCH_MAX 64
+#define H2_PREFACE "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n"
+#define H2_PREFACE_LEN 24
+#define H2_UPGRADE_RESPONSE \
+    "HTTP/1.1 101 Switching Protocols\r\nConnection: Upgrade\r\nUpgrade: h2c\r\n\r\n"
+#define H2_FRAME_HEADER_SIZE 9
+#define H2_DEFAULT_FRAME_SIZE 16384
+#define H2_DEFAULT_WINDOW 65535
+#define H2_MAX_STREAMS 128      /* concurrent streams per connection */
+#define H2_HEADER_TABLE_SIZE 4096
+#define H2_MAX_HEADER_BLOCK (64 * 1024)
+#define H2_STREAM_BUFFER (32 * 1024)    /* body held back per stream */
+#define WORKER_MAX_CONNECTIONS 10000    /* then the worker is replaced */
+#define CONN_TIMEOUT_MSEC 30000
 #define DEFAULT_PORT "80"
+#define CONFIG_MAX_ARGS 12
+#define RATE_KEY_BUSY (~0ULL)
+#define TOO_MANY_REQUESTS_BODY \
+    "<html><header><title>Too Many Requests</title></header>" \
+    "<body><p>Too many requests</p></body></html>\r\n"
+#define MAX_HOSTNAME 256
+#define FILE_CACHE_SLOTS 4096   /* shared by all hosts, power of 2 */
+#define FILE_CACHE_PATH_MAX 256
+#define SEQLOCK_RETRIES 4
+#define FILE_CACHE_TTL 1        /* seconds */
+#define INDEX_FILE "index.html"
+#define LISTING_CACHE_SIZE 16   /* rendered listings per process */
+#define DIRENT_BUF_SIZE (64 * 1024)
+#define RATE_SHARDS 64
+#define RATE_PROBE 8            /* slots looked at per lookup */
+#define RATE_SWEEP_STEP 32      /* slots swept per accepted connection */
+#define RATE_IDLE_MSEC 60000
+#define RATE_DEFAULT_SLOTS 65536
+#define FLIGHT_SLOTS 64
+#define FLIGHT_PATH_MAX 256
+#define FLIGHT_BODY_MAX (256 * 1024)
+#define FLIGHT_GRACE_MSEC 1000  /* how long a finished fill is shared */
+#define FLIGHT_WAIT_MSEC 5000   /* how long to wait for someone's fill */
+#define PACK_MAGIC "HTTPPACK"
+#define PACK_VERSION 1
+#define HOT_SLOTS 1024
+#define HOT_PATH_MAX 256
+#define WARMUP_HOT_MARK 64      /* captured entries marked "hot" */
+#define WARMUP_MLOCK_DEFAULT (64 * 1024 * 1024)
+#define CAPTURE_MAGIC 0x31435448    /* "HTC1" */
+#define CAPTURE_HEAD_MAX 8192
+#ifndef IOPRIO_CLASS_SHIFT
+# define IOPRIO_CLASS_SHIFT 13
+# define IOPRIO_CLASS_IDLE 3
+# define IOPRIO_WHO_PROCESS 1
+#endif
 
 /****** Data Type Definitions ********************************************/
 
+/* A pooled I/O buffer.  Connections lease one only while they have
+   more data in flight than fits in their small inline buffer. */
+struct IOBuf {
+    struct IOBuf *next;     /* free list */
+    char data[IOBUF_SIZE];
+};
+
+struct Connection {
+    int fd;
+    char *rbuf;             /* inline_buf or rlease->data */
+    size_t rcapa;
+    size_t rpos;
+    size_t rlen;
+    struct IOBuf *rlease;
+    struct IOBuf *wlease;
+    size_t wlen;
+    struct H2Session *h2;   /* non-NULL once the client spoke HTTP/2 */
+    char inline_buf[INLINE_BUF_SIZE];
+};
+
+/* HTTP/2 frame types, flags, settings and error codes */
+enum H2FrameType {
+    H2_DATA = 0,
+    H2_HEADERS,
+    H2_PRIORITY,
+    H2_RST_STREAM,
+    H2_SETTINGS,
+    H2_PUSH_PROMISE,
+    H2_PING,
+    H2_GOAWAY,
+    H2_WINDOW_UPDATE,
+    H2_CONTINUATION
+};
+
+#define H2_END_STREAM       0x01
+#define H2_ACK              0x01
+#define H2_END_HEADERS      0x04
+#define H2_PADDED           0x08
+#define H2_PRIORITY_FLAG    0x20
+
+#define H2_SETTINGS_ENABLE_PUSH             2
+#define H2_SETTINGS_MAX_CONCURRENT_STREAMS  3
+#define H2_SETTINGS_INITIAL_WINDOW_SIZE     4
+#define H2_SETTINGS_MAX_FRAME_SIZE          5
+
+#define H2_NO_ERROR             0x0
+#define H2_PROTOCOL_ERROR       0x1
+#define H2_FLOW_CONTROL_ERROR   0x3
+#define H2_FRAME_SIZE_ERROR     0x6
+#define H2_REFUSED_STREAM       0x7
+#define H2_COMPRESSION_ERROR    0x9
+#define H2_ENHANCE_YOUR_CALM    0xb
+
+struct H2Buffer {
+    char *ptr;
+    size_t len;
+    size_t capa;
+};
+
+struct HPackEntry {
+    char *name;
+    char *value;
+    size_t size;            /* as RFC 7541 counts it */
+};
+
+/* The HPACK dynamic table, a ring with the newest entry at head. */
+struct HPackTable {
+    struct HPackEntry *entries;
+    int capa;
+    int head;
+    int count;
+    size_t size;
+    size_t max_size;
+};
+
+struct H2Stream {
+    unsigned int id;
+    struct HTTPRequest *req;
+    size_t body_len;
+    long send_window;
+    int ready;              /* request complete, queued */
+    int reset;
+    int answered;           /* the handler is done */
+    int ended;              /* END_STREAM sent */
+    struct H2Buffer out;    /* body not sent yet: these bytes, */
+    size_t out_pos;
+    int file_fd;            /* then file_len bytes of this file, or -1 */
+    off_t file_offset;
+    size_t file_len;
+    struct H2Stream *next;
+    struct H2Stream *next_ready;
+};
+
+struct H2Session {
+    struct H2Stream *streams;
+    int n_streams;
+    struct H2Stream *ready_head;
+    struct H2Stream *ready_tail;
+    struct H2Stream *current;       /* being answered */
+    struct HPackTable decoder;
+    long send_window;               /* connection flow control window */
+    unsigned long peer_window;      /* SETTINGS_INITIAL_WINDOW_SIZE */
+    unsigned long peer_max_frame;
+    unsigned int last_stream_id;
+    int goaway;
+    struct H2Buffer hblock;         /* header block being received */
+    unsigned int hblock_stream;
+    int hblock_end_stream;
+    struct H2Buffer resp_head;      /* HTTP/1 response header so far */
+    int resp_body;                  /* header sent, the rest is body */
+};
+
 struct HTTPHeaderField {
     char *name;
     char *value;
     struct HTTPHeaderField *next;
 };
 
+enum HTTPMethod {
+    METHOD_UNKNOWN = 0,
+    METHOD_GET,
+    METHOD_HEAD,
+    METHOD_POST,
+    METHOD_PUT,
+    METHOD_DELETE,
+    METHOD_OPTIONS,
+    METHOD_TRACE
+};
+
+/* Request phases, in the order they happen. */
+enum Phase {
+    PHASE_READ,         /* reading and parsing the request */
+    PHASE_ROUTE,        /* Host: and route lookup */
+    PHASE_OPEN,         /* resolving and opening the file */
+    PHASE_SEND,         /* writing the response */
+    PHASE_TOTAL,
+    N_PHASES
+};
+
 struct HTTPRequest {
     int protocol_minor_version;
     char *method;
+    enum HTTPMethod method_id;
     char *path;
     struct HTTPHeaderField *header;
     char *body;
     long length;
+    struct VirtualHost *vhost;
+    int status;
+    unsigned long bytes_sent;
+    unsigned long long trace_start;
+    unsigned long long trace_mark[N_PHASES];    /* 0 if phase was skipped */
 };
 
 struct FileInfo {
-    char *path;
+    char *path;     /* relative to the docroot fd */
+    int fd;         /* open file when ok, -1 otherwise */
     long size;
     int ok;
+    int is_dir;     /* path is a directory: ok if it has an index file,
+                       else fd is the directory itself */
+};
+
+enum RouteType {
+    ROUTE_STATIC,
+    ROUTE_PROXY,
+    ROUTE_STATS,
+    ROUTE_REDIRECT,
+    ROUTE_PACK
+};
+
+/* The archive written by mkpack.  These must match mkpack.c. */
+struct PackHeader {
+    char magic[8];
+    unsigned int version;
+    unsigned int n_entries;
+    unsigned long long index_offset;
+    unsigned long long strings_offset;
+    unsigned long long strings_size;
+};
+
+struct PackEntry {
+    unsigned int path;              /* offsets into the string table */
+    unsigned int path_len;
+    unsigned int content_type;
+    unsigned int etag;
+    unsigned int gzip_etag;
+    unsigned int pad;
+    unsigned long long body_offset;
+    unsigned long long body_size;
+    unsigned long long gzip_offset; /* 0 if there is no .gz variant */
+    unsigned long long gzip_size;
+    long long mtime;
+};
+
+/* A pack file mapped at startup.  Bodies are not touched through the
+   mapping but sent with sendfile(2) from fd. */
+struct Pack {
+    char *path;
+    int fd;
+    char *map;
+    size_t size;
+    unsigned int n_entries;
+    struct PackEntry *index;
+    char *strings;
+};
+
+struct Route;
+typedef void (*route_handler)(struct HTTPRequest *req, struct Connection *conn, struct Route *route);
+
+struct Route {
+    char *prefix;
+    size_t prefixlen;
+    enum RouteType type;
+    char *arg;              /* docroot, upstream or redirect target */
+    int dirfd;              /* ROUTE_STATIC only */
+    int autoindex;          /* ROUTE_STATIC: list directories */
+    struct Pack *pack;      /* ROUTE_PACK only */
+    char *upstream_host;    /* ROUTE_PROXY only */
+    char *upstream_port;
+    route_handler handler;
+    struct Route *next;     /* in definition order, for the stats page */
+};
+
+/* A node of the compressed (radix) trie of route prefixes.
+   Children are kept sorted by the first byte of their label,
+   so a lookup is one binary search per node. */
+struct RouteNode {
+    char *label;
+    size_t len;
+    struct Route *route;
+    int n_children;
+    unsigned char *keys;
+    struct RouteNode **children;
+};
+
+/* Per-host counters, in the shared segment. */
+struct HostStats {
+    unsigned long requests;
+    unsigned long bytes_sent;
+    unsigned long status[6];    /* indexed by status code / 100 */
+};
+
+/* A slot of the file metadata cache.  seq is a sequence lock, odd
+   while a writer updates the slot: readers copy the slot and retry if
+   seq moved meanwhile, writers take it with one CAS or give up, since
+   a lost update costs no more than a miss. */
+struct FileCacheEntry {
+    unsigned int seq;
+    int dirfd;
+    unsigned long hash;
+    int ok;
+    int is_dir;
+    time_t expire;
+    char path[FILE_CACHE_PATH_MAX];
+};
+
+/* The segment shared by the server and all of its children.  It is
+   mapped before the first fork(), so a path one process has looked up
+   need not be looked up again by the others. */
+struct SharedArea {
+    unsigned long cache_hits;       /* negative or directory: saved syscalls */
+    unsigned long cache_rechecked;  /* a file: opened and fstat()ed anyway */
+    unsigned long cache_misses;
+    struct FileCacheEntry cache[FILE_CACHE_SLOTS];
+    struct HostStats hosts[];   /* one per virtual host */
+};
+
+/* A rendered directory listing.  Adding, removing or renaming an
+   entry changes the directory's mtime and ctime, so the HTML stays
+   valid as long as they and the inode are the same. */
+struct DirListing {
+    char *urlpath;          /* the listing shows it */
+    dev_t dev;
+    ino_t ino;              /* 0 if the slot must not be reused */
+    struct timespec mtime;
+    struct timespec ctime;
+    char *html;
+    size_t len;
+};
+
+/* struct linux_dirent64 of getdents64(2) */
+struct LinuxDirent64 {
+    unsigned long long d_ino;
+    long long d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+};
+
+/* A client's pair of token buckets.  Each bucket is one 64bit word,
+   (tokens << 32 | msec stamp), so it is updated by a single CAS.
+   Request tokens are counted in 1/1000 requests; byte tokens may go
+   negative, since bytes are charged after they are sent. */
+struct RateSlot {
+    unsigned long long key;     /* hash of the client address, 0 if free,
+                                   RATE_KEY_BUSY while being set up */
+    unsigned long long requests;
+    unsigned long long bytes;
+    unsigned int ref;           /* CLOCK reference bit */
+    unsigned int pad;
+};
+
+struct RateShard {
+    struct RateSlot *slots;
+};
+
+struct RateLimit {
+    unsigned long req_rate;     /* per second */
+    unsigned long req_burst;
+    unsigned long byte_rate;    /* per second, 0 for no limit */
+    unsigned long byte_burst;
+    unsigned long slots_per_shard;  /* power of 2 */
+    struct RateShard *shards;   /* in shared memory */
+    unsigned long sweep;        /* the CLOCK hand, per process */
+};
+
+/* A single-flight slot.  word holds the state in its low 2 bits and
+   the number of processes using the result above them; it doubles as
+   the futex that waiters sleep on. */
+#define FLIGHT_EMPTY    0
+#define FLIGHT_FILLING  1
+#define FLIGHT_DONE     2
+#define FLIGHT_STATE(w) ((w) & 3)
+#define FLIGHT_READERS(w) ((w) >> 2)
+#define FLIGHT_READER   4
+
+struct FlightSlot {
+    unsigned int word;
+    unsigned int stamp;         /* msec when filling started / finished */
+    pid_t owner;
+    int dirfd;
+    unsigned long hash;
+    char path[FLIGHT_PATH_MAX];
+    int ok;
+    int is_dir;
+    int has_body;
+    long size;
+    char body[FLIGHT_BODY_MAX];
+};
+
+/* A log-linear (HDR style) latency histogram in nanoseconds:
+   values below 16 have their own bucket, larger ones 16 buckets per
+   power of 2, i.e. about 6% precision over the whole 64bit range. */
+struct Histogram {
+    unsigned long count;
+    unsigned long long max;
+    unsigned long buckets[HIST_BUCKETS];
+};
+
+/* A captured request, followed by head_len bytes of request line and
+   header fields, each ending with CRLF.  This must match
+   httpd2-replay.c. */
+struct CaptureRecord {
+    unsigned int magic;
+    unsigned int head_len;
+    unsigned long long start_usec;  /* wall clock, when reading began */
+    unsigned int duration_usec;
+    unsigned int body_len;          /* the body itself is not kept */
+    unsigned long long bytes_sent;
+    unsigned int pid;
+    unsigned int status;
+};
+
+struct TraceArea {
+    struct Histogram phases[N_PHASES];
+    unsigned long slow_seen;
+};
+
+/* A listening socket and the options it was configured with. */
+struct Listener {
+    char *spec;             /* [<addr>:]<port> as written */
+    int fd;
+    int backlog;
+    int defer_accept;       /* seconds, 0 for off */
+    int fastopen;           /* queue length, 0 for off */
+    int nodelay;
+    int cork;
+    int sndbuf;             /* 0 for the system default */
+    int rcvbuf;
+    int v6only;
+    struct Listener *next;
+};
+
+/* An accepted connection not yet handed to anyone. */
+struct Client {
+    int fd;
+    struct Listener *listener;
+    struct sockaddr_storage addr;
+};
+
+/* A request counter for the warm-up manifest.  The table is direct
+   mapped: a hit on another path wears the count down, and the path
+   with the count at zero takes the slot over, so the paths that stay
+   are the frequent ones. */
+struct HotSlot {
+    unsigned long hash;         /* 0 if free */
+    long hits;
+    struct VirtualHost *vhost;  /* same address in every child */
+    char path[HOT_PATH_MAX];
+};
+
+struct VirtualHost {
+    char *name;                 /* canonical (first) name */
+    char **names;               /* the name and its aliases */
+    int n_names;
+    char *docroot;
+    int docroot_fd;
+    struct RouteNode *route_root;
+    struct Route *routes;
+    struct HostStats *stats;
+    struct VirtualHost *next;
 };
 
 /****** Function Prototypes **********************************************/
@@ -73,41 +535,242 @@ static void trap_signal(int sig, sighandler_t handler);
 static void signal_exit(int sig);
 static void wait_child(int sig);
 static void become_daemon(void);
-static int listen_socket(char *port);
-static void server_main(int server, char *docroot);
-static void service(FILE *in, FILE *out, char *docroot);
-static struct HTTPRequest* read_request(FILE *in);
-static void read_request_line(struct HTTPRequest *req, FILE *in);
-static struct HTTPHeaderField* read_header_field(FILE *in);
+static void add_listener(char *spec, char **opts, int n);
+static void open_listeners(void);
+static int listen_socket(struct Listener *l, char *host, char *port, int family);
+static int accept_clients(struct Client *clients, int max);
+static void setup_client_socket(struct Listener *l, int sock);
+static void server_main(void);
+static void supervise_workers(void);
+static pid_t spawn_worker(void);
+static void worker_main(void);
+static int serve_client(struct Client *client);
+static void load_config(char *path);
+static struct VirtualHost* new_vhost(char *names, char *docroot);
+static void setup_vhosts(void);
+static void setup_shared(int n_hosts);
+static struct VirtualHost* lookup_vhost(char *host);
+static unsigned long hash_string(const char *str, size_t len);
+static int open_docroot(char *path);
+static void count_stat(unsigned long *counter, unsigned long n);
+static void count_bytes_sent(struct HTTPRequest *req, unsigned long n);
+static void setup_ratelimit(char **args, int n);
+static struct RateSlot* rate_slot(struct sockaddr *addr, int create);
+static unsigned long long rate_key(struct sockaddr *addr);
+static int bucket_take(unsigned long long *bucket, unsigned long rate,
+                       unsigned long burst, long cost, unsigned int now, int must_have);
+static void init_rate_slot(struct RateSlot *slot, unsigned int now);
+static int rate_admit(struct sockaddr *addr);
+static int rate_request(struct sockaddr *addr);
+static void rate_charge(struct sockaddr *addr, unsigned long bytes);
+static void rate_sweep(void);
+static unsigned int msec_now(void);
+static void reject_client(int sock);
+static void too_many_requests_response(struct HTTPRequest *req, struct Connection *conn);
+static void add_route(struct VirtualHost *vhost, char *prefix, char *type, char *arg);
+static struct RouteNode* new_route_node(const char *label, size_t len);
+static void insert_route(struct RouteNode *node, const char *key, struct Route *route);
+static struct RouteNode* find_route_child(struct RouteNode *node, unsigned char c);
+static void add_route_child(struct RouteNode *node, struct RouteNode *child);
+static struct Route* lookup_route(struct RouteNode *node, const char *path);
+static struct Pack* open_pack(char *path);
+static struct PackEntry* lookup_pack(struct Pack *pack, const char *path);
+static struct PackEntry* find_pack_entry(struct Pack *pack, char *urlpath);
+static void setup_flights(void);
+static struct FlightSlot* flight_join(int dirfd, char *path, int *leader);
+static void flight_publish(struct FlightSlot *slot, struct FileInfo *info);
+static void flight_leave(struct FlightSlot *slot);
+static void flight_abandon(void);
+static void futex_wait(unsigned int *addr, unsigned int val, unsigned int msec);
+static void futex_wake(unsigned int *addr);
+static void conn_init(struct Connection *conn, int fd);
+static void conn_close(struct Connection *conn);
+static void conn_abort(struct Connection *conn);
+static void wait_socket(int fd, short events);
+static struct IOBuf* iobuf_lease(void);
+static void iobuf_return(struct IOBuf *buf);
+static int conn_fill(struct Connection *conn);
+static char* conn_gets(struct Connection *conn, char *buf, size_t size);
+static size_t conn_read(struct Connection *conn, char *buf, size_t size);
+static void conn_release_input(struct Connection *conn);
+static char* conn_wspace(struct Connection *conn, size_t *space);
+static void conn_write(struct Connection *conn, const char *buf, size_t len);
+static void conn_printf(struct Connection *conn, const char *fmt, ...);
+static int conn_flush(struct Connection *conn);
+static void conn_send_raw(struct Connection *conn, const void *buf, size_t len, int flags);
+static void h2_serve(struct Connection *conn, struct sockaddr *addr, struct HTTPRequest *upgraded);
+static void h2_session_free(struct H2Session *s);
+static int h2_preface_ahead(struct Connection *conn);
+static int h2_wait_idle(struct Connection *conn);
+static int h2_upgrade_requested(struct HTTPRequest *req);
+static void h2_drop_upgrade_fields(struct HTTPRequest *req);
+static void h2_apply_upgrade_settings(struct Connection *conn, char *settings64);
+static struct H2Stream* h2_new_stream(struct H2Session *s, unsigned int id, struct HTTPRequest *req);
+static struct H2Stream* h2_find_stream(struct H2Session *s, unsigned int id);
+static void h2_free_stream(struct H2Session *s, struct H2Stream *st);
+static void h2_queue_stream(struct H2Session *s, struct H2Stream *st);
+static void h2_answer(struct Connection *conn, struct H2Stream *st, struct sockaddr *addr);
+static void h2_end_response(struct Connection *conn);
+static void h2_output(struct Connection *conn, const char *data, size_t len);
+static void h2_send_response_header(struct Connection *conn, struct H2Stream *st, char *head, size_t len);
+static void h2_write_headers(struct Connection *conn, struct H2Stream *st,
+                             const unsigned char *block, size_t len, int flags);
+static void h2_send_data(struct Connection *conn, struct H2Stream *st, const char *data, size_t len);
+static void h2_send_file(struct Connection *conn, int fd, off_t offset, size_t len);
+static size_t h2_pending(struct H2Stream *st);
+static void h2_drain(struct Connection *conn, struct H2Stream *st, size_t limit);
+static int h2_pump(struct Connection *conn);
+static void h2_write_body(struct Connection *conn, struct H2Stream *st, size_t len, int flags);
+static void h2_drop_body(struct H2Stream *st);
+static int h2_frame_ahead(struct Connection *conn);
+static void h2_frame_header(unsigned char *p, size_t len, int type, int flags, unsigned int id);
+static void h2_write_frame(struct Connection *conn, int type, int flags, unsigned int id,
+                           const void *payload, size_t len);
+static void h2_rst_stream(struct Connection *conn, unsigned int id, unsigned int code);
+static void h2_window_update(struct Connection *conn, unsigned int id, unsigned long inc);
+static void h2_goaway(struct Connection *conn, unsigned int code);
+static void h2_fail(struct Connection *conn, unsigned int code, const char *msg);
+static int h2_read_frame(struct Connection *conn);
+static void h2_handle_frame(struct Connection *conn, int type, int flags, unsigned int id,
+                            unsigned char *p, size_t len);
+static void h2_apply_settings(struct Connection *conn, unsigned char *p, size_t len);
+static void h2_end_headers(struct Connection *conn);
+static void h2_add_field(struct HTTPRequest *req, char *name, char *value);
+static void h2_buffer_append(struct H2Buffer *b, const void *data, size_t len);
+static void h2_buffer_putc(struct H2Buffer *b, int c);
+static void hpack_build_huffman_tree(void);
+static long hpack_huffman_decode(const unsigned char *src, size_t len, char *dst, size_t size);
+static long hpack_decode_int(const unsigned char **pp, const unsigned char *end, int n);
+static char* hpack_decode_string(const unsigned char **pp, const unsigned char *end);
+static void hpack_evict(struct HPackTable *t, size_t size);
+static void hpack_add(struct HPackTable *t, char *name, char *value);
+static int hpack_lookup(struct HPackTable *t, long index, const char **name, const char **value);
+static int hpack_decode_block(struct HPackTable *t, const unsigned char *p, size_t len,
+                              struct HTTPRequest *req);
+static void hpack_encode_int(struct H2Buffer *b, unsigned long v, int n, unsigned char first);
+static void hpack_encode_string(struct H2Buffer *b, const char *str, size_t len);
+static void put_be16(unsigned char *p, unsigned int v);
+static void put_be32(unsigned char *p, unsigned long v);
+static unsigned int get_be16(const unsigned char *p);
+static unsigned long get_be32(const unsigned char *p);
+static void setup_trace(void);
+static void setup_hot(void);
+static void open_warmup(char *path);
+static void count_hit(struct HTTPRequest *req);
+static int cmp_hot_slot(const void *a, const void *b);
+static void output_manifest(struct Connection *conn);
+static void start_warmup(void);
+static void warmup_entry(struct VirtualHost *vhost, char *path, int hot);
+static void warmup_range(int fd, char *map, off_t offset, size_t len, int hot);
+static unsigned long long trace_now(void);
+static void open_capture(char *path);
+static void capture_request(struct HTTPRequest *req, unsigned long long total_ns);
+static void trace_mark(struct HTTPRequest *req, enum Phase phase);
+static void trace_finish(struct HTTPRequest *req);
+static int hist_bucket(unsigned long long v);
+static unsigned long long hist_value(int bucket);
+static void hist_add(struct Histogram *hist, unsigned long long v);
+static unsigned long long hist_percentile(struct Histogram *hist, double pct);
+static void service(struct Connection *conn, struct sockaddr *addr);
+static void process_request(struct HTTPRequest *req, struct Connection *conn, struct sockaddr *addr);
+static struct HTTPRequest* read_request(struct Connection *conn);
+static void read_request_line(struct HTTPRequest *req, struct Connection *conn);
+static struct HTTPHeaderField* read_header_field(struct Connection *conn);
 static void upcase(char *str);
+static enum HTTPMethod intern_method(const char *name);
 static void free_request(struct HTTPRequest *req);
 static long content_length(struct HTTPRequest *req);
 static char* lookup_header_field_value(struct HTTPRequest *req, char *name);
-static void respond_to(struct HTTPRequest *req, FILE *out, char *docroot);
-static void do_file_response(struct HTTPRequest *req, FILE *out, char *docroot);
-static void method_not_allowed(struct HTTPRequest *req, FILE *out);
-static void not_implemented(struct HTTPRequest *req, FILE *out);
-static void not_found(struct HTTPRequest *req, FILE *out);
-static void output_common_header_fields(struct HTTPRequest *req, FILE *out, char *status);
-static struct FileInfo* get_fileinfo(char *docroot, char *path);
-static char* build_fspath(char *docroot, char *path);
+static void respond_to(struct HTTPRequest *req, struct Connection *conn);
+static void do_file_response(struct HTTPRequest *req, struct Connection *conn, struct Route *route);
+static void output_file_header_fields(struct HTTPRequest *req, struct Connection *conn, long size, char *path);
+static void output_file_body(struct HTTPRequest *req, struct Connection *conn, struct FileInfo *info);
+static void redirect_to_directory(struct HTTPRequest *req, struct Connection *conn);
+static void do_listing_response(struct HTTPRequest *req, struct Connection *conn, struct FileInfo *info);
+static struct DirListing* get_listing(int fd, char *urlpath);
+static int render_listing(int fd, char *urlpath, struct H2Buffer *out);
+static int cmp_name(const void *a, const void *b);
+static void put_string(struct H2Buffer *b, const char *str);
+static void put_html(struct H2Buffer *b, const char *str);
+static void put_url(struct H2Buffer *b, const char *str);
+static void do_proxy_response(struct HTTPRequest *req, struct Connection *conn, struct Route *route);
+static void do_stats_response(struct HTTPRequest *req, struct Connection *conn, struct Route *route);
+static void do_redirect_response(struct HTTPRequest *req, struct Connection *conn, struct Route *route);
+static void do_pack_response(struct HTTPRequest *req, struct Connection *conn, struct Route *route);
+static int etag_matches(char *list, const char *etag);
+static int accepts_gzip(struct HTTPRequest *req);
+static void send_file_range(struct HTTPRequest *req, struct Connection *conn,
+                            int fd, off_t offset, size_t len);
+static int open_upstream(char *host, char *port);
+static void method_not_allowed(struct HTTPRequest *req, struct Connection *conn);
+static void not_implemented(struct HTTPRequest *req, struct Connection *conn);
+static void not_found(struct HTTPRequest *req, struct Connection *conn);
+static void bad_gateway(struct HTTPRequest *req, struct Connection *conn);
+static void output_common_header_fields(struct HTTPRequest *req, struct Connection *conn, char *status);
+static struct FileInfo* get_fileinfo(int dirfd, char *path, int use_cache);
+static int file_cache_get(int dirfd, const char *path, unsigned long h,
+                          struct FileCacheEntry *copy);
+static void file_cache_put(int dirfd, const char *path, unsigned long h,
+                           struct FileInfo *info, time_t expire);
+static int open_index(struct FileInfo *info);
+static char* index_path(const char *dir);
+static int open_beneath(int dirfd, char *path);
+static int normalize_path(const char *src, char *dst, size_t size);
 static void free_fileinfo(struct FileInfo *info);
-static char* guess_content_type(struct FileInfo *info);
+static char* guess_content_type(char *path);
+static char* xstrdup(const char *str);
 static void* xmalloc(size_t sz);
+static void* xrealloc(void *ptr, size_t sz);
 static void log_exit(const char *fmt, ...);
+static void log_warn(const char *fmt, ...);
 
 /****** Functions ********************************************************/
 
-#define USAGE "Usage: %s [--port=n] [--chroot --user=u --group=g] [--debug] <docroot>\n"
+#define USAGE "Usage: %s [--port=n] [--chroot --user=u --group=g] [--config=file] [--pack=file] [--warmup=file] [--workers=n] [--capture=file] [--autoindex] [--debug] [<docroot>]\n"
 
 static int debug_mode = 0;
+static int autoindex_mode = 0;
+static time_t server_started;
+static struct VirtualHost *vhosts = NULL;        /* in definition order */
+static struct VirtualHost *default_vhost = NULL;
+static struct VirtualHost **vhost_table = NULL;  /* open addressing, by name */
+static unsigned long vhost_mask;
+static struct RateLimit *ratelimit = NULL;
+static char *too_many_requests;                  /* pre-rendered response */
+static size_t too_many_requests_len;
+static struct FlightSlot *flights = NULL;        /* in shared memory */
+static struct FlightSlot *flight_held = NULL;    /* joined by this request */
+static struct IOBuf *iobuf_free = NULL;
+static struct SharedArea *shared = NULL;
+static struct DirListing listings[LISTING_CACHE_SIZE];  /* per process */
+static struct TraceArea *trace_area = NULL;      /* in shared memory */
+static double trace_ns_per_tick = 1.0;
+static unsigned long slow_msec = 0;              /* 0: no slow request log */
+static unsigned long slow_sample = 1;
+static int capture_fd = -1;
+static const char *phase_names[N_PHASES] = { "read", "route", "open", "send", "total" };
+static struct Listener *listeners = NULL;
+static int n_workers = 0;                        /* 0: a child per connection */
+static int accept_batch = 1;                     /* adapts to the load */
+static sigjmp_buf request_abort;                 /* workers: log_exit() lands here */
+static volatile int request_abort_armed = 0;
+static struct HotSlot *hot_slots = NULL;         /* in shared memory */
+static FILE *warmup_file = NULL;
+static unsigned long warmup_mlock_max = WARMUP_MLOCK_DEFAULT;
+static unsigned long warmup_locked = 0;          /* warm-up process only */
 
 static struct option longopts[] = {
     {"debug",  no_argument,       &debug_mode, 1},
+    {"autoindex", no_argument,    &autoindex_mode, 1},
     {"chroot", no_argument,       NULL, 'c'},
     {"user",   required_argument, NULL, 'u'},
     {"group",  required_argument, NULL, 'g'},
     {"port",   required_argument, NULL, 'p'},
+    {"config", required_argument, NULL, 'f'},
+    {"pack",   required_argument, NULL, 'k'},
+    {"warmup", required_argument, NULL, 'w'},
+    {"workers", required_argument, NULL, 'n'},
+    {"capture", required_argument, NULL, 't'},
     {"help",   no_argument,       NULL, 'h'},
     {0, 0, 0, 0}
 };
@@ -115,9 +778,10 @@ static struct option longopts[] = {
 int
 main(int argc, char *argv[])
 {
-    int server;
     char *port = NULL;
-    char *docroot;
+    char *docroot = NULL;
+    char *config = NULL;
+    char *pack = NULL;
     int do_chroot = 0;
     char *user = NULL;
     char *group = NULL;
@@ -139,6 +803,21 @@ main(int argc, char *argv[])
         case 'p':
             port = optarg;
             break;
+        case 'f':
+            config = optarg;
+            break;
+        case 'k':
+            pack = optarg;
+            break;
+        case 'w':
+            open_warmup(optarg);
+            break;
+        case 'n':
+            n_workers = atoi(optarg);
+            break;
+        case 't':
+            open_capture(optarg);
+            break;
         case 'h':
             fprintf(stdout, USAGE, argv[0]);
             exit(0);
@@ -147,23 +826,43 @@ main(int argc, char *argv[])
             exit(1);
         }
     }
-    if (optind != argc - 1) {
+    if (optind == argc - 1) {
+        docroot = argv[optind];
+    }
+    else if (optind != argc || (!config && !pack)) {
         fprintf(stderr, USAGE, argv[0]);
         exit(1);
     }
-    docroot = argv[optind];
 
     if (do_chroot) {
+        if (!docroot) {
+            fprintf(stderr, "--chroot requires <docroot>\n");
+            exit(1);
+        }
         setup_environment(docroot, user, group);
-        docroot = "";
+        docroot = "/";
     }
+    default_vhost = new_vhost("*", docroot);
+    if (config) load_config(config);
+    if (pack && !lookup_route(default_vhost->route_root, "/"))
+        add_route(default_vhost, "/", "pack", pack);
+    if (docroot && !lookup_route(default_vhost->route_root, "/"))
+        add_route(default_vhost, "/", autoindex_mode ? "autoindex" : "static", NULL);
+    setup_vhosts();
+    setup_flights();
+    setup_trace();
+    setup_hot();
+    if (port || !listeners)
+        add_listener(port ? port : DEFAULT_PORT, NULL, 0);
+    server_started = time(NULL);
     install_signal_handlers();
-    server = listen_socket(port);
+    open_listeners();
     if (!debug_mode) {
         openlog(SERVER_NAME, LOG_PID|LOG_NDELAY, LOG_DAEMON);
         become_daemon();
     }
-    server_main(server, docroot);
+    if (warmup_file) start_warmup();
+    server_main();
     exit(0);
 }
 
@@ -240,6 +939,7 @@ trap_signal(int sig, sighandler_t handler)
 static void
 signal_exit(int sig)
 {
+    request_abort_armed = 0;
     log_exit("exit by signal %d", sig);
 }
 
@@ -249,310 +949,4207 @@ wait_child(int sig)
     wait(NULL);
 }
 
+/* Adds a listener.  spec is "<port>", "<addr>:<port>", "[<v6addr>]:<port>"
+   or "*:<port>"; without an address the listener is a dual-stack IPv6
+   socket, or plain IPv4 where IPv6 is not available.  Options are
+
+       backlog=<n>      listen(2) backlog
+       defer=<sec>      TCP_DEFER_ACCEPT: wake up only when data arrives
+       fastopen=<qlen>  TCP_FASTOPEN
+       nodelay          TCP_NODELAY on accepted sockets
+       cork             TCP_CORK on accepted sockets (headers and body
+                        go out in full segments)
+       sndbuf=<bytes>   SO_SNDBUF
+       rcvbuf=<bytes>   SO_RCVBUF
+       v6only           IPV6_V6ONLY, no IPv4-mapped addresses */
+static void
+add_listener(char *spec, char **opts, int n)
+{
+    struct Listener *l, **tail;
+    int i;
+
+    l = xmalloc(sizeof(struct Listener));
+    memset(l, 0, sizeof(struct Listener));
+    l->spec = xstrdup(spec);
+    l->fd = -1;
+    l->backlog = DEFAULT_BACKLOG;
+    for (i = 0; i < n; i++) {
+        char *val = strchr(opts[i], '=');
+
+        if (val) val++;
+        if (strncmp(opts[i], "backlog=", 8) == 0)
+            l->backlog = atoi(val);
+        else if (strncmp(opts[i], "defer=", 6) == 0)
+            l->defer_accept = atoi(val);
+        else if (strncmp(opts[i], "fastopen=", 9) == 0)
+            l->fastopen = atoi(val);
+        else if (strcmp(opts[i], "nodelay") == 0)
+            l->nodelay = 1;
+        else if (strcmp(opts[i], "cork") == 0)
+            l->cork = 1;
+        else if (strncmp(opts[i], "sndbuf=", 7) == 0)
+            l->sndbuf = atoi(val);
+        else if (strncmp(opts[i], "rcvbuf=", 7) == 0)
+            l->rcvbuf = atoi(val);
+        else if (strcmp(opts[i], "v6only") == 0)
+            l->v6only = 1;
+        else {
+            fprintf(stderr, "unknown listen option: %s\n", opts[i]);
+            exit(1);
+        }
+    }
+    if (l->nodelay && l->cork) {
+        fprintf(stderr, "%s: nodelay and cork exclude each other\n", spec);
+        exit(1);
+    }
+    for (tail = &listeners; *tail; tail = &(*tail)->next)
+        ;
+    *tail = l;
+}
+
+static void
+open_listeners(void)
+{
+    struct Listener *l;
+
+    for (l = listeners; l; l = l->next) {
+        char *host = xstrdup(l->spec);
+        char *port = strrchr(host, ':');
+
+        if (port) {
+            *port++ = '\0';
+            if (host[0] == '[' && port[-2] == ']') {
+                port[-2] = '\0';
+                memmove(host, host + 1, strlen(host));
+            }
+            if (strcmp(host, "*") == 0 || host[0] == '\0') host = NULL;
+        }
+        else {
+            port = host;
+            host = NULL;
+        }
+        if (host)
+            l->fd = listen_socket(l, host, port, AF_UNSPEC);
+        else if ((l->fd = listen_socket(l, NULL, port, AF_INET6)) < 0)
+            l->fd = listen_socket(l, NULL, port, AF_INET);
+        if (l->fd < 0) {
+            fprintf(stderr, "failed to listen on %s\n", l->spec);
+            exit(1);
+        }
+    }
+}
+
 static int
-listen_socket(char *port)
+listen_socket(struct Listener *l, char *host, char *port, int family)
 {
     struct addrinfo hints, *res, *ai;
     int err;
 
     memset(&hints, 0, sizeof(struct addrinfo));
-    hints.ai_family = AF_INET;
+    hints.ai_family = family;
     hints.ai_socktype = SOCK_STREAM;
     hints.ai_flags = AI_PASSIVE;
-    if ((err = getaddrinfo(NULL, port, &hints, &res)) != 0)
-        log_exit(gai_strerror(err));
+    if ((err = getaddrinfo(host, port, &hints, &res)) != 0) {
+        fprintf(stderr, "%s: %s\n", l->spec, gai_strerror(err));
+        exit(1);
+    }
     for (ai = res; ai; ai = ai->ai_next) {
-        int sock;
+        int sock, on = 1;
 
         sock = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
         if (sock < 0) continue;
+        setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &on, sizeof on);
+        if (ai->ai_family == AF_INET6)
+            setsockopt(sock, IPPROTO_IPV6, IPV6_V6ONLY, &l->v6only, sizeof l->v6only);
+        /* buffer sizes are inherited by accepted sockets, and must be
+           set before listen(2) to affect the window scale */
+        if (l->sndbuf) setsockopt(sock, SOL_SOCKET, SO_SNDBUF, &l->sndbuf, sizeof l->sndbuf);
+        if (l->rcvbuf) setsockopt(sock, SOL_SOCKET, SO_RCVBUF, &l->rcvbuf, sizeof l->rcvbuf);
+        if (l->defer_accept
+                && setsockopt(sock, IPPROTO_TCP, TCP_DEFER_ACCEPT,
+                              &l->defer_accept, sizeof l->defer_accept) < 0)
+            perror("TCP_DEFER_ACCEPT");
         if (bind(sock, ai->ai_addr, ai->ai_addrlen) < 0) {
             close(sock);
             continue;
         }
-        if (listen(sock, MAX_BACKLOG) < 0) {
+        if (l->fastopen
+                && setsockopt(sock, IPPROTO_TCP, TCP_FASTOPEN,
+                              &l->fastopen, sizeof l->fastopen) < 0)
+            perror("TCP_FASTOPEN");
+        if (listen(sock, l->backlog) < 0) {
             close(sock);
             continue;
         }
+        /* accept_clients() drains the queue until EAGAIN */
+        fcntl(sock, F_SETFL, fcntl(sock, F_GETFL) | O_NONBLOCK);
+        fcntl(sock, F_SETFD, FD_CLOEXEC);
         freeaddrinfo(res);
         return sock;
     }
-    log_exit("failed to listen socket");
-    return -1;  /* NOT REACH */
+    freeaddrinfo(res);
+    return -1;
 }
 
-static void
-server_main(int server, char *docroot)
+/* Waits until some listener is readable and accepts a batch of up to
+   max connections from the ready ones, in turn, so a busy listener
+   cannot starve the others.  The batch grows while the queues still
+   have connections when it is full, and shrinks when they run dry
+   early, so a quiet server does not ask for more than one at a time.
+   Accepted sockets are non-blocking and close-on-exec from the start. */
+static int
+accept_clients(struct Client *clients, int max)
 {
-    for (;;) {
-        struct sockaddr_storage addr;
-        socklen_t addrlen = sizeof addr;
-        int sock;
-        int pid;
-
-        sock = accept(server, (struct sockaddr*)&addr, &addrlen);
-        if (sock < 0) log_exit("accept(2) failed: %s", strerror(errno));
-        pid = fork();
-        if (pid < 0) exit(3);
-        if (pid == 0) {   /* child */
-            FILE *inf = fdopen(sock, "r");
-            FILE *outf = fdopen(sock, "w");
-
-            service(inf, outf, docroot);
-            exit(0);
+    static struct pollfd *fds = NULL;
+    static struct Listener **ls;
+    static int n_fds = 0, next = 0;
+    int i, n = 0;
+
+    if (!fds) {
+        struct Listener *l;
+
+        for (l = listeners; l; l = l->next) n_fds++;
+        fds = xmalloc(sizeof(struct pollfd) * n_fds);
+        ls = xmalloc(sizeof(struct Listener*) * n_fds);
+        for (i = 0, l = listeners; l; i++, l = l->next) {
+            fds[i].fd = l->fd;
+            fds[i].events = POLLIN;
+            ls[i] = l;
+        }
+    }
+    while (n == 0) {
+        if (poll(fds, n_fds, -1) < 0) {
+            if (errno == EINTR) continue;
+            log_exit("poll(2) failed: %s", strerror(errno));
+        }
+        for (i = 0; i < n_fds && n < accept_batch; i++) {
+            int k = (next + i) % n_fds;
+
+            if (!(fds[k].revents & POLLIN)) continue;
+            while (n < accept_batch) {
+                struct Client *c = &clients[n];
+                socklen_t addrlen = sizeof c->addr;
+
+                c->fd = accept4(fds[k].fd, (struct sockaddr*)&c->addr, &addrlen,
+                                SOCK_NONBLOCK|SOCK_CLOEXEC);
+                if (c->fd < 0) {
+                    if (errno == EINTR) continue;
+                    if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+                    if (errno == ECONNABORTED || errno == EPROTO) continue;
+                    if (errno == EMFILE || errno == ENFILE
+                            || errno == ENOBUFS || errno == ENOMEM) {
+                        log_warn("accept4(2) failed: %s", strerror(errno));
+                        break;
+                    }
+                    log_exit("accept4(2) failed: %s", strerror(errno));
+                }
+                c->listener = ls[k];
+                n++;
+            }
+            next = k + 1;
         }
-        close(sock);
     }
+    if (n == accept_batch && accept_batch * 2 <= max)
+        accept_batch *= 2;
+    else if (n < accept_batch / 2)
+        accept_batch /= 2;
+    return n;
 }
 
 static void
-service(FILE *in, FILE *out, char *docroot)
+setup_client_socket(struct Listener *l, int sock)
 {
-    struct HTTPRequest *req;
+    int on = 1;
 
-    req = read_request(in);
-    respond_to(req, out, docroot);
-    free_request(req);
+    if (l->nodelay)
+        setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &on, sizeof on);
+    if (l->cork)
+        setsockopt(sock, IPPROTO_TCP, TCP_CORK, &on, sizeof on);
 }
 
-static struct HTTPRequest*
-read_request(FILE *in)
+/* Without workers, every connection gets a child of its own, as
+   before; the parent only accepts.  With workers, see below. */
+static void
+server_main(void)
 {
-    struct HTTPRequest *req;
-    struct HTTPHeaderField *h;
+    struct Client clients[ACCEPT_BATCH_MAX];
 
-    req = xmalloc(sizeof(struct HTTPRequest));
-    read_request_line(req, in);
-    req->header = NULL;
-    while (h = read_header_field(in)) {
-        h->next = req->header;
-        req->header = h;
+    if (n_workers > 0) {
+        supervise_workers();
+        return;
     }
-    req->length = content_length(req);
-    if (req->length != 0) {
-        if (req->length > MAX_REQUEST_BODY_LENGTH)
-            log_exit("request body too long");
-        req->body = xmalloc(req->length);
-        if (fread(req->body, req->length, 1, in) < 1)
-            log_exit("failed to read request body");
-    } else {
-        req->body = NULL;
+    for (;;) {
+        int i, n;
+
+        n = accept_clients(clients, ACCEPT_BATCH_MAX);
+        for (i = 0; i < n; i++) {
+            struct Listener *l;
+            int j, pid;
+
+            if (ratelimit) {
+                rate_sweep();
+                if (!rate_admit((struct sockaddr*)&clients[i].addr)) {
+                    reject_client(clients[i].fd);
+                    continue;
+                }
+            }
+            pid = fork();
+            if (pid < 0) exit(3);
+            if (pid == 0) {   /* child */
+                /* the rest of the batch belongs to our siblings */
+                for (j = i + 1; j < n; j++)
+                    close(clients[j].fd);
+                for (l = listeners; l; l = l->next)
+                    close(l->fd);
+                /* a vanished client must end in log_exit(), which
+                   cleans up, rather than in a silent SIGPIPE */
+                trap_signal(SIGPIPE, SIG_IGN);
+                serve_client(&clients[i]);
+                exit(0);
+            }
+            close(clients[i].fd);
+        }
     }
-    return req;
 }
 
+/* Preforks n_workers processes and replaces those which exit.  Each
+   worker accepts a connection on the shared listeners and serves it
+   itself, so there is no fork(2) per connection and the in-process
+   caches and buffer pool live as long as the worker. */
 static void
-read_request_line(struct HTTPRequest *req, FILE *in)
+supervise_workers(void)
 {
-    char buf[LINE_BUF_SIZE];
-    char *path, *p;
-
-    if (!fgets(buf, LINE_BUF_SIZE, in))
-        log_exit("no request line");
-    p = strchr(buf, ' ');       /* p (1) */
-    if (!p) log_exit("parse error on request line (1): %s", buf);
-    *p++ = '\0';
-    req->method = xmalloc(p - buf);
-    strcpy(req->method, buf);
-    upcase(req->method);
+    pid_t *pids;
+    int i, status;
 
-    path = p;
-    p = strchr(path, ' ');      /* p (2) */
-    if (!p) log_exit("parse error on request line (2): %s", buf);
-    *p++ = '\0';
-    req->path = xmalloc(p - path);
-    strcpy(req->path, path);
+    trap_signal(SIGCHLD, SIG_DFL);
+    pids = xmalloc(sizeof(pid_t) * n_workers);
+    for (i = 0; i < n_workers; i++)
+        pids[i] = spawn_worker();
+    for (;;) {
+        pid_t pid = waitpid(-1, &status, 0);
 
-    if (strncasecmp(p, "HTTP/1.", strlen("HTTP/1.")) != 0)
-        log_exit("parse error on request line (3): %s", buf);
-    p += strlen("HTTP/1.");     /* p (3) */
-    req->protocol_minor_version = atoi(p);
+        if (pid < 0) {
+            if (errno == EINTR) continue;
+            log_exit("waitpid(2) failed: %s", strerror(errno));
+        }
+        for (i = 0; i < n_workers; i++) {
+            if (pids[i] == pid) {
+                if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+                    log_warn("worker %ld died (status %d)", (long)pid, status);
+                pids[i] = spawn_worker();
+            }
+        }
+    }
 }
 
-static struct HTTPHeaderField*
-read_header_field(FILE *in)
+static pid_t
+spawn_worker(void)
 {
-    struct HTTPHeaderField *h;
-    char buf[LINE_BUF_SIZE];
-    char *p;
-
-    if (!fgets(buf, LINE_BUF_SIZE, in))
-        log_exit("failed to read request header field: %s", strerror(errno));
-    if ((buf[0] == '\n') || (strcmp(buf, "\r\n") == 0))
-        return NULL;
-
-    p = strchr(buf, ':');
-    if (!p) log_exit("parse error on request header field: %s", buf);
-    *p++ = '\0';
-    h = xmalloc(sizeof(struct HTTPHeaderField));
-    h->name = xmalloc(p - buf);
-    strcpy(h->name, buf);
-
-    p += strspn(p, " \t"); 
-    h->value = xmalloc(strlen(p) + 1);
-    strcpy(h->value, p);
+    pid_t pid;
 
-    return h;
+    pid = fork();
+    if (pid < 0) log_exit("fork(2) failed: %s", strerror(errno));
+    if (pid == 0) {
+        prctl(PR_SET_PDEATHSIG, SIGTERM);
+        if (getppid() == 1) exit(0);
+        trap_signal(SIGPIPE, SIG_IGN);
+        worker_main();
+        exit(0);
+    }
+    return pid;
 }
 
+/* A worker serves one connection at a time, to the end, so it accepts
+   only one: a socket accepted ahead would wait behind a slow client or
+   an idle HTTP/2 connection, while it could have gone to another worker.
+   A request which fails ends in log_exit(), which returns here instead
+   of exiting.  Whatever the request had allocated or opened is lost,
+   so such a worker makes way for a new one; so does a worker that has
+   served WORKER_MAX_CONNECTIONS. */
 static void
-upcase(char *str)
+worker_main(void)
 {
-    char *p;
+    struct Client client;
+    unsigned long served = 0;
+    int clean = 1;
 
-    for (p = str; *p; p++) {
-        *p = (char)toupper((int)*p);
+    while (clean && served < WORKER_MAX_CONNECTIONS) {
+        accept_clients(&client, 1);
+        if (ratelimit) {
+            rate_sweep();
+            if (!rate_admit((struct sockaddr*)&client.addr)) {
+                reject_client(client.fd);
+                continue;
+            }
+        }
+        if (!serve_client(&client)) clean = 0;
+        served++;
     }
 }
 
-static void
-free_request(struct HTTPRequest *req)
+/* Returns 0 if the request was aborted by log_exit(). */
+static int
+serve_client(struct Client *client)
 {
-    struct HTTPHeaderField *h, *head;
+    static struct Connection conn;
 
-    head = req->header;
-    while (head) {
-        h = head;
-        head = head->next;
-        free(h->name);
-        free(h->value);
-        free(h);
+    setup_client_socket(client->listener, client->fd);
+    conn_init(&conn, client->fd);
+    if (sigsetjmp(request_abort, 1)) {
+        request_abort_armed = 0;
+        flight_abandon();
+        conn_abort(&conn);
+        return 0;
     }
-    free(req->method);
-    free(req->path);
-    free(req->body);
-    free(req);
+    request_abort_armed = (n_workers > 0);
+    service(&conn, (struct sockaddr*)&client->addr);
+    request_abort_armed = 0;
+    conn_close(&conn);
+    return 1;
 }
 
-static long
-content_length(struct HTTPRequest *req)
-{
-    char *val;
-    long len;
-    
-    val = lookup_header_field_value(req, "Content-Length");
-    if (!val) return 0;
-    len = atol(val);
-    if (len < 0) log_exit("negative Content-Length value");
-    return len;
-}
+/* Reads the virtual host and route table.  The format is line oriented:
 
-static char*
-lookup_header_field_value(struct HTTPRequest *req, char *name)
+       # comment
+       ratelimit <req/sec> <burst> [<bytes/sec> <bytes burst> [<entries>]]
+       listen [<addr>:]<port> [<option>...]
+       workers <n>
+       slowlog <msec> [<log one in N>]
+       capture <file>
+       warmup <manifest> [<mlock limit in bytes>]
+       host <name>[,<alias>...] <docroot>
+       route <prefix> static [<docroot>]
+       route <prefix> autoindex [<docroot>]
+       route <prefix> proxy <host>:<port>
+       route <prefix> redirect <url>
+       route <prefix> stats
+       route <prefix> pack <packfile>
+
+   A route belongs to the last preceding host line; routes before
+   any host line belong to the default host, which serves requests
+   with an unknown Host: header.  Routes are matched by the longest
+   prefix of the request path that ends at a "/" or at its end. */
+static void
+load_config(char *path)
 {
-    struct HTTPHeaderField *h;
+    FILE *f;
+    char buf[LINE_BUF_SIZE];
+    char *args[CONFIG_MAX_ARGS];
+    struct VirtualHost *vhost = default_vhost;
+    int lineno = 0;
 
-    for (h = req->header; h; h = h->next) {
-        if (strcasecmp(h->name, name) == 0)
-            return h->value;
+    f = fopen(path, "r");
+    if (!f) {
+        perror(path);
+        exit(1);
     }
-    return NULL;
+    while (fgets(buf, sizeof buf, f)) {
+        char *p;
+        int n = 0;
+
+        lineno++;
+        if ((p = strchr(buf, '#'))) *p = '\0';
+        for (p = strtok(buf, " \t\r\n"); p; p = strtok(NULL, " \t\r\n")) {
+            if (n == CONFIG_MAX_ARGS) {
+                fprintf(stderr, "%s:%d: too many words\n", path, lineno);
+                exit(1);
+            }
+            args[n++] = p;
+        }
+        if (n == 0) continue;
+        if (strcmp(args[0], "ratelimit") == 0 && n >= 3 && n <= 6) {
+            setup_ratelimit(args + 1, n - 1);
+        }
+        else if (strcmp(args[0], "slowlog") == 0 && (n == 2 || n == 3)) {
+            slow_msec = strtoul(args[1], NULL, 10);
+            slow_sample = (n == 3 ? strtoul(args[2], NULL, 10) : 1);
+            if (slow_sample == 0) slow_sample = 1;
+        }
+        else if (strcmp(args[0], "capture") == 0 && n == 2) {
+            open_capture(args[1]);
+        }
+        else if (strcmp(args[0], "listen") == 0 && n >= 2) {
+            add_listener(args[1], args + 2, n - 2);
+        }
+        else if (strcmp(args[0], "workers") == 0 && n == 2) {
+            n_workers = atoi(args[1]);
+        }
+        else if (strcmp(args[0], "warmup") == 0 && (n == 2 || n == 3)) {
+            open_warmup(args[1]);
+            if (n == 3) warmup_mlock_max = strtoul(args[2], NULL, 10);
+        }
+        else if (strcmp(args[0], "host") == 0 && n == 3) {
+            vhost = new_vhost(args[1], args[2]);
+        }
+        else if (strcmp(args[0], "route") == 0 && (n == 3 || n == 4)) {
+            add_route(vhost, args[1], args[2], (n == 4 ? args[3] : NULL));
+        }
+        else {
+            fprintf(stderr, "%s:%d: syntax error\n", path, lineno);
+            exit(1);
+        }
+    }
+    fclose(f);
 }
 
-static void
-respond_to(struct HTTPRequest *req, FILE *out, char *docroot)
+static struct VirtualHost*
+new_vhost(char *names, char *docroot)
 {
-    if (strcmp(req->method, "GET") == 0)
-        do_file_response(req, out, docroot);
-    else if (strcmp(req->method, "HEAD") == 0)
-        do_file_response(req, out, docroot);
-    else if (strcmp(req->method, "POST") == 0)
-        method_not_allowed(req, out);
-    else
-        not_implemented(req, out);
+    struct VirtualHost *vhost, **tail;
+    char *p;
+
+    vhost = xmalloc(sizeof(struct VirtualHost));
+    memset(vhost, 0, sizeof(struct VirtualHost));
+    vhost->names = xmalloc(sizeof(char*) * (strlen(names) / 2 + 1));
+    for (p = strtok(xstrdup(names), ","); p; p = strtok(NULL, ",")) {
+        if (strlen(p) >= MAX_HOSTNAME) {
+            fprintf(stderr, "host name too long: %s\n", p);
+            exit(1);
+        }
+        upcase(p);
+        vhost->names[vhost->n_names++] = p;
+    }
+    vhost->name = vhost->n_names > 0 ? vhost->names[0] : "";
+    vhost->docroot = docroot ? xstrdup(docroot) : NULL;
+    vhost->docroot_fd = docroot ? open_docroot(docroot) : -1;
+    vhost->route_root = new_route_node("", 0);
+    for (tail = &vhosts; *tail; tail = &(*tail)->next)
+        ;
+    *tail = vhost;
+    return vhost;
 }
 
+/* Builds the Host: lookup table and the shared statistics area.
+   Called once, after the whole config is read. */
 static void
-do_file_response(struct HTTPRequest *req, FILE *out, char *docroot)
+setup_vhosts(void)
 {
-    struct FileInfo *info;
+    struct VirtualHost *vhost;
+    struct HostStats *stats;
+    unsigned long size;
+    int n_hosts = 0, n_names = 0;
+    int i, j;
 
-    info = get_fileinfo(docroot, req->path);
+    for (vhost = vhosts; vhost; vhost = vhost->next) {
+        if (vhost != default_vhost && !lookup_route(vhost->route_root, "/"))
+            add_route(vhost, "/", "static", NULL);
+        n_hosts++;
+        n_names += vhost->n_names;
+    }
+    if (!default_vhost->route_root->route && default_vhost->route_root->n_children == 0) {
+        if (!default_vhost->next) {
+            fprintf(stderr, "no routes and no hosts configured\n");
+            exit(1);
+        }
+        /* no default routes: unknown hosts go to the first host */
+        default_vhost = default_vhost->next;
+    }
+
+    for (size = 8; size < (unsigned long)n_names * 2; size *= 2)
+        ;
+    vhost_table = xmalloc(sizeof(struct VirtualHost*) * size);
+    memset(vhost_table, 0, sizeof(struct VirtualHost*) * size);
+    vhost_mask = size - 1;
+    for (vhost = vhosts; vhost; vhost = vhost->next) {
+        for (i = 0; i < vhost->n_names; i++) {
+            char *name = vhost->names[i];
+            unsigned long h;
+
+            if (strcmp(name, "*") == 0) continue;
+            h = hash_string(name, strlen(name)) & vhost_mask;
+            while (vhost_table[h]) {
+                for (j = 0; j < vhost_table[h]->n_names; j++) {
+                    if (strcmp(vhost_table[h]->names[j], name) == 0) {
+                        fprintf(stderr, "duplicate host: %s\n", name);
+                        exit(1);
+                    }
+                }
+                h = (h + 1) & vhost_mask;
+            }
+            vhost_table[h] = vhost;
+        }
+    }
+
+    setup_shared(n_hosts);
+    stats = shared->hosts;
+    for (vhost = vhosts; vhost; vhost = vhost->next)
+        vhost->stats = stats++;
+}
+
+/* Maps the shared segment.  It is backed by a memfd, so that it shows
+   up by name in /proc/<pid>/maps, where available. */
+static void
+setup_shared(int n_hosts)
+{
+    size_t size = sizeof(struct SharedArea) + sizeof(struct HostStats) * n_hosts;
+    void *p = MAP_FAILED;
+#ifdef MFD_CLOEXEC
+    int fd;
+
+    fd = memfd_create("httpd2-shared", MFD_CLOEXEC);
+    if (fd >= 0) {
+        if (ftruncate(fd, size) < 0) {
+            perror("ftruncate(2)");
+            exit(1);
+        }
+        p = mmap(NULL, size, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+        close(fd);
+    }
+    else
+#endif
+        p = mmap(NULL, size, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED) {
+        perror("mmap(2)");
+        exit(1);
+    }
+    shared = p;
+}
+
+/* Resolves a Host: header value (with optional port) to its host.
+   Unknown names give the default host. */
+static struct VirtualHost*
+lookup_vhost(char *host)
+{
+    char name[MAX_HOSTNAME];
+    size_t len;
+    unsigned long h;
+
+    if (!host) return default_vhost;
+    for (len = 0; host[len] && host[len] != ':' && !isspace((int)host[len]); len++) {
+        if (len == MAX_HOSTNAME - 1) return default_vhost;
+        name[len] = (char)toupper((int)host[len]);
+    }
+    if (len > 0 && name[len-1] == '.') len--;
+    name[len] = '\0';
+    h = hash_string(name, len) & vhost_mask;
+    while (vhost_table[h]) {
+        struct VirtualHost *vhost = vhost_table[h];
+        int i;
+
+        for (i = 0; i < vhost->n_names; i++) {
+            if (strcmp(vhost->names[i], name) == 0)
+                return vhost;
+        }
+        h = (h + 1) & vhost_mask;
+    }
+    return default_vhost;
+}
+
+/* FNV-1a */
+static unsigned long
+hash_string(const char *str, size_t len)
+{
+    unsigned long h = 2166136261UL;
+    size_t i;
+
+    for (i = 0; i < len; i++) {
+        h ^= (unsigned char)str[i];
+        h *= 16777619UL;
+    }
+    return h;
+}
+
+static void
+count_stat(unsigned long *counter, unsigned long n)
+{
+    __sync_fetch_and_add(counter, n);
+}
+
+static void
+count_bytes_sent(struct HTTPRequest *req, unsigned long n)
+{
+    count_stat(&req->vhost->stats->bytes_sent, n);
+    req->bytes_sent += n;
+}
+
+static int
+open_docroot(char *path)
+{
+    int fd;
+
+    fd = open(path, O_RDONLY|O_DIRECTORY);
+    if (fd < 0) {
+        perror(path);
+        exit(1);
+    }
+    return fd;
+}
+
+static void
+add_route(struct VirtualHost *vhost, char *prefix, char *type, char *arg)
+{
+    struct Route *route, **tail;
+
+    if (prefix[0] != '/') {
+        fprintf(stderr, "route prefix must start with '/': %s\n", prefix);
+        exit(1);
+    }
+    route = xmalloc(sizeof(struct Route));
+    memset(route, 0, sizeof(struct Route));
+    route->prefix = xstrdup(prefix);
+    route->prefixlen = strlen(prefix);
+    route->arg = arg ? xstrdup(arg) : NULL;
+    if ((strcmp(type, "static") == 0 || strcmp(type, "autoindex") == 0)
+        && (arg || vhost->docroot)) {
+        route->type = ROUTE_STATIC;
+        route->handler = do_file_response;
+        route->autoindex = (strcmp(type, "autoindex") == 0);
+        if (!arg) route->arg = vhost->docroot;
+        route->dirfd = arg ? open_docroot(arg) : vhost->docroot_fd;
+    }
+    else if (strcmp(type, "proxy") == 0 && arg && strrchr(arg, ':')) {
+        char *p;
+
+        route->type = ROUTE_PROXY;
+        route->handler = do_proxy_response;
+        route->upstream_host = xstrdup(arg);
+        p = strrchr(route->upstream_host, ':');
+        *p++ = '\0';
+        route->upstream_port = p;
+    }
+    else if (strcmp(type, "redirect") == 0 && arg) {
+        route->type = ROUTE_REDIRECT;
+        route->handler = do_redirect_response;
+    }
+    else if (strcmp(type, "pack") == 0 && arg) {
+        route->type = ROUTE_PACK;
+        route->handler = do_pack_response;
+        route->pack = open_pack(arg);
+    }
+    else if (strcmp(type, "stats") == 0 && !arg) {
+        route->type = ROUTE_STATS;
+        route->handler = do_stats_response;
+    }
+    else {
+        fprintf(stderr, "bad route: %s %s %s\n", prefix, type, arg ? arg : "");
+        exit(1);
+    }
+    insert_route(vhost->route_root, prefix, route);
+    for (tail = &vhost->routes; *tail; tail = &(*tail)->next)
+        ;
+    *tail = route;
+}
+
+static struct RouteNode*
+new_route_node(const char *label, size_t len)
+{
+    struct RouteNode *node;
+
+    node = xmalloc(sizeof(struct RouteNode));
+    node->label = xmalloc(len + 1);
+    memcpy(node->label, label, len);
+    node->label[len] = '\0';
+    node->len = len;
+    node->route = NULL;
+    node->n_children = 0;
+    node->keys = NULL;
+    node->children = NULL;
+    return node;
+}
+
+static void
+insert_route(struct RouteNode *node, const char *key, struct Route *route)
+{
+    for (;;) {
+        struct RouteNode *child;
+        size_t n;
+
+        if (*key == '\0') {
+            if (node->route) {
+                fprintf(stderr, "duplicate route: %s\n", route->prefix);
+                exit(1);
+            }
+            node->route = route;
+            return;
+        }
+        child = find_route_child(node, (unsigned char)*key);
+        if (!child) {
+            child = new_route_node(key, strlen(key));
+            child->route = route;
+            add_route_child(node, child);
+            return;
+        }
+        for (n = 0; n < child->len && key[n] == child->label[n]; n++)
+            ;
+        if (n < child->len) {
+            /* split the edge: child keeps the common part,
+               a new node takes over the rest of its label and subtree */
+            struct RouteNode *rest;
+
+            rest = new_route_node(child->label + n, child->len - n);
+            rest->route = child->route;
+            rest->n_children = child->n_children;
+            rest->keys = child->keys;
+            rest->children = child->children;
+            child->label[n] = '\0';
+            child->len = n;
+            child->route = NULL;
+            child->n_children = 0;
+            child->keys = NULL;
+            child->children = NULL;
+            add_route_child(child, rest);
+        }
+        key += n;
+        node = child;
+    }
+}
+
+static struct RouteNode*
+find_route_child(struct RouteNode *node, unsigned char c)
+{
+    int lo = 0, hi = node->n_children - 1;
+
+    while (lo <= hi) {
+        int mid = (lo + hi) / 2;
+
+        if (node->keys[mid] == c)
+            return node->children[mid];
+        if (node->keys[mid] < c)
+            lo = mid + 1;
+        else
+            hi = mid - 1;
+    }
+    return NULL;
+}
+
+static void
+add_route_child(struct RouteNode *node, struct RouteNode *child)
+{
+    unsigned char c = (unsigned char)child->label[0];
+    int i;
+
+    node->keys = xrealloc(node->keys, node->n_children + 1);
+    node->children = xrealloc(node->children,
+                              sizeof(struct RouteNode*) * (node->n_children + 1));
+    for (i = node->n_children; i > 0 && node->keys[i-1] > c; i--) {
+        node->keys[i] = node->keys[i-1];
+        node->children[i] = node->children[i-1];
+    }
+    node->keys[i] = c;
+    node->children[i] = child;
+    node->n_children++;
+}
+
+/* Returns the route with the longest prefix of path, or NULL.  A prefix
+   counts only when it ends at a segment boundary: "/static" matches
+   "/static" and "/static/x" but not "/staticfoo".  Walks the trie once
+   and never allocates. */
+static struct Route*
+lookup_route(struct RouteNode *node, const char *path)
+{
+    struct Route *found = node->route;
+    const char *start = path;
+
+    for (;;) {
+        struct RouteNode *child;
+
+        child = find_route_child(node, (unsigned char)*path);
+        if (!child) break;
+        if (strncmp(path, child->label, child->len) != 0) break;
+        path += child->len;
+        node = child;
+        if (node->route && (*path == '/' || *path == '\0'
+                            || (path > start && path[-1] == '/')))
+            found = node->route;
+    }
+    return found;
+}
+
+/****** Pack Files *******************************************************/
+
+/* Maps a pack file written by mkpack.  This is the only file system
+   work a pack route ever does: requests are answered from the index
+   and bodies are sent from the pack's fd at their known offsets. */
+static struct Pack*
+open_pack(char *path)
+{
+    struct Pack *pack;
+    struct PackHeader *header;
+    struct stat st;
+    unsigned int i;
+
+    pack = xmalloc(sizeof(struct Pack));
+    pack->path = xstrdup(path);
+    pack->fd = open(path, O_RDONLY|O_CLOEXEC);
+    if (pack->fd < 0 || fstat(pack->fd, &st) < 0) {
+        perror(path);
+        exit(1);
+    }
+    pack->size = st.st_size;
+    if (pack->size < sizeof(struct PackHeader)) {
+        fprintf(stderr, "%s: not a pack file\n", path);
+        exit(1);
+    }
+    pack->map = mmap(NULL, pack->size, PROT_READ, MAP_SHARED, pack->fd, 0);
+    if (pack->map == MAP_FAILED) {
+        perror("mmap(2)");
+        exit(1);
+    }
+    header = (struct PackHeader*)pack->map;
+    if (memcmp(header->magic, PACK_MAGIC, sizeof header->magic) != 0
+            || header->version != PACK_VERSION
+            || header->strings_offset > pack->size
+            || header->strings_size > pack->size - header->strings_offset
+            || header->index_offset > pack->size
+            || header->n_entries > (pack->size - header->index_offset) / sizeof(struct PackEntry)) {
+        fprintf(stderr, "%s: broken pack file\n", path);
+        exit(1);
+    }
+    pack->n_entries = header->n_entries;
+    pack->index = (struct PackEntry*)(pack->map + header->index_offset);
+    pack->strings = pack->map + header->strings_offset;
+    /* check the entries once, so that requests need not; the lookup
+       is a binary search, so the paths must be strictly increasing */
+    for (i = 0; i < pack->n_entries; i++) {
+        struct PackEntry *ent = &pack->index[i];
+
+        if ((unsigned long long)ent->path + ent->path_len >= header->strings_size
+                || ent->content_type >= header->strings_size
+                || ent->etag >= header->strings_size
+                || ent->gzip_etag >= header->strings_size
+                || ent->body_offset > pack->size
+                || ent->body_size > pack->size - ent->body_offset
+                || ent->gzip_offset > pack->size
+                || ent->gzip_size > pack->size - ent->gzip_offset
+                || pack->strings[header->strings_size - 1] != '\0') {
+            fprintf(stderr, "%s: broken pack file\n", path);
+            exit(1);
+        }
+        if (i > 0 && strcmp(pack->strings + ent[-1].path, pack->strings + ent->path) >= 0) {
+            fprintf(stderr, "%s: pack index is not sorted\n", path);
+            exit(1);
+        }
+    }
+    return pack;
+}
+
+/* Looks up a request path, mapping directories to their index.html. */
+static struct PackEntry*
+find_pack_entry(struct Pack *pack, char *urlpath)
+{
+    char buf[LINE_BUF_SIZE];
+    size_t len;
+
+    while (*urlpath == '/') urlpath++;
+    len = strlen(urlpath);
+    if (len == 0 || urlpath[len - 1] == '/') {
+        if (len + sizeof INDEX_FILE > sizeof buf) return NULL;
+        memcpy(buf, urlpath, len);
+        memcpy(buf + len, INDEX_FILE, sizeof INDEX_FILE);
+        return lookup_pack(pack, buf);
+    }
+    return lookup_pack(pack, urlpath);
+}
+
+/* Binary search of the path index; path has no leading slash. */
+static struct PackEntry*
+lookup_pack(struct Pack *pack, const char *path)
+{
+    unsigned int lo = 0, hi = pack->n_entries;
+
+    while (lo < hi) {
+        unsigned int mid = lo + (hi - lo) / 2;
+        int cmp = strcmp(path, pack->strings + pack->index[mid].path);
+
+        if (cmp == 0) return &pack->index[mid];
+        if (cmp < 0)
+            hi = mid;
+        else
+            lo = mid + 1;
+    }
+    return NULL;
+}
+
+/****** Rate Limiting ****************************************************/
+
+/* Per client address token buckets, shared by the processes which
+   admit connections (the parent, or the workers) and those which serve
+   them: every request, including each HTTP/2 stream, takes a request
+   token and its response is charged to the byte bucket.  The table is
+   split into shards of open-addressing slots; all updates are single
+   word CAS operations, so nobody ever takes a lock.  Slots of idle
+   clients are recycled by a CLOCK sweep run on every admission, each
+   process going round the whole table with a hand of its own, and a
+   full probe window evicts a slot whose reference bit is clear, so
+   memory stays bounded however many clients show up. */
+
+static void
+setup_ratelimit(char **args, int n)
+{
+    unsigned long slots = RATE_DEFAULT_SLOTS;
+    unsigned long i;
+    struct RateSlot *mem;
+
+    ratelimit = xmalloc(sizeof(struct RateLimit));
+    memset(ratelimit, 0, sizeof(struct RateLimit));
+    ratelimit->req_rate = strtoul(args[0], NULL, 10);
+    ratelimit->req_burst = strtoul(args[1], NULL, 10);
+    if (n >= 4) {
+        ratelimit->byte_rate = strtoul(args[2], NULL, 10);
+        ratelimit->byte_burst = strtoul(args[3], NULL, 10);
+    }
+    if (n >= 5) slots = strtoul(args[4], NULL, 10);
+    if (ratelimit->req_rate == 0 || ratelimit->req_burst == 0
+        || ratelimit->req_burst > 2000000 || ratelimit->byte_burst > 0x7fffffffUL
+        || (n >= 4 && ratelimit->byte_burst == 0)) {
+        fprintf(stderr, "bad ratelimit parameters\n");
+        exit(1);
+    }
+    for (i = 1; i * RATE_SHARDS < slots; i *= 2)
+        ;
+    ratelimit->slots_per_shard = i;
+    ratelimit->shards = mmap(NULL, sizeof(struct RateShard) * RATE_SHARDS,
+                             PROT_READ|PROT_WRITE, MAP_SHARED|MAP_ANONYMOUS, -1, 0);
+    mem = mmap(NULL, sizeof(struct RateSlot) * i * RATE_SHARDS,
+               PROT_READ|PROT_WRITE, MAP_SHARED|MAP_ANONYMOUS, -1, 0);
+    if (ratelimit->shards == MAP_FAILED || mem == MAP_FAILED) {
+        perror("mmap(2)");
+        exit(1);
+    }
+    for (i = 0; i < RATE_SHARDS; i++) {
+        ratelimit->shards[i].slots = mem + i * ratelimit->slots_per_shard;
+    }
+
+    too_many_requests = xmalloc(LINE_BUF_SIZE);
+    snprintf(too_many_requests, LINE_BUF_SIZE,
+             "HTTP/1.%d 429 Too Many Requests\r\n"
+             "Server: %s/%s\r\n"
+             "Connection: close\r\n"
+             "Retry-After: 1\r\n"
+             "Content-Type: text/html\r\n"
+             "Content-Length: %d\r\n"
+             "\r\n"
+             "%s",
+             HTTP_MINOR_VERSION, SERVER_NAME, SERVER_VERSION,
+             (int)strlen(TOO_MANY_REQUESTS_BODY), TOO_MANY_REQUESTS_BODY);
+    too_many_requests_len = strlen(too_many_requests);
+}
+
+/* Returns the slot for addr.  When create is false, returns NULL for
+   an unknown client.  May also return NULL if no slot can be freed;
+   the caller then lets the client through. */
+static struct RateSlot*
+rate_slot(struct sockaddr *addr, int create)
+{
+    unsigned long long key = rate_key(addr);
+    struct RateShard *shard = &ratelimit->shards[key % RATE_SHARDS];
+    unsigned long mask = ratelimit->slots_per_shard - 1;
+    unsigned long base = (unsigned long)(key >> 8);
+    unsigned long long k;
+    struct RateSlot *slot;
+    int i;
+
+    for (i = 0; i < RATE_PROBE; i++) {
+        slot = &shard->slots[(base + i) & mask];
+        if (__atomic_load_n(&slot->key, __ATOMIC_ACQUIRE) == key) {
+            if (!slot->ref) __atomic_store_n(&slot->ref, 1, __ATOMIC_RELAXED);
+            return slot;
+        }
+    }
+    if (!create) return NULL;
+    /* take a free slot or, failing that, one not referenced recently */
+    for (i = 0; i < RATE_PROBE * 2; i++) {
+        slot = &shard->slots[(base + i % RATE_PROBE) & mask];
+        k = __atomic_load_n(&slot->key, __ATOMIC_ACQUIRE);
+        if (k == RATE_KEY_BUSY) continue;
+        if (i >= RATE_PROBE) {
+            if (__atomic_exchange_n(&slot->ref, 0, __ATOMIC_RELAXED)) continue;
+        }
+        else if (k != 0) {
+            continue;
+        }
+        /* reserve the slot, fill it in, and only then publish the key:
+           nobody may see the buckets of the previous owner */
+        if (__atomic_compare_exchange_n(&slot->key, &k, RATE_KEY_BUSY, 0,
+                                        __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+            init_rate_slot(slot, msec_now());
+            __atomic_store_n(&slot->key, key, __ATOMIC_RELEASE);
+            return slot;
+        }
+        if (k == key) return slot;
+    }
+    return NULL;
+}
+
+/* 64bit FNV-1a of the address bytes (never 0 nor RATE_KEY_BUSY) */
+static unsigned long long
+rate_key(struct sockaddr *addr)
+{
+    unsigned char *p;
+    size_t len, i;
+    unsigned long long h = 14695981039346656037ULL;
+
+    if (addr->sa_family == AF_INET6) {
+        p = (unsigned char*)&((struct sockaddr_in6*)addr)->sin6_addr;
+        len = sizeof(struct in6_addr);
+    }
+    else {
+        p = (unsigned char*)&((struct sockaddr_in*)addr)->sin_addr;
+        len = sizeof(struct in_addr);
+    }
+    for (i = 0; i < len; i++) {
+        h ^= p[i];
+        h *= 1099511628211ULL;
+    }
+    return (h && h != RATE_KEY_BUSY) ? h : 1;
+}
+
+static void
+init_rate_slot(struct RateSlot *slot, unsigned int now)
+{
+    unsigned long long tokens;
+
+    tokens = (unsigned long long)ratelimit->req_burst * 1000;
+    __atomic_store_n(&slot->requests, (tokens << 32) | now, __ATOMIC_RELAXED);
+    tokens = (unsigned long long)ratelimit->byte_burst;
+    __atomic_store_n(&slot->bytes, (tokens << 32) | now, __ATOMIC_RELAXED);
+    __atomic_store_n(&slot->ref, 1, __ATOMIC_RELAXED);
+}
+
+/* Refills the bucket up to burst, then subtracts cost.  When must_have
+   is set the bucket is left untouched unless it holds at least cost
+   (or, for cost 0, anything at all); returns whether it did. */
+static int
+bucket_take(unsigned long long *bucket, unsigned long rate, unsigned long burst,
+            long cost, unsigned int now, int must_have)
+{
+    unsigned long long old, new;
+    long long tokens, refill;
+    unsigned int stamp;
+
+    old = __atomic_load_n(bucket, __ATOMIC_RELAXED);
+    do {
+        tokens = (int)(old >> 32);
+        stamp = (unsigned int)old;
+        refill = (long long)(unsigned int)(now - stamp) * rate / 1000;
+        if (refill > 0) {
+            tokens += refill;
+            if (tokens > (long long)burst) tokens = burst;
+            stamp = now;
+        }
+        if (must_have && (cost ? tokens < cost : tokens <= 0))
+            return 0;
+        tokens -= cost;
+        if (tokens < -(long long)burst) tokens = -(long long)burst;
+        new = ((unsigned long long)(unsigned int)tokens << 32) | stamp;
+    } while (!__atomic_compare_exchange_n(bucket, &old, new, 0,
+                                          __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+    return 1;
+}
+
+/* Called by the parent (or a worker) for each accepted connection.
+   Turns the client away while one of its buckets is empty, but takes
+   nothing: the requests themselves are charged by rate_request(). */
+static int
+rate_admit(struct sockaddr *addr)
+{
+    struct RateSlot *slot;
+    unsigned int now = msec_now();
+
+    slot = rate_slot(addr, 1);
+    if (!slot) return 1;
+    if (ratelimit->byte_rate
+        && !bucket_take(&slot->bytes, ratelimit->byte_rate, ratelimit->byte_burst,
+                        0, now, 1))
+        return 0;
+    /* request tokens are kept in 1/1000 units: rate per msec == req_rate */
+    return bucket_take(&slot->requests, ratelimit->req_rate * 1000,
+                       ratelimit->req_burst * 1000, 0, now, 1);
+}
+
+/* Called for each request (each stream on HTTP/2) before it is served;
+   returns 0 if the client has run out of request tokens. */
+static int
+rate_request(struct sockaddr *addr)
+{
+    struct RateSlot *slot;
+
+    slot = rate_slot(addr, 1);
+    if (!slot) return 1;
+    return bucket_take(&slot->requests, ratelimit->req_rate * 1000,
+                       ratelimit->req_burst * 1000, 1000, msec_now(), 1);
+}
+
+/* Called by a child after its response is sent. */
+static void
+rate_charge(struct sockaddr *addr, unsigned long bytes)
+{
+    struct RateSlot *slot;
+
+    if (!ratelimit || !ratelimit->byte_rate || bytes == 0) return;
+    slot = rate_slot(addr, 0);
+    if (!slot) return;
+    if (bytes > ratelimit->byte_burst) bytes = ratelimit->byte_burst;
+    bucket_take(&slot->bytes, ratelimit->byte_rate, ratelimit->byte_burst,
+                (long)bytes, msec_now(), 0);
+}
+
+/* Advances the CLOCK hand by a few slots: clears reference bits and
+   frees slots that were neither referenced nor used for a while. */
+static void
+rate_sweep(void)
+{
+    unsigned long total = ratelimit->slots_per_shard * RATE_SHARDS;
+    unsigned int now = msec_now();
+    int i;
+
+    for (i = 0; i < RATE_SWEEP_STEP; i++) {
+        unsigned long n = ratelimit->sweep++ % total;
+        struct RateSlot *slot;
+        unsigned long long k;
+
+        slot = &ratelimit->shards[n / ratelimit->slots_per_shard]
+                   .slots[n % ratelimit->slots_per_shard];
+        k = __atomic_load_n(&slot->key, __ATOMIC_ACQUIRE);
+        if (k == 0 || k == RATE_KEY_BUSY) continue;
+        if (__atomic_exchange_n(&slot->ref, 0, __ATOMIC_RELAXED)) continue;
+        if (now - (unsigned int)__atomic_load_n(&slot->requests, __ATOMIC_RELAXED)
+            < RATE_IDLE_MSEC)
+            continue;
+        __atomic_compare_exchange_n(&slot->key, &k, 0, 0,
+                                    __ATOMIC_ACQ_REL, __ATOMIC_RELAXED);
+    }
+}
+
+static unsigned int
+msec_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned int)(ts.tv_sec * 1000 + ts.tv_nsec / 1000000);
+}
+
+/* Sends the pre-rendered 429 response; the socket is fresh, so this
+   small write never blocks the parent. */
+static void
+reject_client(int sock)
+{
+    if (write(sock, too_many_requests, too_many_requests_len) < 0)
+        ;   /* nothing to do: the client is being dropped anyway */
+    shutdown(sock, SHUT_WR);
+    close(sock);
+}
+
+/****** Request Coalescing *********************************************/
+
+/* When many children ask for the same file at once (typically right
+   after a restart), only the first one -- the leader -- looks it up and
+   reads it; the others sleep on the slot's futex and then share the
+   result from shared memory.  A finished result stays usable for
+   FLIGHT_GRACE_MSEC so that stragglers of the same burst benefit too. */
+
+static void
+setup_flights(void)
+{
+    flights = mmap(NULL, sizeof(struct FlightSlot) * FLIGHT_SLOTS,
+                   PROT_READ|PROT_WRITE, MAP_SHARED|MAP_ANONYMOUS, -1, 0);
+    if (flights == MAP_FAILED) {
+        perror("mmap(2)");
+        exit(1);
+    }
+}
+
+/* Returns the slot for (dirfd, path) with the caller registered as a
+   reader, or NULL when the request should simply be served alone.
+   *leader is set if the caller has to fill the slot (and then call
+   flight_publish()); otherwise the slot holds a finished result. */
+static struct FlightSlot*
+flight_join(int dirfd, char *path, int *leader)
+{
+    struct FlightSlot *slot;
+    unsigned long h;
+    unsigned int w, now, start;
+
+    while (*path == '/') path++;
+    if (!flights || strlen(path) >= FLIGHT_PATH_MAX) return NULL;
+    h = hash_string(path, strlen(path));
+    slot = &flights[(h ^ dirfd) % FLIGHT_SLOTS];
+    start = msec_now();
+    for (;;) {
+        int mine;
+
+        w = __atomic_load_n(&slot->word, __ATOMIC_ACQUIRE);
+        now = msec_now();
+        mine = (slot->hash == h && slot->dirfd == dirfd
+                && strcmp(slot->path, path) == 0);
+        switch (FLIGHT_STATE(w)) {
+        case FLIGHT_FILLING:
+            if (kill(slot->owner, 0) < 0 && errno == ESRCH) {
+                /* the leader died; drop its fill */
+                __atomic_compare_exchange_n(&slot->word, &w, FLIGHT_EMPTY, 0,
+                                            __ATOMIC_ACQ_REL, __ATOMIC_RELAXED);
+                continue;
+            }
+            if (!mine || now - start >= FLIGHT_WAIT_MSEC) return NULL;
+            futex_wait(&slot->word, w, FLIGHT_WAIT_MSEC - (now - start));
+            continue;
+        case FLIGHT_DONE:
+            if (mine && now - slot->stamp < FLIGHT_GRACE_MSEC) {
+                if (!__atomic_compare_exchange_n(&slot->word, &w, w + FLIGHT_READER, 0,
+                                                 __ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+                    continue;
+                /* no one refills the slot while we read it, but someone
+                   may have between our look and the CAS and left the same
+                   word behind: look again now that it holds still */
+                if (slot->hash != h || slot->dirfd != dirfd
+                        || strcmp(slot->path, path) != 0) {
+                    __atomic_fetch_sub(&slot->word, FLIGHT_READER, __ATOMIC_RELEASE);
+                    continue;
+                }
+                *leader = 0;
+                flight_held = slot;
+                return slot;
+            }
+            /* fall through: an old result may be replaced once unused */
+        case FLIGHT_EMPTY:
+        default:
+            if (FLIGHT_READERS(w) != 0) return NULL;
+            if (!__atomic_compare_exchange_n(&slot->word, &w,
+                                             FLIGHT_FILLING|FLIGHT_READER, 0,
+                                             __ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+                continue;
+            slot->owner = getpid();
+            slot->stamp = now;
+            slot->dirfd = dirfd;
+            slot->hash = h;
+            strcpy(slot->path, path);
+            slot->ok = 0;
+            slot->is_dir = 0;
+            slot->has_body = 0;
+            slot->size = 0;
+            *leader = 1;
+            flight_held = slot;
+            return slot;
+        }
+    }
+}
+
+/* Stores the leader's result (and the body of a small file) in the
+   slot and wakes up the waiters.  The leader stays a reader. */
+static void
+flight_publish(struct FlightSlot *slot, struct FileInfo *info)
+{
+    slot->ok = info->ok;
+    slot->is_dir = info->is_dir;
+    slot->size = info->size;
+    if (info->ok && info->size <= FLIGHT_BODY_MAX) {
+        long done = 0;
+        ssize_t n;
+
+        while (done < info->size) {
+            n = pread(info->fd, slot->body + done, info->size - done, done);
+            if (n <= 0) break;
+            done += n;
+        }
+        slot->has_body = (done == info->size);
+    }
+    slot->stamp = msec_now();
+    __atomic_store_n(&slot->word, FLIGHT_DONE|FLIGHT_READER, __ATOMIC_RELEASE);
+    futex_wake(&slot->word);
+}
+
+static void
+flight_leave(struct FlightSlot *slot)
+{
+    flight_held = NULL;
+    __atomic_fetch_sub(&slot->word, FLIGHT_READER, __ATOMIC_RELEASE);
+}
+
+/* Called when log_exit() aborts a request: gives up the slot it still
+   holds, or a slot that would never be reused stays counted as read.
+   An unfinished fill is dropped and its waiters are woken up. */
+static void
+flight_abandon(void)
+{
+    struct FlightSlot *slot = flight_held;
+    unsigned int w;
+
+    if (!slot) return;
+    flight_held = NULL;
+    w = __atomic_load_n(&slot->word, __ATOMIC_ACQUIRE);
+    if (FLIGHT_STATE(w) == FLIGHT_FILLING) {
+        __atomic_store_n(&slot->word, FLIGHT_EMPTY, __ATOMIC_RELEASE);
+        futex_wake(&slot->word);
+        return;
+    }
+    __atomic_fetch_sub(&slot->word, FLIGHT_READER, __ATOMIC_RELEASE);
+}
+
+static void
+futex_wait(unsigned int *addr, unsigned int val, unsigned int msec)
+{
+    struct timespec ts;
+
+    ts.tv_sec = msec / 1000;
+    ts.tv_nsec = (msec % 1000) * 1000000L;
+    syscall(SYS_futex, addr, FUTEX_WAIT, val, &ts, NULL, 0);
+}
+
+static void
+futex_wake(unsigned int *addr)
+{
+    syscall(SYS_futex, addr, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+}
+
+/****** Connections ******************************************************/
+
+/* Buffered I/O on a client socket, replacing stdio.  A connection owns
+   only a small inline buffer; a full size buffer is leased from the
+   pool while a request does not fit in it or a response is being
+   written, and returned as soon as it is drained. */
+
+static void
+conn_init(struct Connection *conn, int fd)
+{
+    conn->fd = fd;
+    conn->rbuf = conn->inline_buf;
+    conn->rcapa = INLINE_BUF_SIZE;
+    conn->rpos = conn->rlen = 0;
+    conn->rlease = NULL;
+    conn->wlease = NULL;
+    conn->wlen = 0;
+    conn->h2 = NULL;
+}
+
+static void
+conn_close(struct Connection *conn)
+{
+    conn_flush(conn);
+    if (conn->rlease) iobuf_return(conn->rlease);
+    conn->rlease = NULL;
+    close(conn->fd);
+}
+
+/* Closes a connection whose request failed, dropping pending output. */
+static void
+conn_abort(struct Connection *conn)
+{
+    if (conn->rlease) iobuf_return(conn->rlease);
+    if (conn->wlease) iobuf_return(conn->wlease);
+    conn->rlease = conn->wlease = NULL;
+    conn->wlen = 0;
+    if (conn->h2) h2_session_free(conn->h2);
+    conn->h2 = NULL;
+    close(conn->fd);
+}
+
+/* Client sockets are non-blocking; this is where we block instead. */
+static void
+wait_socket(int fd, short events)
+{
+    struct pollfd pfd;
+    int n;
+
+    pfd.fd = fd;
+    pfd.events = events;
+    do {
+        n = poll(&pfd, 1, CONN_TIMEOUT_MSEC);
+    } while (n < 0 && errno == EINTR);
+    if (n < 0) log_exit("poll(2) failed: %s", strerror(errno));
+    if (n == 0) log_exit("connection timed out");
+}
+
+static struct IOBuf*
+iobuf_lease(void)
+{
+    struct IOBuf *buf;
+
+    if (!iobuf_free) {
+        struct IOBuf *slab;
+        int i;
+
+        slab = mmap(NULL, sizeof(struct IOBuf) * IOBUF_SLAB_COUNT,
+                    PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+        if (slab == MAP_FAILED)
+            log_exit("failed to allocate I/O buffers: %s", strerror(errno));
+        for (i = 0; i < IOBUF_SLAB_COUNT; i++)
+            iobuf_return(&slab[i]);
+    }
+    buf = iobuf_free;
+    iobuf_free = buf->next;
+    return buf;
+}
+
+static void
+iobuf_return(struct IOBuf *buf)
+{
+    buf->next = iobuf_free;
+    iobuf_free = buf;
+}
+
+/* Reads more input, moving to a leased buffer when the inline one is
+   full.  Returns the number of bytes read, 0 on EOF. */
+static int
+conn_fill(struct Connection *conn)
+{
+    ssize_t n;
+
+    if (conn->rpos > 0) {
+        memmove(conn->rbuf, conn->rbuf + conn->rpos, conn->rlen - conn->rpos);
+        conn->rlen -= conn->rpos;
+        conn->rpos = 0;
+    }
+    if (conn->rlen == conn->rcapa) {
+        if (conn->rlease) return -1;    /* caller asks for too long a line */
+        conn->rlease = iobuf_lease();
+        memcpy(conn->rlease->data, conn->rbuf, conn->rlen);
+        conn->rbuf = conn->rlease->data;
+        conn->rcapa = IOBUF_SIZE;
+    }
+    for (;;) {
+        n = read(conn->fd, conn->rbuf + conn->rlen, conn->rcapa - conn->rlen);
+        if (n >= 0) break;
+        if (errno == EAGAIN || errno == EWOULDBLOCK)
+            wait_socket(conn->fd, POLLIN);
+        else if (errno != EINTR)
+            break;
+    }
+    if (n < 0) log_exit("failed to read from socket: %s", strerror(errno));
+    conn->rlen += n;
+    return (int)n;
+}
+
+/* Like fgets(3): reads one line including its newline. */
+static char*
+conn_gets(struct Connection *conn, char *buf, size_t size)
+{
+    for (;;) {
+        char *start = conn->rbuf + conn->rpos;
+        size_t avail = conn->rlen - conn->rpos;
+        char *nl = memchr(start, '\n', avail);
+        size_t len;
+
+        if (nl || avail >= size - 1) {
+            len = nl ? (size_t)(nl - start) + 1 : size - 1;
+            if (len > size - 1) len = size - 1;
+        }
+        else if (conn_fill(conn) > 0) {
+            continue;
+        }
+        else {
+            if (avail == 0) return NULL;
+            len = avail;
+        }
+        memcpy(buf, start, len);
+        buf[len] = '\0';
+        conn->rpos += len;
+        return buf;
+    }
+}
+
+static size_t
+conn_read(struct Connection *conn, char *buf, size_t size)
+{
+    size_t done = 0;
+
+    while (done < size) {
+        size_t avail = conn->rlen - conn->rpos;
+
+        if (avail == 0 && size - done < conn->rcapa) {
+            if (conn_fill(conn) <= 0) break;
+            continue;
+        }
+        if (avail == 0) {
+            ssize_t n;
+
+            /* large bodies bypass the buffer */
+            n = read(conn->fd, buf + done, size - done);
+            if (n < 0 && errno == EINTR) continue;
+            if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                wait_socket(conn->fd, POLLIN);
+                continue;
+            }
+            if (n <= 0) break;
+            done += n;
+            continue;
+        }
+        if (avail > size - done) avail = size - done;
+        memcpy(buf + done, conn->rbuf + conn->rpos, avail);
+        conn->rpos += avail;
+        done += avail;
+    }
+    return done;
+}
+
+/* Gives the read buffer back once everything in it was consumed. */
+static void
+conn_release_input(struct Connection *conn)
+{
+    if (conn->rlease && conn->rpos == conn->rlen) {
+        iobuf_return(conn->rlease);
+        conn->rlease = NULL;
+        conn->rbuf = conn->inline_buf;
+        conn->rcapa = INLINE_BUF_SIZE;
+        conn->rpos = conn->rlen = 0;
+    }
+}
+
+/* Returns the free part of the output buffer, flushing it first when
+   it is full.  Data put there is committed by advancing conn->wlen. */
+static char*
+conn_wspace(struct Connection *conn, size_t *space)
+{
+    if (conn->wlease && conn->wlen == IOBUF_SIZE)
+        conn_flush(conn);
+    if (!conn->wlease) {
+        conn->wlease = iobuf_lease();
+        conn->wlen = 0;
+    }
+    *space = IOBUF_SIZE - conn->wlen;
+    return conn->wlease->data + conn->wlen;
+}
+
+static void
+conn_write(struct Connection *conn, const char *buf, size_t len)
+{
+    while (len > 0) {
+        size_t space;
+        char *p = conn_wspace(conn, &space);
+
+        if (space > len) space = len;
+        memcpy(p, buf, space);
+        conn->wlen += space;
+        buf += space;
+        len -= space;
+    }
+}
+
+static void
+conn_printf(struct Connection *conn, const char *fmt, ...)
+{
+    va_list ap;
+    size_t space;
+    char *p;
+    int n;
+
+    p = conn_wspace(conn, &space);
+    va_start(ap, fmt);
+    n = vsnprintf(p, space, fmt, ap);
+    va_end(ap);
+    if (n < 0) log_exit("vsnprintf(3) failed");
+    if ((size_t)n < space) {
+        conn->wlen += n;
+        return;
+    }
+    /* did not fit: format into a temporary buffer */
+    p = xmalloc(n + 1);
+    va_start(ap, fmt);
+    vsnprintf(p, n + 1, fmt, ap);
+    va_end(ap);
+    conn_write(conn, p, n);
+    free(p);
+}
+
+/* Writes out all buffered output and returns the buffer to the pool.
+   On an HTTP/2 connection the output is an HTTP/1 response to be
+   translated into frames first. */
+static int
+conn_flush(struct Connection *conn)
+{
+
+    if (!conn->wlease) return 0;
+    if (conn->h2)
+        h2_output(conn, conn->wlease->data, conn->wlen);
+    else
+        conn_send_raw(conn, conn->wlease->data, conn->wlen, 0);
+    iobuf_return(conn->wlease);
+    conn->wlease = NULL;
+    conn->wlen = 0;
+    return 0;
+}
+
+/* Writes bypassing the buffer (and HTTP/2 framing). */
+static void
+conn_send_raw(struct Connection *conn, const void *buf, size_t len, int flags)
+{
+    const char *p = buf;
+
+    while (len > 0) {
+        ssize_t n = send(conn->fd, p, len, flags);
+
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            wait_socket(conn->fd, POLLOUT);
+            continue;
+        }
+        if (n < 0) log_exit("failed to write to socket: %s", strerror(errno));
+        p += n;
+        len -= n;
+    }
+}
+
+/****** Tracing **********************************************************/
+
+/* Every request takes a timestamp at each phase boundary; the phase
+   durations go into histograms shared by all children, shown by the
+   stats route.  Requests slower than the slowlog threshold are logged
+   with their breakdown.  Timestamps come from the TSC where there is
+   one (a few ns to read); elsewhere from CLOCK_MONOTONIC, as the
+   coarse clock's jiffy resolution is too low for phases this short. */
+
+static void
+setup_trace(void)
+{
+    trace_area = mmap(NULL, sizeof(struct TraceArea),
+                      PROT_READ|PROT_WRITE, MAP_SHARED|MAP_ANONYMOUS, -1, 0);
+    if (trace_area == MAP_FAILED) {
+        perror("mmap(2)");
+        exit(1);
+    }
+#if defined(__x86_64__) || defined(__i386__)
+    {
+        struct timespec t0, t1, delay = { 0, 10000000 };
+        unsigned long long c0, c1;
+
+        clock_gettime(CLOCK_MONOTONIC, &t0);
+        c0 = trace_now();
+        nanosleep(&delay, NULL);
+        clock_gettime(CLOCK_MONOTONIC, &t1);
+        c1 = trace_now();
+        trace_ns_per_tick = ((t1.tv_sec - t0.tv_sec) * 1e9 + (t1.tv_nsec - t0.tv_nsec))
+                            / (double)(c1 - c0);
+    }
+#endif
+}
+
+static unsigned long long
+trace_now(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    unsigned int lo, hi;
+
+    __asm__ __volatile__("rdtsc" : "=a"(lo), "=d"(hi));
+    return ((unsigned long long)hi << 32) | lo;
+#else
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+#endif
+}
+
+static void
+trace_mark(struct HTTPRequest *req, enum Phase phase)
+{
+    req->trace_mark[phase] = trace_now();
+}
+
+/* Records the phase durations of a finished request. */
+static void
+trace_finish(struct HTTPRequest *req)
+{
+    unsigned long long ns[N_PHASES];
+    unsigned long long prev = req->trace_start;
+    int i;
+
+    trace_mark(req, PHASE_SEND);
+    for (i = 0; i < PHASE_TOTAL; i++) {
+        ns[i] = 0;
+        if (!req->trace_mark[i]) continue;
+        ns[i] = (unsigned long long)((req->trace_mark[i] - prev) * trace_ns_per_tick);
+        prev = req->trace_mark[i];
+        hist_add(&trace_area->phases[i], ns[i]);
+    }
+    ns[PHASE_TOTAL] = (unsigned long long)((prev - req->trace_start) * trace_ns_per_tick);
+    hist_add(&trace_area->phases[PHASE_TOTAL], ns[PHASE_TOTAL]);
+
+    if (slow_msec && ns[PHASE_TOTAL] >= slow_msec * 1000000ULL
+        && __sync_fetch_and_add(&trace_area->slow_seen, 1) % slow_sample == 0) {
+        log_warn("slow request: %s %s total=%lluus read=%lluus route=%lluus open=%lluus send=%lluus",
+                 req->method, req->path, ns[PHASE_TOTAL] / 1000,
+                 ns[PHASE_READ] / 1000, ns[PHASE_ROUTE] / 1000,
+                 ns[PHASE_OPEN] / 1000, ns[PHASE_SEND] / 1000);
+    }
+    if (capture_fd >= 0) capture_request(req, ns[PHASE_TOTAL]);
+}
+
+/* The capture file is opened with O_APPEND and every request is one
+   write(2), so the records of all children interleave whole.  They
+   are in order of completion; httpd2-replay sorts them by start. */
+static void
+open_capture(char *path)
+{
+    if (capture_fd >= 0) close(capture_fd);
+    capture_fd = open(path, O_WRONLY|O_CREAT|O_APPEND|O_CLOEXEC, 0644);
+    if (capture_fd < 0) {
+        perror(path);
+        exit(1);
+    }
+}
+
+/* Header fields that do not fit in CAPTURE_HEAD_MAX are dropped. */
+static void
+capture_request(struct HTTPRequest *req, unsigned long long total_ns)
+{
+    char buf[sizeof(struct CaptureRecord) + CAPTURE_HEAD_MAX];
+    struct CaptureRecord *rec = (struct CaptureRecord*)buf;
+    struct HTTPHeaderField *fields[64], *h;
+    struct timespec now;
+    char *p = buf + sizeof(struct CaptureRecord);
+    char *end = p + CAPTURE_HEAD_MAX;
+    int n = 0, len;
+
+    clock_gettime(CLOCK_REALTIME, &now);
+    len = snprintf(p, end - p, "%s %s HTTP/1.%d\r\n",
+                   req->method, req->path, req->protocol_minor_version);
+    if (len >= end - p) return;
+    p += len;
+    /* the list is in reverse order */
+    for (h = req->header; h && n < 64; h = h->next)
+        fields[n++] = h;
+    while (n-- > 0) {
+        size_t vlen = strcspn(fields[n]->value, "\r\n");
+
+        len = snprintf(p, end - p, "%s: %.*s\r\n", fields[n]->name, (int)vlen, fields[n]->value);
+        if (len >= end - p) break;
+        p += len;
+    }
+    rec->magic = CAPTURE_MAGIC;
+    rec->head_len = p - (buf + sizeof(struct CaptureRecord));
+    rec->start_usec = (unsigned long long)now.tv_sec * 1000000 + now.tv_nsec / 1000
+                      - total_ns / 1000;
+    rec->duration_usec = total_ns / 1000;
+    rec->body_len = req->length;
+    rec->bytes_sent = req->bytes_sent;
+    rec->pid = getpid();
+    rec->status = req->status;
+    if (write(capture_fd, buf, p - buf) < 0)
+        log_warn("capture write failed: %s", strerror(errno));
+}
+
+static int
+hist_bucket(unsigned long long v)
+{
+    int e;
+
+    if (v < 16) return (int)v;
+    e = 63 - __builtin_clzll(v);
+    return (e - 3) * 16 + (int)((v >> (e - 4)) & 15);
+}
+
+/* the lowest value falling into bucket */
+static unsigned long long
+hist_value(int bucket)
+{
+    int e;
+
+    if (bucket < 16) return bucket;
+    e = bucket / 16 + 3;
+    return (16ULL + bucket % 16) << (e - 4);
+}
+
+static void
+hist_add(struct Histogram *hist, unsigned long long v)
+{
+    unsigned long long max;
+
+    __atomic_fetch_add(&hist->buckets[hist_bucket(v)], 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&hist->count, 1, __ATOMIC_RELAXED);
+    max = __atomic_load_n(&hist->max, __ATOMIC_RELAXED);
+    while (v > max && !__atomic_compare_exchange_n(&hist->max, &max, v, 0,
+                                                   __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        ;
+}
+
+static unsigned long long
+hist_percentile(struct Histogram *hist, double pct)
+{
+    double rank = hist->count * pct / 100.0;
+    unsigned long target, seen = 0;
+    int i;
+
+    /* nearest rank: the smallest value with pct% of all at or below it */
+    target = (unsigned long)rank;
+    if (target < rank) target++;
+    if (target == 0) target = 1;
+    for (i = 0; i < HIST_BUCKETS; i++) {
+        seen += hist->buckets[i];
+        if (seen >= target) return hist_value(i);
+    }
+    return hist->max;
+}
+
+/****** Warm-up **********************************************************/
+
+/* After a restart every file is a page cache and dentry cache miss.
+   A manifest lists the files to touch before clients ask for them:
+
+       [<host>] <path> [hot]
+
+   one per line, most requested first.  GET <stats route>/manifest
+   prints one captured from the live request counts.  The files are
+   read ahead by a separate process at idle I/O priority while the
+   server already accepts connections; "hot" files are also mlock()ed
+   and stay locked for as long as that process lives.  Only kernel
+   caches are warmed.  The shared file cache is bypassed: its entries
+   expire after FILE_CACHE_TTL seconds, long before most of the files
+   are asked for, and would only push out the lookups of live requests.
+   The per-process caches (listings, pooled buffers) belong to the
+   workers or children and cannot be filled from outside. */
+
+static void
+setup_hot(void)
+{
+    hot_slots = mmap(NULL, sizeof(struct HotSlot) * HOT_SLOTS,
+                     PROT_READ|PROT_WRITE, MAP_SHARED|MAP_ANONYMOUS, -1, 0);
+    if (hot_slots == MAP_FAILED) {
+        perror("mmap(2)");
+        exit(1);
+    }
+}
+
+static void
+open_warmup(char *path)
+{
+    if (warmup_file) fclose(warmup_file);
+    warmup_file = fopen(path, "r");
+    if (!warmup_file) {
+        perror(path);
+        exit(1);
+    }
+}
+
+/* Counts a successful file response for the captured manifest. */
+static void
+count_hit(struct HTTPRequest *req)
+{
+    struct HotSlot *slot;
+    unsigned long h, old;
+    size_t len = strlen(req->path);
+
+    if (!hot_slots || len >= HOT_PATH_MAX) return;
+    h = hash_string(req->path, len) ^ (unsigned long)req->vhost;
+    if (h == 0) h = 1;
+    slot = &hot_slots[h % HOT_SLOTS];
+    old = slot->hash;
+    if (old == h) {
+        __sync_fetch_and_add(&slot->hits, 1);
+        return;
+    }
+    if (__sync_sub_and_fetch(&slot->hits, 1) > 0) return;
+    if (!__sync_bool_compare_and_swap(&slot->hash, old, h)) return;
+    /* the slot is ours; a reader may see a half written path, which
+       then simply fails to resolve when it is warmed up */
+    slot->vhost = req->vhost;
+    memcpy(slot->path, req->path, len + 1);
+    slot->hits = 1;
+}
+
+static int
+cmp_hot_slot(const void *a, const void *b)
+{
+    long x = (*(struct HotSlot**)a)->hits;
+    long y = (*(struct HotSlot**)b)->hits;
+
+    return x < y ? 1 : x > y ? -1 : 0;
+}
+
+static void
+output_manifest(struct Connection *conn)
+{
+    struct HotSlot **list;
+    int i, n = 0;
+
+    list = xmalloc(sizeof(struct HotSlot*) * HOT_SLOTS);
+    for (i = 0; i < HOT_SLOTS; i++) {
+        if (hot_slots[i].hash && hot_slots[i].hits > 0 && hot_slots[i].path[0] == '/')
+            list[n++] = &hot_slots[i];
+    }
+    qsort(list, n, sizeof(struct HotSlot*), cmp_hot_slot);
+    for (i = 0; i < n; i++) {
+        conn_printf(conn, "%s %s%s\n", list[i]->vhost->name, list[i]->path,
+                    i < WARMUP_HOT_MARK ? " hot" : "");
+    }
+    free(list);
+}
+
+/* Forks the warm-up process.  It goes away with the server. */
+static void
+start_warmup(void)
+{
+    struct Listener *l;
+    char buf[LINE_BUF_SIZE];
+    pid_t pid;
+
+    pid = fork();
+    if (pid < 0) log_exit("fork(2) failed: %s", strerror(errno));
+    if (pid != 0) {
+        fclose(warmup_file);
+        warmup_file = NULL;
+        return;
+    }
+    for (l = listeners; l; l = l->next)
+        close(l->fd);
+    prctl(PR_SET_PDEATHSIG, SIGTERM);
+    if (getppid() == 1) exit(0);    /* the server is already gone */
+    syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0, IOPRIO_CLASS_IDLE << IOPRIO_CLASS_SHIFT);
+    setpriority(PRIO_PROCESS, 0, 19);
+    while (fgets(buf, sizeof buf, warmup_file)) {
+        char line[LINE_BUF_SIZE];
+        char *args[3];
+        int n = 0, hot = 0;
+        char *p;
+
+        strcpy(line, buf);
+        for (p = strtok(buf, " \t\r\n"); p && n < 3; p = strtok(NULL, " \t\r\n"))
+            args[n++] = p;
+        if (n == 0 || args[0][0] == '#') continue;
+        if (strcmp(args[n - 1], "hot") == 0) {
+            hot = 1;
+            n--;
+        }
+        if (n == 1 && args[0][0] == '/')
+            warmup_entry(default_vhost, args[0], hot);
+        else if (n == 2 && args[1][0] == '/')
+            warmup_entry(lookup_vhost(args[0]), args[1], hot);
+        else
+            log_warn("bad warm-up manifest line: %s", strtok(line, "\r\n"));
+    }
+    fclose(warmup_file);
+    if (warmup_locked == 0) exit(0);
+    for (;;)
+        pause();        /* keep the locked pages resident */
+}
+
+static void
+warmup_entry(struct VirtualHost *vhost, char *path, int hot)
+{
+    struct Route *route;
+
+    route = lookup_route(vhost->route_root, path);
+    if (!route) return;
+    if (route->type == ROUTE_STATIC) {
+        struct FileInfo *info;
+
+        info = get_fileinfo(route->dirfd, path + route->prefixlen, 0);
+        if (info->ok && info->size > 0)
+            warmup_range(info->fd, NULL, 0, info->size, hot);
+        free_fileinfo(info);
+    }
+    else if (route->type == ROUTE_PACK) {
+        struct Pack *pack = route->pack;
+        struct PackEntry *ent;
+
+        ent = find_pack_entry(pack, path + route->prefixlen);
+        if (!ent) return;
+        warmup_range(pack->fd, pack->map, ent->body_offset, ent->body_size, hot);
+        if (ent->gzip_offset)
+            warmup_range(pack->fd, pack->map, ent->gzip_offset, ent->gzip_size, hot);
+    }
+}
+
+/* Reads a file range ahead and, if hot and within the limit, locks it
+   in memory.  map is the whole file mapped already, or NULL. */
+static void
+warmup_range(int fd, char *map, off_t offset, size_t len, int hot)
+{
+    long pagesize = sysconf(_SC_PAGESIZE);
+    off_t start;
+    char *p;
+
+    posix_fadvise(fd, offset, len, POSIX_FADV_WILLNEED);
+    if (!hot || warmup_locked + len > warmup_mlock_max) return;
+    start = offset & ~(off_t)(pagesize - 1);
+    len += offset - start;
+    if (map) {
+        p = map + start;
+    }
+    else {
+        p = mmap(NULL, len, PROT_READ, MAP_SHARED, fd, start);
+        if (p == MAP_FAILED) return;
+    }
+    if (mlock(p, len) < 0) {
+        log_warn("warm-up: mlock(2) failed: %s", strerror(errno));
+        warmup_mlock_max = 0;   /* most likely RLIMIT_MEMLOCK; stop trying */
+        if (!map) munmap(p, len);
+        return;
+    }
+    warmup_locked += len;
+}
+
+/****** HTTP/2 ***********************************************************/
+
+/* Cleartext HTTP/2 (RFC 7540), entered either with the connection
+   preface ("prior knowledge") or by an HTTP/1.1 "Upgrade: h2c" request.
+   Requests are read from any number of streams and handed, in the order
+   they became complete, to the same respond_to() as HTTP/1.  The handlers
+   keep writing HTTP/1 responses to the Connection; conn_flush() hands
+   them to h2_output(), which turns the status line and header fields
+   into a HEADERS frame at once and queues the rest on the stream, up to
+   H2_STREAM_BUFFER bytes.  File bodies, from a docroot or a pack, are
+   queued as a file range and framed around sendfile(2).  h2_pump() then
+   sends one DATA frame of every stream with a body pending per round,
+   as far as the flow control windows allow, so a large or slow-to-drain
+   response shares the connection with the ones behind it instead of
+   holding them up.  Only the handlers run one at a time: a slow upstream
+   still delays the streams queued after it.  Stream priorities are
+   ignored.  A connection idle for CONN_TIMEOUT_MSEC is closed with a
+   GOAWAY.  The HPACK encoder only sends literals, which keeps it
+   stateless; the decoder implements all of RFC 7541. */
+
+static const char *hpack_static_table[][2] = {
+    { ":authority", "" },
+    { ":method", "GET" },
+    { ":method", "POST" },
+    { ":path", "/" },
+    { ":path", "/index.html" },
+    { ":scheme", "http" },
+    { ":scheme", "https" },
+    { ":status", "200" },
+    { ":status", "204" },
+    { ":status", "206" },
+    { ":status", "304" },
+    { ":status", "400" },
+    { ":status", "404" },
+    { ":status", "500" },
+    { "accept-charset", "" },
+    { "accept-encoding", "gzip, deflate" },
+    { "accept-language", "" },
+    { "accept-ranges", "" },
+    { "accept", "" },
+    { "access-control-allow-origin", "" },
+    { "age", "" },
+    { "allow", "" },
+    { "authorization", "" },
+    { "cache-control", "" },
+    { "content-disposition", "" },
+    { "content-encoding", "" },
+    { "content-language", "" },
+    { "content-length", "" },
+    { "content-location", "" },
+    { "content-range", "" },
+    { "content-type", "" },
+    { "cookie", "" },
+    { "date", "" },
+    { "etag", "" },
+    { "expect", "" },
+    { "expires", "" },
+    { "from", "" },
+    { "host", "" },
+    { "if-match", "" },
+    { "if-modified-since", "" },
+    { "if-none-match", "" },
+    { "if-range", "" },
+    { "if-unmodified-since", "" },
+    { "last-modified", "" },
+    { "link", "" },
+    { "location", "" },
+    { "max-forwards", "" },
+    { "proxy-authenticate", "" },
+    { "proxy-authorization", "" },
+    { "range", "" },
+    { "referer", "" },
+    { "refresh", "" },
+    { "retry-after", "" },
+    { "server", "" },
+    { "set-cookie", "" },
+    { "strict-transport-security", "" },
+    { "transfer-encoding", "" },
+    { "user-agent", "" },
+    { "vary", "" },
+    { "via", "" },
+    { "www-authenticate", "" }
+};
+
+#define HPACK_STATIC_ENTRIES 61
+
+/* RFC 7541 Appendix B; the last one is EOS */
+static const unsigned int hpack_huffman_codes[257] = {
+    0x1ff8, 0x7fffd8, 0xfffffe2, 0xfffffe3, 0xfffffe4, 0xfffffe5,
+    0xfffffe6, 0xfffffe7, 0xfffffe8, 0xffffea, 0x3ffffffc, 0xfffffe9,
+    0xfffffea, 0x3ffffffd, 0xfffffeb, 0xfffffec, 0xfffffed, 0xfffffee,
+    0xfffffef, 0xffffff0, 0xffffff1, 0xffffff2, 0x3ffffffe, 0xffffff3,
+    0xffffff4, 0xffffff5, 0xffffff6, 0xffffff7, 0xffffff8, 0xffffff9,
+    0xffffffa, 0xffffffb, 0x14, 0x3f8, 0x3f9, 0xffa,
+    0x1ff9, 0x15, 0xf8, 0x7fa, 0x3fa, 0x3fb,
+    0xf9, 0x7fb, 0xfa, 0x16, 0x17, 0x18,
+    0x0, 0x1, 0x2, 0x19, 0x1a, 0x1b,
+    0x1c, 0x1d, 0x1e, 0x1f, 0x5c, 0xfb,
+    0x7ffc, 0x20, 0xffb, 0x3fc, 0x1ffa, 0x21,
+    0x5d, 0x5e, 0x5f, 0x60, 0x61, 0x62,
+    0x63, 0x64, 0x65, 0x66, 0x67, 0x68,
+    0x69, 0x6a, 0x6b, 0x6c, 0x6d, 0x6e,
+    0x6f, 0x70, 0x71, 0x72, 0xfc, 0x73,
+    0xfd, 0x1ffb, 0x7fff0, 0x1ffc, 0x3ffc, 0x22,
+    0x7ffd, 0x3, 0x23, 0x4, 0x24, 0x5,
+    0x25, 0x26, 0x27, 0x6, 0x74, 0x75,
+    0x28, 0x29, 0x2a, 0x7, 0x2b, 0x76,
+    0x2c, 0x8, 0x9, 0x2d, 0x77, 0x78,
+    0x79, 0x7a, 0x7b, 0x7ffe, 0x7fc, 0x3ffd,
+    0x1ffd, 0xffffffc, 0xfffe6, 0x3fffd2, 0xfffe7, 0xfffe8,
+    0x3fffd3, 0x3fffd4, 0x3fffd5, 0x7fffd9, 0x3fffd6, 0x7fffda,
+    0x7fffdb, 0x7fffdc, 0x7fffdd, 0x7fffde, 0xffffeb, 0x7fffdf,
+    0xffffec, 0xffffed, 0x3fffd7, 0x7fffe0, 0xffffee, 0x7fffe1,
+    0x7fffe2, 0x7fffe3, 0x7fffe4, 0x1fffdc, 0x3fffd8, 0x7fffe5,
+    0x3fffd9, 0x7fffe6, 0x7fffe7, 0xffffef, 0x3fffda, 0x1fffdd,
+    0xfffe9, 0x3fffdb, 0x3fffdc, 0x7fffe8, 0x7fffe9, 0x1fffde,
+    0x7fffea, 0x3fffdd, 0x3fffde, 0xfffff0, 0x1fffdf, 0x3fffdf,
+    0x7fffeb, 0x7fffec, 0x1fffe0, 0x1fffe1, 0x3fffe0, 0x1fffe2,
+    0x7fffed, 0x3fffe1, 0x7fffee, 0x7fffef, 0xfffea, 0x3fffe2,
+    0x3fffe3, 0x3fffe4, 0x7ffff0, 0x3fffe5, 0x3fffe6, 0x7ffff1,
+    0x3ffffe0, 0x3ffffe1, 0xfffeb, 0x7fff1, 0x3fffe7, 0x7ffff2,
+    0x3fffe8, 0x1ffffec, 0x3ffffe2, 0x3ffffe3, 0x3ffffe4, 0x7ffffde,
+    0x7ffffdf, 0x3ffffe5, 0xfffff1, 0x1ffffed, 0x7fff2, 0x1fffe3,
+    0x3ffffe6, 0x7ffffe0, 0x7ffffe1, 0x3ffffe7, 0x7ffffe2, 0xfffff2,
+    0x1fffe4, 0x1fffe5, 0x3ffffe8, 0x3ffffe9, 0xffffffd, 0x7ffffe3,
+    0x7ffffe4, 0x7ffffe5, 0xfffec, 0xfffff3, 0xfffed, 0x1fffe6,
+    0x3fffe9, 0x1fffe7, 0x1fffe8, 0x7ffff3, 0x3fffea, 0x3fffeb,
+    0x1ffffee, 0x1ffffef, 0xfffff4, 0xfffff5, 0x3ffffea, 0x7ffff4,
+    0x3ffffeb, 0x7ffffe6, 0x3ffffec, 0x3ffffed, 0x7ffffe7, 0x7ffffe8,
+    0x7ffffe9, 0x7ffffea, 0x7ffffeb, 0xffffffe, 0x7ffffec, 0x7ffffed,
+    0x7ffffee, 0x7ffffef, 0x7fffff0, 0x3ffffee, 0x3fffffff,
+};
+static const unsigned char hpack_huffman_lens[257] = {
+    13, 23, 28, 28, 28, 28, 28, 28, 28, 24, 30, 28, 28, 30, 28, 28,
+    28, 28, 28, 28, 28, 28, 30, 28, 28, 28, 28, 28, 28, 28, 28, 28,
+    6, 10, 10, 12, 13, 6, 8, 11, 10, 10, 8, 11, 8, 6, 6, 6,
+    5, 5, 5, 6, 6, 6, 6, 6, 6, 6, 7, 8, 15, 6, 12, 10,
+    13, 6, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7,
+    7, 7, 7, 7, 7, 7, 7, 7, 8, 7, 8, 13, 19, 13, 14, 6,
+    15, 5, 6, 5, 6, 5, 6, 6, 6, 5, 7, 7, 6, 6, 6, 5,
+    6, 7, 6, 5, 5, 6, 7, 7, 7, 7, 7, 15, 11, 14, 13, 28,
+    20, 22, 20, 20, 22, 22, 22, 23, 22, 23, 23, 23, 23, 23, 24, 23,
+    24, 24, 22, 23, 24, 23, 23, 23, 23, 21, 22, 23, 22, 23, 23, 24,
+    22, 21, 20, 22, 22, 23, 23, 21, 23, 22, 22, 24, 21, 22, 23, 23,
+    21, 21, 22, 21, 23, 22, 23, 23, 20, 22, 22, 22, 23, 22, 22, 23,
+    26, 26, 20, 19, 22, 23, 22, 25, 26, 26, 26, 27, 27, 26, 24, 25,
+    19, 21, 26, 27, 27, 26, 27, 24, 21, 21, 26, 26, 28, 27, 27, 27,
+    20, 24, 20, 21, 22, 21, 21, 23, 22, 22, 25, 25, 24, 24, 26, 23,
+    26, 27, 26, 26, 27, 27, 27, 27, 27, 28, 27, 27, 27, 27, 27, 26,
+    30,
+};
+
+/* The Huffman code as a binary tree, built on first use: node 0 is the
+   root, a child < 0 is the leaf of symbol -child - 1. */
+static short hpack_huffman_tree[512][2];
+static int hpack_huffman_nodes = 0;
+
+static void
+hpack_build_huffman_tree(void)
+{
+    int sym, bit;
+
+    hpack_huffman_nodes = 1;
+    for (sym = 0; sym < 257; sym++) {
+        unsigned int code = hpack_huffman_codes[sym];
+        int len = hpack_huffman_lens[sym];
+        int node = 0;
+
+        for (bit = len - 1; bit > 0; bit--) {
+            int b = (code >> bit) & 1;
+
+            if (hpack_huffman_tree[node][b] == 0)
+                hpack_huffman_tree[node][b] = hpack_huffman_nodes++;
+            node = hpack_huffman_tree[node][b];
+        }
+        hpack_huffman_tree[node][code & 1] = -sym - 1;
+    }
+}
+
+/* Returns the decoded length, or -1 on a malformed string. */
+static long
+hpack_huffman_decode(const unsigned char *src, size_t len, char *dst, size_t size)
+{
+    size_t i, n = 0;
+    int node = 0, depth = 0, ones = 1;
+
+    if (!hpack_huffman_nodes) hpack_build_huffman_tree();
+    for (i = 0; i < len; i++) {
+        int bit;
+
+        for (bit = 7; bit >= 0; bit--) {
+            int b = (src[i] >> bit) & 1;
+            int next = hpack_huffman_tree[node][b];
+
+            ones = ones && b;
+            depth++;
+            if (next < 0) {
+                if (next == -257 || n == size) return -1;   /* EOS */
+                dst[n++] = (char)(-next - 1);
+                node = depth = 0;
+                ones = 1;
+            }
+            else if (next == 0) {
+                return -1;
+            }
+            else {
+                node = next;
+            }
+        }
+    }
+    /* padding: at most 7 bits, all ones */
+    if (depth > 7 || !ones) return -1;
+    return (long)n;
+}
+
+/* Decodes an integer with an n bit prefix; returns -1 on error. */
+static long
+hpack_decode_int(const unsigned char **pp, const unsigned char *end, int n)
+{
+    const unsigned char *p = *pp;
+    unsigned long max = (1UL << n) - 1;
+    unsigned long v;
+    int shift = 0;
+
+    if (p == end) return -1;
+    v = *p++ & max;
+    if (v == max) {
+        for (;;) {
+            if (p == end || shift > 28) return -1;
+            v += (unsigned long)(*p & 0x7f) << shift;
+            shift += 7;
+            if (!(*p++ & 0x80)) break;
+        }
+    }
+    *pp = p;
+    return (long)v;
+}
+
+/* Decodes a string literal into a malloc()ed buffer. */
+static char*
+hpack_decode_string(const unsigned char **pp, const unsigned char *end)
+{
+    int huffman;
+    long len;
+    char *str;
+
+    if (*pp == end) return NULL;
+    huffman = **pp & 0x80;
+    len = hpack_decode_int(pp, end, 7);
+    if (len < 0 || len > end - *pp) return NULL;
+    if (huffman) {
+        long n;
+
+        /* the shortest code is 5 bits */
+        str = xmalloc(len * 8 / 5 + 1);
+        n = hpack_huffman_decode(*pp, len, str, len * 8 / 5);
+        if (n < 0) {
+            free(str);
+            return NULL;
+        }
+        str[n] = '\0';
+    }
+    else {
+        str = xmalloc(len + 1);
+        memcpy(str, *pp, len);
+        str[len] = '\0';
+    }
+    *pp += len;
+    return str;
+}
+
+/* Evicts the oldest entries until the table fits in size. */
+static void
+hpack_evict(struct HPackTable *t, size_t size)
+{
+    while (t->size > size && t->count > 0) {
+        struct HPackEntry *e = &t->entries[(t->head + t->count - 1) % t->capa];
+
+        t->size -= e->size;
+        free(e->name);
+        free(e->value);
+        t->count--;
+    }
+}
+
+static void
+hpack_add(struct HPackTable *t, char *name, char *value)
+{
+    size_t size = strlen(name) + strlen(value) + 32;
+    struct HPackEntry *e;
+
+    hpack_evict(t, size <= t->max_size ? t->max_size - size : 0);
+    if (size > t->max_size) return;     /* too large: the table is now empty */
+    if (t->count == t->capa) {
+        struct HPackEntry *entries;
+        int i;
+
+        entries = xmalloc(sizeof(struct HPackEntry) * t->capa * 2);
+        for (i = 0; i < t->count; i++)
+            entries[i] = t->entries[(t->head + i) % t->capa];
+        free(t->entries);
+        t->entries = entries;
+        t->head = 0;
+        t->capa *= 2;
+    }
+    t->head = (t->head + t->capa - 1) % t->capa;
+    e = &t->entries[t->head];
+    e->name = xstrdup(name);
+    e->value = xstrdup(value);
+    e->size = size;
+    t->size += size;
+    t->count++;
+}
+
+/* Looks up an index of the combined static and dynamic table. */
+static int
+hpack_lookup(struct HPackTable *t, long index, const char **name, const char **value)
+{
+    if (index <= 0) return 0;
+    if (index <= HPACK_STATIC_ENTRIES) {
+        *name = hpack_static_table[index - 1][0];
+        *value = hpack_static_table[index - 1][1];
+        return 1;
+    }
+    index -= HPACK_STATIC_ENTRIES + 1;
+    if (index >= t->count) return 0;
+    *name = t->entries[(t->head + index) % t->capa].name;
+    *value = t->entries[(t->head + index) % t->capa].value;
+    return 1;
+}
+
+/* Decodes a header block into req.  Pseudo-header fields become the
+   method, path and Host:; the other fields are stored the way
+   read_header_field() stores them.  Returns 0 on a compression error,
+   after which the connection cannot continue. */
+static int
+hpack_decode_block(struct HPackTable *t, const unsigned char *p, size_t len,
+                   struct HTTPRequest *req)
+{
+    const unsigned char *end = p + len;
+
+    while (p < end) {
+        const char *sname, *svalue;
+        char *name, *value;
+        int add = 0;
+        long index;
+
+        if (*p & 0x80) {                        /* indexed */
+            index = hpack_decode_int(&p, end, 7);
+            if (!hpack_lookup(t, index, &sname, &svalue)) return 0;
+            name = xstrdup(sname);
+            value = xstrdup(svalue);
+        }
+        else if ((*p & 0xe0) == 0x20) {         /* table size update */
+            index = hpack_decode_int(&p, end, 5);
+            if (index < 0 || (size_t)index > H2_HEADER_TABLE_SIZE) return 0;
+            t->max_size = index;
+            hpack_evict(t, t->max_size);
+            continue;
+        }
+        else {                                  /* literal */
+            add = (*p & 0xc0) == 0x40;
+            index = hpack_decode_int(&p, end, add ? 6 : 4);
+            if (index < 0) return 0;
+            if (index > 0) {
+                if (!hpack_lookup(t, index, &sname, &svalue)) return 0;
+                name = xstrdup(sname);
+            }
+            else if (!(name = hpack_decode_string(&p, end))) {
+                return 0;
+            }
+            if (!(value = hpack_decode_string(&p, end))) {
+                free(name);
+                return 0;
+            }
+        }
+        if (add) hpack_add(t, name, value);
+        h2_add_field(req, name, value);
+    }
+    return 1;
+}
+
+static void
+h2_add_field(struct HTTPRequest *req, char *name, char *value)
+{
+    struct HTTPHeaderField *h;
+
+    if (strcmp(name, ":method") == 0 && !req->method) {
+        req->method = value;
+        upcase(req->method);
+        req->method_id = intern_method(req->method);
+        free(name);
+        return;
+    }
+    if (strcmp(name, ":path") == 0 && !req->path) {
+        req->path = value;
+        free(name);
+        return;
+    }
+    if (name[0] == ':' && strcmp(name, ":authority") != 0) {
+        free(name);
+        free(value);
+        return;
+    }
+    h = xmalloc(sizeof(struct HTTPHeaderField));
+    if (name[0] == ':') {
+        free(name);
+        name = xstrdup("host");
+    }
+    h->name = name;
+    h->value = xmalloc(strlen(value) + 3);
+    strcpy(h->value, value);
+    strcat(h->value, "\r\n");
+    free(value);
+    h->next = req->header;
+    req->header = h;
+}
+
+static void
+hpack_encode_int(struct H2Buffer *b, unsigned long v, int n, unsigned char first)
+{
+    unsigned long max = (1UL << n) - 1;
+
+    if (v < max) {
+        h2_buffer_putc(b, first | v);
+        return;
+    }
+    h2_buffer_putc(b, first | max);
+    for (v -= max; v >= 128; v >>= 7)
+        h2_buffer_putc(b, (v & 0x7f) | 0x80);
+    h2_buffer_putc(b, v);
+}
+
+static void
+hpack_encode_string(struct H2Buffer *b, const char *str, size_t len)
+{
+    hpack_encode_int(b, len, 7, 0);
+    h2_buffer_append(b, str, len);
+}
+
+static void
+h2_buffer_append(struct H2Buffer *b, const void *data, size_t len)
+{
+    if (b->len + len > b->capa) {
+        while (b->len + len > b->capa)
+            b->capa = b->capa ? b->capa * 2 : 1024;
+        b->ptr = xrealloc(b->ptr, b->capa);
+    }
+    memcpy(b->ptr + b->len, data, len);
+    b->len += len;
+}
+
+static void
+h2_buffer_putc(struct H2Buffer *b, int c)
+{
+    unsigned char ch = (unsigned char)c;
+
+    h2_buffer_append(b, &ch, 1);
+}
+
+/* Starts the HTTP/2 session.  upgraded is the HTTP/1.1 request which
+   asked for "Upgrade: h2c", which becomes stream 1; it is NULL with
+   prior knowledge. */
+static void
+h2_serve(struct Connection *conn, struct sockaddr *addr, struct HTTPRequest *upgraded)
+{
+    struct H2Session *s;
+    unsigned char settings[12];
+    char preface[H2_PREFACE_LEN];
+    int on = 1;
+
+    /* frames are small and carefully batched (MSG_MORE) already;
+       Nagle would only hold back the last one of each burst */
+    setsockopt(conn->fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof on);
+    s = xmalloc(sizeof(struct H2Session));
+    memset(s, 0, sizeof(struct H2Session));
+    s->decoder.capa = 16;
+    s->decoder.entries = xmalloc(sizeof(struct HPackEntry) * s->decoder.capa);
+    s->decoder.max_size = H2_HEADER_TABLE_SIZE;
+    s->send_window = H2_DEFAULT_WINDOW;
+    s->peer_window = H2_DEFAULT_WINDOW;
+    s->peer_max_frame = H2_DEFAULT_FRAME_SIZE;
+    conn_flush(conn);
+    conn->h2 = s;
+    if (upgraded) {
+        char *settings64 = lookup_header_field_value(upgraded, "HTTP2-Settings");
+
+        conn_send_raw(conn, H2_UPGRADE_RESPONSE, strlen(H2_UPGRADE_RESPONSE), 0);
+        h2_apply_upgrade_settings(conn, settings64);
+        h2_drop_upgrade_fields(upgraded);
+        s->last_stream_id = 1;
+        h2_queue_stream(s, h2_new_stream(s, 1, upgraded));
+    }
+    /* our SETTINGS: the only one we change is the stream limit */
+    put_be16(settings, H2_SETTINGS_MAX_CONCURRENT_STREAMS);
+    put_be32(settings + 2, H2_MAX_STREAMS);
+    put_be16(settings + 6, H2_SETTINGS_ENABLE_PUSH);
+    put_be32(settings + 8, 0);
+    h2_write_frame(conn, H2_SETTINGS, 0, 0, settings, sizeof settings);
+    if (conn_read(conn, preface, H2_PREFACE_LEN) != H2_PREFACE_LEN
+            || memcmp(preface, H2_PREFACE, H2_PREFACE_LEN) != 0)
+        h2_fail(conn, H2_PROTOCOL_ERROR, "bad HTTP/2 connection preface");
+
+    for (;;) {
+        while (s->ready_head) {
+            struct H2Stream *st = s->ready_head;
+
+            s->ready_head = st->next_ready;
+            if (!s->ready_head) s->ready_tail = NULL;
+            h2_answer(conn, st, addr);
+        }
+        if (h2_pump(conn)) {
+            /* take in a WINDOW_UPDATE or a new request between rounds */
+            if (h2_frame_ahead(conn) && !h2_read_frame(conn)) break;
+            continue;
+        }
+        /* nothing to send until the client says more */
+        if (s->goaway && s->n_streams == 0) break;
+        if (s->n_streams == 0 && !h2_wait_idle(conn)) break;
+        if (!h2_read_frame(conn)) break;
+    }
+    h2_goaway(conn, H2_NO_ERROR);
+    conn->h2 = NULL;
+    h2_session_free(s);
+}
+
+/* Frees a session with whatever streams it still has; conn_abort()
+   calls this for a session given up on by log_exit(). */
+static void
+h2_session_free(struct H2Session *s)
+{
+    while (s->streams)
+        h2_free_stream(s, s->streams);
+    hpack_evict(&s->decoder, 0);
+    free(s->decoder.entries);
+    free(s->hblock.ptr);
+    free(s->resp_head.ptr);
+    free(s);
+}
+
+/* Waits for the next frame of a connection with no open stream.
+   Returns 0 if none came within CONN_TIMEOUT_MSEC; the caller then
+   says GOAWAY instead of letting wait_socket() abort the connection. */
+static int
+h2_wait_idle(struct Connection *conn)
+{
+    struct pollfd pfd;
+    int n;
+
+    if (conn->rpos < conn->rlen) return 1;
+    pfd.fd = conn->fd;
+    pfd.events = POLLIN;
+    do {
+        n = poll(&pfd, 1, CONN_TIMEOUT_MSEC);
+    } while (n < 0 && errno == EINTR);
+    if (n < 0) log_exit("poll(2) failed: %s", strerror(errno));
+    return n > 0;
+}
+
+/* Returns nonzero if a frame can be read without blocking for long. */
+static int
+h2_frame_ahead(struct Connection *conn)
+{
+    struct pollfd pfd;
+
+    if (conn->rpos < conn->rlen) return 1;
+    pfd.fd = conn->fd;
+    pfd.events = POLLIN;
+    return poll(&pfd, 1, 0) > 0;
+}
+
+/* Peeks whether the client starts with the HTTP/2 preface. */
+static int
+h2_preface_ahead(struct Connection *conn)
+{
+    for (;;) {
+        size_t avail = conn->rlen - conn->rpos;
+        size_t n = avail < H2_PREFACE_LEN ? avail : H2_PREFACE_LEN;
+
+        if (memcmp(conn->rbuf + conn->rpos, H2_PREFACE, n) != 0) return 0;
+        if (n == H2_PREFACE_LEN) return 1;
+        if (conn_fill(conn) <= 0) return 0;
+    }
+}
+
+static int
+h2_upgrade_requested(struct HTTPRequest *req)
+{
+    char *upgrade, *connection;
+
+    if (req->protocol_minor_version < 1 || req->length != 0) return 0;
+    upgrade = lookup_header_field_value(req, "Upgrade");
+    connection = lookup_header_field_value(req, "Connection");
+    if (!upgrade || !connection) return 0;
+    if (!lookup_header_field_value(req, "HTTP2-Settings")) return 0;
+    return strstr(upgrade, "h2c") && strcasestr(connection, "upgrade");
+}
+
+/* Removes the header fields of the upgrade, which must not leak into
+   a proxied request. */
+static void
+h2_drop_upgrade_fields(struct HTTPRequest *req)
+{
+    struct HTTPHeaderField **hp = &req->header;
+
+    while (*hp) {
+        struct HTTPHeaderField *h = *hp;
+
+        if (strcasecmp(h->name, "Upgrade") == 0
+                || strcasecmp(h->name, "HTTP2-Settings") == 0
+                || strcasecmp(h->name, "Connection") == 0) {
+            *hp = h->next;
+            free(h->name);
+            free(h->value);
+            free(h);
+        }
+        else {
+            hp = &h->next;
+        }
+    }
+}
+
+/* HTTP2-Settings is a SETTINGS payload in base64url. */
+static void
+h2_apply_upgrade_settings(struct Connection *conn, char *settings64)
+{
+    unsigned char buf[256];
+    size_t n = 0;
+    unsigned long acc = 0;
+    int bits = 0;
+    char *p;
+
+    for (p = settings64; *p && *p != '\r' && *p != '\n' && n < sizeof buf; p++) {
+        int v;
+
+        if (*p >= 'A' && *p <= 'Z') v = *p - 'A';
+        else if (*p >= 'a' && *p <= 'z') v = *p - 'a' + 26;
+        else if (*p >= '0' && *p <= '9') v = *p - '0' + 52;
+        else if (*p == '-' || *p == '+') v = 62;
+        else if (*p == '_' || *p == '/') v = 63;
+        else continue;
+        acc = (acc << 6) | v;
+        bits += 6;
+        if (bits >= 8) {
+            bits -= 8;
+            buf[n++] = (acc >> bits) & 0xff;
+        }
+    }
+    h2_apply_settings(conn, buf, n - n % 6);
+}
+
+static struct H2Stream*
+h2_new_stream(struct H2Session *s, unsigned int id, struct HTTPRequest *req)
+{
+    struct H2Stream *st;
+
+    st = xmalloc(sizeof(struct H2Stream));
+    memset(st, 0, sizeof(struct H2Stream));
+    st->id = id;
+    st->req = req;
+    st->send_window = s->peer_window;
+    st->file_fd = -1;
+    st->next = s->streams;
+    s->streams = st;
+    s->n_streams++;
+    return st;
+}
+
+static struct H2Stream*
+h2_find_stream(struct H2Session *s, unsigned int id)
+{
+    struct H2Stream *st;
+
+    for (st = s->streams; st; st = st->next) {
+        if (st->id == id) return st;
+    }
+    return NULL;
+}
+
+static void
+h2_free_stream(struct H2Session *s, struct H2Stream *st)
+{
+    struct H2Stream **sp;
+
+    for (sp = &s->streams; *sp; sp = &(*sp)->next) {
+        if (*sp == st) {
+            *sp = st->next;
+            break;
+        }
+    }
+    s->n_streams--;
+    if (st->req) free_request(st->req);
+    h2_drop_body(st);
+    free(st->out.ptr);
+    free(st);
+}
+
+/* The request is complete: queue it to be answered. */
+static void
+h2_queue_stream(struct H2Session *s, struct H2Stream *st)
+{
+    struct HTTPRequest *req = st->req;
+
+    st->ready = 1;
+    req->length = req->body ? st->body_len : 0;
+    if (s->ready_tail)
+        s->ready_tail->next_ready = st;
+    else
+        s->ready_head = st;
+    s->ready_tail = st;
+}
+
+/* Runs one request through the usual request processing.  The stream
+   stays until h2_pump() has sent the rest of its body. */
+static void
+h2_answer(struct Connection *conn, struct H2Stream *st, struct sockaddr *addr)
+{
+    struct H2Session *s = conn->h2;
+    struct HTTPRequest *req = st->req;
+
+    s->current = st;
+    s->resp_body = 0;
+    s->resp_head.len = 0;
+    st->req = NULL;
+    if (st->reset) {
+        free_request(req);
+    }
+    else {
+        if (!req->method) req->method = xstrdup("");
+        if (!req->path) req->path = xstrdup("/");
+        process_request(req, conn, addr);
+    }
+    s->current = NULL;
+    st->answered = 1;
+}
+
+/* Called by process_request() once the handler is done. */
+static void
+h2_end_response(struct Connection *conn)
+{
+    struct H2Session *s = conn->h2;
+    struct H2Stream *st = s->current;
+
+    conn_flush(conn);
+    if (st->reset) return;
+    if (!s->resp_body) {
+        /* the handler never completed a header */
+        static const unsigned char status_500 = 0x80 | 14;
+
+        h2_write_headers(conn, st, &status_500, 1, H2_END_STREAM);
+        st->ended = 1;
+    }
+    /* otherwise h2_pump() ends the stream with its last DATA frame */
+}
+
+/* Receives what the handler wrote with conn_flush(). */
+static void
+h2_output(struct Connection *conn, const char *data, size_t len)
+{
+    struct H2Session *s = conn->h2;
+    struct H2Stream *st = s->current;
+    char *end;
+
+    if (!st || st->reset) return;
+    if (s->resp_body) {
+        h2_send_data(conn, st, data, len);
+        return;
+    }
+    h2_buffer_append(&s->resp_head, data, len);
+    end = memmem(s->resp_head.ptr, s->resp_head.len, "\r\n\r\n", 4);
+    if (!end) {
+        if (s->resp_head.len > H2_MAX_HEADER_BLOCK)
+            log_exit("response header too long");
+        return;
+    }
+    end += 4;
+    h2_send_response_header(conn, st, s->resp_head.ptr, end - s->resp_head.ptr);
+    s->resp_body = 1;
+    if (end < s->resp_head.ptr + s->resp_head.len)
+        h2_send_data(conn, st, end, s->resp_head.ptr + s->resp_head.len - end);
+}
+
+/* Translates an HTTP/1 status line and header into a HEADERS frame. */
+static void
+h2_send_response_header(struct Connection *conn, struct H2Stream *st, char *head, size_t len)
+{
+    static const char *hop_by_hop[] = {
+        "connection", "keep-alive", "proxy-connection", "transfer-encoding", "upgrade", NULL
+    };
+    struct H2Buffer block;
+    char *line, *next, *end = head + len;
+    int status, i;
+
+    memset(&block, 0, sizeof block);
+    next = memchr(head, '\n', len);
+    if (strncmp(head, "HTTP/", 5) != 0 || !(line = memchr(head, ' ', next - head)))
+        log_exit("bad response status line");
+    status = atoi(line + 1);
+    switch (status) {
+    case 200: h2_buffer_putc(&block, 0x80 | 8); break;
+    case 204: h2_buffer_putc(&block, 0x80 | 9); break;
+    case 206: h2_buffer_putc(&block, 0x80 | 10); break;
+    case 304: h2_buffer_putc(&block, 0x80 | 11); break;
+    case 400: h2_buffer_putc(&block, 0x80 | 12); break;
+    case 404: h2_buffer_putc(&block, 0x80 | 13); break;
+    case 500: h2_buffer_putc(&block, 0x80 | 14); break;
+    default: {
+        char buf[8];
+
+        /* literal without indexing, name :status from the static table */
+        snprintf(buf, sizeof buf, "%03d", status % 1000);
+        hpack_encode_int(&block, 8, 4, 0x00);
+        hpack_encode_string(&block, buf, 3);
+    }
+    }
+    for (line = next + 1; line < end; line = next + 1) {
+        char *colon, *value, *vend;
+
+        next = memchr(line, '\n', end - line);
+        if (!next) break;
+        colon = memchr(line, ':', next - line);
+        if (!colon) continue;
+        for (i = 0; line + i < colon; i++)
+            line[i] = (char)tolower((int)line[i]);
+        for (i = 0; hop_by_hop[i]; i++) {
+            if ((size_t)(colon - line) == strlen(hop_by_hop[i])
+                    && memcmp(line, hop_by_hop[i], colon - line) == 0)
+                break;
+        }
+        if (hop_by_hop[i]) continue;
+        value = colon + 1;
+        while (value < next && (*value == ' ' || *value == '\t')) value++;
+        vend = next;
+        while (vend > value && (vend[-1] == '\r' || vend[-1] == ' ')) vend--;
+        h2_buffer_putc(&block, 0x00);
+        hpack_encode_string(&block, line, colon - line);
+        hpack_encode_string(&block, value, vend - value);
+    }
+    h2_write_headers(conn, st, (unsigned char*)block.ptr, block.len, 0);
+    free(block.ptr);
+}
+
+/* Sends a header block, split into CONTINUATION frames if needed. */
+static void
+h2_write_headers(struct Connection *conn, struct H2Stream *st,
+                 const unsigned char *block, size_t len, int flags)
+{
+    struct H2Session *s = conn->h2;
+    int type = H2_HEADERS;
+
+    for (;;) {
+        size_t n = len < s->peer_max_frame ? len : s->peer_max_frame;
+
+        if (n == len) flags |= H2_END_HEADERS;
+        h2_write_frame(conn, type, flags, st->id, block, n);
+        block += n;
+        len -= n;
+        if (len == 0) break;
+        type = H2_CONTINUATION;
+        flags = 0;
+    }
+}
+
+/* Queues body bytes on the stream; a stream which has too many waits
+   for them to go out, while the others keep their turns. */
+static void
+h2_send_data(struct Connection *conn, struct H2Stream *st, const char *data, size_t len)
+{
+    if (st->reset) return;
+    if (st->file_fd >= 0) h2_drain(conn, st, 0);      /* the file goes first */
+    if (st->out_pos > 0) {
+        st->out.len -= st->out_pos;
+        memmove(st->out.ptr, st->out.ptr + st->out_pos, st->out.len);
+        st->out_pos = 0;
+    }
+    h2_buffer_append(&st->out, data, len);
+    if (h2_pending(st) > H2_STREAM_BUFFER) h2_drain(conn, st, H2_STREAM_BUFFER);
+}
+
+/* Queues a file body; h2_pump() frames it around sendfile(2).  The
+   handler may close fd, so the stream keeps a duplicate. */
+static void
+h2_send_file(struct Connection *conn, int fd, off_t offset, size_t len)
+{
+    struct H2Session *s = conn->h2;
+    struct H2Stream *st = s->current;
+
+    conn_flush(conn);
+    if (!st || st->reset || len == 0) return;
+    if (st->file_fd >= 0) h2_drain(conn, st, 0);
+    if (st->reset) return;
+    st->file_fd = fcntl(fd, F_DUPFD_CLOEXEC, 0);
+    if (st->file_fd < 0) log_exit("dup(2) failed: %s", strerror(errno));
+    st->file_offset = offset;
+    st->file_len = len;
+}
+
+static size_t
+h2_pending(struct H2Stream *st)
+{
+    return st->out.len - st->out_pos + st->file_len;
+}
+
+/* Sends frames of all streams until st has at most limit bytes pending,
+   reading the client's WINDOW_UPDATEs when the windows are shut. */
+static void
+h2_drain(struct Connection *conn, struct H2Stream *st, size_t limit)
+{
+    while (!st->reset && h2_pending(st) > limit) {
+        if (!h2_pump(conn) && !h2_read_frame(conn))
+            log_exit("connection closed while sending");
+    }
+}
+
+/* One round: a DATA frame of every stream with a body pending, as far as
+   its window and the connection's allow.  Streams whose handler is done
+   and whose body is out are ended and freed.  Returns nonzero if it sent
+   anything. */
+static int
+h2_pump(struct Connection *conn)
+{
+    struct H2Session *s = conn->h2;
+    struct H2Stream *st, *next;
+    int sent = 0;
+
+    for (st = s->streams; st; st = next) {
+        size_t pending, n, buffered;
+        long window;
+        int flags = 0;
+
+        next = st->next;
+        if (st->reset) {
+            h2_drop_body(st);
+            if (st->answered) h2_free_stream(s, st);
+            continue;
+        }
+        pending = h2_pending(st);
+        if (pending == 0) {
+            if (!st->answered) continue;
+            if (!st->ended) {
+                h2_write_frame(conn, H2_DATA, H2_END_STREAM, st->id, NULL, 0);
+                sent = 1;
+            }
+            h2_free_stream(s, st);
+            continue;
+        }
+        window = s->send_window < st->send_window ? s->send_window : st->send_window;
+        if (window <= 0) continue;
+        n = pending;
+        if (n > (unsigned long)window) n = window;
+        if (n > s->peer_max_frame) n = s->peer_max_frame;
+        buffered = st->out.len - st->out_pos;
+        if (buffered > 0 && n > buffered) n = buffered;
+        if (st->answered && n == pending) flags = H2_END_STREAM;
+        h2_write_body(conn, st, n, flags);
+        sent = 1;
+        if (flags) h2_free_stream(s, st);
+    }
+    return sent;
+}
+
+/* Sends one DATA frame of len bytes, from the buffer or else the file. */
+static void
+h2_write_body(struct Connection *conn, struct H2Stream *st, size_t len, int flags)
+{
+    struct H2Session *s = conn->h2;
+    unsigned char header[H2_FRAME_HEADER_SIZE];
+    size_t done = 0;
+
+    s->send_window -= len;
+    st->send_window -= len;
+    if (st->out_pos < st->out.len) {
+        h2_write_frame(conn, H2_DATA, flags, st->id, st->out.ptr + st->out_pos, len);
+        st->out_pos += len;
+        if (st->out_pos == st->out.len) st->out_pos = st->out.len = 0;
+        return;
+    }
+    h2_frame_header(header, len, H2_DATA, flags, st->id);
+    conn_send_raw(conn, header, sizeof header, MSG_MORE);
+    while (done < len) {
+        ssize_t r = sendfile(conn->fd, st->file_fd, &st->file_offset, len - done);
+
+        if (r < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                wait_socket(conn->fd, POLLOUT);
+                continue;
+            }
+            log_exit("sendfile(2) failed: %s", strerror(errno));
+        }
+        if (r == 0)
+            log_exit("file truncated");
+        done += r;
+    }
+    st->file_len -= len;
+    if (st->file_len == 0) h2_drop_body(st);
+}
+
+/* Forgets the body not sent yet, as for a reset stream. */
+static void
+h2_drop_body(struct H2Stream *st)
+{
+    st->out.len = st->out_pos = 0;
+    if (st->file_fd >= 0) close(st->file_fd);
+    st->file_fd = -1;
+    st->file_len = 0;
+}
+
+static void
+h2_frame_header(unsigned char *p, size_t len, int type, int flags, unsigned int id)
+{
+    p[0] = (len >> 16) & 0xff;
+    p[1] = (len >> 8) & 0xff;
+    p[2] = len & 0xff;
+    p[3] = type;
+    p[4] = flags;
+    put_be32(p + 5, id & 0x7fffffff);
+}
+
+static void
+h2_write_frame(struct Connection *conn, int type, int flags, unsigned int id,
+               const void *payload, size_t len)
+{
+    unsigned char header[H2_FRAME_HEADER_SIZE];
+
+    h2_frame_header(header, len, type, flags, id);
+    conn_send_raw(conn, header, sizeof header, len > 0 ? MSG_MORE : 0);
+    if (len > 0) conn_send_raw(conn, payload, len, 0);
+}
+
+static void
+h2_rst_stream(struct Connection *conn, unsigned int id, unsigned int code)
+{
+    unsigned char payload[4];
+
+    put_be32(payload, code);
+    h2_write_frame(conn, H2_RST_STREAM, 0, id, payload, 4);
+}
+
+static void
+h2_window_update(struct Connection *conn, unsigned int id, unsigned long inc)
+{
+    unsigned char payload[4];
+
+    put_be32(payload, inc);
+    h2_write_frame(conn, H2_WINDOW_UPDATE, 0, id, payload, 4);
+}
+
+static void
+h2_goaway(struct Connection *conn, unsigned int code)
+{
+    unsigned char payload[8];
+
+    put_be32(payload, conn->h2->last_stream_id);
+    put_be32(payload + 4, code);
+    h2_write_frame(conn, H2_GOAWAY, 0, 0, payload, 8);
+}
+
+/* A connection error: tell the client and give up. */
+static void
+h2_fail(struct Connection *conn, unsigned int code, const char *msg)
+{
+    h2_goaway(conn, code);
+    log_exit("HTTP/2: %s", msg);
+}
+
+/* Reads and handles one frame.  Returns 0 on EOF. */
+static int
+h2_read_frame(struct Connection *conn)
+{
+    static unsigned char payload[H2_DEFAULT_FRAME_SIZE];
+    unsigned char header[H2_FRAME_HEADER_SIZE];
+    size_t n, len;
+    unsigned int id;
+
+    n = conn_read(conn, (char*)header, sizeof header);
+    if (n == 0) return 0;
+    if (n < sizeof header) log_exit("HTTP/2: truncated frame");
+    len = (header[0] << 16) | (header[1] << 8) | header[2];
+    id = get_be32(header + 5) & 0x7fffffff;
+    if (len > sizeof payload)
+        h2_fail(conn, H2_FRAME_SIZE_ERROR, "frame too large");
+    if (conn_read(conn, (char*)payload, len) < len)
+        log_exit("HTTP/2: truncated frame");
+    if (conn->h2->hblock_stream && header[3] != H2_CONTINUATION)
+        h2_fail(conn, H2_PROTOCOL_ERROR, "expected CONTINUATION");
+    h2_handle_frame(conn, header[3], header[4], id, payload, len);
+    return 1;
+}
+
+static void
+h2_handle_frame(struct Connection *conn, int type, int flags, unsigned int id,
+                unsigned char *p, size_t len)
+{
+    struct H2Session *s = conn->h2;
+    struct H2Stream *st;
+
+    switch (type) {
+    case H2_DATA:
+        if (id == 0) h2_fail(conn, H2_PROTOCOL_ERROR, "DATA on stream 0");
+        /* give the flow control credit back at once: bodies are small
+           and the limit is enforced below */
+        if (len > 0) h2_window_update(conn, 0, len);
+        st = h2_find_stream(s, id);
+        if (!st || st->ready || st->reset) {
+            if (id > s->last_stream_id)
+                h2_fail(conn, H2_PROTOCOL_ERROR, "DATA on idle stream");
+            return;
+        }
+        if (flags & H2_PADDED) {
+            size_t pad = len > 0 ? p[0] : 0;
+
+            if (len == 0 || pad >= len)
+                h2_fail(conn, H2_PROTOCOL_ERROR, "bad padding");
+            p++;
+            len -= pad + 1;
+        }
+        if (st->body_len + len > MAX_REQUEST_BODY_LENGTH) {
+            h2_rst_stream(conn, id, H2_REFUSED_STREAM);
+            st->reset = 1;
+            h2_queue_stream(s, st);
+            return;
+        }
+        if (len > 0) {
+            st->req->body = xrealloc(st->req->body, st->body_len + len);
+            memcpy(st->req->body + st->body_len, p, len);
+            st->body_len += len;
+            if (!(flags & H2_END_STREAM)) h2_window_update(conn, id, len);
+        }
+        if (flags & H2_END_STREAM) h2_queue_stream(s, st);
+        break;
+
+    case H2_HEADERS:
+        if (id == 0 || !(id & 1))
+            h2_fail(conn, H2_PROTOCOL_ERROR, "bad stream id");
+        if (flags & H2_PADDED) {
+            size_t pad = len > 0 ? p[0] : 0;
+
+            if (len == 0 || pad >= len)
+                h2_fail(conn, H2_PROTOCOL_ERROR, "bad padding");
+            p++;
+            len -= pad + 1;
+        }
+        if (flags & H2_PRIORITY_FLAG) {
+            if (len < 5) h2_fail(conn, H2_FRAME_SIZE_ERROR, "short HEADERS");
+            p += 5;
+            len -= 5;
+        }
+        s->hblock.len = 0;
+        s->hblock_stream = id;
+        s->hblock_end_stream = flags & H2_END_STREAM;
+        h2_buffer_append(&s->hblock, p, len);
+        if (flags & H2_END_HEADERS) h2_end_headers(conn);
+        break;
+
+    case H2_CONTINUATION:
+        if (!s->hblock_stream || id != s->hblock_stream)
+            h2_fail(conn, H2_PROTOCOL_ERROR, "unexpected CONTINUATION");
+        if (s->hblock.len + len > H2_MAX_HEADER_BLOCK)
+            h2_fail(conn, H2_ENHANCE_YOUR_CALM, "header block too large");
+        h2_buffer_append(&s->hblock, p, len);
+        if (flags & H2_END_HEADERS) h2_end_headers(conn);
+        break;
+
+    case H2_PRIORITY:
+        break;
+
+    case H2_RST_STREAM:
+        if (len != 4) h2_fail(conn, H2_FRAME_SIZE_ERROR, "bad RST_STREAM");
+        st = h2_find_stream(s, id);
+        if (!st) break;
+        st->reset = 1;
+        if (!st->ready) h2_queue_stream(s, st);     /* to be freed */
+        break;
+
+    case H2_SETTINGS:
+        if (id != 0 || len % 6 != 0)
+            h2_fail(conn, H2_PROTOCOL_ERROR, "bad SETTINGS");
+        if (flags & H2_ACK) break;
+        h2_apply_settings(conn, p, len);
+        h2_write_frame(conn, H2_SETTINGS, H2_ACK, 0, NULL, 0);
+        break;
+
+    case H2_PING:
+        if (len != 8) h2_fail(conn, H2_FRAME_SIZE_ERROR, "bad PING");
+        if (!(flags & H2_ACK))
+            h2_write_frame(conn, H2_PING, H2_ACK, 0, p, 8);
+        break;
+
+    case H2_GOAWAY:
+        s->goaway = 1;
+        break;
+
+    case H2_WINDOW_UPDATE: {
+        unsigned long inc;
+
+        if (len != 4) h2_fail(conn, H2_FRAME_SIZE_ERROR, "bad WINDOW_UPDATE");
+        inc = get_be32(p) & 0x7fffffff;
+        if (id == 0) {
+            s->send_window += inc;
+            if (s->send_window > 0x7fffffffL)
+                h2_fail(conn, H2_FLOW_CONTROL_ERROR, "window too large");
+        }
+        else if ((st = h2_find_stream(s, id))) {
+            st->send_window += inc;
+        }
+        break;
+    }
+
+    default:
+        break;      /* unknown frames are ignored */
+    }
+}
+
+static void
+h2_apply_settings(struct Connection *conn, unsigned char *p, size_t len)
+{
+    struct H2Session *s = conn->h2;
+    size_t i;
+
+    for (i = 0; i + 6 <= len; i += 6) {
+        unsigned int id = get_be16(p + i);
+        unsigned long v = get_be32(p + i + 2);
+
+        if (id == H2_SETTINGS_INITIAL_WINDOW_SIZE) {
+            struct H2Stream *st;
+
+            if (v > 0x7fffffffUL)
+                h2_fail(conn, H2_FLOW_CONTROL_ERROR, "bad initial window");
+            for (st = s->streams; st; st = st->next)
+                st->send_window += (long)v - s->peer_window;
+            s->peer_window = v;
+        }
+        else if (id == H2_SETTINGS_MAX_FRAME_SIZE) {
+            if (v < H2_DEFAULT_FRAME_SIZE || v > 0xffffff)
+                h2_fail(conn, H2_PROTOCOL_ERROR, "bad max frame size");
+            s->peer_max_frame = v;
+        }
+    }
+}
+
+/* A complete header block: opens a stream, or ends one (trailers). */
+static void
+h2_end_headers(struct Connection *conn)
+{
+    struct H2Session *s = conn->h2;
+    struct HTTPRequest *req;
+    struct H2Stream *st;
+    unsigned int id = s->hblock_stream;
+
+    s->hblock_stream = 0;
+    req = xmalloc(sizeof(struct HTTPRequest));
+    memset(req, 0, sizeof(struct HTTPRequest));
+    req->protocol_minor_version = 1;
+    req->trace_start = trace_now();
+    if (!hpack_decode_block(&s->decoder, (unsigned char*)s->hblock.ptr, s->hblock.len, req)) {
+        free_request(req);
+        h2_fail(conn, H2_COMPRESSION_ERROR, "bad header block");
+    }
+    st = h2_find_stream(s, id);
+    if (st || id <= s->last_stream_id) {
+        /* trailers are decoded for the table's sake, and dropped */
+        free_request(req);
+        if (st && !st->ready && s->hblock_end_stream) h2_queue_stream(s, st);
+        return;
+    }
+    s->last_stream_id = id;
+    if (s->goaway || s->n_streams >= H2_MAX_STREAMS || !req->method || !req->path) {
+        h2_rst_stream(conn, id, req->method && req->path ? H2_REFUSED_STREAM : H2_PROTOCOL_ERROR);
+        free_request(req);
+        return;
+    }
+    st = h2_new_stream(s, id, req);
+    if (s->hblock_end_stream) h2_queue_stream(s, st);
+}
+
+static void
+put_be16(unsigned char *p, unsigned int v)
+{
+    p[0] = (v >> 8) & 0xff;
+    p[1] = v & 0xff;
+}
+
+static void
+put_be32(unsigned char *p, unsigned long v)
+{
+    p[0] = (v >> 24) & 0xff;
+    p[1] = (v >> 16) & 0xff;
+    p[2] = (v >> 8) & 0xff;
+    p[3] = v & 0xff;
+}
+
+static unsigned int
+get_be16(const unsigned char *p)
+{
+    return (p[0] << 8) | p[1];
+}
+
+static unsigned long
+get_be32(const unsigned char *p)
+{
+    return ((unsigned long)p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+}
+
+/****** Request Handling *************************************************/
+
+static void
+service(struct Connection *conn, struct sockaddr *addr)
+{
+    struct HTTPRequest *req;
+    unsigned long long start = trace_now();
+
+    if (h2_preface_ahead(conn)) {
+        h2_serve(conn, addr, NULL);
+        return;
+    }
+    req = read_request(conn);
+    req->trace_start = start;
+    if (h2_upgrade_requested(req)) {
+        h2_serve(conn, addr, req);
+        return;
+    }
+    process_request(req, conn, addr);
+}
+
+static void
+process_request(struct HTTPRequest *req, struct Connection *conn, struct sockaddr *addr)
+{
+    trace_mark(req, PHASE_READ);
+    if (ratelimit && !rate_request(addr))
+        too_many_requests_response(req, conn);
+    else
+        respond_to(req, conn);
+    if (conn->h2) h2_end_response(conn);
+    trace_finish(req);
+    if (ratelimit) rate_charge(addr, req->bytes_sent);
+    free_request(req);
+}
+
+static struct HTTPRequest*
+read_request(struct Connection *conn)
+{
+    struct HTTPRequest *req;
+    struct HTTPHeaderField *h;
+
+    req = xmalloc(sizeof(struct HTTPRequest));
+    memset(req, 0, sizeof(struct HTTPRequest));
+    read_request_line(req, conn);
+    req->header = NULL;
+    while ((h = read_header_field(conn)) != NULL) {
+        h->next = req->header;
+        req->header = h;
+    }
+    req->length = content_length(req);
+    if (req->length != 0) {
+        if (req->length > MAX_REQUEST_BODY_LENGTH)
+            log_exit("request body too long");
+        req->body = xmalloc(req->length);
+        if (conn_read(conn, req->body, req->length) < req->length)
+            log_exit("failed to read request body");
+    } else {
+        req->body = NULL;
+    }
+    conn_release_input(conn);
+    return req;
+}
+
+static void
+read_request_line(struct HTTPRequest *req, struct Connection *conn)
+{
+    char buf[LINE_BUF_SIZE];
+    char *path, *p;
+
+    if (!conn_gets(conn, buf, LINE_BUF_SIZE))
+        log_exit("no request line");
+    p = strchr(buf, ' ');       /* p (1) */
+    if (!p) log_exit("parse error on request line (1): %s", buf);
+    *p++ = '\0';
+    req->method = xmalloc(p - buf);
+    strcpy(req->method, buf);
+    upcase(req->method);
+    req->method_id = intern_method(req->method);
+
+    path = p;
+    p = strchr(path, ' ');      /* p (2) */
+    if (!p) log_exit("parse error on request line (2): %s", buf);
+    *p++ = '\0';
+    req->path = xmalloc(p - path);
+    strcpy(req->path, path);
+
+    if (strncasecmp(p, "HTTP/1.", strlen("HTTP/1.")) != 0)
+        log_exit("parse error on request line (3): %s", buf);
+    p += strlen("HTTP/1.");     /* p (3) */
+    req->protocol_minor_version = atoi(p);
+}
+
+static struct HTTPHeaderField*
+read_header_field(struct Connection *conn)
+{
+    struct HTTPHeaderField *h;
+    char buf[LINE_BUF_SIZE];
+    char *p;
+
+    if (!conn_gets(conn, buf, LINE_BUF_SIZE))
+        log_exit("failed to read request header field: %s", strerror(errno));
+    if ((buf[0] == '\n') || (strcmp(buf, "\r\n") == 0))
+        return NULL;
+
+    p = strchr(buf, ':');
+    if (!p) log_exit("parse error on request header field: %s", buf);
+    *p++ = '\0';
+    h = xmalloc(sizeof(struct HTTPHeaderField));
+    h->name = xmalloc(p - buf);
+    strcpy(h->name, buf);
+
+    p += strspn(p, " \t"); 
+    h->value = xmalloc(strlen(p) + 1);
+    strcpy(h->value, p);
+
+    return h;
+}
+
+static void
+upcase(char *str)
+{
+    char *p;
+
+    for (p = str; *p; p++) {
+        *p = (char)toupper((int)*p);
+    }
+}
+
+/* Maps a method name to its enum once, at parse time,
+   so that dispatching never compares strings. */
+static enum HTTPMethod
+intern_method(const char *name)
+{
+    switch (strlen(name)) {
+    case 3:
+        if (memcmp(name, "GET", 3) == 0) return METHOD_GET;
+        if (memcmp(name, "PUT", 3) == 0) return METHOD_PUT;
+        break;
+    case 4:
+        if (memcmp(name, "HEAD", 4) == 0) return METHOD_HEAD;
+        if (memcmp(name, "POST", 4) == 0) return METHOD_POST;
+        break;
+    case 5:
+        if (memcmp(name, "TRACE", 5) == 0) return METHOD_TRACE;
+        break;
+    case 6:
+        if (memcmp(name, "DELETE", 6) == 0) return METHOD_DELETE;
+        break;
+    case 7:
+        if (memcmp(name, "OPTIONS", 7) == 0) return METHOD_OPTIONS;
+        break;
+    }
+    return METHOD_UNKNOWN;
+}
+
+static void
+free_request(struct HTTPRequest *req)
+{
+    struct HTTPHeaderField *h, *head;
+
+    head = req->header;
+    while (head) {
+        h = head;
+        head = head->next;
+        free(h->name);
+        free(h->value);
+        free(h);
+    }
+    free(req->method);
+    free(req->path);
+    free(req->body);
+    free(req);
+}
+
+static long
+content_length(struct HTTPRequest *req)
+{
+    char *val;
+    long len;
+    
+    val = lookup_header_field_value(req, "Content-Length");
+    if (!val) return 0;
+    len = atol(val);
+    if (len < 0) log_exit("negative Content-Length value");
+    return len;
+}
+
+static char*
+lookup_header_field_value(struct HTTPRequest *req, char *name)
+{
+    struct HTTPHeaderField *h;
+
+    for (h = req->header; h; h = h->next) {
+        if (strcasecmp(h->name, name) == 0)
+            return h->value;
+    }
+    return NULL;
+}
+
+static void
+respond_to(struct HTTPRequest *req, struct Connection *conn)
+{
+    struct Route *route;
+
+    req->vhost = default_vhost;
+    if (req->method_id == METHOD_UNKNOWN) {
+        not_implemented(req, conn);
+        return;
+    }
+    req->vhost = lookup_vhost(lookup_header_field_value(req, "Host"));
+    route = lookup_route(req->vhost->route_root, req->path);
+    trace_mark(req, PHASE_ROUTE);
+    if (!route) {
+        not_found(req, conn);
+        return;
+    }
+    if (route->type != ROUTE_PROXY) {
+        switch (req->method_id) {
+        case METHOD_GET:
+        case METHOD_HEAD:
+            break;
+        case METHOD_POST:
+            method_not_allowed(req, conn);
+            return;
+        default:
+            not_implemented(req, conn);
+            return;
+        }
+    }
+    route->handler(req, conn, route);
+}
+
+static void
+do_file_response(struct HTTPRequest *req, struct Connection *conn, struct Route *route)
+{
+    struct FileInfo *info;
+    struct FlightSlot *flight = NULL;
+    char *path = req->path + route->prefixlen;
+    int leader = 0;
+
+    /* Concurrent requests for the same file share one lookup and,
+       for small files, one read. */
+    if (req->method_id != METHOD_HEAD)
+        flight = flight_join(route->dirfd, path, &leader);
+    if (flight && !leader) {
+        trace_mark(req, PHASE_OPEN);
+        if (!flight->ok && !flight->is_dir) {
+            flight_leave(flight);
+            not_found(req, conn);
+            return;
+        }
+        if (flight->has_body && !flight->is_dir) {
+            output_file_header_fields(req, conn, flight->size, path);
+            count_hit(req);
+            conn_write(conn, flight->body, flight->size);
+            count_bytes_sent(req, flight->size);
+            flight_leave(flight);
+            conn_flush(conn);
+            return;
+        }
+        flight_leave(flight);
+        flight = NULL;
+    }
+
+    info = get_fileinfo(route->dirfd, path, 1);
+    if (flight) flight_publish(flight, info);
+    trace_mark(req, PHASE_OPEN);
     if (!info->ok) {
+        if (flight) flight_leave(flight);
+        if (info->is_dir && req->path[strlen(req->path) - 1] != '/')
+            redirect_to_directory(req, conn);
+        else if (info->is_dir && route->autoindex)
+            do_listing_response(req, conn, info);
+        else
+            not_found(req, conn);
         free_fileinfo(info);
-        not_found(req, out);
         return;
     }
-    output_common_header_fields(req, out, "200 OK");
-    fprintf(out, "Content-Length: %ld\r\n", info->size);
-    fprintf(out, "Content-Type: %s\r\n", guess_content_type(info));
-    fprintf(out, "\r\n");
-    if (strcmp(req->method, "HEAD") != 0) {
-        int fd;
-        char buf[BLOCK_BUF_SIZE];
+    if (info->is_dir && req->path[strlen(req->path) - 1] != '/') {
+        if (flight) flight_leave(flight);
+        free_fileinfo(info);
+        redirect_to_directory(req, conn);
+        return;
+    }
+    output_file_header_fields(req, conn, info->size, path);
+    count_hit(req);
+    if (flight && flight->has_body) {
+        conn_write(conn, flight->body, flight->size);
+        count_bytes_sent(req, flight->size);
+    }
+    else if (req->method_id != METHOD_HEAD) {
+        output_file_body(req, conn, info);
+    }
+    if (flight) flight_leave(flight);
+    conn_flush(conn);
+    free_fileinfo(info);
+}
+
+static void
+output_file_header_fields(struct HTTPRequest *req, struct Connection *conn, long size, char *path)
+{
+    output_common_header_fields(req, conn, "200 OK");
+    conn_printf(conn, "Content-Length: %ld\r\n", size);
+    conn_printf(conn, "Content-Type: %s\r\n", guess_content_type(path));
+    conn_printf(conn, "\r\n");
+}
+
+/* Reads the file straight into the connection's output buffer. */
+static void
+output_file_body(struct HTTPRequest *req, struct Connection *conn, struct FileInfo *info)
+{
+    if (conn->h2) {
+        h2_send_file(conn, info->fd, 0, info->size);
+        count_bytes_sent(req, info->size);
+        return;
+    }
+    for (;;) {
+        size_t space;
+        char *p = conn_wspace(conn, &space);
         ssize_t n;
 
-        fd = open(info->path, O_RDONLY);
-        if (fd < 0)
-            log_exit("failed to open %s: %s", info->path, strerror(errno));
-        for (;;) {
-            n = read(fd, buf, BLOCK_BUF_SIZE);
-            if (n < 0)
-                log_exit("failed to read %s: %s", info->path, strerror(errno));
-            if (n == 0)
-                break;
-            if (fwrite(buf, 1, n, out) < n)
-                log_exit("failed to write to socket");
+        n = read(info->fd, p, space);
+        if (n < 0)
+            log_exit("failed to read %s: %s", info->path, strerror(errno));
+        if (n == 0)
+            break;
+        conn->wlen += n;
+        count_bytes_sent(req, n);
+    }
+}
+
+/* Relative links in a directory's page need the trailing slash. */
+static void
+redirect_to_directory(struct HTTPRequest *req, struct Connection *conn)
+{
+    output_common_header_fields(req, conn, "301 Moved Permanently");
+    conn_printf(conn, "Location: %s/\r\n", req->path);
+    conn_printf(conn, "Content-Type: text/html\r\n");
+    conn_printf(conn, "\r\n");
+    if (req->method_id != METHOD_HEAD) {
+        conn_printf(conn, "<html>\r\n");
+        conn_printf(conn, "<header><title>Moved Permanently</title><header>\r\n");
+        conn_printf(conn, "<body><p>Moved to <a href=\"%s/\">%s/</a></p></body>\r\n",
+                req->path, req->path);
+        conn_printf(conn, "</html>\r\n");
+    }
+    conn_flush(conn);
+}
+
+static void
+do_listing_response(struct HTTPRequest *req, struct Connection *conn, struct FileInfo *info)
+{
+    struct DirListing *listing;
+
+    listing = get_listing(info->fd, req->path);
+    if (!listing) {
+        not_found(req, conn);
+        return;
+    }
+    output_common_header_fields(req, conn, "200 OK");
+    conn_printf(conn, "Content-Length: %lu\r\n", (unsigned long)listing->len);
+    conn_printf(conn, "Content-Type: text/html\r\n");
+    conn_printf(conn, "\r\n");
+    if (req->method_id != METHOD_HEAD) {
+        conn_write(conn, listing->html, listing->len);
+        count_bytes_sent(req, listing->len);
+    }
+    conn_flush(conn);
+}
+
+/* Returns the listing of the open directory fd, rendering it only if
+   the directory changed since it was last rendered by this process.
+   A directory changed within the last second may change again without
+   a visible mtime change, so its listing is not kept. */
+static struct DirListing*
+get_listing(int fd, char *urlpath)
+{
+    struct DirListing *listing;
+    struct H2Buffer html;
+    struct stat st;
+    unsigned long h;
+    time_t now;
+
+    if (fstat(fd, &st) < 0) return NULL;
+    h = hash_string(urlpath, strlen(urlpath)) ^ (unsigned long)st.st_ino;
+    listing = &listings[h % LISTING_CACHE_SIZE];
+    if (listing->html && listing->ino == st.st_ino && listing->dev == st.st_dev
+        && listing->mtime.tv_sec == st.st_mtim.tv_sec
+        && listing->mtime.tv_nsec == st.st_mtim.tv_nsec
+        && listing->ctime.tv_sec == st.st_ctim.tv_sec
+        && listing->ctime.tv_nsec == st.st_ctim.tv_nsec
+        && strcmp(listing->urlpath, urlpath) == 0)
+        return listing;
+
+    memset(&html, 0, sizeof html);
+    if (render_listing(fd, urlpath, &html) < 0) {
+        free(html.ptr);
+        return NULL;
+    }
+    free(listing->html);
+    free(listing->urlpath);
+    listing->urlpath = xstrdup(urlpath);
+    listing->dev = st.st_dev;
+    listing->ino = st.st_ino;
+    listing->mtime = st.st_mtim;
+    listing->ctime = st.st_ctim;
+    listing->html = html.ptr;
+    listing->len = html.len;
+    now = time(NULL);
+    if (st.st_mtime >= now - 1 || st.st_ctime >= now - 1)
+        listing->ino = 0;
+    return listing;
+}
+
+/* Renders the entries of fd, read with getdents64(2).  The file type
+   comes with each entry on most file systems, so the listing costs no
+   stat(2) per entry; it shows names only, which also keeps it valid
+   while the files themselves change.  Dot files and anything but
+   regular files and directories are left out. */
+static int
+render_listing(int fd, char *urlpath, struct H2Buffer *out)
+{
+    char *buf;
+    char **names = NULL;
+    size_t n = 0, capa = 0, i;
+    long nread, pos;
+
+    buf = xmalloc(DIRENT_BUF_SIZE);
+    while ((nread = syscall(SYS_getdents64, fd, buf, DIRENT_BUF_SIZE)) > 0) {
+        for (pos = 0; pos < nread; pos += ((struct LinuxDirent64*)(buf + pos))->d_reclen) {
+            struct LinuxDirent64 *d = (struct LinuxDirent64*)(buf + pos);
+            int type = d->d_type;
+            size_t len;
+
+            if (d->d_name[0] == '.') continue;
+            if (type == DT_UNKNOWN) {
+                struct stat st;
+
+                if (fstatat(fd, d->d_name, &st, AT_SYMLINK_NOFOLLOW) < 0) continue;
+                type = S_ISDIR(st.st_mode) ? DT_DIR : S_ISREG(st.st_mode) ? DT_REG : DT_UNKNOWN;
+            }
+            if (type != DT_DIR && type != DT_REG) continue;
+            if (n == capa) {
+                capa = capa ? capa * 2 : 256;
+                names = xrealloc(names, sizeof(char*) * capa);
+            }
+            len = strlen(d->d_name);
+            names[n] = xmalloc(len + 2);
+            memcpy(names[n], d->d_name, len);
+            if (type == DT_DIR) names[n][len++] = '/';
+            names[n][len] = '\0';
+            n++;
         }
-        close(fd);
     }
-    fflush(out);
-    free_fileinfo(info);
+    free(buf);
+    if (nread < 0) {
+        log_warn("getdents64(2) failed on %s: %s", urlpath, strerror(errno));
+        for (i = 0; i < n; i++) free(names[i]);
+        free(names);
+        return -1;
+    }
+    qsort(names, n, sizeof(char*), cmp_name);
+
+    put_string(out, "<html>\r\n<head><title>Index of ");
+    put_html(out, urlpath);
+    put_string(out, "</title></head>\r\n<body>\r\n<h1>Index of ");
+    put_html(out, urlpath);
+    put_string(out, "</h1>\r\n<ul>\r\n");
+    if (strcmp(urlpath, "/") != 0)
+        put_string(out, "<li><a href=\"../\">../</a></li>\r\n");
+    for (i = 0; i < n; i++) {
+        put_string(out, "<li><a href=\"");
+        put_url(out, names[i]);
+        put_string(out, "\">");
+        put_html(out, names[i]);
+        put_string(out, "</a></li>\r\n");
+        free(names[i]);
+    }
+    free(names);
+    put_string(out, "</ul>\r\n</body>\r\n</html>\r\n");
+    return 0;
+}
+
+static int
+cmp_name(const void *a, const void *b)
+{
+    return strcmp(*(char**)a, *(char**)b);
+}
+
+static void
+put_string(struct H2Buffer *b, const char *str)
+{
+    h2_buffer_append(b, str, strlen(str));
+}
+
+static void
+put_html(struct H2Buffer *b, const char *str)
+{
+    for (; *str; str++) {
+        switch (*str) {
+        case '&': put_string(b, "&amp;"); break;
+        case '<': put_string(b, "&lt;"); break;
+        case '>': put_string(b, "&gt;"); break;
+        case '"': put_string(b, "&quot;"); break;
+        default:  h2_buffer_putc(b, *str); break;
+        }
+    }
+}
+
+/* Percent-encodes everything but unreserved characters and '/'. */
+static void
+put_url(struct H2Buffer *b, const char *str)
+{
+    static const char hex[] = "0123456789ABCDEF";
+
+    for (; *str; str++) {
+        unsigned char c = *str;
+
+        if (isalnum(c) || strchr("-._~/", c)) {
+            h2_buffer_putc(b, c);
+        }
+        else {
+            h2_buffer_putc(b, '%');
+            h2_buffer_putc(b, hex[c >> 4]);
+            h2_buffer_putc(b, hex[c & 15]);
+        }
+    }
+}
+
+static void
+do_pack_response(struct HTTPRequest *req, struct Connection *conn, struct Route *route)
+{
+    struct Pack *pack = route->pack;
+    struct PackEntry *ent;
+    char *etag, *inm;
+    char date[64];
+    unsigned long long offset, size;
+    time_t mtime;
+    int gzip;
+
+    ent = find_pack_entry(pack, req->path + route->prefixlen);
+    trace_mark(req, PHASE_OPEN);
+    if (!ent) {
+        not_found(req, conn);
+        return;
+    }
+    /* each representation has its own ETag */
+    gzip = (ent->gzip_offset != 0 && accepts_gzip(req));
+    etag = pack->strings + (gzip ? ent->gzip_etag : ent->etag);
+    inm = lookup_header_field_value(req, "If-None-Match");
+    if (inm && etag_matches(inm, etag)) {
+        output_common_header_fields(req, conn, "304 Not Modified");
+        conn_printf(conn, "ETag: %s\r\n", etag);
+        if (ent->gzip_offset != 0)
+            conn_printf(conn, "Vary: Accept-Encoding\r\n");
+        conn_printf(conn, "\r\n");
+        conn_flush(conn);
+        return;
+    }
+    offset = gzip ? ent->gzip_offset : ent->body_offset;
+    size = gzip ? ent->gzip_size : ent->body_size;
+    output_common_header_fields(req, conn, "200 OK");
+    conn_printf(conn, "Content-Length: %llu\r\n", size);
+    conn_printf(conn, "Content-Type: %s\r\n", pack->strings + ent->content_type);
+    conn_printf(conn, "ETag: %s\r\n", etag);
+    mtime = ent->mtime;
+    if (strftime(date, sizeof date, "%a, %d %b %Y %H:%M:%S GMT", gmtime(&mtime)) > 0)
+        conn_printf(conn, "Last-Modified: %s\r\n", date);
+    if (ent->gzip_offset != 0)
+        conn_printf(conn, "Vary: Accept-Encoding\r\n");
+    if (gzip)
+        conn_printf(conn, "Content-Encoding: gzip\r\n");
+    conn_printf(conn, "\r\n");
+    conn_flush(conn);
+    count_hit(req);
+    if (req->method_id != METHOD_HEAD)
+        send_file_range(req, conn, pack->fd, offset, size);
+}
+
+/* True if the If-None-Match list contains etag or "*". */
+static int
+etag_matches(char *list, const char *etag)
+{
+    size_t len = strlen(etag);
+    char *p = list;
+
+    for (;;) {
+        while (*p == ' ' || *p == '\t' || *p == ',') p++;
+        if (!*p || *p == '\r' || *p == '\n') return 0;
+        if (*p == '*') return 1;
+        if (strncmp(p, "W/", 2) == 0) p += 2;
+        if (strncmp(p, etag, len) == 0) return 1;
+        p = strchr(p, ',');
+        if (!p) return 0;
+    }
+}
+
+static int
+accepts_gzip(struct HTTPRequest *req)
+{
+    char *val = lookup_header_field_value(req, "Accept-Encoding");
+    char *p;
+
+    if (!val) return 0;
+    for (p = val; (p = strstr(p, "gzip")); p += 4) {
+        char *q = p + 4;
+
+        if (p > val && p[-1] != ' ' && p[-1] != ',') continue;
+        while (*q == ' ') q++;
+        if (*q == ';') {
+            q = strstr(q, "q=");
+            return q ? strtod(q + 2, NULL) > 0 : 1;
+        }
+        return 1;
+    }
+    return 0;
+}
+
+/* Sends len bytes at offset of fd; the headers must be flushed already. */
+static void
+send_file_range(struct HTTPRequest *req, struct Connection *conn,
+                int fd, off_t offset, size_t len)
+{
+    if (conn->h2) {
+        h2_send_file(conn, fd, offset, len);
+        count_bytes_sent(req, len);
+        return;
+    }
+    while (len > 0) {
+        ssize_t n = sendfile(conn->fd, fd, &offset, len);
+
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                wait_socket(conn->fd, POLLOUT);
+                continue;
+            }
+            log_exit("sendfile(2) failed: %s", strerror(errno));
+        }
+        if (n == 0)
+            log_exit("pack file truncated");
+        len -= n;
+        count_bytes_sent(req, n);
+    }
+}
+
+/* Forwards the request as HTTP/1.0 and relays the response verbatim. */
+static void
+do_proxy_response(struct HTTPRequest *req, struct Connection *conn, struct Route *route)
+{
+    struct HTTPHeaderField *h;
+    struct Connection up;
+    int sock;
+
+    sock = open_upstream(route->upstream_host, route->upstream_port);
+    if (sock < 0) {
+        bad_gateway(req, conn);
+        return;
+    }
+    conn_init(&up, sock);
+    conn_printf(&up, "%s %s HTTP/1.0\r\n", req->method, req->path);
+    for (h = req->header; h; h = h->next) {
+        if (strcasecmp(h->name, "Connection") == 0) continue;
+        conn_printf(&up, "%s: %s", h->name, h->value);
+    }
+    conn_printf(&up, "Connection: close\r\n");
+    conn_printf(&up, "\r\n");
+    if (req->length > 0)
+        conn_write(&up, req->body, req->length);
+    conn_flush(&up);
+    count_stat(&req->vhost->stats->requests, 1);
+    for (;;) {
+        size_t space;
+        char *p = conn_wspace(conn, &space);
+        ssize_t n;
+
+        n = read(sock, p, space);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) break;
+        conn->wlen += n;
+        count_bytes_sent(req, n);
+    }
+    conn_close(&up);
+    conn_flush(conn);
+}
+
+static int
+open_upstream(char *host, char *port)
+{
+    struct addrinfo hints, *res, *ai;
+    int sock;
+
+    memset(&hints, 0, sizeof(struct addrinfo));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(host, port, &hints, &res) != 0)
+        return -1;
+    for (ai = res; ai; ai = ai->ai_next) {
+        sock = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+        if (sock < 0) continue;
+        if (connect(sock, ai->ai_addr, ai->ai_addrlen) < 0) {
+            close(sock);
+            continue;
+        }
+        freeaddrinfo(res);
+        return sock;
+    }
+    freeaddrinfo(res);
+    return -1;
+}
+
+static void
+do_stats_response(struct HTTPRequest *req, struct Connection *conn, struct Route *route)
+{
+    struct VirtualHost *vhost;
+    struct Route *r;
+    struct Listener *l;
+    static const char *type_names[] = { "static", "proxy", "stats", "redirect", "pack" };
+    int i;
+
+    output_common_header_fields(req, conn, "200 OK");
+    conn_printf(conn, "Content-Type: text/plain\r\n");
+    conn_printf(conn, "\r\n");
+    if (req->method_id == METHOD_HEAD) {
+        conn_flush(conn);
+        return;
+    }
+    if (strcmp(req->path + route->prefixlen, "/manifest") == 0) {
+        output_manifest(conn);
+        conn_flush(conn);
+        return;
+    }
+    conn_printf(conn, "uptime: %ld\n", (long)(time(NULL) - server_started));
+    conn_printf(conn, "pid: %ld\n", (long)getppid());
+    for (l = listeners; l; l = l->next) {
+        conn_printf(conn, "listen: %s backlog=%d", l->spec, l->backlog);
+        if (l->defer_accept) conn_printf(conn, " defer=%d", l->defer_accept);
+        if (l->fastopen) conn_printf(conn, " fastopen=%d", l->fastopen);
+        if (l->nodelay) conn_printf(conn, " nodelay");
+        if (l->cork) conn_printf(conn, " cork");
+        if (l->sndbuf) conn_printf(conn, " sndbuf=%d", l->sndbuf);
+        if (l->rcvbuf) conn_printf(conn, " rcvbuf=%d", l->rcvbuf);
+        if (l->v6only) conn_printf(conn, " v6only");
+        conn_printf(conn, "\n");
+    }
+    conn_printf(conn, "file_cache: slots=%d hits=%lu rechecked=%lu misses=%lu\n",
+                FILE_CACHE_SLOTS, shared->cache_hits, shared->cache_rechecked,
+                shared->cache_misses);
+    for (vhost = vhosts; vhost; vhost = vhost->next) {
+        conn_printf(conn, "host:");
+        for (i = 0; i < vhost->n_names; i++)
+            conn_printf(conn, " %s", vhost->names[i]);
+        conn_printf(conn, "%s\n", vhost == default_vhost ? " (default)" : "");
+        conn_printf(conn, "  docroot: %s\n", vhost->docroot ? vhost->docroot : "");
+        conn_printf(conn, "  requests: %lu\n", vhost->stats->requests);
+        conn_printf(conn, "  bytes_sent: %lu\n", vhost->stats->bytes_sent);
+        for (i = 1; i < 6; i++)
+            conn_printf(conn, "  status_%dxx: %lu\n", i, vhost->stats->status[i]);
+        for (r = vhost->routes; r; r = r->next) {
+            conn_printf(conn, "  route: %s %s %s\n",
+                    r->prefix, r->autoindex ? "autoindex" : type_names[r->type],
+                    r->arg ? r->arg : "");
+        }
+    }
+    for (i = 0; i < N_PHASES; i++) {
+        struct Histogram *hist = &trace_area->phases[i];
+
+        conn_printf(conn, "phase: %-5s count=%lu p50=%lluus p90=%lluus p99=%lluus p99.9=%lluus max=%lluus\n",
+                    phase_names[i], hist->count,
+                    hist_percentile(hist, 50.0) / 1000, hist_percentile(hist, 90.0) / 1000,
+                    hist_percentile(hist, 99.0) / 1000, hist_percentile(hist, 99.9) / 1000,
+                    hist->max / 1000);
+    }
+    conn_flush(conn);
+}
+
+static void
+do_redirect_response(struct HTTPRequest *req, struct Connection *conn, struct Route *route)
+{
+    char *rest = req->path + route->prefixlen;
+
+    output_common_header_fields(req, conn, "301 Moved Permanently");
+    conn_printf(conn, "Location: %s%s\r\n", route->arg, rest);
+    conn_printf(conn, "Content-Type: text/html\r\n");
+    conn_printf(conn, "\r\n");
+    if (req->method_id != METHOD_HEAD) {
+        conn_printf(conn, "<html>\r\n");
+        conn_printf(conn, "<header><title>Moved Permanently</title><header>\r\n");
+        conn_printf(conn, "<body><p>Moved to <a href=\"%s%s\">%s%s</a></p></body>\r\n",
+                route->arg, rest, route->arg, rest);
+        conn_printf(conn, "</html>\r\n");
+    }
+    conn_flush(conn);
 }
 
 static void
-method_not_allowed(struct HTTPRequest *req, FILE *out)
+method_not_allowed(struct HTTPRequest *req, struct Connection *conn)
 {
-    output_common_header_fields(req, out, "405 Method Not Allowed");
-    fprintf(out, "Content-Type: text/html\r\n");
-    fprintf(out, "\r\n");
-    fprintf(out, "<html>\r\n");
-    fprintf(out, "<header>\r\n");
-    fprintf(out, "<title>405 Method Not Allowed</title>\r\n");
-    fprintf(out, "<header>\r\n");
-    fprintf(out, "<body>\r\n");
-    fprintf(out, "<p>The request method %s is not allowed</p>\r\n", req->method);
-    fprintf(out, "</body>\r\n");
-    fprintf(out, "</html>\r\n");
-    fflush(out);
+    output_common_header_fields(req, conn, "405 Method Not Allowed");
+    conn_printf(conn, "Content-Type: text/html\r\n");
+    conn_printf(conn, "\r\n");
+    conn_printf(conn, "<html>\r\n");
+    conn_printf(conn, "<header>\r\n");
+    conn_printf(conn, "<title>405 Method Not Allowed</title>\r\n");
+    conn_printf(conn, "<header>\r\n");
+    conn_printf(conn, "<body>\r\n");
+    conn_printf(conn, "<p>The request method %s is not allowed</p>\r\n", req->method);
+    conn_printf(conn, "</body>\r\n");
+    conn_printf(conn, "</html>\r\n");
+    conn_flush(conn);
 }
 
 static void
-not_implemented(struct HTTPRequest *req, FILE *out)
+not_implemented(struct HTTPRequest *req, struct Connection *conn)
 {
-    output_common_header_fields(req, out, "501 Not Implemented");
-    fprintf(out, "Content-Type: text/html\r\n");
-    fprintf(out, "\r\n");
-    fprintf(out, "<html>\r\n");
-    fprintf(out, "<header>\r\n");
-    fprintf(out, "<title>501 Not Implemented</title>\r\n");
-    fprintf(out, "<header>\r\n");
-    fprintf(out, "<body>\r\n");
-    fprintf(out, "<p>The request method %s is not implemented</p>\r\n", req->method);
-    fprintf(out, "</body>\r\n");
-    fprintf(out, "</html>\r\n");
-    fflush(out);
+    output_common_header_fields(req, conn, "501 Not Implemented");
+    conn_printf(conn, "Content-Type: text/html\r\n");
+    conn_printf(conn, "\r\n");
+    conn_printf(conn, "<html>\r\n");
+    conn_printf(conn, "<header>\r\n");
+    conn_printf(conn, "<title>501 Not Implemented</title>\r\n");
+    conn_printf(conn, "<header>\r\n");
+    conn_printf(conn, "<body>\r\n");
+    conn_printf(conn, "<p>The request method %s is not implemented</p>\r\n", req->method);
+    conn_printf(conn, "</body>\r\n");
+    conn_printf(conn, "</html>\r\n");
+    conn_flush(conn);
 }
 
 static void
-not_found(struct HTTPRequest *req, FILE *out)
+not_found(struct HTTPRequest *req, struct Connection *conn)
 {
-    output_common_header_fields(req, out, "404 Not Found");
-    fprintf(out, "Content-Type: text/html\r\n");
-    fprintf(out, "\r\n");
+    output_common_header_fields(req, conn, "404 Not Found");
+    conn_printf(conn, "Content-Type: text/html\r\n");
+    conn_printf(conn, "\r\n");
     if (strcmp(req->method, "HEAD") != 0) {
-        fprintf(out, "<html>\r\n");
-        fprintf(out, "<header><title>Not Found</title><header>\r\n");
-        fprintf(out, "<body><p>File not found</p></body>\r\n");
-        fprintf(out, "</html>\r\n");
+        conn_printf(conn, "<html>\r\n");
+        conn_printf(conn, "<header><title>Not Found</title><header>\r\n");
+        conn_printf(conn, "<body><p>File not found</p></body>\r\n");
+        conn_printf(conn, "</html>\r\n");
+    }
+    conn_flush(conn);
+}
+
+static void
+too_many_requests_response(struct HTTPRequest *req, struct Connection *conn)
+{
+    req->vhost = default_vhost;
+    output_common_header_fields(req, conn, "429 Too Many Requests");
+    conn_printf(conn, "Retry-After: 1\r\n");
+    conn_printf(conn, "Content-Type: text/html\r\n");
+    conn_printf(conn, "Content-Length: %d\r\n", (int)strlen(TOO_MANY_REQUESTS_BODY));
+    conn_printf(conn, "\r\n");
+    if (req->method_id != METHOD_HEAD)
+        conn_printf(conn, "%s", TOO_MANY_REQUESTS_BODY);
+    conn_flush(conn);
+}
+
+static void
+bad_gateway(struct HTTPRequest *req, struct Connection *conn)
+{
+    output_common_header_fields(req, conn, "502 Bad Gateway");
+    conn_printf(conn, "Content-Type: text/html\r\n");
+    conn_printf(conn, "\r\n");
+    if (req->method_id != METHOD_HEAD) {
+        conn_printf(conn, "<html>\r\n");
+        conn_printf(conn, "<header><title>Bad Gateway</title><header>\r\n");
+        conn_printf(conn, "<body><p>Upstream server is not available</p></body>\r\n");
+        conn_printf(conn, "</html>\r\n");
     }
-    fflush(out);
+    conn_flush(conn);
 }
 
 #define TIME_BUF_SIZE 64
 
 static void
-output_common_header_fields(struct HTTPRequest *req, FILE *out, char *status)
+output_common_header_fields(struct HTTPRequest *req, struct Connection *conn, char *status)
 {
     time_t t;
     struct tm *tm;
@@ -562,51 +5159,284 @@ output_common_header_fields(struct HTTPRequest *req, FILE *out, char *status)
     tm = gmtime(&t);
     if (!tm) log_exit("gmtime() failed: %s", strerror(errno));
     strftime(buf, TIME_BUF_SIZE, "%a, %d %b %Y %H:%M:%S GMT", tm);
-    fprintf(out, "HTTP/1.%d %s\r\n", HTTP_MINOR_VERSION, status);
-    fprintf(out, "Date: %s\r\n", buf);
-    fprintf(out, "Server: %s/%s\r\n", SERVER_NAME, SERVER_VERSION);
-    fprintf(out, "Connection: close\r\n");
+    count_stat(&req->vhost->stats->requests, 1);
+    count_stat(&req->vhost->stats->status[(status[0] - '0') % 6], 1);
+    req->status = atoi(status);
+    conn_printf(conn, "HTTP/1.%d %s\r\n", HTTP_MINOR_VERSION, status);
+    conn_printf(conn, "Date: %s\r\n", buf);
+    conn_printf(conn, "Server: %s/%s\r\n", SERVER_NAME, SERVER_VERSION);
+    conn_printf(conn, "Connection: close\r\n");
 }
 
+/* Opens urlpath below dirfd.  The path can never leave the docroot,
+   whatever ".." or symbolic links it contains.  A directory resolves
+   to its index file if it has one.  Lookup results are remembered for
+   FILE_CACHE_TTL seconds in the shared file cache, whichever process
+   made them: a cached miss costs no system call at all and a cached
+   directory needs no probe for its index file.  A cached file is still
+   opened and fstat()ed, since the length sent must be that of the file
+   actually read.  use_cache is 0 to neither consult nor fill the cache. */
 static struct FileInfo*
-get_fileinfo(char *docroot, char *urlpath)
+get_fileinfo(int dirfd, char *urlpath, int use_cache)
 {
     struct FileInfo *info;
+    struct FileCacheEntry ent;
     struct stat st;
+    unsigned long h;
+    time_t now;
 
+    while (*urlpath == '/') urlpath++;
     info = xmalloc(sizeof(struct FileInfo));
-    info->path = build_fspath(docroot, urlpath);
+    info->path = xstrdup(*urlpath ? urlpath : ".");
+    info->fd = -1;
     info->ok = 0;
-    if (lstat(info->path, &st) < 0) return info;
-    if (!S_ISREG(st.st_mode)) return info;
+    info->size = 0;
+    info->is_dir = 0;
+
+    h = hash_string(info->path, strlen(info->path));
+    now = time(NULL);
+    if (use_cache && file_cache_get(dirfd, info->path, h, &ent) && now < ent.expire) {
+        /* a file found again costs the open and fstat of a miss,
+           so only the other hits count as such */
+        if (ent.ok && !ent.is_dir)
+            count_stat(&shared->cache_rechecked, 1);
+        else
+            count_stat(&shared->cache_hits, 1);
+        if (!ent.ok && !ent.is_dir) return info;
+        if (ent.ok && ent.is_dir) {
+            char *path = index_path(info->path);
+
+            free(info->path);
+            info->path = path;
+        }
+        info->fd = open_beneath(dirfd, info->path);
+        if (info->fd < 0) return info;
+        info->is_dir = ent.is_dir;
+        if (!ent.ok) return info;   /* a directory to list */
+        if (fstat(info->fd, &st) == 0 && S_ISREG(st.st_mode)) {
+            info->ok = 1;
+            info->size = st.st_size;
+        }
+        else {
+            close(info->fd);
+            info->fd = -1;
+        }
+        return info;
+    }
+    if (use_cache) count_stat(&shared->cache_misses, 1);
+    info->fd = open_beneath(dirfd, info->path);
+    if (info->fd >= 0 && fstat(info->fd, &st) == 0 && S_ISREG(st.st_mode)) {
+        info->ok = 1;
+        info->size = st.st_size;
+    }
+    else if (info->fd >= 0 && S_ISDIR(st.st_mode)) {
+        info->is_dir = 1;
+        open_index(info);
+    }
+    else if (info->fd >= 0) {
+        close(info->fd);
+        info->fd = -1;
+    }
+    if (use_cache)
+        file_cache_put(dirfd, *urlpath ? urlpath : ".", h, info, now + FILE_CACHE_TTL);
+    return info;
+}
+
+/* Copies the cache slot for path into copy.  Returns 0 on a miss,
+   including a slot that is being written. */
+static int
+file_cache_get(int dirfd, const char *path, unsigned long h, struct FileCacheEntry *copy)
+{
+    struct FileCacheEntry *ent = &shared->cache[h & (FILE_CACHE_SLOTS - 1)];
+    unsigned int seq;
+    int i;
+
+    for (i = 0; i < SEQLOCK_RETRIES; i++) {
+        seq = __atomic_load_n(&ent->seq, __ATOMIC_ACQUIRE);
+        if (seq & 1) return 0;
+        memcpy(copy, ent, sizeof(struct FileCacheEntry));
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&ent->seq, __ATOMIC_RELAXED) == seq) break;
+    }
+    if (i == SEQLOCK_RETRIES) return 0;
+    copy->path[FILE_CACHE_PATH_MAX - 1] = '\0';
+    return copy->hash == h && copy->dirfd == dirfd && strcmp(copy->path, path) == 0;
+}
+
+static void
+file_cache_put(int dirfd, const char *path, unsigned long h, struct FileInfo *info, time_t expire)
+{
+    struct FileCacheEntry *ent = &shared->cache[h & (FILE_CACHE_SLOTS - 1)];
+    unsigned int seq;
+
+    if (strlen(path) >= FILE_CACHE_PATH_MAX) return;
+    seq = __atomic_load_n(&ent->seq, __ATOMIC_RELAXED);
+    if (seq & 1) return;
+    if (!__atomic_compare_exchange_n(&ent->seq, &seq, seq + 1, 0,
+                                     __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+        return;
+    ent->hash = h;
+    ent->dirfd = dirfd;
+    ent->ok = info->ok;
+    ent->is_dir = info->is_dir;
+    ent->expire = expire;
+    strcpy(ent->path, path);
+    __atomic_store_n(&ent->seq, seq + 2, __ATOMIC_RELEASE);
+}
+
+/* Replaces the directory in info by its index file, if it has one.
+   The directory stays open otherwise, for a listing. */
+static int
+open_index(struct FileInfo *info)
+{
+    struct stat st;
+    char *path;
+    int fd;
+
+    fd = openat(info->fd, INDEX_FILE, O_RDONLY|O_NONBLOCK|O_NOCTTY|O_CLOEXEC|O_NOFOLLOW);
+    if (fd < 0) return 0;
+    if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode)) {
+        close(fd);
+        return 0;
+    }
+    close(info->fd);
+    info->fd = fd;
     info->ok = 1;
     info->size = st.st_size;
-    return info;
+    path = index_path(info->path);
+    free(info->path);
+    info->path = path;
+    return 1;
 }
 
-static char *
-build_fspath(char *docroot, char *urlpath)
+static char*
+index_path(const char *dir)
 {
+    size_t len = strlen(dir);
     char *path;
 
-    path = xmalloc(strlen(docroot) + 1 + strlen(urlpath) + 1);
-    sprintf(path, "%s/%s", docroot, urlpath);
+    if (strcmp(dir, ".") == 0) return xstrdup(INDEX_FILE);
+    path = xmalloc(len + 1 + sizeof INDEX_FILE);
+    memcpy(path, dir, len);
+    if (len > 0 && dir[len-1] != '/') path[len++] = '/';
+    memcpy(path + len, INDEX_FILE, sizeof INDEX_FILE);
     return path;
 }
 
+/* Opens path relative to dirfd, refusing to resolve outside of dirfd
+   or through symbolic links.  Uses openat2(2) where the kernel has it.
+   Otherwise the path is normalized lexically, which removes every "..",
+   and opened one component at a time with O_NOFOLLOW, so a symbolic
+   link anywhere along the path fails with ELOOP or ENOTDIR. */
+static int
+open_beneath(int dirfd, char *path)
+{
+    char buf[PATH_MAX];
+    char *p, *slash;
+    int flags = O_RDONLY|O_NONBLOCK|O_NOCTTY|O_CLOEXEC;
+    int fd, next, e;
+#ifdef SYS_openat2
+    static int have_openat2 = 1;
+
+    if (have_openat2) {
+        struct open_how how;
+
+        memset(&how, 0, sizeof how);
+        how.flags = flags;
+        how.resolve = RESOLVE_BENEATH|RESOLVE_NO_SYMLINKS|RESOLVE_NO_MAGICLINKS;
+        fd = syscall(SYS_openat2, dirfd, path, &how, sizeof how);
+        if (fd >= 0 || errno != ENOSYS) return fd;
+        have_openat2 = 0;
+    }
+#endif
+    if (normalize_path(path, buf, sizeof buf) < 0) {
+        errno = EXDEV;
+        return -1;
+    }
+    fd = dirfd;
+    p = buf;
+    while ((slash = strchr(p, '/')) != NULL) {
+        *slash = '\0';
+        next = openat(fd, p, O_RDONLY|O_DIRECTORY|O_NOFOLLOW|O_CLOEXEC);
+        e = errno;
+        if (fd != dirfd) close(fd);
+        if (next < 0) {
+            errno = e;
+            return -1;
+        }
+        fd = next;
+        p = slash + 1;
+    }
+    next = openat(fd, p, flags|O_NOFOLLOW);
+    e = errno;
+    if (fd != dirfd) close(fd);
+    errno = e;
+    return next;
+}
+
+/* Removes empty and "." components from a relative path and resolves
+   "..".  Returns -1 when the path climbs above its starting point or
+   does not fit in dst. */
+static int
+normalize_path(const char *src, char *dst, size_t size)
+{
+    char *p = dst;
+
+    while (*src) {
+        const char *end;
+        size_t len;
+
+        while (*src == '/') src++;
+        if (!*src) break;
+        end = strchr(src, '/');
+        if (!end) end = src + strlen(src);
+        len = end - src;
+        if (len == 1 && src[0] == '.') {
+            ;
+        }
+        else if (len == 2 && src[0] == '.' && src[1] == '.') {
+            if (p == dst) return -1;
+            do {
+                p--;
+            } while (p > dst && *p != '/');
+        }
+        else {
+            if ((size_t)(p - dst) + len + 2 > size) return -1;
+            if (p != dst) *p++ = '/';
+            memcpy(p, src, len);
+            p += len;
+        }
+        src = end;
+    }
+    if (p == dst) *p++ = '.';
+    *p = '\0';
+    return 0;
+}
+
 static void
 free_fileinfo(struct FileInfo *info)
 {
+    if (info->fd >= 0) close(info->fd);
     free(info->path);
     free(info);
 }
 
 static char*
-guess_content_type(struct FileInfo *info)
+guess_content_type(char *path)
 {
     return "text/plain";   /* FIXME */
 }
 
+static char*
+xstrdup(const char *str)
+{
+    char *p;
+
+    p = xmalloc(strlen(str) + 1);
+    strcpy(p, str);
+    return p;
+}
+
 static void*
 xmalloc(size_t sz)
 {
@@ -617,6 +5447,16 @@ xmalloc(size_t sz)
     return p;
 }
 
+static void*
+xrealloc(void *ptr, size_t sz)
+{
+    void *p;
+
+    p = realloc(ptr, sz);
+    if (!p) log_exit("failed to allocate memory");
+    return p;
+}
+
 static void
 log_exit(const char *fmt, ...)
 {
@@ -631,5 +5471,24 @@ log_exit(const char *fmt, ...)
         vsyslog(LOG_ERR, fmt, ap);
     }
     va_end(ap);
+    if (request_abort_armed)
+        siglongjmp(request_abort, 1);
+    flight_abandon();
     exit(1);
 }
+
+static void
+log_warn(const char *fmt, ...)
+{
+    va_list ap;
+
+    va_start(ap, fmt);
+    if (debug_mode) {
+        vfprintf(stderr, fmt, ap);
+        fputc('\n', stderr);
+    }
+    else {
+        vsyslog(LOG_WARNING, fmt, ap);
+    }
+    va_end(ap);
+}
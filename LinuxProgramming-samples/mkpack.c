@@ -0,0 +1,389 @@
+/*
+    mkpack.c -- packs a document tree into one archive for httpd2.
+
+    Usage: mkpack <docroot> <packfile>
+
+    Every regular file below docroot is stored with its content type
+    and ETag computed in advance.  When both "x" and "x.gz" exist,
+    "x.gz" is stored as the precompressed variant of "x" instead of
+    as a file of its own.  httpd2 serves the archive with a route like
+
+        route / pack /path/to/packfile
+
+    The layout (in host byte order) is a PackHeader, the file bodies,
+    a string table and finally the index, an array of PackEntry sorted
+    by path so that lookups can use binary search.
+
+    This program is free software.
+    Redistribution and use in source and binary forms,
+    with or without modification, are permitted.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#define PACK_MAGIC "HTTPPACK"
+#define PACK_VERSION 1
+#define PACK_ALIGN 8
+#define COPY_BUF_SIZE (64 * 1024)
+
+struct PackHeader {
+    char magic[8];
+    unsigned int version;
+    unsigned int n_entries;
+    unsigned long long index_offset;
+    unsigned long long strings_offset;
+    unsigned long long strings_size;
+};
+
+struct PackEntry {
+    unsigned int path;              /* offsets into the string table */
+    unsigned int path_len;
+    unsigned int content_type;
+    unsigned int etag;
+    unsigned int gzip_etag;
+    unsigned int pad;
+    unsigned long long body_offset;
+    unsigned long long body_size;
+    unsigned long long gzip_offset; /* 0 if there is no .gz variant */
+    unsigned long long gzip_size;
+    long long mtime;
+};
+
+struct file {
+    char *path;             /* relative to docroot, no leading slash */
+    char *fspath;
+    long long mtime;
+    struct file *gzip;      /* precompressed variant */
+    int is_variant;
+};
+
+struct strtab {
+    char *ptr;
+    size_t len;
+    size_t capa;
+};
+
+static void collect(char *fsdir, char *dir);
+static void add_file(char *fspath, char *path, struct stat *st);
+static int cmp_file(const void *a, const void *b);
+static void find_variants(void);
+static unsigned long long copy_body(int out, unsigned long long *offset,
+                                    char *fspath, unsigned long long *size);
+static unsigned int add_string(const char *str);
+static const char* guess_content_type(const char *path);
+static void write_all(int fd, const void *buf, size_t len);
+static void pad(int fd, unsigned long long *offset);
+static void* xmalloc(size_t size);
+static void* xrealloc(void *ptr, size_t size);
+static char* join_path(const char *a, const char *b);
+static void die(const char *s);
+
+static struct file *files = NULL;
+static size_t n_files = 0, files_capa = 0;
+static struct strtab strings = { NULL, 0, 0 };
+
+int
+main(int argc, char *argv[])
+{
+    struct PackHeader header;
+    struct PackEntry *index;
+    unsigned long long offset;
+    char *tmppath;
+    size_t i, n;
+    int out;
+
+    if (argc != 3) {
+        fprintf(stderr, "Usage: %s <docroot> <packfile>\n", argv[0]);
+        exit(1);
+    }
+    collect(argv[1], "");
+    qsort(files, n_files, sizeof(struct file), cmp_file);
+    find_variants();
+
+    tmppath = xmalloc(strlen(argv[2]) + 5);
+    strcpy(tmppath, argv[2]);
+    strcat(tmppath, ".tmp");
+    out = open(tmppath, O_WRONLY|O_CREAT|O_TRUNC, 0644);
+    if (out < 0) die(tmppath);
+    memset(&header, 0, sizeof header);
+    write_all(out, &header, sizeof header);
+    offset = sizeof header;
+
+    index = xmalloc(sizeof(struct PackEntry) * (n_files + 1));
+    n = 0;
+    for (i = 0; i < n_files; i++) {
+        struct file *f = &files[i];
+        struct PackEntry *ent;
+        unsigned long long hash;
+        char etag[32];
+
+        if (f->is_variant) continue;
+        ent = &index[n++];
+        memset(ent, 0, sizeof(struct PackEntry));
+        pad(out, &offset);
+        ent->body_offset = offset;
+        hash = copy_body(out, &offset, f->fspath, &ent->body_size);
+        snprintf(etag, sizeof etag, "\"%016llx\"", hash);
+        ent->etag = add_string(etag);
+        if (f->gzip) {
+            pad(out, &offset);
+            ent->gzip_offset = offset;
+            hash = copy_body(out, &offset, f->gzip->fspath, &ent->gzip_size);
+            snprintf(etag, sizeof etag, "\"%016llx\"", hash);
+            ent->gzip_etag = add_string(etag);
+        }
+        ent->path = add_string(f->path);
+        ent->path_len = strlen(f->path);
+        ent->content_type = add_string(guess_content_type(f->path));
+        ent->mtime = f->mtime;
+    }
+
+    header.strings_offset = offset;
+    header.strings_size = strings.len;
+    write_all(out, strings.ptr, strings.len);
+    offset += strings.len;
+    pad(out, &offset);
+    header.index_offset = offset;
+    write_all(out, index, sizeof(struct PackEntry) * n);
+
+    memcpy(header.magic, PACK_MAGIC, sizeof header.magic);
+    header.version = PACK_VERSION;
+    header.n_entries = n;
+    if (lseek(out, 0, SEEK_SET) < 0) die("lseek(2)");
+    write_all(out, &header, sizeof header);
+    if (close(out) < 0) die(tmppath);
+    if (rename(tmppath, argv[2]) < 0) die(argv[2]);
+    printf("%lu files packed into %s\n", (unsigned long)n, argv[2]);
+    exit(0);
+}
+
+/* Collects the regular files below fsdir; dir is the same directory
+   relative to the docroot.  Symbolic links are not followed. */
+static void
+collect(char *fsdir, char *dir)
+{
+    DIR *d;
+    struct dirent *ent;
+
+    d = opendir(fsdir);
+    if (!d) die(fsdir);
+    while ((ent = readdir(d))) {
+        struct stat st;
+        char *fspath, *path;
+
+        if (strcmp(ent->d_name, ".") == 0) continue;
+        if (strcmp(ent->d_name, "..") == 0) continue;
+        fspath = join_path(fsdir, ent->d_name);
+        path = *dir ? join_path(dir, ent->d_name) : join_path(ent->d_name, NULL);
+        if (lstat(fspath, &st) < 0) die(fspath);
+        if (S_ISDIR(st.st_mode)) {
+            collect(fspath, path);
+            free(fspath);
+            free(path);
+        }
+        else if (S_ISREG(st.st_mode)) {
+            add_file(fspath, path, &st);
+        }
+        else {
+            free(fspath);
+            free(path);
+        }
+    }
+    closedir(d);
+}
+
+static void
+add_file(char *fspath, char *path, struct stat *st)
+{
+    struct file *f;
+
+    if (n_files == files_capa) {
+        files_capa = files_capa ? files_capa * 2 : 256;
+        files = xrealloc(files, sizeof(struct file) * files_capa);
+    }
+    f = &files[n_files++];
+    f->path = path;
+    f->fspath = fspath;
+    f->mtime = st->st_mtime;
+    f->gzip = NULL;
+    f->is_variant = 0;
+}
+
+static int
+cmp_file(const void *a, const void *b)
+{
+    return strcmp(((struct file*)a)->path, ((struct file*)b)->path);
+}
+
+/* Pairs "x.gz" with "x".  files must be sorted. */
+static void
+find_variants(void)
+{
+    size_t i;
+
+    for (i = 0; i < n_files; i++) {
+        struct file key, *base;
+        size_t len = strlen(files[i].path);
+
+        if (len <= 3 || strcmp(files[i].path + len - 3, ".gz") != 0) continue;
+        key.path = xmalloc(len - 2);
+        memcpy(key.path, files[i].path, len - 3);
+        key.path[len - 3] = '\0';
+        base = bsearch(&key, files, n_files, sizeof(struct file), cmp_file);
+        free(key.path);
+        if (!base) continue;
+        base->gzip = &files[i];
+        files[i].is_variant = 1;
+    }
+}
+
+/* Appends the file to out and returns its FNV-1a hash, used as ETag. */
+static unsigned long long
+copy_body(int out, unsigned long long *offset, char *fspath, unsigned long long *size)
+{
+    static char buf[COPY_BUF_SIZE];
+    unsigned long long hash = 14695981039346656037ULL;
+    ssize_t n, i;
+    int fd;
+
+    fd = open(fspath, O_RDONLY);
+    if (fd < 0) die(fspath);
+    *size = 0;
+    while ((n = read(fd, buf, sizeof buf)) > 0) {
+        for (i = 0; i < n; i++) {
+            hash ^= (unsigned char)buf[i];
+            hash *= 1099511628211ULL;
+        }
+        write_all(out, buf, n);
+        *size += n;
+    }
+    if (n < 0) die(fspath);
+    close(fd);
+    *offset += *size;
+    return hash;
+}
+
+static unsigned int
+add_string(const char *str)
+{
+    size_t len = strlen(str) + 1;
+    unsigned int pos = strings.len;
+
+    if (strings.len + len > strings.capa) {
+        while (strings.len + len > strings.capa)
+            strings.capa = strings.capa ? strings.capa * 2 : 4096;
+        strings.ptr = xrealloc(strings.ptr, strings.capa);
+    }
+    memcpy(strings.ptr + strings.len, str, len);
+    strings.len += len;
+    return pos;
+}
+
+static const char*
+guess_content_type(const char *path)
+{
+    static const char *types[][2] = {
+        { "html", "text/html" },
+        { "htm",  "text/html" },
+        { "css",  "text/css" },
+        { "js",   "application/javascript" },
+        { "json", "application/json" },
+        { "txt",  "text/plain" },
+        { "xml",  "application/xml" },
+        { "svg",  "image/svg+xml" },
+        { "png",  "image/png" },
+        { "jpg",  "image/jpeg" },
+        { "jpeg", "image/jpeg" },
+        { "gif",  "image/gif" },
+        { "ico",  "image/x-icon" },
+        { "pdf",  "application/pdf" },
+        { "wasm", "application/wasm" },
+        { "woff", "font/woff" },
+        { "woff2", "font/woff2" },
+        { NULL, NULL }
+    };
+    const char *ext = strrchr(path, '.');
+    int i;
+
+    if (ext && !strchr(ext, '/')) {
+        for (i = 0; types[i][0]; i++) {
+            if (strcmp(ext + 1, types[i][0]) == 0)
+                return types[i][1];
+        }
+    }
+    return "application/octet-stream";
+}
+
+static void
+write_all(int fd, const void *buf, size_t len)
+{
+    const char *p = buf;
+
+    while (len > 0) {
+        ssize_t n = write(fd, p, len);
+
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            die("write(2)");
+        }
+        p += n;
+        len -= n;
+    }
+}
+
+static void
+pad(int fd, unsigned long long *offset)
+{
+    static const char zero[PACK_ALIGN];
+    size_t n = (PACK_ALIGN - *offset % PACK_ALIGN) % PACK_ALIGN;
+
+    write_all(fd, zero, n);
+    *offset += n;
+}
+
+static char*
+join_path(const char *a, const char *b)
+{
+    char *p;
+
+    p = xmalloc(strlen(a) + 1 + (b ? strlen(b) : 0) + 1);
+    strcpy(p, a);
+    if (b) {
+        strcat(p, "/");
+        strcat(p, b);
+    }
+    return p;
+}
+
+static void*
+xmalloc(size_t size)
+{
+    void *p = malloc(size);
+
+    if (!p) die("malloc(3)");
+    return p;
+}
+
+static void*
+xrealloc(void *ptr, size_t size)
+{
+    void *p = realloc(ptr, size);
+
+    if (!p) die("realloc(3)");
+    return p;
+}
+
+static void
+die(const char *s)
+{
+    perror(s);
+    exit(1);
+}
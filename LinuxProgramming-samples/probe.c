@@ -0,0 +1,723 @@
+/*
+    probe.c -- probes many hosts at once.
+
+    Usage: probe [-nq] [-p <port>] [-c <concurrency>] [-t <timeout msec>]
+                 [-d <attempt delay msec>] [-f <target file>] [<target>...]
+
+    A target is "host", "host:port" or "[v6addr]:port"; the default
+    port is daytime's (see daytimed.c).  Up to <concurrency> targets
+    are probed at a time with non-blocking connects.  The addresses of
+    a host are tried Happy Eyeballs style (RFC 8305): IPv6 and IPv4
+    alternate, and the next address is tried when the current attempt
+    has not connected within the attempt delay, or at once when it
+    fails.  The first connection wins.  Unless -n is given, the probe
+    also waits for the server's first line.
+
+    Prints one line per target in the order given, then a histogram and
+    percentiles of the connect and reply times.  -q prints only the
+    summary line.  Addresses are taken as they are; host names are
+    resolved in the background with getaddrinfo_a(3) when a target
+    starts, so a slow name server holds up only its own targets.  The
+    timeout covers the lookup too.
+
+    This program is free software.
+    Redistribution and use in source and binary forms,
+    with or without modification, are permitted.
+*/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <signal.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <netdb.h>
+
+#define DEFAULT_PORT "13"
+#define DEFAULT_CONCURRENCY 256
+#define DEFAULT_TIMEOUT_MSEC 3000
+#define DEFAULT_ATTEMPT_DELAY_MSEC 250  /* RFC 8305 recommends 250ms */
+#define MAX_ATTEMPTS 8          /* addresses tried per target */
+#define MAX_EVENTS 256
+#define REPLY_MAX 128
+#define HIST_BUCKETS 32         /* powers of 2 in usec */
+
+enum state {
+    WAITING,
+    RESOLVING,
+    CONNECTING,
+    READING,
+    DONE
+};
+
+struct target;
+
+struct attempt {
+    struct target *t;           /* NULL once dropped */
+    int fd;
+    struct sockaddr_storage addr;
+    socklen_t addrlen;
+    struct attempt *next_dead;
+};
+
+struct target {
+    char *spec;
+    char *host;
+    char *port;                 /* NULL for the -p port */
+    enum state state;
+    struct addrinfo hints;
+    struct gaicb gai;           /* the lookup while RESOLVING */
+    struct addrinfo *res;
+    struct addrinfo *order[MAX_ATTEMPTS];   /* families interleaved */
+    int n_addrs;
+    int next_addr;
+    struct attempt *attempts[MAX_ATTEMPTS]; /* in flight */
+    int n_inflight;
+    struct attempt *winner;
+    unsigned long long started;
+    unsigned long long next_attempt_at;
+    unsigned long long deadline;
+    long connect_usec;          /* -1 if not connected */
+    long reply_usec;            /* -1 if no reply */
+    char reply[REPLY_MAX];
+    size_t reply_len;
+    char address[INET6_ADDRSTRLEN];
+    const char *error;
+};
+
+static void add_target(char *spec);
+static void read_targets(char *path);
+static void start_target(struct target *t);
+static void resolve_done(union sigval sv);
+static void resolved(void);
+static void start_connecting(struct target *t);
+static void order_addresses(struct target *t);
+static void start_attempt(struct target *t);
+static void attempt_event(struct attempt *a, unsigned int events);
+static void connected(struct attempt *a);
+static void read_reply(struct target *t);
+static void drop_attempt(struct attempt *a);
+static void finish(struct target *t, const char *error);
+static void check_timers(unsigned long long now);
+static int next_timeout(unsigned long long now);
+static void print_results(void);
+static void print_histogram(const char *label, long *v, size_t n);
+static int cmp_long(const void *a, const void *b);
+static unsigned long long now_usec(void);
+static void* xmalloc(size_t size);
+static char* xstrdup(const char *s);
+
+static struct target *targets = NULL;
+static size_t n_targets = 0, targets_capa = 0;
+static struct target **active;
+static struct attempt *dead = NULL;    /* freed after each epoll_wait() batch */
+static int n_active = 0;
+static int epfd;
+static int resolver_pipe[2];   /* finished lookups, one target* each */
+static char *default_port = DEFAULT_PORT;
+static int concurrency = DEFAULT_CONCURRENCY;
+static unsigned long long timeout_usec = DEFAULT_TIMEOUT_MSEC * 1000ULL;
+static unsigned long long attempt_delay_usec = DEFAULT_ATTEMPT_DELAY_MSEC * 1000ULL;
+static int connect_only = 0;
+static int quiet = 0;
+
+int
+main(int argc, char *argv[])
+{
+    struct epoll_event events[MAX_EVENTS];
+    struct rlimit rl;
+    size_t next = 0;
+    int opt, i, n;
+
+    while ((opt = getopt(argc, argv, "nqp:c:t:d:f:")) != -1) {
+        switch (opt) {
+        case 'n':
+            connect_only = 1;
+            break;
+        case 'q':
+            quiet = 1;
+            break;
+        case 'p':
+            default_port = optarg;
+            break;
+        case 'c':
+            concurrency = atoi(optarg);
+            break;
+        case 't':
+            timeout_usec = strtoull(optarg, NULL, 10) * 1000;
+            break;
+        case 'd':
+            attempt_delay_usec = strtoull(optarg, NULL, 10) * 1000;
+            break;
+        case 'f':
+            read_targets(optarg);
+            break;
+        default:
+            goto usage;
+        }
+    }
+    for (i = optind; i < argc; i++)
+        add_target(argv[i]);
+    if (n_targets == 0 || concurrency < 1) {
+  usage:
+        fprintf(stderr, "Usage: %s [-nq] [-p <port>] [-c <concurrency>] [-t <timeout msec>]\n"
+                        "       [-d <attempt delay msec>] [-f <target file>] [<target>...]\n",
+                argv[0]);
+        exit(1);
+    }
+
+    /* every target may have MAX_ATTEMPTS sockets open */
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0) {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+        getrlimit(RLIMIT_NOFILE, &rl);
+        if ((rlim_t)concurrency * MAX_ATTEMPTS + 16 > rl.rlim_cur)
+            concurrency = (rl.rlim_cur - 16) / MAX_ATTEMPTS;
+    }
+    active = xmalloc(sizeof(struct target*) * concurrency);
+    epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (epfd < 0) {
+        perror("epoll_create1(2)");
+        exit(1);
+    }
+    if (pipe2(resolver_pipe, O_NONBLOCK|O_CLOEXEC) < 0) {
+        perror("pipe2(2)");
+        exit(1);
+    }
+    {
+        struct epoll_event ev;
+
+        ev.events = EPOLLIN;
+        ev.data.ptr = NULL;     /* the only event which is no attempt */
+        if (epoll_ctl(epfd, EPOLL_CTL_ADD, resolver_pipe[0], &ev) < 0) {
+            perror("epoll_ctl(2)");
+            exit(1);
+        }
+    }
+
+    while (next < n_targets || n_active > 0) {
+        unsigned long long now;
+
+        while (next < n_targets && n_active < concurrency)
+            start_target(&targets[next++]);
+        if (n_active == 0) continue;
+        now = now_usec();
+        n = epoll_wait(epfd, events, MAX_EVENTS, next_timeout(now));
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            perror("epoll_wait(2)");
+            exit(1);
+        }
+        for (i = 0; i < n; i++) {
+            if (events[i].data.ptr)
+                attempt_event(events[i].data.ptr, events[i].events);
+            else
+                resolved();
+        }
+        check_timers(now_usec());
+        while (dead) {
+            struct attempt *a = dead;
+
+            dead = a->next_dead;
+            free(a);
+        }
+    }
+    print_results();
+    exit(0);
+}
+
+static void
+add_target(char *spec)
+{
+    struct target *t;
+    char *host, *p;
+
+    if (n_targets == targets_capa) {
+        targets_capa = targets_capa ? targets_capa * 2 : 256;
+        targets = realloc(targets, sizeof(struct target) * targets_capa);
+        if (!targets) {
+            perror("realloc(3)");
+            exit(1);
+        }
+    }
+    t = &targets[n_targets++];
+    memset(t, 0, sizeof(struct target));
+    t->spec = xstrdup(spec);
+    host = xstrdup(spec);
+    t->port = NULL;
+    if (host[0] == '[' && (p = strchr(host, ']'))) {
+        *p++ = '\0';
+        if (*p == ':') t->port = p + 1;
+        host++;
+    }
+    else if ((p = strchr(host, ':')) && !strchr(p + 1, ':')) {
+        *p = '\0';
+        t->port = p + 1;
+    }
+    t->host = host;
+    t->connect_usec = t->reply_usec = -1;
+    t->state = WAITING;
+}
+
+/* One target per line; blank lines and '#' comments are skipped. */
+static void
+read_targets(char *path)
+{
+    FILE *f;
+    char buf[1024];
+
+    f = strcmp(path, "-") == 0 ? stdin : fopen(path, "r");
+    if (!f) {
+        perror(path);
+        exit(1);
+    }
+    while (fgets(buf, sizeof buf, f)) {
+        char *p = buf + strspn(buf, " \t");
+
+        p[strcspn(p, " \t\r\n#")] = '\0';
+        if (*p) add_target(p);
+    }
+    if (f != stdin) fclose(f);
+}
+
+/* An address is converted on the spot; a name is looked up in the
+   background and the target waits in RESOLVING until resolved() sees
+   the result. */
+static void
+start_target(struct target *t)
+{
+    struct gaicb *list[1];
+    struct sigevent sev;
+    int err;
+
+    active[n_active++] = t;
+    t->started = now_usec();
+    t->deadline = t->started + timeout_usec;
+    memset(&t->hints, 0, sizeof t->hints);
+    t->hints.ai_family = AF_UNSPEC;
+    t->hints.ai_socktype = SOCK_STREAM;
+    t->hints.ai_flags = AI_NUMERICHOST;
+    err = getaddrinfo(t->host, t->port ? t->port : default_port, &t->hints, &t->res);
+    if (err == 0) {
+        start_connecting(t);
+        return;
+    }
+    t->res = NULL;
+    if (err != EAI_NONAME) {
+        finish(t, gai_strerror(err));
+        return;
+    }
+    t->hints.ai_flags = 0;
+    memset(&t->gai, 0, sizeof t->gai);
+    t->gai.ar_name = t->host;
+    t->gai.ar_service = t->port ? t->port : default_port;
+    t->gai.ar_request = &t->hints;
+    memset(&sev, 0, sizeof sev);
+    sev.sigev_notify = SIGEV_THREAD;
+    sev.sigev_notify_function = resolve_done;
+    sev.sigev_value.sival_ptr = t;
+    list[0] = &t->gai;
+    err = getaddrinfo_a(GAI_NOWAIT, list, 1, &sev);
+    if (err != 0) {
+        finish(t, gai_strerror(err));
+        return;
+    }
+    t->state = RESOLVING;
+}
+
+/* Runs in a thread of the resolver: hands the target over to the main
+   loop, which alone touches targets. */
+static void
+resolve_done(union sigval sv)
+{
+    struct target *t = sv.sival_ptr;
+
+    if (write(resolver_pipe[1], &t, sizeof t) != sizeof t) {
+        perror("write(2)");
+        exit(1);
+    }
+}
+
+static void
+resolved(void)
+{
+    struct target *t;
+    int err;
+
+    while (read(resolver_pipe[0], &t, sizeof t) == sizeof t) {
+        err = gai_error(&t->gai);
+        if (t->state != RESOLVING) {
+            /* timed out meanwhile */
+            if (err == 0) freeaddrinfo(t->gai.ar_result);
+            continue;
+        }
+        if (err != 0) {
+            finish(t, gai_strerror(err));
+            continue;
+        }
+        t->res = t->gai.ar_result;
+        start_connecting(t);
+    }
+}
+
+static void
+start_connecting(struct target *t)
+{
+    order_addresses(t);
+    t->state = CONNECTING;
+    start_attempt(t);
+}
+
+/* IPv6 first, then alternating families, as RFC 8305 section 4. */
+static void
+order_addresses(struct target *t)
+{
+    struct addrinfo *v6[MAX_ATTEMPTS], *v4[MAX_ATTEMPTS], *ai;
+    int n6 = 0, n4 = 0, i6 = 0, i4 = 0;
+
+    for (ai = t->res; ai; ai = ai->ai_next) {
+        if (ai->ai_family == AF_INET6 && n6 < MAX_ATTEMPTS) v6[n6++] = ai;
+        else if (ai->ai_family == AF_INET && n4 < MAX_ATTEMPTS) v4[n4++] = ai;
+    }
+    while (t->n_addrs < MAX_ATTEMPTS && (i6 < n6 || i4 < n4)) {
+        if (i6 < n6) t->order[t->n_addrs++] = v6[i6++];
+        if (i4 < n4 && t->n_addrs < MAX_ATTEMPTS) t->order[t->n_addrs++] = v4[i4++];
+    }
+}
+
+/* Starts connecting to the next address.  An address that fails on
+   the spot is skipped at once; when none is left and nothing is in
+   flight, the target has failed. */
+static void
+start_attempt(struct target *t)
+{
+    while (t->next_addr < t->n_addrs) {
+        struct addrinfo *ai = t->order[t->next_addr++];
+        struct epoll_event ev;
+        struct attempt *a;
+        int fd;
+
+        fd = socket(ai->ai_family, SOCK_STREAM|SOCK_NONBLOCK|SOCK_CLOEXEC, 0);
+        if (fd < 0) {
+            t->error = strerror(errno);
+            continue;
+        }
+        a = xmalloc(sizeof(struct attempt));
+        a->t = t;
+        a->fd = fd;
+        memcpy(&a->addr, ai->ai_addr, ai->ai_addrlen);
+        a->addrlen = ai->ai_addrlen;
+        t->attempts[t->n_inflight++] = a;
+        if (connect(fd, ai->ai_addr, ai->ai_addrlen) == 0) {
+            connected(a);
+            return;
+        }
+        if (errno != EINPROGRESS) {
+            t->error = strerror(errno);
+            drop_attempt(a);
+            continue;
+        }
+        ev.events = EPOLLOUT;
+        ev.data.ptr = a;
+        if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+            perror("epoll_ctl(2)");
+            exit(1);
+        }
+        t->next_attempt_at = now_usec() + attempt_delay_usec;
+        return;
+    }
+    if (t->n_inflight == 0)
+        finish(t, t->error ? t->error : "no address");
+}
+
+static void
+attempt_event(struct attempt *a, unsigned int events)
+{
+    struct target *t = a->t;
+
+    if (!t) return;     /* dropped earlier in this batch */
+    if (t->state == CONNECTING) {
+        int err = 0;
+        socklen_t len = sizeof err;
+
+        if (getsockopt(a->fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0) err = errno;
+        if (err) {
+            t->error = strerror(err);
+            drop_attempt(a);
+            start_attempt(t);
+            return;
+        }
+        connected(a);
+        return;
+    }
+    if (t->state == READING)
+        read_reply(t);
+}
+
+/* The first attempt to connect wins; the others are closed. */
+static void
+connected(struct attempt *a)
+{
+    struct target *t = a->t;
+    struct epoll_event ev;
+    void *addr;
+    int i;
+
+    t->connect_usec = now_usec() - t->started;
+    t->winner = a;
+    for (i = t->n_inflight - 1; i >= 0; i--) {
+        if (t->attempts[i] != a)
+            drop_attempt(t->attempts[i]);
+    }
+    if (a->addr.ss_family == AF_INET6)
+        addr = &((struct sockaddr_in6*)&a->addr)->sin6_addr;
+    else
+        addr = &((struct sockaddr_in*)&a->addr)->sin_addr;
+    inet_ntop(a->addr.ss_family, addr, t->address, sizeof t->address);
+    if (connect_only) {
+        finish(t, NULL);
+        return;
+    }
+    t->state = READING;
+    ev.events = EPOLLIN;
+    ev.data.ptr = a;
+    if (epoll_ctl(epfd, EPOLL_CTL_MOD, a->fd, &ev) < 0
+        && epoll_ctl(epfd, EPOLL_CTL_ADD, a->fd, &ev) < 0) {
+        perror("epoll_ctl(2)");
+        exit(1);
+    }
+}
+
+/* Reads up to the end of the first line. */
+static void
+read_reply(struct target *t)
+{
+    char buf[REPLY_MAX];
+    ssize_t n;
+    char *nl;
+
+    n = read(t->winner->fd, buf, sizeof buf);
+    if (n < 0) {
+        if (errno == EAGAIN) return;
+        finish(t, strerror(errno));
+        return;
+    }
+    if (t->reply_usec < 0) t->reply_usec = now_usec() - t->started;
+    if (n == 0) {
+        finish(t, t->reply_len > 0 ? NULL : "no reply");
+        return;
+    }
+    if ((size_t)n > sizeof t->reply - 1 - t->reply_len)
+        n = sizeof t->reply - 1 - t->reply_len;
+    memcpy(t->reply + t->reply_len, buf, n);
+    t->reply_len += n;
+    t->reply[t->reply_len] = '\0';
+    if ((nl = strpbrk(t->reply, "\r\n"))) {
+        *nl = '\0';
+        t->reply_len = nl - t->reply;
+        finish(t, NULL);
+    }
+    else if (t->reply_len == sizeof t->reply - 1) {
+        finish(t, NULL);
+    }
+}
+
+static void
+drop_attempt(struct attempt *a)
+{
+    struct target *t = a->t;
+    int i;
+
+    for (i = 0; i < t->n_inflight; i++) {
+        if (t->attempts[i] == a) {
+            t->attempts[i] = t->attempts[--t->n_inflight];
+            break;
+        }
+    }
+    if (t->winner == a) t->winner = NULL;
+    close(a->fd);       /* also removes it from the epoll set */
+    a->t = NULL;
+    a->next_dead = dead;
+    dead = a;
+}
+
+static void
+finish(struct target *t, const char *error)
+{
+    int i;
+
+    t->error = error;
+    if (error) t->connect_usec = t->reply_usec = -1;
+    if (t->state == RESOLVING)
+        gai_cancel(&t->gai);    /* if too late, resolved() frees the result */
+    t->state = DONE;
+    while (t->n_inflight > 0)
+        drop_attempt(t->attempts[0]);
+    if (t->res) freeaddrinfo(t->res);
+    t->res = NULL;
+    for (i = 0; i < n_active; i++) {
+        if (active[i] == t) {
+            active[i] = active[--n_active];
+            break;
+        }
+    }
+}
+
+static void
+check_timers(unsigned long long now)
+{
+    int i;
+
+    for (i = 0; i < n_active; ) {
+        struct target *t = active[i];
+
+        if (now >= t->deadline) {
+            finish(t, "timed out");
+            continue;   /* active[i] is another target now */
+        }
+        if (t->state == CONNECTING && now >= t->next_attempt_at
+            && t->next_addr < t->n_addrs)
+            start_attempt(t);
+        if (i < n_active && active[i] == t) i++;
+    }
+}
+
+/* msec until the nearest deadline or next attempt, rounded up */
+static int
+next_timeout(unsigned long long now)
+{
+    unsigned long long nearest = ~0ULL;
+    int i;
+
+    for (i = 0; i < n_active; i++) {
+        struct target *t = active[i];
+
+        if (t->deadline < nearest) nearest = t->deadline;
+        if (t->state == CONNECTING && t->next_addr < t->n_addrs
+            && t->next_attempt_at < nearest)
+            nearest = t->next_attempt_at;
+    }
+    if (nearest <= now) return 0;
+    return (nearest - now + 999) / 1000;
+}
+
+static void
+print_results(void)
+{
+    long *connects, *replies;
+    size_t i, n_ok = 0, n_connects = 0, n_replies = 0;
+
+    connects = xmalloc(sizeof(long) * n_targets);
+    replies = xmalloc(sizeof(long) * n_targets);
+    for (i = 0; i < n_targets; i++) {
+        struct target *t = &targets[i];
+
+        if (!t->error) n_ok++;
+        if (t->connect_usec >= 0) connects[n_connects++] = t->connect_usec;
+        if (t->reply_usec >= 0) replies[n_replies++] = t->reply_usec;
+        if (quiet) continue;
+        if (t->error) {
+            printf("%s\tfailed: %s\n", t->spec, t->error);
+            continue;
+        }
+        printf("%s\t%s\tconnect=%.3fms", t->spec, t->address, t->connect_usec / 1000.0);
+        if (!connect_only)
+            printf("\treply=%.3fms\t%s", t->reply_usec / 1000.0, t->reply);
+        printf("\n");
+    }
+    printf("%lu targets: %lu ok, %lu failed\n", (unsigned long)n_targets,
+           (unsigned long)n_ok, (unsigned long)(n_targets - n_ok));
+    if (!quiet) {
+        print_histogram("connect", connects, n_connects);
+        if (!connect_only) print_histogram("reply", replies, n_replies);
+    }
+    free(connects);
+    free(replies);
+}
+
+static void
+print_histogram(const char *label, long *v, size_t n)
+{
+    static const double pcts[] = { 50, 90, 99 };
+    unsigned long buckets[HIST_BUCKETS];
+    unsigned long most = 0;
+    size_t i;
+    int b, lo = HIST_BUCKETS, hi = 0;
+
+    if (n == 0) return;
+    qsort(v, n, sizeof(long), cmp_long);
+    printf("%s:", label);
+    for (i = 0; i < sizeof pcts / sizeof pcts[0]; i++) {
+        /* nearest rank: the smallest value with p% of all at or below it */
+        double rank = n * pcts[i] / 100;
+        size_t k = (size_t)rank;
+
+        if (k < rank) k++;
+        k = k > 0 ? k - 1 : 0;
+        printf(" p%g=%.3fms", pcts[i], v[k] / 1000.0);
+    }
+    printf(" max=%.3fms\n", v[n - 1] / 1000.0);
+
+    memset(buckets, 0, sizeof buckets);
+    for (i = 0; i < n; i++) {
+        for (b = 0; b < HIST_BUCKETS - 1 && v[i] >= (1L << (b + 1)); b++)
+            ;
+        buckets[b]++;
+        if (b < lo) lo = b;
+        if (b > hi) hi = b;
+        if (buckets[b] > most) most = buckets[b];
+    }
+    for (b = lo; b <= hi; b++) {
+        int width = (int)(buckets[b] * 50 / most);
+
+        printf("  %10ldus - %10ldus %7lu |%.*s\n", 1L << b, (1L << (b + 1)) - 1, buckets[b],
+               width, "##################################################");
+    }
+}
+
+static int
+cmp_long(const void *a, const void *b)
+{
+    long x = *(const long*)a, y = *(const long*)b;
+
+    return x < y ? -1 : x > y;
+}
+
+static unsigned long long
+now_usec(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void*
+xmalloc(size_t size)
+{
+    void *p = malloc(size ? size : 1);
+
+    if (!p) {
+        perror("malloc(3)");
+        exit(1);
+    }
+    return p;
+}
+
+static char*
+xstrdup(const char *s)
+{
+    char *p = xmalloc(strlen(s) + 1);
+
+    strcpy(p, s);
+    return p;
+}
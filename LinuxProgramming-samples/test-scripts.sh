@@ -229,12 +229,54 @@ print "close" > grep2-tmp
 assert_equal    'grep -f grep2-tmp head.c'  './grep2 -f grep2-tmp head.c'
 print "" > grep2-tmp
 assert_equal    'grep -f grep2-tmp head.c'  './grep2 -f grep2-tmp head.c'
+printf 'fopen\nfclose\n' > grep2-tmp
+assert_equal    'grep -f grep2-tmp cat2.c'  './grep2 -f grep2-tmp cat2.c'
+printf 'perror\\(\nexit\\(1\n' > grep2-tmp
+assert_equal    'grep -F -e "perror(" -e "exit(1" cat2.c'   './grep2 -f grep2-tmp cat2.c'
+assert_equal    'grep -F -v -e "perror(" -e "exit(1" cat2.c' './grep2 -v -f grep2-tmp cat2.c'
+printf 'FOPEN\nFclose\n' > grep2-tmp
+assert_equal    'grep -i -f grep2-tmp cat2.c'  './grep2 -i -f grep2-tmp cat2.c'
+assert_equal    'grep -E -i "PuTs|stream\(" cat2.c'  './grep2 -i "PuTs|stream\(" cat2.c'
+assert_equal    'grep -E "fo+pen|fclose" cat2.c'     './grep2 "fo+pen|fclose" cat2.c'
+assert_equal    'grep -E "(f)?close\(" cat2.c'       './grep2 "(f)?close\(" cat2.c'
+assert_equal    'grep -E -v "[a-z]*_stream" cat2.c'  './grep2 -v "[a-z]*_stream" cat2.c'
+assert_equal    'grep -E "^ +[a-z]{2,4} \(" cat2.c'    './grep2 "^ +[a-z]{2,4} \(" cat2.c'
+assert_equal    'grep -E -i "[^a-z ]I" cat2.c'       './grep2 -i "[^a-z ]I" cat2.c'
+assert_equal    'grep -E "(ar)g.*\1" cat2.c'         './grep2 "(ar)g.*\1" cat2.c'
+printf 'ab\nb\nxb c\n' > grep2-tmp
+assert_equal    'grep -E "(.)[[:space:]]\1" grep2-tmp'   './grep2 "(.)[[:space:]]\1" grep2-tmp'
+mkdir -p tc.grepdir/a
+cp head.c tc.grepdir/a/head.c
+cp cat2.c tc.grepdir/cat2.c
+assert_equal    'grep close tc.grepdir/a/head.c tc.grepdir/cat2.c'   './grep2 -r -j 3 close tc.grepdir'
+assert_equal    'grep -v close tc.grepdir/a/head.c tc.grepdir/cat2.c | sort'   './grep2 -r -u -v close tc.grepdir | sort'
+rm -rf tc.grepdir
+assert_equal    'grep -n close head.c'      './grep2 -n close head.c'
+i=0
+while [ $i -lt 160 ]; do cat grep2.c; i=`expr $i + 1`; done > tc.grepbig
+assert_equal    'grep -E -n "regexec|[0-9]{4}" tc.grepbig'   './grep2 -j 3 -n "regexec|[0-9]{4}" tc.grepbig'
+assert_equal    'grep -c -v static tc.grepbig'   './grep2 -j 3 -v static tc.grepbig | wc -l'
+./grepidx tc.grepidx tc.grepbig > /dev/null
+assert_equal    'grep -n "necessary_literal(" tc.grepbig'     './grep2 -X tc.grepidx -n "necessary_literal\(" tc.grepbig'
+echo "appended necessary_literal(" >> tc.grepbig
+assert_equal    'grep -n "necessary_literal(" tc.grepbig'     './grep2 -X tc.grepidx -n "necessary_literal\(" tc.grepbig'
+./grepidx tc.grepidx tc.grepbig > /dev/null
+assert_equal    'grep -n "necessary_literal(" tc.grepbig'     './grep2 -X tc.grepidx -n "necessary_literal\(" tc.grepbig'
+sed '1,1000s/matcher_init/qzqzqzqzqzqz/' tc.grepbig > tc.tmp
+cat tc.tmp > tc.grepbig
+assert_equal    'grep -n qzqzqzqzqzqz tc.grepbig'     './grep2 -X tc.grepidx -n qzqzqzqzqzqz tc.grepbig'
+./grepidx tc.grepidx tc.grepbig > /dev/null
+assert_equal    'grep -n qzqzqzqzqzqz tc.grepbig'     './grep2 -X tc.grepidx -n qzqzqzqzqzqz tc.grepbig'
+rm -f tc.grepbig tc.grepidx tc.tmp
 
 assert_equal    'grep close head.c'         './grep3 close head.c'
 assert_equal    'grep NOTMATCH head.c'      './grep3 NOTMATCH head.c'
 assert_equal    'grep close /dev/null'      './grep3 close /dev/null'
 assert_equal    'grep close head.c'         './grep3 close head.c'
 assert_equal    'grep "open|close" head.c'  './grep3 "open|close" head.c'
+printf 'ab\nc\nxb c\n' > tc.tmp
+assert_equal    'grep -E "b[[:space:]]c" tc.tmp'   './grep3 "b[[:space:]]c" tc.tmp'
+rm -f tc.tmp
 
 # FIXME: ln
 # FIXME: symlink
@@ -304,4 +346,13 @@ echo 'b' >> tc.tmp
 assert_stdout   "2"                     './wcl tc.tmp'
 rm -f tc.tmp
 
+if [ -f probe -a -f daytimed ]; then
+./daytimed -o 24000 daytime time 2>/dev/null &
+daytimed_pid=$!
+sleep 1
+assert_stdout   "3 targets: 3 ok, 0 failed" './probe -q -p 24013 127.0.0.1 localhost 127.0.0.1:24013'
+assert_stdout   "1 targets: 0 ok, 1 failed" './probe -q 127.0.0.1:24014'
+kill $daytimed_pid
+fi
+
 test_finished